@@ -257,6 +257,7 @@ const Node* bind_last_instruction_and_wrap_in_block(BodyBuilder*, const Node*);
 
 struct CompilerConfig_ {
     bool dynamic_scheduling;
+    /// in bytes, a bound on what the program may need: only that much gets reserved when its call graph lets us work it out
     uint32_t per_thread_stack_size;
 
     struct {
@@ -272,6 +273,13 @@ struct CompilerConfig_ {
         bool decay_ptrs;
     } lower;
 
+    /// Width of the words backing emulated private memory. Wider words let aligned accesses use fewer loads and stores,
+    /// narrower stores become read-modify-writes. Subgroup and shared memory keep the arena's word size: other invocations
+    /// store to their words too, and those read-modify-writes would race.
+    struct {
+        IntSizes private_word_size;
+    } emulated_memory;
+
     struct {
         bool spv_shuffle_instead_of_broadcast_first;
         bool force_join_point_lifting;
@@ -283,6 +291,22 @@ struct CompilerConfig_ {
             bool after_every_pass;
             bool delete_unused_instructions;
         } cleanup;
+        struct {
+            /// how many instructions a loop is allowed to grow to when unrolled, 0 disables unrolling
+            uint32_t max_size;
+        } unrolling;
+        struct {
+            /// how many instructions inlining functions into several call sites may add to the module, in total
+            uint32_t growth_budget;
+        } inlining;
+        struct {
+            /// how many instructions cloning functions for their constant arguments may add to the module, in total
+            uint32_t budget;
+        } cloning;
+        struct {
+            /// matches with at least this many cases, covering enough of their range, are kept for the target to emit as a jump table, 0 always lowers them
+            uint32_t min_jump_table_cases;
+        } switches;
     } optimisations;
 
     struct {
@@ -50,7 +50,7 @@ void* arena_alloc(Arena* arena, size_t size) {
         // we need more storage for the block pointers themselves !
         if (arena->nblocks == arena->maxblocks) {
             arena->maxblocks *= 2;
-            arena->blocks = realloc(arena->blocks, arena->maxblocks);
+            arena->blocks = realloc(arena->blocks, arena->maxblocks * sizeof(void*));
         }
 
         arena->blocks[arena->nblocks++] = malloc(alloc_size);
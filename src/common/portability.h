@@ -18,6 +18,7 @@ static_assert(__STDC_VERSION__ >= 201112L, "C11 support is required to build sha
     #define popen _popen
     #define pclose _pclose
     #define SHADY_FALLTHROUGH
+    #define SHADY_THREAD_LOCAL __declspec(thread)
     // It's mid 2022, and this typedef is missing from <stdalign.h>
     // MSVC is not a real C11 compiler.
     typedef long long max_align_t;
@@ -29,6 +30,7 @@ static_assert(__STDC_VERSION__ >= 201112L, "C11 support is required to build sha
     #endif
     #define SHADY_UNUSED __attribute__((unused))
     #define SHADY_FALLTHROUGH __attribute__((fallthrough));
+    #define SHADY_THREAD_LOCAL _Thread_local
 #endif
 
 static inline void* alloc_aligned(size_t size, size_t alignment) {
@@ -0,0 +1,73 @@
+#include "thread.h"
+
+#include <stdlib.h>
+#include <assert.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+struct Thread_ {
+    ThreadFn fn;
+    void* uptr;
+#ifdef _WIN32
+    HANDLE handle;
+#else
+    pthread_t handle;
+#endif
+};
+
+#ifdef _WIN32
+static DWORD WINAPI thread_entry(LPVOID param) {
+    Thread* thread = (Thread*) param;
+    thread->fn(thread->uptr);
+    return 0;
+}
+#else
+static void* thread_entry(void* param) {
+    Thread* thread = (Thread*) param;
+    thread->fn(thread->uptr);
+    return NULL;
+}
+#endif
+
+Thread* spawn_thread(ThreadFn fn, void* uptr) {
+    Thread* thread = calloc(1, sizeof(Thread));
+    thread->fn = fn;
+    thread->uptr = uptr;
+#ifdef _WIN32
+    thread->handle = CreateThread(NULL, 0, thread_entry, thread, 0, NULL);
+    if (!thread->handle) {
+#else
+    if (pthread_create(&thread->handle, NULL, thread_entry, thread) != 0) {
+#endif
+        free(thread);
+        return NULL;
+    }
+    return thread;
+}
+
+void join_thread(Thread* thread) {
+    assert(thread);
+#ifdef _WIN32
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+#else
+    pthread_join(thread->handle, NULL);
+#endif
+    free(thread);
+}
+
+size_t get_hardware_concurrency(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (size_t) count : 1;
+#endif
+}
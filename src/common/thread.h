@@ -0,0 +1,16 @@
+#ifndef SHADY_THREAD_H
+#define SHADY_THREAD_H
+
+#include <stddef.h>
+
+/// Minimal portable threads, enough to fan work out and wait for it.
+typedef struct Thread_ Thread;
+typedef void (*ThreadFn)(void* uptr);
+
+Thread* spawn_thread(ThreadFn fn, void* uptr);
+/// Waits for the thread to finish, and frees it.
+void join_thread(Thread*);
+
+size_t get_hardware_concurrency(void);
+
+#endif
@@ -1,5 +1,6 @@
 #include "util.h"
 #include "arena.h"
+#include "portability.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -7,6 +8,15 @@
 #include <stdarg.h>
 #include <assert.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #define ESCAPE_SEQS(X) \
 X('\\', '\\') \
 X('\'', '\'') \
@@ -86,6 +96,86 @@ err_post_open:
     return false;
 }
 
+static size_t get_page_size() {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwPageSize;
+#else
+    return (size_t) sysconf(_SC_PAGESIZE);
+#endif
+}
+
+/// Maps the file read-only, returns NULL if that is not possible.
+static const char* map_file(const char* filename, size_t* size) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return NULL;
+    LARGE_INTEGER fsize;
+    const char* data = NULL;
+    if (GetFileSizeEx(file, &fsize) && fsize.QuadPart > 0) {
+        *size = (size_t) fsize.QuadPart;
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping) {
+            data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            // the view keeps the mapping alive
+            CloseHandle(mapping);
+        }
+    }
+    CloseHandle(file);
+    return data;
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    const char* data = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        *size = st.st_size;
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+            data = NULL;
+    }
+    close(fd);
+    return data;
+#endif
+}
+
+static void unmap_file(size_t size, const char* data) {
+#ifdef _WIN32
+    UnmapViewOfFile(data);
+#else
+    munmap((void*) data, size);
+#endif
+}
+
+bool open_file_view(const char* filename, FileView* view) {
+    size_t size = 0;
+    const char* data = map_file(filename, &size);
+    // the tail of the last page is zero-filled, which gives us a terminator for free unless the file ends on a page boundary
+    if (data && size % get_page_size() != 0) {
+        *view = (FileView) { .size = size, .contents = data, .mapped = true };
+        return true;
+    }
+    if (data)
+        unmap_file(size, data);
+
+    char* contents;
+    if (!read_file(filename, &size, &contents))
+        return false;
+    *view = (FileView) { .size = size, .contents = contents, .mapped = false };
+    return true;
+}
+
+void close_file_view(FileView* view) {
+    if (view->mapped)
+        unmap_file(view->size, view->contents);
+    else
+        free((void*) view->contents);
+    *view = (FileView) { 0 };
+}
+
 bool write_file(const char* filename, size_t size, const char* data) {
     FILE* f = fopen(filename, "wb");
     if (f == NULL)
@@ -107,7 +197,7 @@ enum {
     ThreadLocalStaticBufferSize = 256
 };
 
-static char static_buffer[ThreadLocalStaticBufferSize];
+static SHADY_THREAD_LOCAL char static_buffer[ThreadLocalStaticBufferSize];
 
 void format_string_internal(const char* str, va_list args, void* uptr, void callback(void*, size_t, char*)) {
     size_t buffer_size = ThreadLocalStaticBufferSize;
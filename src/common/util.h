@@ -9,6 +9,16 @@ size_t apply_escape_codes(const char* src, size_t og_len, char* dst);
 bool read_file(const char* filename, size_t* size, char** output);
 bool write_file(const char* filename, size_t size, const char* data);
 
+/// Read-only view of a file, memory-mapped when possible. The contents are always followed by a zero byte.
+typedef struct {
+    size_t size;
+    const char* contents;
+    bool mapped;
+} FileView;
+
+bool open_file_view(const char* filename, FileView* view);
+void close_file_view(FileView* view);
+
 typedef struct Arena_ Arena;
 char* format_string_arena(Arena*, const char* str, ...);
 char* format_string_new(const char* str, ...);
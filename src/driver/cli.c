@@ -104,6 +104,55 @@ void cli_parse_compiler_config_args(CompilerConfig* config, int* pargc, char** a
             if (i == argc)
                 error("Missing subgroup size name");
             config->specialization.subgroup_size = atoi(argv[i]);
+        } else if (strcmp(argv[i], "--unroll-budget") == 0) {
+            argv[i] = NULL;
+            i++;
+            if (i == argc)
+                error("Missing unrolling budget");
+            config->optimisations.unrolling.max_size = atoi(argv[i]);
+        } else if (strcmp(argv[i], "--inline-budget") == 0) {
+            argv[i] = NULL;
+            i++;
+            if (i == argc)
+                error("Missing inlining budget");
+            config->optimisations.inlining.growth_budget = atoi(argv[i]);
+        } else if (strcmp(argv[i], "--cloning-budget") == 0) {
+            argv[i] = NULL;
+            i++;
+            if (i == argc)
+                error("Missing cloning budget");
+            config->optimisations.cloning.budget = atoi(argv[i]);
+        } else if (strcmp(argv[i], "--min-jump-table-cases") == 0) {
+            argv[i] = NULL;
+            i++;
+            if (i == argc)
+                error("Missing jump table threshold");
+            config->optimisations.switches.min_jump_table_cases = atoi(argv[i]);
+        } else if (strcmp(argv[i], "--stack-size") == 0) {
+            argv[i] = NULL;
+            i++;
+            if (i == argc)
+                error("Missing stack size");
+            config->per_thread_stack_size = atoi(argv[i]);
+        } else if (strcmp(argv[i], "--emulated-word-size") == 0) {
+            argv[i] = NULL;
+            i++;
+            if (i + 1 >= argc)
+                error("Missing address space or word size");
+            IntSizes* word_size;
+            if (strcmp(argv[i], "private") == 0)
+                word_size = &config->emulated_memory.private_word_size;
+            else
+                error("Only emulated private memory can use wider words, not %s", argv[i]);
+            argv[i] = NULL;
+            i++;
+            switch (atoi(argv[i])) {
+                case 8:  *word_size = IntTy8;  break;
+                case 16: *word_size = IntTy16; break;
+                case 32: *word_size = IntTy32; break;
+                case 64: *word_size = IntTy64; break;
+                default: error("Word size must be 8, 16, 32 or 64 bits, not %s", argv[i]);
+            }
         } else if (strcmp(argv[i], "--execution-model") == 0) {
             argv[i] = NULL;
             i++;
@@ -143,6 +192,12 @@ void cli_parse_compiler_config_args(CompilerConfig* config, int* pargc, char** a
         error_print("  --execution-model <em>                   Selects an entry point for the program to be specialized on.\nPossible values: " EXECUTION_MODELS(EM));
 #undef EM
         error_print("  --subgroup-size N                         Sets the subgroup size the program will be specialized for.\n");
+        error_print("  --unroll-budget N                         Sets how many instructions unrolled loops may grow to, 0 disables unrolling.\n");
+        error_print("  --inline-budget N                         Sets how many instructions inlining functions into several call sites may add, in total.\n");
+        error_print("  --cloning-budget N                        Sets how many instructions cloning functions for their constant arguments may add, in total.\n");
+        error_print("  --min-jump-table-cases N                  Keeps dense switches with at least N cases as jump tables, 0 always lowers them to branches.\n");
+        error_print("  --stack-size N                            Bounds the stack, in bytes. Recursive programs get all of it, others what they need.\n");
+        error_print("  --emulated-word-size private N            Backs the emulated private memory with N-bit words.\n");
         error_print("  --lift-join-points                        Forcefully lambda-lifts all join points. Can help with reconvergence issues.\n");
     }
 
@@ -59,33 +59,23 @@ ShadyErrorCodes driver_load_source_file(SourceLanguage lang, size_t len, const c
             ParserConfig pconfig = {
                     .front_end = lang == SrcSlim,
             };
-            debugv_print("Parsing: \n%s\n", file_contents);
-            parse_shady_ir(pconfig, (const char*) file_contents, mod);
+            debugv_print("Parsing: \n%.*s\n", (int) len, file_contents);
+            parse_shady_ir(pconfig, len, (const char*) file_contents, mod);
         }
     }
     return NoError;
 }
 
 ShadyErrorCodes driver_load_source_file_from_filename(const char* filename, Module* mod) {
-    ShadyErrorCodes err;
     SourceLanguage lang = guess_source_language(filename);
-    size_t len;
-    char* contents;
+    FileView view;
     assert(filename);
-    bool ok = read_file(filename, &len, &contents);
-    if (!ok) {
+    if (!open_file_view(filename, &view)) {
         error_print("Failed to read file '%s'\n", filename);
-        err = InputFileIOError;
-        goto exit;
+        return InputFileIOError;
     }
-    if (contents == NULL) {
-        error_print("file does not exist\n");
-        err = InputFileDoesNotExist;
-        goto exit;
-    }
-    err = driver_load_source_file(lang, len, contents, mod);
-    exit:
-    free((void*) contents);
+    ShadyErrorCodes err = driver_load_source_file(lang, view.size, view.contents, mod);
+    close_file_view(&view);
     return err;
 }
 
@@ -140,12 +140,11 @@ int main(int argc, char** argv) {
         exit(ClangInvocationFailed);
 
     if (!vcc_options.only_run_clang) {
-        size_t len;
-        char* llvm_ir;
-        if (!read_file(vcc_options.tmp_filename, &len, &llvm_ir))
+        FileView llvm_ir;
+        if (!open_file_view(vcc_options.tmp_filename, &llvm_ir))
             exit(InputFileIOError);
-        driver_load_source_file(SrcLLVM, len, llvm_ir, mod);
-        free(llvm_ir);
+        driver_load_source_file(SrcLLVM, llvm_ir.size, llvm_ir.contents, mod);
+        close_file_view(&llvm_ir);
 
         if (vcc_options.delete_tmp_file)
             remove(vcc_options.tmp_filename);
@@ -380,9 +380,13 @@ EmittedInstr convert_instruction(Parser* p, Node* fn_or_bb, BodyBuilder* b, LLVM
             LLVMValueRef callee = LLVMGetCalledValue(instr);
             callee = remove_ptr_bitcasts(p, callee);
             assert(num_args + 1 == num_ops);
-            String intrinsic = is_llvm_intrinsic(callee);
-            if (!intrinsic)
-                intrinsic = is_shady_intrinsic(callee);
+            String intrinsic = NULL;
+            // indirect calls can't be intrinsics
+            if (LLVMIsAFunction(callee) || LLVMIsConstant(callee)) {
+                intrinsic = is_llvm_intrinsic(callee);
+                if (!intrinsic)
+                    intrinsic = is_shady_intrinsic(callee);
+            }
             if (intrinsic) {
                 assert(LLVMIsAFunction(callee));
                 if (strcmp(intrinsic, "llvm.dbg.declare") == 0) {
@@ -5,9 +5,11 @@
 #include "portability.h"
 #include "log.h"
 #include "util.h"
+#include "thread.h"
 
 #include "type.h"
 #include "ir_private.h"
+#include "rewrite.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -774,7 +776,7 @@ static const Node* accept_terminator(ctxparams, Node* fn) {
             expect(accept_token(ctx, rpar_tok));
 
             return br_switch(arena, (Switch) {
-                .switch_value = first(values),
+                .switch_value = inspectee,
                 .case_values = values,
                 .case_jumps = cases,
                 .default_jump = default_jump,
@@ -1037,10 +1039,7 @@ static const Node* accept_nominal_type_decl(ctxparams, Nodes annotations) {
     return nom;
 }
 
-void parse_shady_ir(ParserConfig config, const char* contents, Module* mod) {
-    IrArena* arena = get_module_arena(mod);
-    Tokenizer* tokenizer = new_tokenizer(contents);
-
+static void parse_declarations(ctxparams) {
     while (true) {
         Token token = curr_token(tokenizer);
         if (token.tag == EOF_tok)
@@ -1063,6 +1062,132 @@ void parse_shady_ir(ParserConfig config, const char* contents, Module* mod) {
         error_print("No idea what to parse here... (tok=(tag = %s, pos = %zu))\n", token_tags[token.tag], token.start);
         exit(-3);
     }
+}
+
+typedef struct {
+    size_t begin;
+    size_t end;
+} DeclarationRange;
+
+/// Splits the token stream at top-level declaration boundaries without parsing anything.
+/// Declarations end with a ';' or with the '}' closing a function body.
+static struct List* scan_declarations(Tokenizer* tokenizer) {
+    struct List* ranges = new_list(DeclarationRange);
+    size_t start = get_tokenizer_position(tokenizer);
+    size_t begin = start;
+    size_t depth = 0;
+    Token token = curr_token(tokenizer);
+    while (token.tag != EOF_tok) {
+        bool ends_decl = false;
+        switch (token.tag) {
+            case lpar_tok:
+            case lbracket_tok:
+            case lsbracket_tok: depth++; break;
+            case rpar_tok:
+            case rsbracket_tok: if (depth > 0) depth--; break;
+            case rbracket_tok: if (depth > 0) depth--; ends_decl = depth == 0; break;
+            case semi_tok: ends_decl = depth == 0; break;
+            default: break;
+        }
+        token = next_token(tokenizer);
+        // nominal types end with '};'
+        if (ends_decl && token.tag != semi_tok) {
+            DeclarationRange range = { begin, get_tokenizer_position(tokenizer) };
+            append_list(DeclarationRange, ranges, range);
+            begin = range.end;
+        }
+    }
+    if (begin != get_tokenizer_position(tokenizer)) {
+        DeclarationRange range = { begin, get_tokenizer_position(tokenizer) };
+        append_list(DeclarationRange, ranges, range);
+    }
+    set_tokenizer_position(tokenizer, start);
+    return ranges;
+}
+
+typedef struct {
+    ParserConfig config;
+    const char* contents;
+    Tokenizer* tokenizer;
+    const DeclarationRange* ranges;
+    size_t first_range;
+    size_t ranges_count;
+    Module* mod;
+} ParserJob;
+
+static void parse_declarations_job(ParserJob* job) {
+    ParserConfig config = job->config;
+    const char* contents = job->contents;
+    Module* mod = job->mod;
+    IrArena* arena = get_module_arena(mod);
+    for (size_t i = job->first_range; i < job->first_range + job->ranges_count; i++) {
+        Tokenizer* tokenizer = split_tokenizer(job->tokenizer, job->ranges[i].begin, job->ranges[i].end);
+        parse_declarations(ctx);
+        destroy_tokenizer(tokenizer);
+    }
+}
+
+/// Below this many declarations per thread, spinning up threads and merging arenas costs more than it saves.
+#define MIN_DECLARATIONS_PER_THREAD 32
+
+/// Each thread parses a contiguous run of declarations into its own arena, the results are then imported in order.
+static void parse_declarations_parallel(ctxparams, struct List* ranges, size_t threads_count) {
+    size_t ranges_count = entries_count_list(ranges);
+    ArenaConfig aconfig = get_arena_config(arena);
+    LARRAY(ParserJob, jobs, threads_count);
+    LARRAY(Thread*, threads, threads_count);
+    for (size_t i = 0; i < threads_count; i++) {
+        size_t first = ranges_count * i / threads_count;
+        jobs[i] = (ParserJob) {
+            .config = config,
+            .contents = contents,
+            .tokenizer = tokenizer,
+            .ranges = read_list(DeclarationRange, ranges),
+            .first_range = first,
+            .ranges_count = ranges_count * (i + 1) / threads_count - first,
+            .mod = new_module(new_ir_arena(aconfig), get_module_name(mod)),
+        };
+    }
+
+    // the calling thread takes the first job
+    for (size_t i = 1; i < threads_count; i++) {
+        threads[i] = spawn_thread((ThreadFn) parse_declarations_job, &jobs[i]);
+        if (!threads[i])
+            parse_declarations_job(&jobs[i]);
+    }
+    parse_declarations_job(&jobs[0]);
+
+    for (size_t i = 0; i < threads_count; i++) {
+        if (i > 0 && threads[i])
+            join_thread(threads[i]);
+
+        Rewriter rewriter = create_importer(jobs[i].mod, mod);
+        Nodes decls = get_module_declarations(jobs[i].mod);
+        for (size_t j = 0; j < decls.count; j++)
+            rewrite_node(&rewriter, decls.nodes[j]);
+        destroy_rewriter(&rewriter);
+        destroy_ir_arena(get_module_arena(jobs[i].mod));
+    }
+}
+
+void parse_shady_ir(ParserConfig config, size_t len, const char* contents, Module* mod) {
+    IrArena* arena = get_module_arena(mod);
+    Tokenizer* tokenizer = new_tokenizer(len, contents);
+
+    size_t threads_count = config.threads ? config.threads : get_hardware_concurrency();
+    if (threads_count > 1) {
+        struct List* ranges = scan_declarations(tokenizer);
+        // a thread count that was asked for is honoured as long as each thread gets a declaration
+        size_t max_threads = entries_count_list(ranges) / (config.threads ? 1 : MIN_DECLARATIONS_PER_THREAD);
+        if (threads_count > max_threads)
+            threads_count = max_threads;
+        if (threads_count > 1)
+            parse_declarations_parallel(ctx, ranges, threads_count);
+        destroy_list(ranges);
+    }
+
+    if (threads_count <= 1)
+        parse_declarations(ctx);
 
     destroy_tokenizer(tokenizer);
 }
@@ -6,6 +6,8 @@
 
 typedef struct {
     bool front_end;
+    /// How many threads to parse top-level declarations with. 0 picks one per hardware thread, for large enough inputs.
+    size_t threads;
 } ParserConfig;
 
 #define INFIX_OPERATORS() \
@@ -36,6 +38,6 @@ INFIX_OPERATORS()
     InfixOperatorsCount
 } InfixOperators;
 
-void parse_shady_ir(ParserConfig config, const char* contents, Module* mod);
+void parse_shady_ir(ParserConfig config, size_t len, const char* contents, Module* mod);
 
 #endif
@@ -1,12 +1,23 @@
 #include "token.h"
 
 #include "log.h"
+#include "list.h"
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <assert.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SHADY_TOKENIZER_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 #define PRIMOP(has_side_effects, name) TEXT_TOKEN(name)
 
 static const char* token_strings[] = {
@@ -23,188 +34,342 @@ const char* token_tags[] = {
 
 #undef PRIMOP
 
+typedef enum {
+    CharWhitespace = 1 << 0,
+    CharIdentifierStart = 1 << 1,
+    CharIdentifier = 1 << 2,
+    CharDigit = 1 << 3,
+    CharHexDigit = 1 << 4,
+} CharClass;
+
+static uint8_t char_classes[256];
+
 static size_t token_strings_size[LIST_END_tok];
+
+// Keywords are looked up through a perfect hash table, the seed of which is found when initializing the tokenizer.
+#define KEYWORDS_TABLE_SIZE 1024
+static uint8_t keywords_table[KEYWORDS_TABLE_SIZE];
+static uint32_t keywords_seed;
+static size_t longest_keyword;
+
+// Other tokens are matched by their first character, longest candidates first.
+#define MAX_PUNCTUATION_CANDIDATES 8
+static uint8_t punctuation_candidates[256][MAX_PUNCTUATION_CANDIDATES];
+static uint8_t punctuation_candidates_count[256];
+
 static bool constants_initialized = false;
 
+static_assert(LIST_END_tok < 256, "token tags must fit the lookup tables");
+
+static inline uint32_t hash_keyword(uint32_t seed, size_t size, const char* str) {
+    uint32_t h = 2166136261u ^ seed;
+    for (size_t i = 0; i < size; i++) {
+        h ^= (unsigned char) str[i];
+        h *= 16777619u;
+    }
+    h ^= h >> 13;
+    return h & (KEYWORDS_TABLE_SIZE - 1);
+}
+
+static bool try_keywords_seed(uint32_t seed) {
+    memset(keywords_table, EOF_tok, sizeof(keywords_table));
+    for (int i = 0; i < LIST_END_tok; i++) {
+        if (token_strings_size[i] == 0 || !(char_classes[(unsigned char) token_strings[i][0]] & CharIdentifierStart))
+            continue;
+        uint32_t h = hash_keyword(seed, token_strings_size[i], token_strings[i]);
+        if (keywords_table[h] != EOF_tok)
+            return false;
+        keywords_table[h] = (uint8_t) i;
+    }
+    return true;
+}
+
 static void init_tokenizer_constants() {
+    for (int c = 0; c < 256; c++) {
+        uint8_t class = 0;
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+            class |= CharWhitespace;
+        if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '_')
+            class |= CharIdentifierStart | CharIdentifier;
+        if (c >= '0' && c <= '9')
+            class |= CharIdentifier | CharDigit | CharHexDigit;
+        if ((c >= 'A' && c <= 'F') || (c >= 'a' && c <= 'f'))
+            class |= CharHexDigit;
+        char_classes[c] = class;
+    }
+
     for (int i = 0; i < LIST_END_tok; i++) {
         token_strings_size[i] = token_strings[i] == NULL ? 0 : strlen(token_strings[i]);
+        if (token_strings_size[i] == 0)
+            continue;
+        unsigned char first = (unsigned char) token_strings[i][0];
+        if (char_classes[first] & CharIdentifierStart) {
+            if (token_strings_size[i] > longest_keyword)
+                longest_keyword = token_strings_size[i];
+            continue;
+        }
+
+        // insertion sort, so that '>>>' gets tried before '>>' and '>'
+        size_t count = punctuation_candidates_count[first]++;
+        assert(count < MAX_PUNCTUATION_CANDIDATES);
+        uint8_t* candidates = punctuation_candidates[first];
+        while (count > 0 && token_strings_size[candidates[count - 1]] < token_strings_size[i]) {
+            candidates[count] = candidates[count - 1];
+            count--;
+        }
+        candidates[count] = (uint8_t) i;
     }
+
+    uint32_t seed = 0;
+    while (!try_keywords_seed(seed))
+        seed++;
+    keywords_seed = seed;
 }
 
 typedef struct Tokenizer_ {
-    const char* const source;
-    const size_t source_size;
-    
-    size_t pos;
-    Token current;
-} Tokenizer;
+    const char* source;
+    size_t source_size;
 
-Tokenizer* new_tokenizer(const char* source) {
-    if (!constants_initialized) {
-        init_tokenizer_constants();
-        constants_initialized = true;
-    }
+    struct List* tokens;
+    bool owns_tokens;
+    size_t cursor;
+    /// index of the final EOF token, or where a sub-tokenizer stops
+    size_t end;
+} Tokenizer;
 
-    Tokenizer* alloc = (Tokenizer*) malloc(sizeof(Tokenizer));
-    Tokenizer tokenizer = (Tokenizer) {
-        .source = source,
-        .source_size = strlen(source),
-        .pos = 0
-    };
-    memcpy(alloc, &tokenizer, sizeof(Tokenizer));
-    next_token(alloc);
-    return alloc;
+#ifdef SHADY_TOKENIZER_SSE2
+static inline unsigned first_set_bit(unsigned mask) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (unsigned) index;
+#else
+    return (unsigned) __builtin_ctz(mask);
+#endif
 }
 
-void destroy_tokenizer(Tokenizer* tokenizer) {
-    free(tokenizer);
+/// Unsigned 'lo <= c <= hi' for every byte, SSE2 only has signed comparisons so we bias both sides.
+static inline __m128i in_range_sse2(__m128i chunk, char lo, char hi) {
+    const __m128i bias = _mm_set1_epi8((char) 0x80);
+    __m128i offset = _mm_xor_si128(_mm_sub_epi8(chunk, _mm_set1_epi8(lo)), bias);
+    return _mm_cmplt_epi8(offset, _mm_set1_epi8((char) ((hi - lo + 1) ^ 0x80)));
 }
 
-static bool in_bounds(Tokenizer* tokenizer, size_t offset_to_slice) {
-    return (tokenizer->pos + offset_to_slice) <= tokenizer->source_size;
+static inline __m128i classify_sse2(__m128i chunk, CharClass class) {
+    switch (class) {
+        case CharWhitespace:
+            return _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\t'))),
+                                _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\r'))));
+        case CharIdentifier: {
+            __m128i letters = in_range_sse2(_mm_or_si128(chunk, _mm_set1_epi8(0x20)), 'a', 'z');
+            __m128i digits = in_range_sse2(chunk, '0', '9');
+            return _mm_or_si128(_mm_or_si128(letters, digits), _mm_cmpeq_epi8(chunk, _mm_set1_epi8('_')));
+        }
+        case CharDigit:
+            return in_range_sse2(chunk, '0', '9');
+        default: assert(false); return _mm_setzero_si128();
+    }
 }
+#endif
 
-const char whitespace[] = { ' ', '\t', '\n', '\r' };
-
-static inline bool is_alpha(char c) { return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'); }
-static inline bool is_digit(char c) { return c >= '0' && c <= '9'; }
-static inline bool is_whitespace(char c) { for (size_t i = 0; i < sizeof(whitespace); i++) { if(c == whitespace[i]) return true; } return false; }
-static inline bool can_start_identifier(char c) { return is_alpha(c) || c == '_'; }
-static inline bool can_make_up_identifier(char c) { return can_start_identifier(c) || is_digit(c); }
+/// Returns the position of the first character at or after 'pos' that is not of the given class.
+static inline size_t skip_class(const char* source, size_t size, size_t pos, CharClass class) {
+#ifdef SHADY_TOKENIZER_SSE2
+    if (class != CharHexDigit) {
+        while (pos + 16 <= size) {
+            __m128i chunk = _mm_loadu_si128((const __m128i*) &source[pos]);
+            unsigned mask = ~(unsigned) _mm_movemask_epi8(classify_sse2(chunk, class)) & 0xFFFFu;
+            if (mask)
+                return pos + first_set_bit(mask);
+            pos += 16;
+        }
+    }
+#endif
+    while (pos < size && (char_classes[(unsigned char) source[pos]] & class))
+        pos++;
+    return pos;
+}
 
-static void eat_whitespace_and_comments(Tokenizer* tokenizer) {
-    while (tokenizer->pos < tokenizer->source_size) {
-        if (is_whitespace(tokenizer->source[tokenizer->pos])) {
-            tokenizer->pos++;
-        } else if (tokenizer->pos + 2 <= tokenizer->source_size && tokenizer->source[tokenizer->pos] == '/' && tokenizer->source[tokenizer->pos + 1] == '/') {
-            while (tokenizer->pos < tokenizer->source_size) {
-                if (tokenizer->source[tokenizer->pos] == '\n')
+static size_t skip_whitespace_and_comments(const char* source, size_t size, size_t pos) {
+    while (true) {
+        pos = skip_class(source, size, pos, CharWhitespace);
+        if (pos + 2 > size || source[pos] != '/')
+            return pos;
+        if (source[pos + 1] == '/') {
+            const char* eol = memchr(&source[pos], '\n', size - pos);
+            pos = eol ? (size_t) (eol - source) : size;
+        } else if (source[pos + 1] == '*') {
+            pos += 2;
+            while (true) {
+                const char* star = pos < size ? memchr(&source[pos], '*', size - pos) : NULL;
+                if (!star) {
+                    pos = size;
                     break;
-                tokenizer->pos++;
-            }
-        } else if (tokenizer->pos + 4 <= tokenizer->source_size && tokenizer->source[tokenizer->pos] == '/' && tokenizer->source[tokenizer->pos + 1] == '*') {
-            tokenizer->pos += 3;
-            while (tokenizer->pos < tokenizer->source_size) {
-                if (tokenizer->source[tokenizer->pos] == '/' && tokenizer->source[tokenizer->pos - 1] == '*') {
-                    tokenizer->pos++;
+                }
+                pos = (size_t) (star - source) + 1;
+                if (pos < size && source[pos] == '/') {
+                    pos++;
                     break;
                 }
-                tokenizer->pos++;
             }
         } else
-            break;
+            return pos;
     }
 }
 
-Token next_token(Tokenizer* tokenizer) {
-    eat_whitespace_and_comments(tokenizer);
-    if (tokenizer->pos == tokenizer->source_size) {
-        debugvv_print("EOF\n");
-        Token token = {
-            .tag = EOF_tok
-        };
-        tokenizer->current = token;
-        return token;
+static size_t lex_number(const char* source, size_t size, size_t pos, TokenTag* tag) {
+    if (source[pos] == '0' && pos + 1 < size && source[pos + 1] == 'x') {
+        *tag = hex_lit_tok;
+        return skip_class(source, size, pos + 2, CharHexDigit);
     }
-    assert(in_bounds(tokenizer, 1));
-    const char* slice = &tokenizer->source[tokenizer->pos];
 
-    Token token = {
-        .start = tokenizer->pos,
-    };
+    *tag = dec_lit_tok;
+    pos = skip_class(source, size, pos, CharDigit);
+    if (pos < size && source[pos] == '.')
+        pos = skip_class(source, size, pos + 1, CharDigit);
+    if (pos < size && source[pos] == 'e') {
+        pos++;
+        if (pos < size && (source[pos] == '-' || source[pos] == '+'))
+            pos++;
+        pos = skip_class(source, size, pos, CharDigit);
+    }
+    if (pos < size && source[pos] == 'f')
+        pos++;
+    return pos;
+}
 
-    size_t token_size = 0;
-    // First, try to do alphanumeric tokenization
-    bool can_be_identifier = false;
-    if (can_start_identifier(slice[0])) {
-        can_be_identifier = true;
-        while (in_bounds(tokenizer, token_size)) {
-            if (can_make_up_identifier(slice[token_size])) {
-                token_size++;
-            } else break;
-        }
-    } else if (is_digit(slice[0])) {
-        token.tag = dec_lit_tok;
+static TokenTag lookup_keyword(const char* str, size_t size) {
+    if (size > longest_keyword)
+        return identifier_tok;
+    TokenTag candidate = keywords_table[hash_keyword(keywords_seed, size, str)];
+    if (candidate != EOF_tok && token_strings_size[candidate] == size && memcmp(token_strings[candidate], str, size) == 0)
+        return candidate;
+    return identifier_tok;
+}
 
-        if (slice[0] == '0' && slice[1] == 'x') {
-            token.tag = hex_lit_tok;
-            token_size += 2;
-        }
+static void tokenize(Tokenizer* tokenizer) {
+    const char* source = tokenizer->source;
+    size_t size = tokenizer->source_size;
+    bool log_tokens = get_log_level() <= DEBUGVV;
 
-        while (in_bounds(tokenizer, token_size) && is_digit(slice[token_size])) {
-            token_size++;
-        }
-        if (slice[token_size] == '.')
-            token_size++;
-        while (in_bounds(tokenizer, token_size) && is_digit(slice[token_size])) {
-            token_size++;
+    size_t pos = 0;
+    while (true) {
+        pos = skip_whitespace_and_comments(source, size, pos);
+        Token token = { .start = pos };
+        if (pos == size || source[pos] == '\0') {
+            debugvv_print("EOF\n");
+            token.tag = EOF_tok;
+            append_list(Token, tokenizer->tokens, token);
+            return;
         }
-        if (slice[token_size] == 'e') {
-            token_size++;
-            if (slice[token_size] == '-' || slice[token_size] == '+')
-                token_size++;
-            while (in_bounds(tokenizer, token_size) && is_digit(slice[token_size])) {
-                token_size++;
+
+        unsigned char c = (unsigned char) source[pos];
+        uint8_t class = char_classes[c];
+        if (class & CharIdentifierStart) {
+            pos = skip_class(source, size, pos + 1, CharIdentifier);
+            token.tag = lookup_keyword(&source[token.start], pos - token.start);
+            token.end = pos;
+        } else if (class & CharDigit) {
+            pos = lex_number(source, size, pos, &token.tag);
+            token.end = pos;
+        } else if (c == '"') {
+            token.tag = string_lit_tok;
+            token.start = pos + 1;
+            const char* end = pos + 1 < size ? memchr(&source[pos + 1], '"', size - pos - 1) : NULL;
+            if (!end) {
+                error_print("Unterminated string literal: %.16s...\n", &source[pos]);
+                exit(-2);
+            }
+            token.end = (size_t) (end - source);
+            pos = token.end + 1;
+        } else {
+            bool matched = false;
+            for (size_t i = 0; i < punctuation_candidates_count[c]; i++) {
+                TokenTag candidate = punctuation_candidates[c][i];
+                size_t tok_size = token_strings_size[candidate];
+                if (pos + tok_size <= size && memcmp(token_strings[candidate], &source[pos], tok_size) == 0) {
+                    token.tag = candidate;
+                    pos += tok_size;
+                    token.end = pos;
+                    matched = true;
+                    break;
+                }
+            }
+            if (!matched) {
+                error_print("We don't know how to tokenize %.16s...\n", &source[pos]);
+                exit(-2);
             }
         }
-        if (slice[token_size] == 'f')
-            token_size++;
 
-        goto parsed_successfully;
-    } else if(slice[0] == '"') {
-        token.tag = string_lit_tok;
-        token.start += 1;
-
-        while (in_bounds(tokenizer, token_size + 1) && slice[token_size + 1] != '"') {
-            token_size++;
-        }
+        append_list(Token, tokenizer->tokens, token);
 
-        if (slice[token_size + 1] == '"') {
-            tokenizer->pos += token_size + 2;
-            goto parsed_successfully_dont_update_pos;
+        if (log_tokens) {
+            debugvv_print("Token parsed: (tag = %s, pos = %zu", token_tags[token.tag], token.start);
+            if (token.tag == identifier_tok || token.tag == string_lit_tok)
+                debugvv_print(", str=%.*s", (int) (token.end - token.start), &source[token.start]);
+            debugvv_print(")\n");
         }
     }
+}
 
-    for (int i = 0; i < LIST_END_tok; i++) {
-        size_t tok_size = token_strings_size[i];
-        // if there is a match ...
-        if (tok_size != 0 && in_bounds(tokenizer, tok_size) && strncmp(token_strings[i], slice, tok_size) == 0) {
-            // if this is an identifier, we need the size to match exactly
-            if (!can_be_identifier || tok_size == token_size) {
-                token.tag = i;
-                token_size = tok_size;
-                goto parsed_successfully;
-            }
-        }
+Tokenizer* new_tokenizer(size_t source_size, const char* source) {
+    if (!constants_initialized) {
+        init_tokenizer_constants();
+        constants_initialized = true;
     }
 
-    // If it was like an identifier, but wasn't a token, then we consider it an identifier !
-    if (can_be_identifier) {
-        token.tag = identifier_tok;
-        goto parsed_successfully;
-    }
+    Tokenizer* tokenizer = (Tokenizer*) malloc(sizeof(Tokenizer));
+    *tokenizer = (Tokenizer) {
+        .source = source,
+        .source_size = source_size,
+        .tokens = new_list(Token),
+        .owns_tokens = true,
+        .cursor = 0,
+    };
+    tokenize(tokenizer);
+    tokenizer->end = entries_count_list(tokenizer->tokens) - 1;
+    return tokenizer;
+}
 
-    error_print("We don't know how to tokenize %.16s...\n", slice);
-    exit(-2);
+Tokenizer* split_tokenizer(Tokenizer* parent, size_t begin, size_t end) {
+    assert(begin <= end && end <= parent->end);
+    Tokenizer* tokenizer = (Tokenizer*) malloc(sizeof(Tokenizer));
+    *tokenizer = (Tokenizer) {
+        .source = parent->source,
+        .source_size = parent->source_size,
+        .tokens = parent->tokens,
+        .owns_tokens = false,
+        .cursor = begin,
+        .end = end,
+    };
+    return tokenizer;
+}
 
-    parsed_successfully:
-    tokenizer->pos += token_size;
+void destroy_tokenizer(Tokenizer* tokenizer) {
+    if (tokenizer->owns_tokens)
+        destroy_list(tokenizer->tokens);
+    free(tokenizer);
+}
 
-    parsed_successfully_dont_update_pos:
-    token.end = token.start + token_size;
-    tokenizer->current = token;
+size_t get_tokenizer_position(Tokenizer* tokenizer) {
+    return tokenizer->cursor;
+}
 
-    debugvv_print("Token parsed: (tag = %s, pos = %zu", token_tags[token.tag], token.start);
-    if (token.tag == identifier_tok || token.tag == string_lit_tok) {
-        debugvv_print(", str=");
-        for (size_t i = token.start; i < token.end; i++)
-            debugvv_print("%c", tokenizer->source[i]);
-    }
-    debugvv_print(")\n");
-    return token;
+void set_tokenizer_position(Tokenizer* tokenizer, size_t position) {
+    assert(position <= tokenizer->end);
+    tokenizer->cursor = position;
+}
+
+Token next_token(Tokenizer* tokenizer) {
+    // we stay on EOF once we reach it
+    if (tokenizer->cursor < tokenizer->end)
+        tokenizer->cursor++;
+    return curr_token(tokenizer);
 }
 
 Token curr_token(Tokenizer* tokenizer) {
-    return tokenizer->current;
+    Token token = read_list(Token, tokenizer->tokens)[tokenizer->cursor];
+    if (tokenizer->cursor == tokenizer->end)
+        token.tag = EOF_tok;
+    return token;
 }
@@ -103,7 +103,8 @@ TOKEN(equal, "=") \
 TOKEN(LIST_END, NULL)
 
 typedef struct Tokenizer_ Tokenizer;
-Tokenizer* new_tokenizer(const char* source);
+/// Tokenizes the whole source up-front, stopping at the end of the buffer or at the first NUL byte.
+Tokenizer* new_tokenizer(size_t source_size, const char* source);
 void destroy_tokenizer(Tokenizer*);
 
 typedef enum {
@@ -123,6 +124,12 @@ typedef struct {
 Token curr_token(Tokenizer* tokenizer);
 Token next_token(Tokenizer* tokenizer);
 
+size_t get_tokenizer_position(Tokenizer* tokenizer);
+void set_tokenizer_position(Tokenizer* tokenizer, size_t position);
+/// Creates a tokenizer over the tokens [begin, end) of an existing one, which reports EOF once it reaches 'end'.
+/// It shares the parent's tokens, so it must be destroyed before it.
+Tokenizer* split_tokenizer(Tokenizer* parent, size_t begin, size_t end);
+
 #define SHADY_TOKEN_H
 
 #endif //SHADY_TOKEN_H
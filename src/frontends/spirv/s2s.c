@@ -54,9 +54,11 @@ typedef struct {
         size_t instruction_offset;
         const Node* node;
         String str;
-        struct { size_t count; uint32_t* data; } literals;
+        struct { size_t count; const uint32_t* data; } literals;
     };
-    SpvDeco* next_decoration;
+    // decorations targeting this id live in SpvParser.decorations[decorations_begin, decorations_begin + decorations_count)
+    size_t decorations_begin;
+    size_t decorations_count;
     size_t final_size;
 } SpvDef;
 
@@ -77,7 +79,7 @@ struct SpvPhiArgs_ {
 typedef struct {
     size_t cursor;
     size_t len;
-    uint32_t* words;
+    const uint32_t* words;
     Module* mod;
     IrArena* arena;
 
@@ -93,6 +95,7 @@ typedef struct {
 
     SpvHeader header;
     SpvDef* defs;
+    SpvDeco* decorations;
     Arena* decorations_arena;
     struct Dict* phi_arguments;
 } SpvParser;
@@ -108,20 +111,16 @@ SpvDef* new_def(SpvParser* parser) {
 
 void add_decoration(SpvParser* parser, SpvId id, SpvDeco decoration) {
     SpvDef* tgt_def = &parser->defs[id];
-    while (tgt_def->next_decoration) {
-        tgt_def = &tgt_def->next_decoration->payload;
-    }
-    SpvDeco* interned = arena_alloc(parser->decorations_arena, sizeof(SpvDeco));
-    memcpy(interned, &decoration, sizeof(SpvDeco));
-    tgt_def->next_decoration = interned;
+    // the slots were counted in scan_definitions
+    parser->decorations[tgt_def->decorations_begin + tgt_def->decorations_count++] = decoration;
 }
 
 SpvDeco* find_decoration(SpvParser* parser, SpvId id, int member, SpvDecoration tag) {
     SpvDef* tgt_def = &parser->defs[id];
-    while (tgt_def->next_decoration) {
-        if (tgt_def->next_decoration->decoration == tag && (member < 0 || tgt_def->next_decoration->member == member))
-            return tgt_def->next_decoration;
-        tgt_def = &tgt_def->next_decoration->payload;
+    for (size_t i = 0; i < tgt_def->decorations_count; i++) {
+        SpvDeco* deco = &parser->decorations[tgt_def->decorations_begin + i];
+        if (deco->decoration == tag && (member < 0 || deco->member == member))
+            return deco;
     }
     return NULL;
 }
@@ -194,7 +193,7 @@ bool parse_spv_header(SpvParser* parser) {
     return true;
 }
 
-String decode_spv_string_literal(SpvParser* parser, uint32_t* at) {
+String decode_spv_string_literal(SpvParser* parser, const uint32_t* at) {
     // TODO: assumes little endian
     return string(get_module_arena(parser->mod), (const char*) at);
 }
@@ -339,7 +338,7 @@ const SpvShdOpMapping* convert_spv_op(SpvOp src) {
 }
 
 SpvId get_result_defined_at(SpvParser* parser, size_t instruction_offset) {
-    uint32_t* instruction = parser->words + instruction_offset;
+    const uint32_t* instruction = parser->words + instruction_offset;
 
     SpvOp op = instruction[0] & 0xFFFF;
     SpvId result;
@@ -355,14 +354,29 @@ SpvId get_result_defined_at(SpvParser* parser, size_t instruction_offset) {
     error("no result defined at offset %zu", instruction_offset);
 }
 
+/// How many decorations an instruction attaches to its target, see add_decoration
+static int count_decorations(SpvOp op) {
+    switch (op) {
+        case SpvOpName:
+        case SpvOpMemberName:
+        case SpvOpExecutionMode:
+        case SpvOpDecorate:
+        case SpvOpMemberDecorate: return 1;
+        case SpvOpEntryPoint: return 2;
+        default: return 0;
+    }
+}
+
+/// Finds where every id is defined and sizes the decoration table, in a single pass over the module.
 void scan_definitions(SpvParser* parser) {
     size_t old_cursor = parser->cursor;
+    size_t decorations_count = 0;
     while (true) {
         size_t available = parser->len - parser->cursor;
         if (available == 0)
             break;
         assert(available > 0);
-        uint32_t* instruction = parser->words + parser->cursor;
+        const uint32_t* instruction = parser->words + parser->cursor;
         SpvOp op = instruction[0] & 0xFFFF;
         int size = (int) ((instruction[0] >> 16u) & 0xFFFFu);
 
@@ -378,9 +392,27 @@ void scan_definitions(SpvParser* parser) {
             parser->defs[result].type = Forward;
             parser->defs[result].instruction_offset = parser->cursor;
         }
+
+        int decorations = count_decorations(op);
+        if (decorations > 0) {
+            // entry points name their target after the execution model
+            SpvId target = op == SpvOpEntryPoint ? instruction[2] : instruction[1];
+            assert(target < parser->header.bound);
+            parser->defs[target].decorations_count += decorations;
+            decorations_count += decorations;
+        }
         parser->cursor += size;
     }
     parser->cursor = old_cursor;
+
+    // turn the counts into ranges, add_decoration fills them back up
+    size_t begin = 0;
+    for (size_t id = 0; id < parser->header.bound; id++) {
+        parser->defs[id].decorations_begin = begin;
+        begin += parser->defs[id].decorations_count;
+        parser->defs[id].decorations_count = 0;
+    }
+    parser->decorations = calloc(decorations_count, sizeof(SpvDeco));
 }
 
 Nodes get_args_from_phi(SpvParser* parser, SpvId block, SpvId predecessor) {
@@ -416,7 +448,7 @@ Nodes get_args_from_phi(SpvParser* parser, SpvId block, SpvId predecessor) {
 }
 
 size_t parse_spv_instruction_at(SpvParser* parser, size_t instruction_offset) {
-    uint32_t* instruction = parser->words + instruction_offset;
+    const uint32_t* instruction = parser->words + instruction_offset;
     SpvOp op = instruction[0] & 0xFFFF;
     int size = (int) ((instruction[0] >> 16u) & 0xFFFFu);
     assert(size > 0);
@@ -488,7 +520,7 @@ size_t parse_spv_instruction_at(SpvParser* parser, size_t instruction_offset) {
             ShdDecoration decoration = op == SpvOpName ? ShdDecorationName : ShdDecorationMemberName;
             int name_offset = op == SpvOpName ? 2 : 3;
             SpvDeco deco = {
-                .payload = { Str, .str = decode_spv_string_literal(parser, instruction + name_offset), .next_decoration = NULL },
+                .payload = { Str, .str = decode_spv_string_literal(parser, instruction + name_offset) },
                 .decoration = decoration,
                 .member = op == SpvOpName ? -1 : (int)instruction[3],
             };
@@ -1357,7 +1389,7 @@ S2SError parse_spirv_into_shady(Module* dst, size_t len, const char* data) {
     SpvParser parser = {
         .cursor = 0,
         .len = len / sizeof(uint32_t),
-        .words = (uint32_t*) data,
+        .words = (const uint32_t*) data,
         .mod = dst,
         .arena = get_module_arena(dst),
 
@@ -1378,6 +1410,7 @@ S2SError parse_spirv_into_shady(Module* dst, size_t len, const char* data) {
 
     destroy_dict(parser.phi_arguments);
     destroy_arena(parser.decorations_arena);
+    free(parser.decorations);
     free(parser.defs);
 
     return S2S_Success;
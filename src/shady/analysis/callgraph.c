@@ -140,7 +140,7 @@ static CGNode* analyze_fn(CallGraph* graph, const Node* fn) {
 static int min(int a, int b) { return a < b ? a : b; }
 
 // https://en.wikipedia.org/wiki/Tarjan%27s_strongly_connected_components_algorithm
-static void strongconnect(CGNode* v, int* index, struct List* stack) {
+static void strongconnect(CallGraph* graph, CGNode* v, int* index, struct List* stack) {
     debugv_print("strongconnect(%s) \n", v->fn->payload.fun.name);
 
     v->tarjan.index = *index;
@@ -158,7 +158,7 @@ static void strongconnect(CGNode* v, int* index, struct List* stack) {
             debugv_print("  %s\n", e.dst_fn->fn->payload.fun.name);
             if (e.dst_fn->tarjan.index == -1) {
                 // Successor w has not yet been visited; recurse on it
-                strongconnect(e.dst_fn, index, stack);
+                strongconnect(graph, e.dst_fn, index, stack);
                 v->tarjan.lowlink = min(v->tarjan.lowlink, e.dst_fn->tarjan.lowlink);
             } else if (e.dst_fn->tarjan.on_stack) {
                 // Successor w is in stack S and hence in the current SCC
@@ -181,6 +181,8 @@ static void strongconnect(CGNode* v, int* index, struct List* stack) {
                 w = pop_last_list(CGNode*, stack);
                 w->tarjan.on_stack = false;
                 scc[scc_size++] = w;
+                // SCCs are found only after all the ones they can reach
+                append_list(CGNode*, graph->bottom_up, w);
             } while (v != w);
         }
 
@@ -194,15 +196,15 @@ static void strongconnect(CGNode* v, int* index, struct List* stack) {
     }
 }
 
-static void tarjan(struct Dict* verts) {
+static void tarjan(CallGraph* graph) {
     int index = 0;
     struct List* stack = new_list(CGNode*);
 
     size_t iter = 0;
     CGNode* n;
-    while (dict_iter(verts, &iter, NULL, &n)) {
+    while (dict_iter(graph->fn2cgn, &iter, NULL, &n)) {
         if (n->tarjan.index == -1)
-            strongconnect(n, &index, stack);
+            strongconnect(graph, n, &index, stack);
     }
 
     destroy_list(stack);
@@ -211,7 +213,8 @@ static void tarjan(struct Dict* verts) {
 CallGraph* new_callgraph(Module* mod) {
     CallGraph* graph = calloc(sizeof(CallGraph), 1);
     *graph = (CallGraph) {
-        .fn2cgn = new_dict(const Node*, CGNode*, (HashFn) hash_node, (CmpFn) compare_node)
+        .fn2cgn = new_dict(const Node*, CGNode*, (HashFn) hash_node, (CmpFn) compare_node),
+        .bottom_up = new_list(CGNode*),
     };
 
     Nodes decls = get_module_declarations(mod);
@@ -223,7 +226,7 @@ CallGraph* new_callgraph(Module* mod) {
 
     debugv_print("CallGraph: done with CFG build, contains %d nodes\n", entries_count_dict(graph->fn2cgn));
 
-    tarjan(graph->fn2cgn);
+    tarjan(graph);
 
     return graph;
 }
@@ -238,5 +241,14 @@ void destroy_callgraph(CallGraph* graph) {
         free(node);
     }
     destroy_dict(graph->fn2cgn);
+    destroy_list(graph->bottom_up);
     free(graph);
 }
+
+Nodes get_callsite_args(const Node* instr) {
+    switch (instr->tag) {
+        case Call_TAG: return instr->payload.call.args;
+        case TailCall_TAG: return instr->payload.tail_call.args;
+        default: SHADY_UNREACHABLE;
+    }
+}
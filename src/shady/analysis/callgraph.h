@@ -28,9 +28,14 @@ struct CGNode_ {
 
 typedef struct Callgraph_ {
     struct Dict* fn2cgn;
+    /// @ref List of @ref CGNode*, callees come before their callers (except within recursive call chains)
+    struct List* bottom_up;
 } CallGraph;
 
 CallGraph* new_callgraph(Module*);
 void destroy_callgraph(CallGraph*);
 
+/// The arguments passed by the Call or TailCall of a @ref CGEdge
+Nodes get_callsite_args(const Node* instr);
+
 #endif
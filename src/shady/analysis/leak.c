@@ -76,3 +76,88 @@ bool is_control_static(const UsesMap* map, const Node* control) {
     assert(found_binding_abs);
     return true;
 }
+
+static bool is_member_access_static(const UsesMap* map, const Node* ptr);
+
+/// The variables the Lets using @p instruction bind it to must only be used as pointers into the same member
+static bool are_member_pointers_static(const UsesMap* map, const Node* instruction) {
+    const Use* use = get_first_use(map, instruction);
+    for (;use; use = use->next_use) {
+        if (use->user->tag != Let_TAG)
+            return false;
+        Nodes results = get_abstraction_params(get_let_tail(use->user));
+        for (size_t i = 0; i < results.count; i++) {
+            if (!is_member_access_static(map, results.nodes[i]))
+                return false;
+        }
+    }
+    return true;
+}
+
+/// Whether a pointer into a member is only loaded from, stored to, or indexed into further, without ever moving to another member
+static bool is_member_access_static(const UsesMap* map, const Node* ptr) {
+    const Use* use = get_first_use(map, ptr);
+    for (;use; use = use->next_use) {
+        if (is_abstraction(use->user) && use->operand_class == NcVariable)
+            continue;
+        if (use->user->tag != PrimOp_TAG)
+            return false;
+        PrimOp payload = use->user->payload.prim_op;
+        for (size_t i = 1; i < payload.operands.count; i++) {
+            if (payload.operands.nodes[i] == ptr)
+                return false;
+        }
+        switch (payload.op) {
+            case load_op:
+            case store_op:
+                continue;
+            case lea_op: {
+                const IntLiteral* offset = resolve_to_int_literal(payload.operands.nodes[1]);
+                if (!offset || get_int_literal_value(*offset, false) != 0)
+                    return false;
+                if (!are_member_pointers_static(map, use->user))
+                    return false;
+                continue;
+            }
+            default: return false;
+        }
+    }
+    return true;
+}
+
+bool is_aggregate_access_static(const UsesMap* map, const Node* ptr, size_t members_count) {
+    const Use* use = get_first_use(map, ptr);
+    for (;use; use = use->next_use) {
+        if (is_abstraction(use->user) && use->operand_class == NcVariable)
+            continue;
+        if (use->user->tag != PrimOp_TAG)
+            return false;
+        PrimOp payload = use->user->payload.prim_op;
+        // the pointer itself must not be stored anywhere
+        for (size_t i = 1; i < payload.operands.count; i++) {
+            if (payload.operands.nodes[i] == ptr)
+                return false;
+        }
+        switch (payload.op) {
+            case load_op:
+            case store_op:
+                continue;
+            case lea_op: {
+                if (payload.operands.count < 3)
+                    return false;
+                const IntLiteral* offset = resolve_to_int_literal(payload.operands.nodes[1]);
+                if (!offset || get_int_literal_value(*offset, false) != 0)
+                    return false;
+                const IntLiteral* index = resolve_to_int_literal(payload.operands.nodes[2]);
+                if (!index || get_int_literal_value(*index, false) >= members_count)
+                    return false;
+                // the member pointer must not be used to get to the other members either
+                if (!are_member_pointers_static(map, use->user))
+                    return false;
+                continue;
+            }
+            default: return false;
+        }
+    }
+    return true;
+}
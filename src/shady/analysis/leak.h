@@ -16,4 +16,8 @@ const Node* get_var_instruction(const UsesMap*, const Node* var);
 
 bool is_control_static(const UsesMap*, const Node* control);
 
+/// Whether a pointer to an aggregate is only ever loaded from, stored to, or offset into a member at a constant index,
+/// and the pointers to the members in turn never leave them
+bool is_aggregate_access_static(const UsesMap*, const Node* ptr, size_t members_count);
+
 #endif
@@ -0,0 +1,135 @@
+#include "liveness.h"
+
+#include "log.h"
+#include "portability.h"
+#include "../visit.h"
+
+#include "../analysis/scope.h"
+
+#include "list.h"
+#include "dict.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+KeyHash hash_node(Node**);
+bool compare_node(Node**, Node**);
+
+struct Liveness_ {
+    Scope* scope;
+    /// indexed by rpo_index, sets of the variables live on entry
+    struct Dict** live_in;
+};
+
+typedef struct {
+    Visitor visitor;
+    struct Dict* set;
+} Context;
+
+static void search_op_for_used_variables(Context* ctx, NodeClass class, String op_name, const Node* node) {
+    assert(node);
+    switch (node->tag) {
+        case Variable_TAG: insert_set_get_result(const Node*, ctx->set, node); break;
+        case Function_TAG:
+        case Case_TAG:
+        case BasicBlock_TAG: assert(false);
+        default: visit_node_operands(&ctx->visitor, IGNORE_ABSTRACTIONS_MASK, node); break;
+    }
+}
+
+static bool is_param_of(const Node* abs, const Node* var) {
+    Nodes params = get_abstraction_params(abs);
+    for (size_t i = 0; i < params.count; i++)
+        if (params.nodes[i] == var)
+            return true;
+    return false;
+}
+
+Liveness* compute_liveness(Scope* scope) {
+    Liveness* liveness = calloc(sizeof(Liveness), 1);
+    liveness->scope = scope;
+    liveness->live_in = calloc(sizeof(struct Dict*), scope->size);
+
+    // start from what the abstractions use themselves
+    for (size_t i = 0; i < scope->size; i++) {
+        const Node* abs = scope->rpo[i]->node;
+        Context ctx = {
+            .visitor = {
+                .visit_op_fn = (VisitOpFn) search_op_for_used_variables,
+            },
+            .set = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+        };
+        const Node* body = get_abstraction_body(abs);
+        if (body)
+            visit_op(&ctx.visitor, NcTerminator, "body", body);
+        Nodes params = get_abstraction_params(abs);
+        for (size_t j = 0; j < params.count; j++)
+            remove_dict(const Node*, ctx.set, params.nodes[j]);
+        liveness->live_in[i] = ctx.set;
+    }
+
+    // then propagate backwards until nothing changes, going in post-order converges fastest
+    bool changed = true;
+    size_t rounds = 0;
+    while (changed) {
+        changed = false;
+        rounds++;
+        for (size_t i = scope->size - 1; i < scope->size; i--) {
+            CFNode* cfnode = scope->rpo[i];
+            struct Dict* live_in = liveness->live_in[i];
+            for (size_t j = 0; j < entries_count_list(cfnode->succ_edges); j++) {
+                CFEdge edge = read_list(CFEdge, cfnode->succ_edges)[j];
+                size_t iter = 0;
+                const Node* var;
+                while (dict_iter(liveness->live_in[edge.dst->rpo_index], &iter, &var, NULL)) {
+                    if (is_param_of(cfnode->node, var))
+                        continue;
+                    changed |= insert_set_get_result(const Node*, live_in, var);
+                }
+            }
+        }
+    }
+    debugvv_print("Liveness of %s converged after %d rounds\n", get_abstraction_name(scope->entry->node), rounds);
+
+    return liveness;
+}
+
+void destroy_liveness(Liveness* liveness) {
+    for (size_t i = 0; i < liveness->scope->size; i++)
+        destroy_dict(liveness->live_in[i]);
+    free(liveness->live_in);
+    free(liveness);
+}
+
+typedef struct {
+    const Node* var;
+    size_t rpo_index;
+} LiveVar;
+
+static int compare_live_vars(const LiveVar* a, const LiveVar* b) {
+    if (a->rpo_index != b->rpo_index)
+        return a->rpo_index < b->rpo_index ? -1 : 1;
+    return (int) a->var->payload.var.pindex - (int) b->var->payload.var.pindex;
+}
+
+struct List* get_live_in(const Liveness* liveness, const Node* abs) {
+    struct Dict* live_in = liveness->live_in[scope_lookup(liveness->scope, abs)->rpo_index];
+    size_t count = entries_count_dict(live_in);
+    LARRAY(LiveVar, vars, count);
+    size_t iter = 0, i = 0;
+    const Node* var;
+    while (dict_iter(live_in, &iter, &var, NULL)) {
+        CFNode** def = var->payload.var.abs ? find_value_dict(const Node*, CFNode*, liveness->scope->map, var->payload.var.abs) : NULL;
+        vars[i++] = (LiveVar) { .var = var, .rpo_index = def ? (*def)->rpo_index : 0 };
+    }
+    qsort(vars, count, sizeof(LiveVar), (int (*)(const void*, const void*)) compare_live_vars);
+
+    struct List* list = new_list(const Node*);
+    for (i = 0; i < count; i++)
+        append_list(const Node*, list, vars[i].var);
+    return list;
+}
+
+bool is_live_in(const Liveness* liveness, const Node* abs, const Node* var) {
+    return find_key_dict(const Node*, liveness->live_in[scope_lookup(liveness->scope, abs)->rpo_index], var);
+}
@@ -0,0 +1,21 @@
+#ifndef SHADY_LIVENESS_H
+#define SHADY_LIVENESS_H
+
+#include "shady/ir.h"
+
+typedef struct Scope_ Scope;
+typedef struct Liveness_ Liveness;
+
+/// Computes which variables are live on entry to every abstraction in @p scope
+Liveness* compute_liveness(Scope* scope);
+void destroy_liveness(Liveness*);
+
+/** @brief The variables live on entry to @p abs, that is, used on some path starting there before being redefined.
+ *
+ * Ordered by where they are defined, in reverse post-order.
+ * @returns a new @ref List of const @ref Node*
+ */
+struct List* get_live_in(const Liveness*, const Node* abs);
+bool is_live_in(const Liveness*, const Node* abs, const Node* var);
+
+#endif
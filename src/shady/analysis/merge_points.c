@@ -0,0 +1,67 @@
+#include "merge_points.h"
+
+#include "scope.h"
+#include "uses.h"
+#include "leak.h"
+
+#include "list.h"
+#include "dict.h"
+#include "log.h"
+
+static void add_merge_point(struct List* merges, MergePoint merge) {
+    if (get_abstraction_params(merge.abs).count > 0)
+        append_list(MergePoint, merges, merge);
+}
+
+void find_merge_points(CallGraph* graph, struct Dict* uses, struct Dict* let_instructions, struct List* merges, const Node* fn) {
+    CGNode* fn_node = *find_value_dict(const Node*, CGNode*, graph->fn2cgn, fn);
+    // we need to see every call site to know what the parameters hold
+    if (!fn_node->is_address_captured && !lookup_annotation(fn, "EntryPoint") && entries_count_dict(fn_node->callers) > 0)
+        add_merge_point(merges, (MergePoint) { .abs = fn, .fn = fn });
+
+    Scope* scope = new_scope(fn);
+    for (size_t i = 0; i < scope->size; i++) {
+        const Node* abs = scope->rpo[i]->node;
+        if (abs->tag == BasicBlock_TAG)
+            add_merge_point(merges, (MergePoint) { .abs = abs, .fn = fn });
+        const Node* body = get_abstraction_body(abs);
+        if (body->tag != Let_TAG)
+            continue;
+        const Node* tail = get_let_tail(body);
+        const Node* instruction = get_let_instruction(body);
+        insert_dict(const Node*, const Node*, let_instructions, tail, instruction);
+        if (instruction->tag == Control_TAG && is_control_static(get_function_uses(uses, fn), instruction))
+            add_merge_point(merges, (MergePoint) { .abs = tail, .fn = fn, .control = instruction });
+    }
+    destroy_scope(scope);
+}
+
+bool get_incoming_values(CallGraph* graph, struct Dict* uses, const MergePoint* merge, size_t i, struct List* values) {
+    switch (merge->abs->tag) {
+        case Function_TAG: {
+            CGNode* fn_node = *find_value_dict(const Node*, CGNode*, graph->fn2cgn, merge->fn);
+            size_t iter = 0;
+            CGEdge e;
+            while (dict_iter(fn_node->callers, &iter, &e, NULL))
+                append_list(const Node*, values, get_callsite_args(e.instr).nodes[i]);
+            return true;
+        }
+        case BasicBlock_TAG: {
+            for (const Use* use = get_first_use(get_function_uses(uses, merge->fn), merge->abs); use; use = use->next_use) {
+                if (use->user->tag != Jump_TAG)
+                    return false;
+                append_list(const Node*, values, use->user->payload.jump.args.nodes[i]);
+            }
+            return true;
+        }
+        case Case_TAG: {
+            const Node* jp = first(get_abstraction_params(merge->control->payload.control.inside));
+            for (const Use* use = get_first_use(get_function_uses(uses, merge->fn), jp); use; use = use->next_use) {
+                if (use->user->tag == Join_TAG)
+                    append_list(const Node*, values, use->user->payload.join.args.nodes[i]);
+            }
+            return true;
+        }
+        default: SHADY_UNREACHABLE;
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef SHADY_MERGE_POINTS_H
+#define SHADY_MERGE_POINTS_H
+
+#include "shady/ir.h"
+#include "callgraph.h"
+
+/// An abstraction whose parameters get their values from somewhere we can see
+typedef struct {
+    /// a Function, a BasicBlock, or the tail of a static Control
+    const Node* abs;
+    const Node* fn;
+    /// the Control, when abs is its tail
+    const Node* control;
+} MergePoint;
+
+/** @brief Appends the abstractions in @p fn that have parameters and whose predecessors we can see to @p merges.
+ *
+ * @p fn itself is only a merge point when @p graph knows all of its callers. Also records the instruction each Let
+ * tail in @p fn is bound to in @p let_instructions, and caches UsesMaps in @p uses (made with new_uses_cache).
+ */
+void find_merge_points(CallGraph* graph, struct Dict* uses, struct Dict* let_instructions, struct List* merges, const Node* fn);
+
+/// Appends what every predecessor of @p merge passes for its parameter @p i to @p values, returns false when some of them are out of sight
+bool get_incoming_values(CallGraph* graph, struct Dict* uses, const MergePoint* merge, size_t i, struct List* values);
+
+#endif
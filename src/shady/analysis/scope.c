@@ -381,6 +381,17 @@ void destroy_scope(Scope* scope) {
     free(scope);
 }
 
+size_t count_scope_instructions(const Node* fn) {
+    if (!get_abstraction_body(fn))
+        return 0;
+    Scope* scope = new_scope(fn);
+    size_t count = 0;
+    for (size_t i = 0; i < scope->size; i++)
+        count += get_abstraction_body(scope->rpo[i]->node)->tag == Let_TAG;
+    destroy_scope(scope);
+    return count;
+}
+
 static size_t post_order_visit(Scope* scope, CFNode* n, size_t i) {
     n->rpo_index = -2;
 
@@ -416,6 +427,14 @@ CFNode* least_common_ancestor(CFNode* i, CFNode* j) {
     return i;
 }
 
+bool cfnode_dominates(const CFNode* a, const CFNode* b) {
+    assert(a && b);
+    // dominators come first in RPO, so we can stop climbing as soon as we went past 'a'
+    while (b && b->rpo_index > a->rpo_index)
+        b = b->idom;
+    return b == a;
+}
+
 void compute_domtree(Scope* scope) {
     for (size_t i = 0; i < scope->size; i++) {
         CFNode* n = read_list(CFNode*, scope->contents)[i];
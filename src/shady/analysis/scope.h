@@ -104,9 +104,14 @@ void compute_rpo(Scope*);
 void compute_domtree(Scope*);
 
 CFNode* least_common_ancestor(CFNode* i, CFNode* j);
+/// Whether @p a dominates @p b (every node dominates itself), requires compute_domtree to have run
+bool cfnode_dominates(const CFNode* a, const CFNode* b);
 
 void destroy_scope(Scope*);
 
+/// How many instructions the abstractions in the scope of @p fn bind, 0 when it has no body
+size_t count_scope_instructions(const Node* fn);
+
 /**
  * @returns @ref List of @ref CFNode*
  */
@@ -0,0 +1,214 @@
+#include "stack_depth.h"
+
+#include "scope.h"
+#include "liveness.h"
+
+#include "log.h"
+#include "portability.h"
+#include "list.h"
+#include "dict.h"
+#include "util.h"
+
+#include "../type.h"
+#include "../transform/memory_layout.h"
+
+#include <assert.h>
+
+KeyHash hash_node(const Node**);
+bool compare_node(const Node**, const Node**);
+
+typedef struct {
+    Module* m;
+    /// Function -> StackDepth
+    struct Dict* depths;
+    /// set of the Functions we're in the middle of visiting
+    struct Dict* visiting;
+    /// in bytes, what lower_stack pads each slot to
+    size_t slot_alignment;
+} Context;
+
+static size_t round_up(size_t a, size_t b) {
+    if (b == 0)
+        return a;
+    return (a + b - 1) / b * b;
+}
+
+static uint32_t maxof(uint32_t a, uint32_t b) {
+    return a > b ? a : b;
+}
+
+/// The memory layout of things as they end up on the stack, once join points, masks and function pointers are lowered
+static TypeMemLayout get_pushed_layout(Context* ctx, const Type* type) {
+    IrArena* a = get_module_arena(ctx->m);
+    switch (type->tag) {
+        case QualifiedType_TAG: return get_pushed_layout(ctx, type->payload.qualified_type.type);
+        case MaskType_TAG: return get_mem_layout(a, uint64_type(a));
+        case JoinPointType_TAG: {
+            const Node* decl = get_declaration(ctx->m, "JoinPoint");
+            if (!decl)
+                return get_mem_layout(a, uint64_type(a));
+            return get_pushed_layout(ctx, decl->payload.nom_type.body);
+        }
+        case TypeDeclRef_TAG: return get_pushed_layout(ctx, type->payload.type_decl_ref.decl->payload.nom_type.body);
+        case PtrType_TAG: {
+            if (type->payload.ptr_type.pointed_type->tag == FnType_TAG)
+                return get_mem_layout(a, uint64_type(a));
+            // logical pointers never make it to the stack, lift_indirect_targets recomputes them instead
+            if (!is_physical_as(type->payload.ptr_type.address_space) && type->payload.ptr_type.address_space != AsGeneric)
+                return (TypeMemLayout) { .type = type, .size_in_bytes = 0, .alignment_in_bytes = 1 };
+            return get_mem_layout(a, type);
+        }
+        case RecordType_TAG: {
+            size_t offset = 0;
+            size_t max_align = 1;
+            Nodes members = type->payload.record_type.members;
+            for (size_t i = 0; i < members.count; i++) {
+                TypeMemLayout member = get_pushed_layout(ctx, members.nodes[i]);
+                offset = round_up(offset, member.alignment_in_bytes) + member.size_in_bytes;
+                if (member.alignment_in_bytes > max_align)
+                    max_align = member.alignment_in_bytes;
+            }
+            return (TypeMemLayout) { .type = type, .size_in_bytes = round_up(offset, max_align), .alignment_in_bytes = max_align };
+        }
+        default: return get_mem_layout(a, type);
+    }
+}
+
+/// How much lower_stack advances the stack pointer by to make room for @p type
+static uint32_t get_slot_size(Context* ctx, const Type* type) {
+    return round_up(get_pushed_layout(ctx, type).size_in_bytes, ctx->slot_alignment);
+}
+
+/// What lift_indirect_targets will spill if it has to split @p fn at @p cont
+static uint32_t get_spilled_size(Context* ctx, const Liveness* liveness, const Node* cont) {
+    struct List* live = get_live_in(liveness, cont);
+    uint32_t size = 0;
+    for (size_t i = 0; i < entries_count_list(live); i++)
+        size += get_slot_size(ctx, read_list(const Node*, live)[i]->type);
+    destroy_list(live);
+    return size;
+}
+
+/// What lower_tailcalls pushes to pass values of @p types along, for tail calls and joins alike
+static uint32_t get_passed_size(Context* ctx, Nodes types) {
+    uint32_t size = 0;
+    for (size_t i = 0; i < types.count; i++)
+        size += get_slot_size(ctx, types.nodes[i]);
+    return size;
+}
+
+/// Joins push the payload of the join point on top of the values they yield
+static uint32_t get_joined_size(Context* ctx, Nodes types) {
+    IrArena* a = get_module_arena(ctx->m);
+    return get_passed_size(ctx, types) + get_slot_size(ctx, uint32_type(a));
+}
+
+static StackDepth visit_function(Context* ctx, const Node* fn);
+
+static StackDepth unbounded_depth(const Node* culprit) {
+    return (StackDepth) { .unbounded = true, .culprit = culprit };
+}
+
+static StackDepth visit_callee(Context* ctx, const Node* fn, const Node* callee) {
+    if (callee->tag != FnAddr_TAG)
+        return unbounded_depth(fn);
+    return visit_function(ctx, callee->payload.fn_addr.fn);
+}
+
+static void merge_unbounded(StackDepth* acc, StackDepth d) {
+    if (d.unbounded && !acc->unbounded) {
+        acc->unbounded = true;
+        acc->culprit = d.culprit;
+    }
+}
+
+static StackDepth visit_function(Context* ctx, const Node* fn) {
+    StackDepth* found = find_value_dict(const Node*, StackDepth, ctx->depths, fn);
+    if (found)
+        return *found;
+    // going around a cycle once is accounted for by the caller we came from
+    if (find_key_dict(const Node*, ctx->visiting, fn))
+        return unbounded_depth(fn);
+    if (!get_abstraction_body(fn))
+        return (StackDepth) { 0 };
+    insert_set_get_result(const Node*, ctx->visiting, fn);
+
+    IrArena* a = get_module_arena(ctx->m);
+    StackDepth depth = { 0 };
+
+    // the return join point lower_callf adds is passed along with the arguments, and is live across every call
+    uint32_t return_jp = get_slot_size(ctx, join_point_type(a, (JoinPointType) { .yield_types = empty(a) }));
+    uint32_t frame = 0;
+    const Node* frame_type = get_declaration(ctx->m, format_string_arena(a->arena, "%s_stack_frame", get_abstraction_name(fn)));
+    if (frame_type && frame_type->tag == NominalType_TAG)
+        frame = get_slot_size(ctx, frame_type->payload.nom_type.body);
+
+    // the arguments stay on the stack until they are popped into the parameters
+    Nodes params = get_abstraction_params(fn);
+    LARRAY(const Type*, param_types, params.count);
+    for (size_t i = 0; i < params.count; i++)
+        param_types[i] = params.nodes[i]->type;
+    uint32_t entry = get_passed_size(ctx, nodes(a, params.count, param_types)) + return_jp;
+    // the results get pushed before the frame is necessarily gone
+    uint32_t exit = frame + get_joined_size(ctx, fn->payload.fun.return_types);
+    uint32_t own = frame + return_jp;
+
+    uint32_t deepest_call = 0;
+    Scope* scope = new_scope(fn);
+    Liveness* liveness = compute_liveness(scope);
+    for (size_t i = 0; i < scope->size; i++) {
+        const Node* body = get_abstraction_body(scope->rpo[i]->node);
+        if (!body)
+            continue;
+        if (body->tag == TailCall_TAG) {
+            StackDepth callee = visit_callee(ctx, fn, body->payload.tail_call.target);
+            merge_unbounded(&depth, callee);
+            deepest_call = maxof(deepest_call, callee.size);
+            continue;
+        }
+        if (body->tag != Let_TAG)
+            continue;
+        const Node* instruction = get_let_instruction(body);
+        switch (instruction->tag) {
+            case Call_TAG: {
+                StackDepth callee = visit_callee(ctx, fn, instruction->payload.call.callee);
+                merge_unbounded(&depth, callee);
+                deepest_call = maxof(deepest_call, get_spilled_size(ctx, liveness, get_let_tail(body)) + callee.size);
+                break;
+            }
+            // controls may nest, so the spills from lifting their tails and the values joined with can pile up
+            case Control_TAG: {
+                own += get_spilled_size(ctx, liveness, get_let_tail(body));
+                own += get_joined_size(ctx, instruction->payload.control.yield_types);
+                break;
+            }
+            case PrimOp_TAG: {
+                if (instruction->payload.prim_op.op == push_stack_op)
+                    merge_unbounded(&depth, unbounded_depth(fn));
+                break;
+            }
+            default: break;
+        }
+    }
+    destroy_liveness(liveness);
+    destroy_scope(scope);
+
+    depth.size = maxof(maxof(entry, exit), own + deepest_call);
+    debugv_print("Stack depth of %s: %d bytes%s\n", get_abstraction_name(fn), depth.size, depth.unbounded ? " (unbounded)" : "");
+    remove_dict(const Node*, ctx->visiting, fn);
+    insert_dict(const Node*, StackDepth, ctx->depths, fn, depth);
+    return depth;
+}
+
+StackDepth compute_stack_depth(const CompilerConfig* config, Module* m, const Node* entry_point) {
+    Context ctx = {
+        .m = m,
+        .slot_alignment = int_size_in_bytes(config->emulated_memory.private_word_size),
+        .depths = new_dict(const Node*, StackDepth, (HashFn) hash_node, (CmpFn) compare_node),
+        .visiting = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+    };
+    StackDepth depth = visit_function(&ctx, entry_point);
+    destroy_dict(ctx.depths);
+    destroy_dict(ctx.visiting);
+    return depth;
+}
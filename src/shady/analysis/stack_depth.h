@@ -0,0 +1,23 @@
+#ifndef SHADY_STACK_DEPTH_H
+#define SHADY_STACK_DEPTH_H
+
+#include "shady/ir.h"
+
+typedef struct {
+    /// bytes of stack needed by the deepest chain of calls, going around each cycle in the call graph at most once
+    uint32_t size;
+    /// set when recursion, indirect calls or explicit stack operations mean @ref size is only a lower bound
+    bool unbounded;
+    /// a function responsible for the stack depth being unbounded, if any
+    const Node* culprit;
+} StackDepth;
+
+/** @brief Estimates how much stack @p entry_point needs, from the sizes of the stack frames and the call graph.
+ *
+ * Meant to run after setup_stack_frames and before lower_callf, while calls are still direct. It accounts for what
+ * the passes after it will push: the return join point from lower_callf, the values live across each call from
+ * lift_indirect_targets, and the arguments, results and join point payloads lower_tailcalls passes on the stack.
+ */
+StackDepth compute_stack_depth(const CompilerConfig*, Module*, const Node* entry_point);
+
+#endif
@@ -89,4 +89,25 @@ const Use* get_first_use(const UsesMap* map, const Node* n) {
     if (found)
         return *found;
     return NULL;
-}
\ No newline at end of file
+}
+
+struct Dict* new_uses_cache() {
+    return new_dict(const Node*, const UsesMap*, (HashFn) hash_node, (CmpFn) compare_node);
+}
+
+const UsesMap* get_function_uses(struct Dict* cache, const Node* fn) {
+    const UsesMap** found = find_value_dict(const Node*, const UsesMap*, cache, fn);
+    if (found)
+        return *found;
+    const UsesMap* uses = create_uses_map(fn, (NcDeclaration | NcType));
+    insert_dict(const Node*, const UsesMap*, cache, fn, uses);
+    return uses;
+}
+
+void destroy_uses_cache(struct Dict* cache) {
+    size_t i = 0;
+    const UsesMap* uses;
+    while (dict_iter(cache, &i, NULL, &uses))
+        destroy_uses_map(uses);
+    destroy_dict(cache);
+}
@@ -22,4 +22,9 @@ struct Use_ {
 
 const Use* get_first_use(const UsesMap*, const Node*);
 
+/// Maps Functions to their UsesMap, which get created the first time they are asked for
+struct Dict* new_uses_cache();
+const UsesMap* get_function_uses(struct Dict* cache, const Node* fn);
+void destroy_uses_cache(struct Dict* cache);
+
 #endif
@@ -4,11 +4,13 @@
 #include "frontends/slim/parser.h"
 #include "shady_scheduler_src.h"
 #include "transform/internal_constants.h"
+#include "analysis/stack_depth.h"
 #include "portability.h"
 #include "ir_private.h"
 #include "util.h"
 
 #include <stdbool.h>
+#include <string.h>
 
 #define KiB * 1024
 #define MiB * 1024 KiB
@@ -18,6 +20,10 @@ CompilerConfig default_compiler_config() {
         .dynamic_scheduling = true,
         .per_thread_stack_size = 4 KiB,
 
+        .emulated_memory = {
+            .private_word_size = IntTy8,
+        },
+
         .target_spirv_version = {
             .major = 1,
             .minor = 4
@@ -33,7 +39,19 @@ CompilerConfig default_compiler_config() {
             .cleanup = {
                 .after_every_pass = true,
                 .delete_unused_instructions = true,
-            }
+            },
+            .unrolling = {
+                .max_size = 128,
+            },
+            .inlining = {
+                .growth_budget = 256,
+            },
+            .cloning = {
+                .budget = 512,
+            },
+            .switches = {
+                .min_jump_table_cases = 4,
+            },
         },
 
         .specialization = {
@@ -61,13 +79,49 @@ ArenaConfig default_arena_config() {
     };
 }
 
+/// How much stack the entry points need when we can tell, the configured size otherwise, which also bounds it
+static uint32_t size_stack(const CompilerConfig* config, Module* mod) {
+    uint32_t needed = 0;
+    bool found_entry_point = false;
+    Nodes decls = get_module_declarations(mod);
+    for (size_t i = 0; i < decls.count; i++) {
+        const Node* decl = decls.nodes[i];
+        if (decl->tag != Function_TAG || !lookup_annotation(decl, "EntryPoint"))
+            continue;
+        if (config->specialization.entry_point && strcmp(get_abstraction_name(decl), config->specialization.entry_point) != 0)
+            continue;
+        StackDepth depth = compute_stack_depth(config, mod, decl);
+        if (depth.size > config->per_thread_stack_size)
+            error("Entry point %s needs %s%d bytes of stack, but only %d are available (see --stack-size)", get_abstraction_name(decl), depth.unbounded ? "at least " : "", depth.size, config->per_thread_stack_size);
+        if (depth.unbounded) {
+            debugv_print("%s can make the stack of %s grow further, keeping it at %d bytes\n", get_abstraction_name(depth.culprit), get_abstraction_name(decl), config->per_thread_stack_size);
+            return config->per_thread_stack_size;
+        }
+        found_entry_point = true;
+        if (depth.size > needed)
+            needed = depth.size;
+    }
+    if (!found_entry_point)
+        return config->per_thread_stack_size;
+
+    // keep it word-aligned, and never empty
+    needed = needed < 4 ? 4 : (needed + 3) / 4 * 4;
+    if (needed > config->per_thread_stack_size)
+        needed = config->per_thread_stack_size;
+    debugv_print("Sizing the stack to %d bytes\n", needed);
+    return needed;
+}
+
 CompilationResult run_compiler_passes(CompilerConfig* config, Module** pmod) {
     if (config->dynamic_scheduling) {
+        // builtin_find_schedulable_leaf spells the live invocations out as the bits of a u64
+        if (config->specialization.subgroup_size > 64)
+            error("The dynamic scheduler handles subgroups of up to 64 invocations, not %d (see --subgroup-size)", config->specialization.subgroup_size);
         debugv_print("Parsing builtin scheduler code");
         ParserConfig pconfig = {
             .front_end = true,
         };
-        parse_shady_ir(pconfig, shady_scheduler_src, *pmod);
+        parse_shady_ir(pconfig, sizeof(shady_scheduler_src) - 1, shady_scheduler_src, *pmod);
     }
 
     IrArena* initial_arena = (*pmod)->arena;
@@ -83,13 +137,26 @@ CompilationResult run_compiler_passes(CompilerConfig* config, Module** pmod) {
     RUN_PASS(infer_program)
 
     RUN_PASS(opt_inline_jumps)
+    RUN_PASS(opt_unroll)
 
     RUN_PASS(lcssa)
     RUN_PASS(reconvergence_heuristics)
 
     RUN_PASS(lower_cf_instrs)
+    RUN_PASS(opt_address_spaces)
+    RUN_PASS(opt_sroa)
+    RUN_PASS(opt_ssa)
     RUN_PASS(opt_mem2reg)
+    RUN_PASS(opt_devirtualize)
+    RUN_PASS(opt_ipo)
+    RUN_PASS(opt_uniformity)
     RUN_PASS(setup_stack_frames)
+
+    // the stack is sized for this module only, the caller's config is left as it was
+    CompilerConfig sized_config = *config;
+    sized_config.per_thread_stack_size = size_stack(config, *pmod);
+    config = &sized_config;
+
     if (!config->hacks.force_join_point_lifting)
         RUN_PASS(mark_leaf_functions)
 
@@ -119,6 +186,8 @@ CompilationResult run_compiler_passes(CompilerConfig* config, Module** pmod) {
     RUN_PASS(lower_physical_ptrs)
     RUN_PASS(lower_subgroup_vars)
     RUN_PASS(lower_memory_layout)
+    RUN_PASS(opt_licm)
+    RUN_PASS(opt_gvn)
 
     if (config->lower.decay_ptrs)
         RUN_PASS(lower_decay_ptrs)
@@ -130,6 +199,8 @@ CompilationResult run_compiler_passes(CompilerConfig* config, Module** pmod) {
 
     if (config->specialization.entry_point)
         RUN_PASS(specialize_entry_point)
+    RUN_PASS(opt_unroll)
+    RUN_PASS(opt_sccp)
     RUN_PASS(lower_fill)
 
     return CompilationNoError;
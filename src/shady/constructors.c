@@ -159,7 +159,7 @@ Node* function(Module* mod, Nodes params, const char* name, Nodes annotations, N
         .module = mod,
         .params = params,
         .body = NULL,
-        .name = name,
+        .name = string(arena, name),
         .annotations = annotations,
         .return_types = return_types,
     };
@@ -192,7 +192,7 @@ Node* basic_block(IrArena* arena, Node* fn, Nodes params, const char* name) {
         .params = params,
         .body = NULL,
         .fn = fn,
-        .name = name,
+        .name = string(arena, name),
     };
 
     Node node;
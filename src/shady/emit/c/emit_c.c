@@ -672,7 +672,7 @@ CType* lookup_existing_type(Emitter* emitter, const Type* node) {
 KeyHash hash_node(Node**);
 bool compare_node(Node**, Node**);
 
-static Module* run_backend_specific_passes(CompilerConfig* config, CEmitterConfig* econfig, Module* initial_mod) {
+static Module* run_backend_specific_passes(const CompilerConfig* config, CEmitterConfig* econfig, Module* initial_mod) {
     IrArena* initial_arena = initial_mod->arena;
     Module* old_mod = NULL;
     Module** pmod = &initial_mod;
@@ -686,6 +686,14 @@ static Module* run_backend_specific_passes(CompilerConfig* config, CEmitterConfi
     if (config->lower.simt_to_explicit_simd) {
         RUN_PASS(simt2d)
     }
+    // matches are emitted as if-chains, so the ones kept around for jump tables are better off as trees of comparisons.
+    // that is done with a local config, the caller's one might be used to compile other modules
+    CompilerConfig trees_config = *config;
+    trees_config.optimisations.switches.min_jump_table_cases = 0;
+    if (config->optimisations.switches.min_jump_table_cases > 0) {
+        config = &trees_config;
+        RUN_PASS(lower_switch_btree)
+    }
     // C lacks a nice way to express constants that can be used in type definitions afterwards, so let's just inline them all.
     RUN_PASS(eliminate_constants)
     return *pmod;
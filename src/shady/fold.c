@@ -13,6 +13,19 @@ static const Node* quote_single(IrArena* a, const Node* value) {
     return quote_helper(a, singleton(value));
 }
 
+static const Node* bool_literal(IrArena* a, bool value) {
+    return value ? true_lit(a) : false_lit(a);
+}
+
+/// Returns 1 for true, 0 for false and -1 if this isn't a boolean literal
+static int resolve_to_bool_literal(const Node* node) {
+    switch (node->tag) {
+        case True_TAG: return 1;
+        case False_TAG: return 0;
+        default: return -1;
+    }
+}
+
 static bool is_zero(const Node* node) {
     const IntLiteral* lit = resolve_to_int_literal(node);
     if (lit && get_int_literal_value(*lit, false) == 0)
@@ -113,6 +126,17 @@ static const Node* fold_let(IrArena* arena, const Node* node) {
     return node;
 }
 
+static uint64_t get_int_width_in_bits(IntSizes width) {
+    switch (width) {
+        case IntTy8:  return 8;
+        case IntTy16: return 16;
+        case IntTy32: return 32;
+        case IntTy64: return 64;
+        default: assert(false);
+    }
+    SHADY_UNREACHABLE;
+}
+
 static const Node* fold_prim_op(IrArena* arena, const Node* node) {
     PrimOp payload = node->payload.prim_op;
 
@@ -120,6 +144,9 @@ static const Node* fold_prim_op(IrArena* arena, const Node* node) {
     FloatSizes float_width;
     bool all_float_literals = true;
 
+    LARRAY(int, bool_literals, payload.operands.count);
+    bool all_bool_literals = true;
+
     LARRAY(const IntLiteral*, int_literals, payload.operands.count);
     bool all_int_literals = true;
     IntSizes int_width;
@@ -136,6 +163,9 @@ static const Node* fold_prim_op(IrArena* arena, const Node* node) {
         if (float_literals[i])
             float_width = float_literals[i]->width;
         all_float_literals &= float_literals[i] != NULL;
+
+        bool_literals[i] = resolve_to_bool_literal(payload.operands.nodes[i]);
+        all_bool_literals &= bool_literals[i] >= 0;
     }
 
 #define UN_OP(primop, op) case primop##_op: \
@@ -148,15 +178,83 @@ if (all_int_literals)        return quote_single(arena, int_literal(arena, (IntL
 else if (all_float_literals) return quote_single(arena, fp_literal_helper(arena, float_width, get_float_literal_value(*float_literals[0]) op get_float_literal_value(*float_literals[1]))); \
 break;
 
+#define CMP_OP(primop, op) case primop##_op: \
+if (all_int_literals && is_signed) return quote_single(arena, bool_literal(arena, get_int_literal_value(*int_literals[0], true) op get_int_literal_value(*int_literals[1], true))); \
+else if (all_int_literals)         return quote_single(arena, bool_literal(arena, (uint64_t) get_int_literal_value(*int_literals[0], false) op (uint64_t) get_int_literal_value(*int_literals[1], false))); \
+else if (all_float_literals)       return quote_single(arena, bool_literal(arena, get_float_literal_value(*float_literals[0]) op get_float_literal_value(*float_literals[1]))); \
+break;
+
+#define LOGIC_OP(primop, op) case primop##_op: \
+if (all_int_literals)       return quote_single(arena, int_literal(arena, (IntLiteral) { .is_signed = is_signed, .width = int_width, .value = int_literals[0]->value op int_literals[1]->value })); \
+else if (all_bool_literals) return quote_single(arena, bool_literal(arena, bool_literals[0] op bool_literals[1])); \
+break;
+
+    if (all_bool_literals && payload.operands.count > 0) {
+        switch (payload.op) {
+            case not_op: return quote_single(arena, bool_literal(arena, !bool_literals[0]));
+            case eq_op:  return quote_single(arena, bool_literal(arena, bool_literals[0] == bool_literals[1]));
+            case neq_op: return quote_single(arena, bool_literal(arena, bool_literals[0] != bool_literals[1]));
+            default: break;
+        }
+    }
+
+    if (all_int_literals || all_bool_literals) {
+        switch (payload.op) {
+            LOGIC_OP(and, &)
+            LOGIC_OP(or, |)
+            LOGIC_OP(xor, ^)
+            default: break;
+        }
+    }
+
+    // shifting by the width of the value or more is undefined on the host, leave it to the target
+    if (all_int_literals && (payload.op == lshift_op || payload.op == rshift_logical_op || payload.op == rshift_arithm_op) && (uint64_t) get_int_literal_value(*int_literals[1], false) >= get_int_width_in_bits(int_literals[0]->width))
+        return node;
+
+    if (all_int_literals) {
+        switch (payload.op) {
+            case not_op: return quote_single(arena, int_literal(arena, (IntLiteral) { .is_signed = is_signed, .width = int_width, .value = ~int_literals[0]->value }));
+            case lshift_op: return quote_single(arena, int_literal(arena, (IntLiteral) { .is_signed = is_signed, .width = int_width, .value = (uint64_t) get_int_literal_value(*int_literals[0], false) << get_int_literal_value(*int_literals[1], false) }));
+            case rshift_logical_op: return quote_single(arena, int_literal(arena, (IntLiteral) { .is_signed = is_signed, .width = int_width, .value = (uint64_t) get_int_literal_value(*int_literals[0], false) >> get_int_literal_value(*int_literals[1], false) }));
+            case rshift_arithm_op: return quote_single(arena, int_literal(arena, (IntLiteral) { .is_signed = is_signed, .width = int_width, .value = get_int_literal_value(*int_literals[0], true) >> get_int_literal_value(*int_literals[1], false) }));
+            default: break;
+        }
+    }
+
+    // leave integer division by zero to the target, they'll do as they please
+    if (all_int_literals && (payload.op == div_op || payload.op == mod_op) && get_int_literal_value(*int_literals[1], false) == 0)
+        return node;
+
+    // the same goes for the smallest signed value divided by -1, which overflows (and traps on the host)
+    if (all_int_literals && is_signed && (payload.op == div_op || payload.op == mod_op) && get_int_literal_value(*int_literals[1], true) == -1) {
+        uint64_t bits = get_int_width_in_bits(int_literals[0]->width);
+        if (get_int_literal_value(*int_literals[0], true) == (int64_t) (UINT64_MAX << (bits - 1)))
+            return node;
+    }
+
     if (all_int_literals || all_float_literals) {
         switch (payload.op) {
             UN_OP(neg, -)
             BIN_OP(add, +)
             BIN_OP(sub, -)
             BIN_OP(mul, *)
-            BIN_OP(div, /)
+            case div_op:
+                if (all_int_literals && is_signed)
+                    return quote_single(arena, int_literal(arena, (IntLiteral) { .is_signed = is_signed, .width = int_width, .value = get_int_literal_value(*int_literals[0], true) / get_int_literal_value(*int_literals[1], true) }));
+                else if (all_int_literals)
+                    return quote_single(arena, int_literal(arena, (IntLiteral) { .is_signed = is_signed, .width = int_width, .value = (uint64_t) get_int_literal_value(*int_literals[0], false) / (uint64_t) get_int_literal_value(*int_literals[1], false) }));
+                else
+                    return quote_single(arena, fp_literal_helper(arena, float_width, get_float_literal_value(*float_literals[0]) / get_float_literal_value(*float_literals[1])));
+            CMP_OP(eq, ==)
+            CMP_OP(neq, !=)
+            CMP_OP(lt, <)
+            CMP_OP(lte, <=)
+            CMP_OP(gt, >)
+            CMP_OP(gte, >=)
             case mod_op:
-                if (all_int_literals)
+                if (all_int_literals && is_signed)
+                    return quote_single(arena, int_literal(arena, (IntLiteral) { .is_signed = is_signed, .width = int_width, .value = get_int_literal_value(*int_literals[0], true) % get_int_literal_value(*int_literals[1], true) }));
+                else if (all_int_literals)
                     return quote_single(arena, int_literal(arena, (IntLiteral) { .is_signed = is_signed, .width = int_width, .value = int_literals[0]->value % int_literals[1]->value }));
                 else
                     return quote_single(arena, fp_literal_helper(arena, float_width, fmod(get_float_literal_value(*float_literals[0]), get_float_literal_value(*float_literals[1]))));
@@ -254,6 +352,14 @@ break;
     return node;
 }
 
+/// Blocks can only be emitted once fold_let has lifted their contents out, which requires a chain of lets ending in a yield
+static bool is_liftable_case(const Node* c) {
+    const Node* terminator = get_abstraction_body(c);
+    while (terminator->tag == Let_TAG)
+        terminator = get_abstraction_body(get_let_tail(terminator));
+    return terminator->tag == Yield_TAG;
+}
+
 static bool is_unreachable_case(const Node* c) {
     assert(c && c->tag == Case_TAG);
     const Node* b = get_abstraction_body(c);
@@ -299,14 +405,39 @@ const Node* fold_node(IrArena* arena, const Node* node) {
         case If_TAG: {
             If payload = node->payload.if_instr;
             const Node* false_case = payload.if_false;
-            if (arena->config.optimisations.delete_unreachable_structured_cases && false_case && is_unreachable_case(false_case))
+            if (arena->config.optimisations.delete_unreachable_structured_cases && false_case && is_unreachable_case(false_case) && is_liftable_case(payload.if_true))
                 return block(arena, (Block) { .inside = payload.if_true, .yield_types = add_qualifiers(arena, payload.yield_types, false) });
+            int condition = resolve_to_bool_literal(payload.condition);
+            if (arena->config.optimisations.delete_unreachable_structured_cases && condition >= 0) {
+                if (!condition && !false_case) // an if without an else yields nothing
+                    return quote_helper(arena, empty(arena));
+                const Node* taken = condition ? payload.if_true : false_case;
+                if (is_liftable_case(taken))
+                    return block(arena, (Block) { .inside = taken, .yield_types = add_qualifiers(arena, payload.yield_types, false) });
+            }
             break;
         }
         case Match_TAG: {
             if (!arena->config.optimisations.delete_unreachable_structured_cases)
                 break;
             Match payload = node->payload.match_instr;
+            const IntLiteral* inspected = resolve_to_int_literal(payload.inspect);
+            if (inspected) {
+                const Node* taken = payload.default_case;
+                for (size_t i = 0; i < payload.literals.count; i++) {
+                    const IntLiteral* literal = resolve_to_int_literal(payload.literals.nodes[i]);
+                    if (!literal) {
+                        taken = NULL;
+                        break;
+                    }
+                    if (get_int_literal_value(*literal, false) == get_int_literal_value(*inspected, false)) {
+                        taken = payload.cases.nodes[i];
+                        break;
+                    }
+                }
+                if (taken && is_liftable_case(taken))
+                    return block(arena, (Block) { .inside = taken, .yield_types = add_qualifiers(arena, payload.yield_types, false) });
+            }
             Nodes old_cases = payload.cases;
             LARRAY(const Node*, literals, old_cases.count);
             LARRAY(const Node*, cases, old_cases.count);
@@ -322,10 +453,10 @@ const Node* fold_node(IrArena* arena, const Node* node) {
             if (new_cases_count == old_cases.count)
                 break;
 
-            if (new_cases_count == 1 && is_unreachable_case(payload.default_case))
+            if (new_cases_count == 1 && is_unreachable_case(payload.default_case) && is_liftable_case(cases[0]))
                 return block(arena, (Block) { .inside = cases[0], .yield_types = add_qualifiers(arena, payload.yield_types, false) });
 
-            if (new_cases_count == 0)
+            if (new_cases_count == 0 && is_liftable_case(payload.default_case))
                 return block(arena, (Block) { .inside = payload.default_case, .yield_types = add_qualifiers(arena, payload.yield_types, false) });
 
             return match_instr(arena, (Match) {
@@ -336,6 +467,26 @@ const Node* fold_node(IrArena* arena, const Node* node) {
                 .cases = nodes(arena, new_cases_count, cases),
             });
         }
+        case Branch_TAG: {
+            int condition = resolve_to_bool_literal(node->payload.branch.branch_condition);
+            if (condition >= 0)
+                return condition ? node->payload.branch.true_jump : node->payload.branch.false_jump;
+            break;
+        }
+        case Switch_TAG: {
+            Switch payload = node->payload.br_switch;
+            const IntLiteral* inspected = resolve_to_int_literal(payload.switch_value);
+            if (!inspected)
+                break;
+            for (size_t i = 0; i < payload.case_values.count; i++) {
+                const IntLiteral* literal = resolve_to_int_literal(payload.case_values.nodes[i]);
+                if (!literal)
+                    return node;
+                if (get_int_literal_value(*literal, false) == get_int_literal_value(*inspected, false))
+                    return payload.case_jumps.nodes[i];
+            }
+            return payload.default_jump;
+        }
         default: break;
     }
 
@@ -160,7 +160,7 @@ static const char* string_impl(IrArena* arena, size_t size, const char* zero_ter
     if (found)
         return *found;
 
-    char* new_str = (char*) arena_alloc(arena->arena, strlen(zero_terminated) + 1);
+    char* new_str = (char*) arena_alloc(arena->arena, size + 1);
     strncpy(new_str, zero_terminated, size);
     new_str[size] = '\0';
 
@@ -174,7 +174,7 @@ const char* string_sized(IrArena* arena, size_t size, const char* str) {
     strncpy(new_str, str, size);
     new_str[size] = '\0';
     assert(strlen(new_str) == size);
-    return string_impl(arena, size, str);
+    return string_impl(arena, size, new_str);
 }
 
 const char* string(IrArena* arena, const char* str) {
@@ -26,6 +26,8 @@ struct Module_ {
     IrArena* arena;
     String name;
     struct List* decls;
+    /// interned name -> declaration
+    struct Dict* decls_index;
     bool sealed;
 };
 
@@ -1,16 +1,27 @@
 #include "ir_private.h"
 
+#include "log.h"
 #include "list.h"
+#include "dict.h"
 #include "portability.h"
 
 #include <string.h>
 
+static KeyHash hash_interned_string(String* s) {
+    return hash_murmur(s, sizeof(String));
+}
+
+static bool compare_interned_strings(String* a, String* b) {
+    return *a == *b;
+}
+
 Module* new_module(IrArena* arena, String name) {
     Module* m = arena_alloc(arena->arena, sizeof(Module));
     *m = (Module) {
         .arena = arena,
         .name = string(arena, name),
         .decls = new_list(Node*),
+        .decls_index = new_dict(String, Node*, (HashFn) hash_interned_string, (CmpFn) compare_interned_strings),
     };
     append_list(Module*, arena->modules, m);
     return m;
@@ -32,19 +43,22 @@ Nodes get_module_declarations(const Module* m) {
 
 void register_decl_module(Module* m, Node* node) {
     assert(is_declaration(node));
-    assert(!get_declaration(m, get_decl_name(node)) && "duplicate declaration");
+    String name = get_decl_name(node);
+    if (!insert_dict_and_get_result(String, Node*, m->decls_index, name, node))
+        error("Duplicate declaration of '%s' in module '%s'", name, m->name);
     append_list(Node*, m->decls, node);
 }
 
 const Node* get_declaration(const Module* m, String name) {
-    Nodes existing_decls = get_module_declarations(m);
-    for (size_t i = 0; i < existing_decls.count; i++) {
-        if (strcmp(get_decl_name(existing_decls.nodes[i]), name) == 0)
-            return existing_decls.nodes[i];
-    }
-    return NULL;
+    // declaration names are interned, a name the arena has never seen cannot be declared
+    String* interned = find_key_dict(String, m->arena->string_set, name);
+    if (!interned)
+        return NULL;
+    Node** found = find_value_dict(String, Node*, m->decls_index, *interned);
+    return found ? *found : NULL;
 }
 
 void destroy_module(Module* m) {
     destroy_list(m->decls);
+    destroy_dict(m->decls_index);
 }
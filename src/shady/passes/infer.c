@@ -79,6 +79,13 @@ static const Node* _infer_type(Context* ctx, const Type* type) {
                 element_type = unit_type(a);
             return ptr_type(a, (PtrType) { .pointed_type = element_type, .address_space = type->payload.ptr_type.address_space });
         }
+        case FnType_TAG: {
+            // match what functions themselves get inferred to
+            return fn_type(a, (FnType) {
+                .param_types = annotate_all_types(a, infer_nodes(ctx, type->payload.fn_type.param_types), false),
+                .return_types = annotate_all_types(a, infer_nodes(ctx, type->payload.fn_type.return_types), false),
+            });
+        }
         default: return recreate_node_identity(&ctx->rewriter, type);
     }
 }
@@ -12,7 +12,7 @@
 
 #include "../transform/ir_gen_helpers.h"
 #include "../analysis/scope.h"
-#include "../analysis/free_variables.h"
+#include "../analysis/liveness.h"
 #include "../analysis/uses.h"
 #include "../analysis/leak.h"
 
@@ -26,6 +26,7 @@ typedef struct Context_ {
     Rewriter rewriter;
     Scope* scope;
     const UsesMap* scope_uses;
+    Liveness* liveness;
 
     struct Dict* lifted;
     bool disable_lowering;
@@ -40,6 +41,9 @@ typedef struct {
     struct List* save_values;
 } LiftedCont;
 
+/// how long a chain of instructions we are willing to recompute instead of spilling its result
+#define MAX_REMAT_DEPTH 4
+
 #pragma GCC diagnostic error "-Wswitch"
 
 static const Node* add_spill_instrs(Context* ctx, BodyBuilder* builder, struct List* spilled_vars) {
@@ -65,6 +69,66 @@ static const Node* add_spill_instrs(Context* ctx, BodyBuilder* builder, struct L
     return sp;
 }
 
+/// Whether @p value is cheap enough to compute again in a lifted continuation instead of spilling it
+static bool is_rematerializable(Context* ctx, const Node* value, int depth) {
+    switch (value->tag) {
+        case IntLiteral_TAG:
+        case FloatLiteral_TAG:
+        case True_TAG:
+        case False_TAG:
+        case NullPtr_TAG:
+        case RefDecl_TAG:
+        case FnAddr_TAG: return true;
+        case Variable_TAG: break;
+        default: return false;
+    }
+    if (depth == 0)
+        return false;
+
+    const Node* instruction = get_var_instruction(ctx->scope_uses, value);
+    if (!instruction || instruction->tag != PrimOp_TAG)
+        return false;
+    PrimOp payload = instruction->payload.prim_op;
+    switch (payload.op) {
+        case quote_op: return is_rematerializable(ctx, payload.operands.nodes[value->payload.var.pindex], depth - 1);
+        case lea_op:
+        case reinterpret_op:
+        case convert_op:
+        case add_op:
+        case sub_op:
+        case mul_op: break;
+        default: return false;
+    }
+    for (size_t i = 0; i < payload.operands.count; i++)
+        if (!is_rematerializable(ctx, payload.operands.nodes[i], depth - 1))
+            return false;
+    return true;
+}
+
+static const Node* rematerialize(Context* ctx, BodyBuilder* bb, const Node* value) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    const Node* found = search_processed(&ctx->rewriter, value);
+    if (found || value->tag != Variable_TAG)
+        return found ? found : rewrite_node(&ctx->rewriter, value);
+
+    PrimOp payload = get_var_instruction(ctx->scope_uses, value)->payload.prim_op;
+    const Node* recomputed;
+    if (payload.op == quote_op) {
+        recomputed = rematerialize(ctx, bb, payload.operands.nodes[value->payload.var.pindex]);
+    } else {
+        LARRAY(const Node*, operands, payload.operands.count);
+        for (size_t i = 0; i < payload.operands.count; i++)
+            operands[i] = rematerialize(ctx, bb, payload.operands.nodes[i]);
+        recomputed = first(bind_instruction_named(bb, prim_op(a, (PrimOp) {
+            .op = payload.op,
+            .type_arguments = rewrite_nodes(&ctx->rewriter, payload.type_arguments),
+            .operands = nodes(a, payload.operands.count, operands),
+        }), &value->payload.var.name));
+    }
+    register_processed(&ctx->rewriter, value, recomputed);
+    return recomputed;
+}
+
 static LiftedCont* lambda_lift(Context* ctx, const Node* cont, String given_name) {
     assert(is_basic_block(cont) || is_case(cont));
     LiftedCont** found = find_value_dict(const Node*, LiftedCont*, ctx->lifted, cont);
@@ -77,13 +141,18 @@ static LiftedCont* lambda_lift(Context* ctx, const Node* cont, String given_name
 
     String name = is_basic_block(cont) ? format_string_arena(a->arena, "%s_%s", get_abstraction_name(cont->payload.basic_block.fn), get_abstraction_name(cont)) : unique_name(a, given_name);
 
-    // Compute the live stuff we'll need
-    Scope* scope = new_scope(cont);
-    struct List* recover_context = compute_free_variables(scope, cont);
+    // Compute the live stuff we'll need, only what can't be recomputed on the other side gets spilled
+    struct List* live = get_live_in(ctx->liveness, cont);
+    struct List* recover_context = new_list(const Node*);
+    struct List* rematerialized = new_list(const Node*);
+    for (size_t i = 0; i < entries_count_list(live); i++) {
+        const Node* ovar = read_list(const Node*, live)[i];
+        append_list(const Node*, is_rematerializable(ctx, ovar, MAX_REMAT_DEPTH) ? rematerialized : recover_context, ovar);
+    }
+    destroy_list(live);
     size_t recover_context_size = entries_count_list(recover_context);
-    destroy_scope(scope);
 
-    debugv_print("free (spilled) variables at '%s': ", name);
+    debugv_print("live (spilled) variables at '%s': ", name);
     for (size_t i = 0; i < recover_context_size; i++) {
         const Node* item = read_list(const Node*, recover_context)[i];
         debugv_print(get_value_name_safe(item));
@@ -131,6 +200,9 @@ static LiftedCont* lambda_lift(Context* ctx, const Node* cont, String given_name
 
         register_processed(&lifting_ctx.rewriter, ovar, recovered_value);
     }
+    for (size_t i = 0; i < entries_count_list(rematerialized); i++)
+        rematerialize(&lifting_ctx, bb, read_list(const Node*, rematerialized)[i]);
+    destroy_list(rematerialized);
 
     const Node* substituted = rewrite_node(&lifting_ctx.rewriter, obody);
     //destroy_dict(lifting_ctx.rewriter.processed);
@@ -148,12 +220,9 @@ static const Node* process_node(Context* ctx, const Node* node) {
 
     // TODO: share this code
     if (is_declaration(node)) {
-        String name = get_decl_name(node);
-        Nodes decls = get_module_declarations(ctx->rewriter.dst_module);
-        for (size_t i = 0; i < decls.count; i++) {
-            if (strcmp(get_decl_name(decls.nodes[i]), name) == 0)
-                return decls.nodes[i];
-        }
+        const Node* existing = get_declaration(ctx->rewriter.dst_module, get_decl_name(node));
+        if (existing)
+            return existing;
     }
 
     IrArena* a = ctx->rewriter.dst_arena;
@@ -166,11 +235,13 @@ static const Node* process_node(Context* ctx, const Node* node) {
             Context fn_ctx = *ctx;
             fn_ctx.scope = new_scope(node);
             fn_ctx.scope_uses = create_uses_map(node, (NcDeclaration | NcType));
+            fn_ctx.liveness = compute_liveness(fn_ctx.scope);
             ctx = &fn_ctx;
 
             Node* new = recreate_decl_header_identity(&ctx->rewriter, node);
             recreate_decl_body_identity(&ctx->rewriter, node, new);
 
+            destroy_liveness(ctx->liveness);
             destroy_uses_map(ctx->scope_uses);
             destroy_scope(ctx->scope);
             return new;
@@ -63,6 +63,18 @@ static const Node* lower_callf_process(Context* ctx, const Node* old) {
         return fun;
     }
 
+    // only functions that had their address taken can be pointed to, and those never are leaf functions
+    if (old->tag == FnType_TAG) {
+        const Type* jp_type = join_point_type(a, (JoinPointType) {
+            .yield_types = strip_qualifiers(a, rewrite_nodes(&ctx->rewriter, old->payload.fn_type.return_types))
+        });
+        Nodes nparams = rewrite_nodes(&ctx->rewriter, old->payload.fn_type.param_types);
+        return fn_type(a, (FnType) {
+            .param_types = append_nodes(a, nparams, qualified_type_helper(jp_type, false)),
+            .return_types = empty(a),
+        });
+    }
+
     if (ctx->disable_lowering)
         return recreate_node_identity(&ctx->rewriter, old);
 
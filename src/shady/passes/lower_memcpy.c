@@ -11,108 +11,315 @@
 
 #include <assert.h>
 
+/// copies and fills of a known size up to this many bytes are fully unrolled
+#define MAX_UNROLLED_BYTES 64
+/// how many words each iteration of the loops does
+#define WORDS_PER_ITERATION 4
+
 typedef struct {
     Rewriter rewriter;
     const CompilerConfig* config;
 } Context;
 
+/// A run of accesses of the same width, either copying from @p src or storing @p value
+typedef struct {
+    const Node* dst;
+    const Node* src;
+    const Node* value;
+} Accesses;
+
+static size_t get_type_alignment(IrArena* a, const Type* t) {
+    if (t->tag == ArrType_TAG && !t->payload.arr_type.size)
+        t = t->payload.arr_type.element_type;
+    size_t alignment = get_mem_layout(a, t).alignment_in_bytes;
+    return alignment ? alignment : 1;
+}
+
+static size_t get_pointee_alignment(IrArena* a, const Node* ptr) {
+    const Type* t = ptr->type;
+    if (!t)
+        return 1;
+    deconstruct_qualified_type(&t);
+    if (t->tag != PtrType_TAG)
+        return 1;
+    return get_type_alignment(a, t->payload.ptr_type.pointed_type);
+}
+
+/// Follows casts and zero offsets back to the allocation or global an address points into, since a byte pointer alone promises nothing
+static size_t get_address_alignment(const Node* ptr) {
+    IrArena* a = ptr->arena;
+    size_t alignment = 1;
+    while (ptr) {
+        size_t known = 1;
+        if (ptr->tag == Variable_TAG) {
+            known = get_pointee_alignment(a, ptr);
+            ptr = get_var_def(ptr->payload.var);
+        } else if (ptr->tag == RefDecl_TAG && ptr->payload.ref_decl.decl->tag == GlobalVariable_TAG) {
+            known = get_type_alignment(a, ptr->payload.ref_decl.decl->payload.global_variable.type);
+            ptr = NULL;
+        } else if (ptr->tag == PrimOp_TAG) {
+            PrimOp prim_op = ptr->payload.prim_op;
+            ptr = NULL;
+            switch (prim_op.op) {
+                case reinterpret_op:
+                case convert_op:
+                    ptr = first(prim_op.operands);
+                    break;
+                case lea_op: {
+                    // only zero offsets keep the base's alignment
+                    bool zero = true;
+                    for (size_t i = 1; i < prim_op.operands.count; i++) {
+                        const IntLiteral* lit = resolve_to_int_literal(prim_op.operands.nodes[i]);
+                        zero &= lit && get_int_literal_value(*lit, false) == 0;
+                    }
+                    if (zero)
+                        ptr = first(prim_op.operands);
+                    break;
+                }
+                case alloca_op:
+                case alloca_logical_op:
+                case alloca_subgroup_op:
+                    known = get_type_alignment(a, first(prim_op.type_arguments));
+                    break;
+                default: break;
+            }
+        } else {
+            known = get_pointee_alignment(a, ptr);
+            ptr = NULL;
+        }
+        if (known > alignment)
+            alignment = known;
+    }
+    return alignment;
+}
+
+/// The widest int the alignment allows, but never narrower than a word
+static IntSizes get_access_width(Context* ctx, size_t alignment) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    IntSizes width = ctx->config->lower.int64 ? IntTy32 : IntTy64;
+    while (width > a->config.memory.word_size && int_size_in_bytes(width) > alignment)
+        width--;
+    return width;
+}
+
+static const Node* gen_access_ptr(BodyBuilder* bb, const Node* ptr, IntSizes width) {
+    IrArena* a = ptr->arena;
+    const Type* ptr_t = ptr->type;
+    deconstruct_qualified_type(&ptr_t);
+    return gen_reinterpret_cast(bb, ptr_type(a, (PtrType) {
+        .address_space = ptr_t->payload.ptr_type.address_space,
+        .pointed_type = arr_type(a, (ArrType) { .element_type = int_type(a, (Int) { .width = width, .is_signed = false }), .size = NULL }),
+    }), ptr);
+}
+
+static void gen_access(BodyBuilder* bb, Accesses accesses, const Node* index) {
+    IrArena* a = accesses.dst->arena;
+    const Node* value = accesses.value;
+    if (accesses.src)
+        value = gen_load(bb, gen_lea(bb, accesses.src, index, singleton(uint32_literal(a, 0))));
+    gen_store(bb, gen_lea(bb, accesses.dst, index, singleton(uint32_literal(a, 0))), value);
+}
+
+/// Does the accesses in [start, end), @p step at a time, @p end - @p start has to be a multiple of @p step
+static void gen_access_loop(BodyBuilder* bb, Accesses accesses, const Node* start, const Node* end, size_t step) {
+    IrArena* a = accesses.dst->arena;
+    const Node* index = var(a, qualified_type_helper(uint32_type(a), false), "mem_i");
+    BodyBuilder* loop_bb = begin_body(a);
+    BodyBuilder* iteration_bb = begin_body(a);
+    for (size_t i = 0; i < step; i++)
+        gen_access(iteration_bb, accesses, i == 0 ? index : gen_primop_e(iteration_bb, add_op, empty(a), mk_nodes(a, index, uint32_literal(a, i))));
+    const Node* next_index = gen_primop_e(iteration_bb, add_op, empty(a), mk_nodes(a, index, uint32_literal(a, step)));
+    bind_instruction(loop_bb, if_instr(a, (If) {
+        .condition = gen_primop_e(loop_bb, lt_op, empty(a), mk_nodes(a, index, end)),
+        .yield_types = empty(a),
+        .if_true = case_(a, empty(a), finish_body(iteration_bb, merge_continue(a, (MergeContinue) { .args = singleton(next_index) }))),
+        .if_false = case_(a, empty(a), merge_break(a, (MergeBreak) { .args = empty(a) }))
+    }));
+
+    bind_instruction(bb, loop_instr(a, (Loop) {
+        .yield_types = empty(a),
+        .body = case_(a, singleton(index), finish_body(loop_bb, unreachable(a))),
+        .initial_args = singleton(start)
+    }));
+}
+
+/// Small known counts are unrolled, bigger ones become loops doing several accesses per iteration
+static void gen_accesses(BodyBuilder* bb, Accesses accesses, IntSizes width, const Node* count) {
+    IrArena* a = accesses.dst->arena;
+    const IntLiteral* lit = resolve_to_int_literal(count);
+    if (lit) {
+        uint32_t n = get_int_literal_value(*lit, false);
+        uint32_t unrolled_from = 0;
+        if (n * int_size_in_bytes(width) > MAX_UNROLLED_BYTES) {
+            unrolled_from = n / WORDS_PER_ITERATION * WORDS_PER_ITERATION;
+            gen_access_loop(bb, accesses, uint32_literal(a, 0), uint32_literal(a, unrolled_from), WORDS_PER_ITERATION);
+        }
+        for (uint32_t i = unrolled_from; i < n; i++)
+            gen_access(bb, accesses, uint32_literal(a, i));
+        return;
+    }
+
+    const Node* blocks_end = gen_primop_e(bb, div_op, empty(a), mk_nodes(a, count, uint32_literal(a, WORDS_PER_ITERATION)));
+                blocks_end = gen_primop_e(bb, mul_op, empty(a), mk_nodes(a, blocks_end, uint32_literal(a, WORDS_PER_ITERATION)));
+    gen_access_loop(bb, accesses, uint32_literal(a, 0), blocks_end, WORDS_PER_ITERATION);
+    gen_access_loop(bb, accesses, blocks_end, count, 1);
+}
+
+static const Node* gen_byte_count(BodyBuilder* bb, const Node* num) {
+    IrArena* a = num->arena;
+    const IntLiteral* lit = resolve_to_int_literal(num);
+    if (lit)
+        return uint32_literal(a, get_int_literal_value(*lit, false));
+    return gen_conversion(bb, uint32_type(a), num);
+}
+
+/// Narrows @p width until it divides a known byte count, so no leftover bytes need handling
+static IntSizes fit_width_to_count(IrArena* a, IntSizes width, const Node* bytes) {
+    const IntLiteral* lit = resolve_to_int_literal(bytes);
+    if (lit)
+        while (width > a->config.memory.word_size && get_int_literal_value(*lit, false) % int_size_in_bytes(width) != 0)
+            width--;
+    return width;
+}
+
+static const Node* gen_count(BodyBuilder* bb, const Node* bytes, IntSizes width) {
+    IrArena* a = bytes->arena;
+    const IntLiteral* lit = resolve_to_int_literal(bytes);
+    if (lit)
+        return uint32_literal(a, get_int_literal_value(*lit, false) / int_size_in_bytes(width));
+    return gen_primop_e(bb, div_op, empty(a), mk_nodes(a, bytes, uint32_literal(a, int_size_in_bytes(width))));
+}
+
+/// When the byte count is unknown, what the accesses of @p width left at the end is done @p leftover_width at a time
+static void gen_leftovers(BodyBuilder* bb, Accesses leftovers, IntSizes width, IntSizes leftover_width, const Node* bytes) {
+    IrArena* a = bytes->arena;
+    const Node* done = gen_count(bb, bytes, width);
+                done = gen_primop_e(bb, mul_op, empty(a), mk_nodes(a, done, uint32_literal(a, int_size_in_bytes(width) / int_size_in_bytes(leftover_width))));
+    gen_access_loop(bb, leftovers, done, gen_count(bb, bytes, leftover_width), 1);
+}
+
+/// Repeats @p value as many times as fits in an int of @p width
+static const Node* gen_splat(BodyBuilder* bb, const Node* value, IntSizes width) {
+    IrArena* a = value->arena;
+    const Type* value_t = value->type;
+    deconstruct_qualified_type(&value_t);
+    IntSizes value_width = value_t->payload.int_type.width;
+    value = gen_reinterpret_cast(bb, int_type(a, (Int) { .width = value_width, .is_signed = false }), value);
+    if (value_width == width)
+        return value;
+    const Type* wide_t = int_type(a, (Int) { .width = width, .is_signed = false });
+    value = gen_conversion(bb, wide_t, value);
+    const Node* acc = value;
+    for (size_t i = 1; i < int_size_in_bytes(width) / int_size_in_bytes(value_width); i++) {
+        const Node* shift = int_literal(a, (IntLiteral) { .width = width, .is_signed = false, .value = i * int_size_in_bytes(value_width) * 8 });
+        acc = gen_primop_e(bb, or_op, empty(a), mk_nodes(a, acc, gen_primop_e(bb, lshift_op, empty(a), mk_nodes(a, value, shift))));
+    }
+    return acc;
+}
+
+/// A count that isn't a multiple of a value wider than a word ends with a piece of one, stored a word at a time
+static void gen_tail(BodyBuilder* bb, const Node* dst_addr, const Node* value, const Node* bytes) {
+    IrArena* a = value->arena;
+    const Type* value_t = value->type;
+    deconstruct_qualified_type(&value_t);
+    IntSizes value_width = value_t->payload.int_type.width;
+    IntSizes word_width = a->config.memory.word_size;
+    if (value_width <= word_width)
+        return;
+
+    size_t words_per_value = int_size_in_bytes(value_width) / int_size_in_bytes(word_width);
+    const Node* start = gen_count(bb, bytes, value_width);
+                start = gen_primop_e(bb, mul_op, empty(a), mk_nodes(a, start, uint32_literal(a, words_per_value)));
+    const Node* end = gen_count(bb, bytes, word_width);
+    const IntLiteral* lit = resolve_to_int_literal(end);
+
+    const Node* dst = gen_access_ptr(bb, dst_addr, word_width);
+    value = gen_reinterpret_cast(bb, int_type(a, (Int) { .width = value_width, .is_signed = false }), value);
+    const Type* word_t = int_type(a, (Int) { .width = word_width, .is_signed = false });
+    for (size_t i = 0; i < words_per_value - 1; i++) {
+        if (lit && get_int_literal_value(*lit, false) % words_per_value <= i)
+            break;
+        const Node* index = gen_primop_e(bb, add_op, empty(a), mk_nodes(a, start, uint32_literal(a, i)));
+        BodyBuilder* store_bb = lit ? bb : begin_body(a);
+        const Node* shift = int_literal(a, (IntLiteral) { .width = value_width, .is_signed = false, .value = i * int_size_in_bytes(word_width) * 8 });
+        const Node* word = gen_conversion(store_bb, word_t, gen_primop_e(store_bb, rshift_logical_op, empty(a), mk_nodes(a, value, shift)));
+        gen_access(store_bb, (Accesses) { .dst = dst, .value = word }, index);
+        if (lit)
+            continue;
+        bind_instruction(bb, if_instr(a, (If) {
+            .condition = gen_primop_e(bb, lt_op, empty(a), mk_nodes(a, index, end)),
+            .yield_types = empty(a),
+            .if_true = case_(a, empty(a), finish_body(store_bb, yield(a, (Yield) { .args = empty(a) }))),
+            .if_false = NULL,
+        }));
+    }
+}
+
 static const Node* process(Context* ctx, const Node* old) {
     const Node* found = search_processed(&ctx->rewriter, old);
     if (found) return found;
 
     IrArena* a = ctx->rewriter.dst_arena;
-    Module* m = ctx->rewriter.dst_module;
 
     switch (old->tag) {
         case PrimOp_TAG: {
             switch (old->payload.prim_op.op) {
                 case memcpy_op: {
-                    const Type* word_type = int_type(a, (Int) { .is_signed = false, .width = a->config.memory.word_size });
-
                     BodyBuilder* bb = begin_body(a);
                     Nodes old_ops = old->payload.prim_op.operands;
 
                     const Node* dst_addr = rewrite_node(&ctx->rewriter, old_ops.nodes[0]);
-                    const Type* dst_addr_type = dst_addr->type;
-                    deconstruct_qualified_type(&dst_addr_type);
-                    assert(dst_addr_type->tag == PtrType_TAG);
-                    dst_addr_type = ptr_type(a, (PtrType) {
-                        .address_space = dst_addr_type->payload.ptr_type.address_space,
-                        .pointed_type = arr_type(a, (ArrType) { .element_type = word_type, .size = NULL }),
-                    });
-                    dst_addr = gen_reinterpret_cast(bb, dst_addr_type, dst_addr);
-
                     const Node* src_addr = rewrite_node(&ctx->rewriter, old_ops.nodes[1]);
-                    const Type* src_addr_type = src_addr->type;
-                    deconstruct_qualified_type(&src_addr_type);
-                    assert(src_addr_type->tag == PtrType_TAG);
-                    src_addr_type = ptr_type(a, (PtrType) {
-                            .address_space = src_addr_type->payload.ptr_type.address_space,
-                            .pointed_type = arr_type(a, (ArrType) { .element_type = word_type, .size = NULL }),
-                    });
-                    src_addr = gen_reinterpret_cast(bb, src_addr_type, src_addr);
-
-                    const Node* num = rewrite_node(&ctx->rewriter, old_ops.nodes[2]);
-                    const Node* num_in_bytes = gen_conversion(bb, uint32_type(a), bytes_to_words(bb, num));
-
-                    const Node* index = var(a, qualified_type_helper(uint32_type(a), false), "memcpy_i");
-                    BodyBuilder* loop_bb = begin_body(a);
-                    const Node* loaded_word = gen_load(loop_bb, gen_lea(loop_bb, src_addr, index, singleton(uint32_literal(a, 0))));
-                    gen_store(loop_bb, gen_lea(loop_bb, dst_addr, index, singleton(uint32_literal(a, 0))), loaded_word);
-                    const Node* next_index = gen_primop_e(loop_bb, add_op, empty(a), mk_nodes(a, index, uint32_literal(a, 1)));
-                    bind_instruction(loop_bb, if_instr(a, (If) {
-                        .condition = gen_primop_e(loop_bb, lt_op, empty(a), mk_nodes(a, next_index, num_in_bytes)),
-                        .yield_types = empty(a),
-                        .if_true = case_(a, empty(a), merge_continue(a, (MergeContinue) {.args = singleton(next_index)})),
-                        .if_false = case_(a, empty(a), merge_break(a, (MergeBreak) {.args = empty(a)}))
-                    }));
-
-                    bind_instruction(bb, loop_instr(a, (Loop) {
-                        .yield_types = empty(a),
-                        .body = case_(a, singleton(index), finish_body(loop_bb, unreachable(a))),
-                        .initial_args = singleton(uint32_literal(a, 0))
-                    }));
+                    const Node* bytes = gen_byte_count(bb, rewrite_node(&ctx->rewriter, old_ops.nodes[2]));
+
+                    size_t alignment = get_address_alignment(old_ops.nodes[0]);
+                    size_t src_alignment = get_address_alignment(old_ops.nodes[1]);
+                    if (src_alignment < alignment)
+                        alignment = src_alignment;
+                    IntSizes width = fit_width_to_count(a, get_access_width(ctx, alignment), bytes);
+
+                    Accesses accesses = {
+                        .dst = gen_access_ptr(bb, dst_addr, width),
+                        .src = gen_access_ptr(bb, src_addr, width),
+                    };
+                    gen_accesses(bb, accesses, width, gen_count(bb, bytes, width));
+                    IntSizes word_width = a->config.memory.word_size;
+                    if (width != word_width && !resolve_to_int_literal(bytes))
+                        gen_leftovers(bb, (Accesses) {
+                            .dst = gen_access_ptr(bb, dst_addr, word_width),
+                            .src = gen_access_ptr(bb, src_addr, word_width),
+                        }, width, word_width, bytes);
                     return yield_values_and_wrap_in_block(bb, empty(a));
                 }
                 case memset_op: {
-                    Nodes old_ops = old->payload.prim_op.operands;
-                    const Node* src_value = rewrite_node(&ctx->rewriter, old_ops.nodes[1]);
-                    const Type* src_type = src_value->type;
-                    deconstruct_qualified_type(&src_type);
-                    assert(src_type->tag == Int_TAG);
-                    const Type* word_type = src_type;// int_type(a, (Int) { .is_signed = false, .width = a->config.memory.word_size });
-
                     BodyBuilder* bb = begin_body(a);
+                    Nodes old_ops = old->payload.prim_op.operands;
 
                     const Node* dst_addr = rewrite_node(&ctx->rewriter, old_ops.nodes[0]);
-                    const Type* dst_addr_type = dst_addr->type;
-                    deconstruct_qualified_type(&dst_addr_type);
-                    assert(dst_addr_type->tag == PtrType_TAG);
-                    dst_addr_type = ptr_type(a, (PtrType) {
-                        .address_space = dst_addr_type->payload.ptr_type.address_space,
-                        .pointed_type = arr_type(a, (ArrType) { .element_type = word_type, .size = NULL }),
-                    });
-                    dst_addr = gen_reinterpret_cast(bb, dst_addr_type, dst_addr);
-
-                    const Node* num = rewrite_node(&ctx->rewriter, old_ops.nodes[2]);
-                    const Node* num_in_bytes = gen_conversion(bb, uint32_type(a), bytes_to_words(bb, num));
-
-                    const Node* index = var(a, qualified_type_helper(uint32_type(a), false), "memset_i");
-                    BodyBuilder* loop_bb = begin_body(a);
-                    gen_store(loop_bb, gen_lea(loop_bb, dst_addr, index, singleton(uint32_literal(a, 0))), src_value);
-                    const Node* next_index = gen_primop_e(loop_bb, add_op, empty(a), mk_nodes(a, index, uint32_literal(a, 1)));
-                    bind_instruction(loop_bb, if_instr(a, (If) {
-                        .condition = gen_primop_e(loop_bb, lt_op, empty(a), mk_nodes(a, next_index, num_in_bytes)),
-                        .yield_types = empty(a),
-                        .if_true = case_(a, empty(a), merge_continue(a, (MergeContinue) {.args = singleton(next_index)})),
-                        .if_false = case_(a, empty(a), merge_break(a, (MergeBreak) {.args = empty(a)}))
-                    }));
-
-                    bind_instruction(bb, loop_instr(a, (Loop) {
-                        .yield_types = empty(a),
-                        .body = case_(a, singleton(index), finish_body(loop_bb, unreachable(a))),
-                        .initial_args = singleton(uint32_literal(a, 0))
-                    }));
+                    const Node* value = rewrite_node(&ctx->rewriter, old_ops.nodes[1]);
+                    const Type* value_t = value->type;
+                    deconstruct_qualified_type(&value_t);
+                    assert(value_t->tag == Int_TAG);
+                    const Node* bytes = gen_byte_count(bb, rewrite_node(&ctx->rewriter, old_ops.nodes[2]));
+
+                    // the value is repeated in each word, so the words can't be narrower than it
+                    IntSizes value_width = value_t->payload.int_type.width;
+                    IntSizes width = fit_width_to_count(a, get_access_width(ctx, get_address_alignment(old_ops.nodes[0])), bytes);
+                    if (width < value_width)
+                        width = value_width;
+
+                    Accesses accesses = {
+                        .dst = gen_access_ptr(bb, dst_addr, width),
+                        .value = gen_splat(bb, value, width),
+                    };
+                    gen_accesses(bb, accesses, width, gen_count(bb, bytes, width));
+                    IntSizes leftover_width = value_width > a->config.memory.word_size ? value_width : a->config.memory.word_size;
+                    if (width != leftover_width && !resolve_to_int_literal(bytes))
+                        gen_leftovers(bb, (Accesses) {
+                            .dst = gen_access_ptr(bb, dst_addr, leftover_width),
+                            .value = gen_splat(bb, value, leftover_width),
+                        }, width, leftover_width, bytes);
+                    gen_tail(bb, dst_addr, value, bytes);
                     return yield_values_and_wrap_in_block(bb, empty(a));
                 }
                 default: break;
@@ -125,13 +332,14 @@ static const Node* process(Context* ctx, const Node* old) {
     return recreate_node_identity(&ctx->rewriter, old);
 }
 
-Module* lower_memcpy(SHADY_UNUSED const CompilerConfig* config, Module* src) {
+Module* lower_memcpy(const CompilerConfig* config, Module* src) {
     ArenaConfig aconfig = get_arena_config(get_module_arena(src));
     IrArena* a = new_ir_arena(aconfig);
     Module* dst = new_module(a, get_module_name(src));
 
     Context ctx = {
-            .rewriter = create_rewriter(src, dst, (RewriteNodeFn) process)
+        .rewriter = create_rewriter(src, dst, (RewriteNodeFn) process),
+        .config = config,
     };
     rewrite_module(&ctx.rewriter);
     destroy_rewriter(&ctx.rewriter);
@@ -5,6 +5,7 @@
 
 #include "../ir_private.h"
 #include "../rewrite.h"
+#include "../visit.h"
 #include "../type.h"
 
 #include "log.h"
@@ -17,11 +18,19 @@
 #include <string.h>
 #include <assert.h>
 
+/// The old globals an entry point uses, directly or through what it calls
+typedef struct {
+    const Node* entry_point;
+    struct Dict* globals;
+} EntryPointGlobals;
+
 typedef struct Context_ {
     Rewriter rewriter;
     const CompilerConfig* config;
 
     Nodes collected[NumAddressSpaces];
+    /// the width of the words in the arrays backing each emulated address space
+    IntSizes word_width[NumAddressSpaces];
 
     struct Dict*   serialisation_uniform[NumAddressSpaces];
     struct Dict* deserialisation_uniform[NumAddressSpaces];
@@ -29,6 +38,9 @@ typedef struct Context_ {
     struct Dict*   serialisation_varying[NumAddressSpaces];
     struct Dict* deserialisation_varying[NumAddressSpaces];
 
+    /// @ref List of @ref EntryPointGlobals, empty when there are no entry points to go by
+    struct List* entry_points;
+
     const Node* fake_private_memory;
     const Node* fake_subgroup_memory;
     const Node* fake_shared_memory;
@@ -56,55 +68,171 @@ static const Node** get_emulated_as_word_array(Context* ctx, AddressSpace as) {
     }
 }
 
-static const Node* gen_deserialisation(Context* ctx, BodyBuilder* bb, const Type* element_type, const Node* arr, const Node* base_offset) {
+/// Where in its word the byte at @p address starts, in bits
+static const Node* gen_shift_within_word(Context* ctx, BodyBuilder* bb, AddressSpace as, const Node* address) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    IntSizes word_width = ctx->word_width[as];
+    const Node* byte = gen_primop_e(bb, mod_op, empty(a), mk_nodes(a, address, size_t_literal(a, int_size_in_bytes(word_width))));
+    const Node* shift = gen_primop_e(bb, mul_op, empty(a), mk_nodes(a, byte, size_t_literal(a, 8)));
+    return gen_conversion(bb, int_type(a, (Int) { .width = word_width, .is_signed = false }), shift);
+}
+
+static const Node* gen_word_ptr(Context* ctx, BodyBuilder* bb, AddressSpace as, const Node* address) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    const Node* arr = *get_emulated_as_word_array(ctx, as);
+    const Node* index = gen_primop_e(bb, div_op, empty(a), mk_nodes(a, address, size_t_literal(a, int_size_in_bytes(ctx->word_width[as]))));
+    return gen_primop_ce(bb, lea_op, 3, (const Node* []) { arr, size_t_literal(a, 0), index });
+}
+
+/// Loads an unsigned int that fits in a single word
+static const Node* gen_load_within_word(Context* ctx, BodyBuilder* bb, AddressSpace as, IntSizes width, const Node* address) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    const Node* word = gen_load(bb, gen_word_ptr(ctx, bb, as, address));
+    if (width == ctx->word_width[as])
+        return word;
+    word = gen_primop_e(bb, rshift_logical_op, empty(a), mk_nodes(a, word, gen_shift_within_word(ctx, bb, as, address)));
+    return gen_conversion(bb, int_type(a, (Int) { .width = width, .is_signed = false }), word);
+}
+
+/// Stores an unsigned int that fits in a single word, leaving the rest of the word alone
+static void gen_store_within_word(Context* ctx, BodyBuilder* bb, AddressSpace as, IntSizes width, const Node* address, const Node* value) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    IntSizes word_width = ctx->word_width[as];
+    const Node* ptr = gen_word_ptr(ctx, bb, as, address);
+    if (width == word_width) {
+        gen_store(bb, ptr, value);
+        return;
+    }
+    const Type* word_type = int_type(a, (Int) { .width = word_width, .is_signed = false });
+    const Node* shift = gen_shift_within_word(ctx, bb, as, address);
+    const Node* mask = int_literal(a, (IntLiteral) { .width = word_width, .is_signed = false, .value = (UINT64_C(1) << (int_size_in_bytes(width) * 8)) - 1 });
+                mask = gen_primop_e(bb, lshift_op, empty(a), mk_nodes(a, mask, shift));
+    const Node* word = gen_load(bb, ptr);
+                word = gen_primop_e(bb, and_op, empty(a), mk_nodes(a, word, gen_primop_e(bb, not_op, empty(a), singleton(mask))));
+    value = gen_conversion(bb, word_type, value);
+    value = gen_primop_e(bb, lshift_op, empty(a), mk_nodes(a, value, shift));
+    gen_store(bb, ptr, gen_primop_e(bb, or_op, empty(a), mk_nodes(a, word, value)));
+}
+
+/// Loads an unsigned int @p chunk_width at a time, each chunk has to be aligned to its own size
+static const Node* gen_load_chunks(Context* ctx, BodyBuilder* bb, AddressSpace as, IntSizes width, IntSizes chunk_width, const Node* address) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    if (chunk_width == width)
+        return gen_load_within_word(ctx, bb, as, width, address);
+
+    const Type* int_t = int_type(a, (Int) { .width = width, .is_signed = false });
+    size_t chunk_size_in_bytes = int_size_in_bytes(chunk_width);
+    const Node* acc = int_literal(a, (IntLiteral) { .width = width, .is_signed = false, .value = 0 });
+    for (size_t byte = 0; byte < int_size_in_bytes(width); byte += chunk_size_in_bytes) {
+        const Node* chunk_address = gen_primop_e(bb, add_op, empty(a), mk_nodes(a, address, size_t_literal(a, byte)));
+        const Node* chunk = gen_load_within_word(ctx, bb, as, chunk_width, chunk_address);
+                    chunk = gen_conversion(bb, int_t, chunk); // widen the chunk we just loaded
+                    chunk = gen_primop_e(bb, lshift_op, empty(a), mk_nodes(a, chunk, int_literal(a, (IntLiteral) { .width = width, .is_signed = false, .value = byte * 8 }))); // shift it
+        acc = gen_primop_e(bb, or_op, empty(a), mk_nodes(a, acc, chunk));
+    }
+    return acc;
+}
+
+static void gen_store_chunks(Context* ctx, BodyBuilder* bb, AddressSpace as, IntSizes width, IntSizes chunk_width, const Node* address, const Node* value) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    if (chunk_width == width) {
+        gen_store_within_word(ctx, bb, as, width, address, value);
+        return;
+    }
+
+    size_t chunk_size_in_bytes = int_size_in_bytes(chunk_width);
+    for (size_t byte = 0; byte < int_size_in_bytes(width); byte += chunk_size_in_bytes) {
+        const Node* chunk_address = gen_primop_e(bb, add_op, empty(a), mk_nodes(a, address, size_t_literal(a, byte)));
+        const Node* chunk = gen_primop_e(bb, rshift_logical_op, empty(a), mk_nodes(a, value, int_literal(a, (IntLiteral) { .width = width, .is_signed = false, .value = byte * 8 }))); // shift it
+                    chunk = gen_conversion(bb, int_type(a, (Int) { .width = chunk_width, .is_signed = false }), chunk); // truncate to the chunk we want to store
+        gen_store_within_word(ctx, bb, as, chunk_width, chunk_address, chunk);
+    }
+}
+
+/// The widest chunks an int of @p width can be accessed with, when its address is aligned to them
+static IntSizes get_chunk_width(Context* ctx, AddressSpace as, IntSizes width) {
+    IntSizes word_width = ctx->word_width[as];
+    return width < word_width ? width : word_width;
+}
+
+/// Whether @p address is a multiple of the size of @p chunk_width, only known once the program runs
+static const Node* gen_is_aligned(Context* ctx, BodyBuilder* bb, IntSizes chunk_width, const Node* address) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    const Node* misalignment = gen_primop_e(bb, mod_op, empty(a), mk_nodes(a, address, size_t_literal(a, int_size_in_bytes(chunk_width))));
+    return gen_primop_e(bb, eq_op, empty(a), mk_nodes(a, misalignment, size_t_literal(a, 0)));
+}
+
+/// Emulated memory is accessed a whole word at a time when the address turns out to be aligned, and byte per byte otherwise
+static const Node* gen_load_int(Context* ctx, BodyBuilder* bb, AddressSpace as, IntSizes width, const Node* address) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    IntSizes chunk_width = get_chunk_width(ctx, as, width);
+    if (chunk_width == IntTy8)
+        return gen_load_chunks(ctx, bb, as, width, IntTy8, address);
+
+    BodyBuilder* aligned_bb = begin_body(a);
+    BodyBuilder* unaligned_bb = begin_body(a);
+    const Node* aligned = gen_load_chunks(ctx, aligned_bb, as, width, chunk_width, address);
+    const Node* unaligned = gen_load_chunks(ctx, unaligned_bb, as, width, IntTy8, address);
+    return first(bind_instruction(bb, if_instr(a, (If) {
+        .condition = gen_is_aligned(ctx, bb, chunk_width, address),
+        .yield_types = singleton(int_type(a, (Int) { .width = width, .is_signed = false })),
+        .if_true = case_(a, empty(a), finish_body(aligned_bb, yield(a, (Yield) { .args = singleton(aligned) }))),
+        .if_false = case_(a, empty(a), finish_body(unaligned_bb, yield(a, (Yield) { .args = singleton(unaligned) }))),
+    })));
+}
+
+static void gen_store_int(Context* ctx, BodyBuilder* bb, AddressSpace as, IntSizes width, const Node* address, const Node* value) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    IntSizes chunk_width = get_chunk_width(ctx, as, width);
+    if (chunk_width == IntTy8) {
+        gen_store_chunks(ctx, bb, as, width, IntTy8, address, value);
+        return;
+    }
+
+    BodyBuilder* aligned_bb = begin_body(a);
+    BodyBuilder* unaligned_bb = begin_body(a);
+    gen_store_chunks(ctx, aligned_bb, as, width, chunk_width, address, value);
+    gen_store_chunks(ctx, unaligned_bb, as, width, IntTy8, address, value);
+    bind_instruction(bb, if_instr(a, (If) {
+        .condition = gen_is_aligned(ctx, bb, chunk_width, address),
+        .yield_types = empty(a),
+        .if_true = case_(a, empty(a), finish_body(aligned_bb, yield(a, (Yield) { .args = empty(a) }))),
+        .if_false = case_(a, empty(a), finish_body(unaligned_bb, yield(a, (Yield) { .args = empty(a) }))),
+    }));
+}
+
+static const Node* gen_deserialisation(Context* ctx, BodyBuilder* bb, AddressSpace as, const Type* element_type, const Node* address) {
     IrArena* a = ctx->rewriter.dst_arena;
     const CompilerConfig* config = ctx->config;
-    const Node* zero = size_t_literal(a, 0);
     switch (element_type->tag) {
         case Bool_TAG: {
-            const Node* logical_ptr = gen_primop_ce(bb, lea_op, 3, (const Node* []) { arr, zero, base_offset });
-            const Node* value = gen_load(bb, logical_ptr);
+            const Node* value = gen_load_int(ctx, bb, as, a->config.memory.word_size, address);
             return gen_primop_ce(bb, neq_op, 2, (const Node*[]) {value, int_literal(a, (IntLiteral) { .value = 0, .width = a->config.memory.word_size })});
         }
         case PtrType_TAG: switch (element_type->payload.ptr_type.address_space) {
             case AsGlobalPhysical: {
                 const Type* ptr_int_t = int_type(a, (Int) {.width = a->config.memory.ptr_size, .is_signed = false });
-                const Node* unsigned_int = gen_deserialisation(ctx, bb, ptr_int_t, arr, base_offset);
+                const Node* unsigned_int = gen_deserialisation(ctx, bb, as, ptr_int_t, address);
                 return gen_reinterpret_cast(bb, element_type, unsigned_int);
             }
             default: error("TODO")
         }
-        case Int_TAG: ser_int: {
-            assert(element_type->tag == Int_TAG);
-            const Node* acc = int_literal(a, (IntLiteral) { .width = element_type->payload.int_type.width, .is_signed = false, .value = 0 });
-            size_t length_in_bytes = int_size_in_bytes(element_type->payload.int_type.width);
-            size_t word_size_in_bytes = int_size_in_bytes(a->config.memory.word_size);
-            const Node* offset = base_offset;
-            const Node* shift = int_literal(a, (IntLiteral) { .width = element_type->payload.int_type.width, .is_signed = false, .value = 0 });
-            const Node* word_bitwidth = int_literal(a, (IntLiteral) { .width = element_type->payload.int_type.width, .is_signed = false, .value = word_size_in_bytes * 8 });
-            for (size_t byte = 0; byte < length_in_bytes; byte += word_size_in_bytes) {
-                const Node* word = gen_load(bb, gen_primop_ce(bb, lea_op, 3, (const Node* []) {arr, zero, offset}));
-                            word = gen_conversion(bb, int_type(a, (Int) { .width = element_type->payload.int_type.width, .is_signed = false }), word); // widen/truncate the word we just loaded
-                            word = first(gen_primop(bb, lshift_op, empty(a), mk_nodes(a, word, shift))); // shift it
-                acc = gen_primop_e(bb, or_op, empty(a), mk_nodes(a, acc, word));
-
-                offset = first(gen_primop(bb, add_op, empty(a), mk_nodes(a, offset, size_t_literal(a, 1))));
-                shift = first(gen_primop(bb, add_op, empty(a), mk_nodes(a, shift, word_bitwidth)));
-            }
+        case Int_TAG: {
+            const Node* acc = gen_load_int(ctx, bb, as, element_type->payload.int_type.width, address);
             if (config->printf_trace.memory_accesses) {
-                AddressSpace as = get_unqualified_type(arr->type)->payload.ptr_type.address_space;
-                String template = format_string_interned(a, "loaded %s at %s:%s\n", element_type->payload.int_type.width == IntTy64 ? "%lu" : "%u", get_address_space_name(as), "%lx");
+                AddressSpace logical_as = get_unqualified_type((*get_emulated_as_word_array(ctx, as))->type)->payload.ptr_type.address_space;
+                String template = format_string_interned(a, "loaded %s at %s:%s\n", element_type->payload.int_type.width == IntTy64 ? "%lu" : "%u", get_address_space_name(logical_as), "%lx");
                 const Node* widened = acc;
                 if (element_type->payload.int_type.width < IntTy32)
                     widened = gen_conversion(bb, uint32_type(a), acc);
-                bind_instruction(bb, prim_op(a, (PrimOp) { .op = debug_printf_op, .operands = mk_nodes(a, string_lit(a, (StringLiteral) { .string = template }), widened, base_offset) }));
+                bind_instruction(bb, prim_op(a, (PrimOp) { .op = debug_printf_op, .operands = mk_nodes(a, string_lit(a, (StringLiteral) { .string = template }), widened, address) }));
             }
-            acc = gen_reinterpret_cast(bb, int_type(a, (Int) { .width = element_type->payload.int_type.width, .is_signed = element_type->payload.int_type.is_signed }), acc);\
+            acc = gen_reinterpret_cast(bb, int_type(a, (Int) { .width = element_type->payload.int_type.width, .is_signed = element_type->payload.int_type.is_signed }), acc);
             return acc;
         }
         case Float_TAG: {
             const Type* unsigned_int_t = int_type(a, (Int) {.width = float_to_int_width(element_type->payload.float_type.width), .is_signed = false });
-            const Node* unsigned_int = gen_deserialisation(ctx, bb, unsigned_int_t, arr, base_offset);
+            const Node* unsigned_int = gen_deserialisation(ctx, bb, as, unsigned_int_t, address);
             return gen_reinterpret_cast(bb, element_type, unsigned_int);
         }
         case TypeDeclRef_TAG:
@@ -116,9 +244,8 @@ static const Node* gen_deserialisation(Context* ctx, BodyBuilder* bb, const Type
             LARRAY(const Node*, loaded, member_types.count);
             for (size_t i = 0; i < member_types.count; i++) {
                 const Node* field_offset = gen_primop_e(bb, offset_of_op, singleton(element_type), singleton(size_t_literal(a, i)));
-                            field_offset = bytes_to_words(bb, field_offset);
-                const Node* adjusted_offset = gen_primop_e(bb, add_op, empty(a), mk_nodes(a, base_offset, field_offset));
-                loaded[i] = gen_deserialisation(ctx, bb, member_types.nodes[i], arr, adjusted_offset);
+                const Node* adjusted_offset = gen_primop_e(bb, add_op, empty(a), mk_nodes(a, address, field_offset));
+                loaded[i] = gen_deserialisation(ctx, bb, as, member_types.nodes[i], adjusted_offset);
             }
             return composite_helper(a, element_type, nodes(a, member_types.count, loaded));
         }
@@ -133,9 +260,9 @@ static const Node* gen_deserialisation(Context* ctx, BodyBuilder* bb, const Type
             size_t components_count = get_int_literal_value(*resolve_to_int_literal(size), 0);
             const Type* component_type = get_fill_type_element_type(element_type);
             LARRAY(const Node*, components, components_count);
-            const Node* offset = base_offset;
+            const Node* offset = address;
             for (size_t i = 0; i < components_count; i++) {
-                components[i] = gen_deserialisation(ctx, bb, component_type, arr, offset);
+                components[i] = gen_deserialisation(ctx, bb, as, component_type, offset);
                 offset = gen_primop_e(bb, add_op, empty(a), mk_nodes(a, offset, gen_primop_e(bb, size_of_op, singleton(component_type), empty(a))));
             }
             return composite_helper(a, element_type, nodes(a, components_count, components));
@@ -144,87 +271,59 @@ static const Node* gen_deserialisation(Context* ctx, BodyBuilder* bb, const Type
     }
 }
 
-static void gen_serialisation(Context* ctx, BodyBuilder* bb, const Type* element_type, const Node* arr, const Node* base_offset, const Node* value) {
+static void gen_serialisation(Context* ctx, BodyBuilder* bb, AddressSpace as, const Type* element_type, const Node* address, const Node* value) {
     IrArena* a = ctx->rewriter.dst_arena;
     const CompilerConfig* config = ctx->config;
-    const Node* zero = size_t_literal(a, 0);
     switch (element_type->tag) {
         case Bool_TAG: {
-            const Node* logical_ptr = gen_primop_ce(bb, lea_op, 3, (const Node* []) { arr, zero, base_offset });
-            const Node* zero_b = int_literal(a, (IntLiteral) { .value = 1, .width = a->config.memory.word_size });
-            const Node* one_b =  int_literal(a, (IntLiteral) { .value = 0, .width = a->config.memory.word_size });
+            const Node* zero_b = int_literal(a, (IntLiteral) { .value = 0, .width = a->config.memory.word_size });
+            const Node* one_b =  int_literal(a, (IntLiteral) { .value = 1, .width = a->config.memory.word_size });
             const Node* int_value = gen_primop_ce(bb, select_op, 3, (const Node*[]) { value, one_b, zero_b });
-            gen_store(bb, logical_ptr, int_value);
+            gen_store_int(ctx, bb, as, a->config.memory.word_size, address, int_value);
             return;
         }
         case PtrType_TAG: switch (element_type->payload.ptr_type.address_space) {
             case AsGlobalPhysical: {
                 const Type* ptr_int_t = int_type(a, (Int) {.width = a->config.memory.ptr_size, .is_signed = false });
                 const Node* unsigned_value = gen_primop_e(bb, reinterpret_op, singleton(ptr_int_t), singleton(value));
-                return gen_serialisation(ctx, bb, ptr_int_t, arr, base_offset, unsigned_value);
+                return gen_serialisation(ctx, bb, as, ptr_int_t, address, unsigned_value);
             }
             default: error("TODO")
         }
-        case Int_TAG: des_int: {
-            assert(element_type->tag == Int_TAG);
+        case Int_TAG: {
             // First bitcast to unsigned so we always get zero-extension and not sign-extension afterwards
             const Type* element_t_unsigned = int_type(a, (Int) { .width = element_type->payload.int_type.width, .is_signed = false});
             value = convert_int_extend_according_to_src_t(bb, element_t_unsigned, value);
-
-            // const Node* acc = int_literal(a, (IntLiteral) { .width = element_type->payload.int_type.width, .is_signed = false, .value = 0 });
-            size_t length_in_bytes = int_size_in_bytes(element_type->payload.int_type.width);
-            size_t word_size_in_bytes = int_size_in_bytes(a->config.memory.word_size);
-            const Node* offset = base_offset;
-            const Node* shift = int_literal(a, (IntLiteral) { .width = element_type->payload.int_type.width, .is_signed = false, .value = 0 });
-            const Node* word_bitwidth = int_literal(a, (IntLiteral) { .width = element_type->payload.int_type.width, .is_signed = false, .value = word_size_in_bytes * 8 });
-            for (size_t byte = 0; byte < length_in_bytes; byte += word_size_in_bytes) {
-                bool is_last_word = byte + word_size_in_bytes >= length_in_bytes;
-                /*bool needs_patch = is_last_word && word_size_in_bytes < length_in_bytes;
-                const Node* original_word = NULL;
-                if (needs_patch) {
-                    original_word = gen_load(bb, gen_primop_ce(bb, lea_op, 3, (const Node* []) {arr, zero, offset}));
-                    error_print("TODO");
-                    error_die();
-                    // word = gen_conversion(bb, int_type(a, (Int) { .width = element_type->payload.int_type.width, .is_signed = false }), word); // widen/truncate the word we just loaded
-                }*/
-                const Node* word = value;
-                word = first(gen_primop(bb, rshift_logical_op, empty(a), mk_nodes(a, word, shift))); // shift it
-                word = gen_conversion(bb, int_type(a, (Int) { .width = a->config.memory.word_size, .is_signed = false }), word); // widen/truncate the word we want to store
-                gen_store(bb, gen_primop_ce(bb, lea_op, 3, (const Node* []) {arr, zero, offset}), word);
-
-                offset = first(gen_primop(bb, add_op, empty(a), mk_nodes(a, offset, size_t_literal(a, 1))));
-                shift = first(gen_primop(bb, add_op, empty(a), mk_nodes(a, shift, word_bitwidth)));
-            }
+            gen_store_int(ctx, bb, as, element_type->payload.int_type.width, address, value);
             if (config->printf_trace.memory_accesses) {
-                AddressSpace as = get_unqualified_type(arr->type)->payload.ptr_type.address_space;
-                String template = format_string_interned(a, "stored %s at %s:%s\n", element_type->payload.int_type.width == IntTy64 ? "%lu" : "%u", get_address_space_name(as), "%lx");
+                AddressSpace logical_as = get_unqualified_type((*get_emulated_as_word_array(ctx, as))->type)->payload.ptr_type.address_space;
+                String template = format_string_interned(a, "stored %s at %s:%s\n", element_type->payload.int_type.width == IntTy64 ? "%lu" : "%u", get_address_space_name(logical_as), "%lx");
                 const Node* widened = value;
                 if (element_type->payload.int_type.width < IntTy32)
                     widened = gen_conversion(bb, uint32_type(a), value);
-                bind_instruction(bb, prim_op(a, (PrimOp) { .op = debug_printf_op, .operands = mk_nodes(a, string_lit(a, (StringLiteral) { .string = template }), widened, base_offset) }));
+                bind_instruction(bb, prim_op(a, (PrimOp) { .op = debug_printf_op, .operands = mk_nodes(a, string_lit(a, (StringLiteral) { .string = template }), widened, address) }));
             }
             return;
         }
         case Float_TAG: {
             const Type* unsigned_int_t = int_type(a, (Int) {.width = float_to_int_width(element_type->payload.float_type.width), .is_signed = false });
             const Node* unsigned_value = gen_primop_e(bb, reinterpret_op, singleton(unsigned_int_t), singleton(value));
-            return gen_serialisation(ctx, bb, unsigned_int_t, arr, base_offset, unsigned_value);
+            return gen_serialisation(ctx, bb, as, unsigned_int_t, address, unsigned_value);
         }
         case RecordType_TAG: {
             Nodes member_types = element_type->payload.record_type.members;
             for (size_t i = 0; i < member_types.count; i++) {
                 const Node* extracted_value = first(bind_instruction(bb, prim_op(a, (PrimOp) { .op = extract_op, .operands = mk_nodes(a, value, int32_literal(a, i)), .type_arguments = empty(a) })));
                 const Node* field_offset = gen_primop_e(bb, offset_of_op, singleton(element_type), singleton(size_t_literal(a, i)));
-                            field_offset = bytes_to_words(bb, field_offset);
-                const Node* adjusted_offset = gen_primop_e(bb, add_op, empty(a), mk_nodes(a, base_offset, field_offset));
-                gen_serialisation(ctx, bb, member_types.nodes[i], arr, adjusted_offset, extracted_value);
+                const Node* adjusted_offset = gen_primop_e(bb, add_op, empty(a), mk_nodes(a, address, field_offset));
+                gen_serialisation(ctx, bb, as, member_types.nodes[i], adjusted_offset, extracted_value);
             }
             return;
         }
         case TypeDeclRef_TAG: {
             const Node* nom = element_type->payload.type_decl_ref.decl;
             assert(nom && nom->tag == NominalType_TAG);
-            gen_serialisation(ctx, bb, nom->payload.nom_type.body, arr, base_offset, value);
+            gen_serialisation(ctx, bb, as, nom->payload.nom_type.body, address, value);
             return;
         }
         case ArrType_TAG:
@@ -237,9 +336,9 @@ static void gen_serialisation(Context* ctx, BodyBuilder* bb, const Type* element
             }
             size_t components_count = get_int_literal_value(*resolve_to_int_literal(size), 0);
             const Type* component_type = get_fill_type_element_type(element_type);
-            const Node* offset = base_offset;
+            const Node* offset = address;
             for (size_t i = 0; i < components_count; i++) {
-                gen_serialisation(ctx, bb, component_type, arr, offset, gen_extract(bb, value, singleton(int32_literal(a, i))));
+                gen_serialisation(ctx, bb, as, component_type, offset, gen_extract(bb, value, singleton(int32_literal(a, i))));
                 offset = gen_primop_e(bb, add_op, empty(a), mk_nodes(a, offset, gen_primop_e(bb, size_of_op, singleton(component_type), empty(a))));
             }
             return;
@@ -278,13 +377,11 @@ static const Node* gen_serdes_fn(Context* ctx, const Type* element_type, bool un
     insert_dict(const Node*, Node*, cache, element_type, fun);
 
     BodyBuilder* bb = begin_body(a);
-    const Node* address = bytes_to_words(bb, address_param);
-    const Node* base = *get_emulated_as_word_array(ctx, as);
     if (ser) {
-        gen_serialisation(ctx, bb, element_type, base, address, value_param);
+        gen_serialisation(ctx, bb, as, element_type, address_param, value_param);
         fun->payload.fun.body = finish_body(bb, fn_ret(a, (Return) { .fn = fun, .args = empty(a) }));
     } else {
-        const Node* loaded_value = gen_deserialisation(ctx, bb, element_type, base, address);
+        const Node* loaded_value = gen_deserialisation(ctx, bb, as, element_type, address_param);
         assert(loaded_value);
         fun->payload.fun.body = finish_body(bb, fn_ret(a, (Return) { .fn = fun, .args = singleton(loaded_value) }));
     }
@@ -389,7 +486,158 @@ static Nodes collect_globals(Context* ctx, AddressSpace as) {
     return nodes(a, members_count, collected);
 }
 
-/// Collects all global variables in a specific AS, and creates a record type for them.
+typedef struct {
+    Visitor visitor;
+    struct Dict* seen;
+    struct Dict* globals;
+} GlobalsVisitor;
+
+static void search_for_globals(GlobalsVisitor* v, const Node* node) {
+    if (!insert_set_get_result(const Node*, v->seen, node))
+        return;
+    switch (node->tag) {
+        case RefDecl_TAG: search_for_globals(v, node->payload.ref_decl.decl); return;
+        case FnAddr_TAG: search_for_globals(v, node->payload.fn_addr.fn); return;
+        case GlobalVariable_TAG: {
+            insert_set_get_result(const Node*, v->globals, node);
+            // globals the initialiser points to are just as live as this one
+            if (node->payload.global_variable.init)
+                search_for_globals(v, node->payload.global_variable.init);
+            return;
+        }
+        case Constant_TAG: {
+            if (node->payload.constant.instruction)
+                search_for_globals(v, node->payload.constant.instruction);
+            return;
+        }
+        case Function_TAG: {
+            if (node->payload.fun.body)
+                search_for_globals(v, node->payload.fun.body);
+            return;
+        }
+        default: break;
+    }
+    visit_node_operands(&v->visitor, NcDeclaration, node);
+}
+
+static struct List* collect_entry_point_globals(Module* m) {
+    struct List* entry_points = new_list(EntryPointGlobals);
+    Nodes decls = get_module_declarations(m);
+    for (size_t i = 0; i < decls.count; i++) {
+        const Node* decl = decls.nodes[i];
+        if (decl->tag != Function_TAG || !lookup_annotation(decl, "EntryPoint"))
+            continue;
+        GlobalsVisitor v = {
+            .visitor = { .visit_node_fn = (VisitNodeFn) search_for_globals },
+            .seen = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+            .globals = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+        };
+        search_for_globals(&v, decl);
+        destroy_dict(v.seen);
+        append_list(EntryPointGlobals, entry_points, ((EntryPointGlobals) { .entry_point = decl, .globals = v.globals }));
+    }
+    return entry_points;
+}
+
+/// Undefined initial values don't need to be stored anywhere
+static bool has_initial_value(const Node* decl) {
+    const Node* init = decl->payload.global_variable.init;
+    return init && init->tag != Undef_TAG;
+}
+
+/// Two globals can overlap when no entry point uses both. Initialised globals are written to by every entry point.
+static bool can_globals_overlap(Context* ctx, const Node* a, const Node* b) {
+    size_t entry_points_count = entries_count_list(ctx->entry_points);
+    if (entry_points_count == 0 || has_initial_value(a) || has_initial_value(b))
+        return false;
+    for (size_t i = 0; i < entry_points_count; i++) {
+        struct Dict* globals = read_list(EntryPointGlobals, ctx->entry_points)[i].globals;
+        if (find_key_dict(const Node*, globals, a) && find_key_dict(const Node*, globals, b))
+            return false;
+    }
+    return true;
+}
+
+/// Globals that never overlap can share a slot in the emulated memory
+typedef struct {
+    struct List* globals;
+    TypeMemLayout layout;
+    /// set when all the globals in there agree on a type
+    const Type* type;
+} GlobalSlot;
+
+static struct List* pack_globals(Context* ctx, Nodes collected) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    struct List* slots = new_list(GlobalSlot);
+    for (size_t i = 0; i < collected.count; i++) {
+        const Node* decl = collected.nodes[i];
+        const Type* type = rewrite_node(&ctx->rewriter, decl->payload.global_variable.type);
+        TypeMemLayout layout = get_mem_layout(a, type);
+
+        GlobalSlot* slot = NULL;
+        for (size_t j = 0; j < entries_count_list(slots) && !slot; j++) {
+            GlobalSlot* candidate = &read_list(GlobalSlot, slots)[j];
+            bool free = true;
+            for (size_t k = 0; k < entries_count_list(candidate->globals) && free; k++)
+                free = can_globals_overlap(ctx, read_list(const Node*, candidate->globals)[k], decl);
+            if (free)
+                slot = candidate;
+        }
+        if (!slot) {
+            append_list(GlobalSlot, slots, ((GlobalSlot) { .globals = new_list(const Node*), .layout = layout, .type = type }));
+            slot = &read_list(GlobalSlot, slots)[entries_count_list(slots) - 1];
+        } else {
+            debugv_print("lower_physical_ptrs: %s overlaps %s\n", decl->payload.global_variable.name, read_list(const Node*, slot->globals)[0]->payload.global_variable.name);
+            if (slot->type != type)
+                slot->type = NULL;
+            slot->layout.size_in_bytes = layout.size_in_bytes > slot->layout.size_in_bytes ? layout.size_in_bytes : slot->layout.size_in_bytes;
+            slot->layout.alignment_in_bytes = layout.alignment_in_bytes > slot->layout.alignment_in_bytes ? layout.alignment_in_bytes : slot->layout.alignment_in_bytes;
+        }
+        append_list(const Node*, slot->globals, decl);
+    }
+
+    // slots holding several types are made of words as wide as the strictest alignment among them
+    for (size_t j = 0; j < entries_count_list(slots); j++) {
+        GlobalSlot* slot = &read_list(GlobalSlot, slots)[j];
+        if (slot->type)
+            continue;
+        size_t alignment = slot->layout.alignment_in_bytes;
+        size_t word_size = int_size_in_bytes(a->config.memory.word_size);
+        if (alignment < word_size)
+            alignment = word_size;
+        IntSizes width = IntTy8;
+        while (int_size_in_bytes(width) < alignment && width < IntTy64)
+            width++;
+        size_t words = (slot->layout.size_in_bytes + int_size_in_bytes(width) - 1) / int_size_in_bytes(width);
+        slot->type = arr_type(a, (ArrType) {
+            .element_type = int_type(a, (Int) { .width = width, .is_signed = false }),
+            .size = uint32_literal(a, words),
+        });
+    }
+    return slots;
+}
+
+static void report_footprint(Context* ctx, AddressSpace as, struct List* slots, const Type* record_t) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    String as_name = get_address_space_name(as);
+    for (size_t i = 0; i < entries_count_list(ctx->entry_points); i++) {
+        EntryPointGlobals* entry_point = &read_list(EntryPointGlobals, ctx->entry_points)[i];
+        size_t used = 0;
+        for (size_t j = 0; j < entries_count_list(slots); j++) {
+            GlobalSlot* slot = &read_list(GlobalSlot, slots)[j];
+            for (size_t k = 0; k < entries_count_list(slot->globals); k++) {
+                if (find_key_dict(const Node*, entry_point->globals, read_list(const Node*, slot->globals)[k])) {
+                    used += slot->layout.size_in_bytes;
+                    break;
+                }
+            }
+        }
+        debug_print("Entry point %s uses %d bytes of emulated %s memory\n", get_abstraction_name(entry_point->entry_point), (int) used, as_name);
+    }
+    debug_print("Emulated %s memory takes %d bytes\n", as_name, (int) get_mem_layout(a, record_t).size_in_bytes);
+}
+
+/// Collects all global variables in a specific AS, and creates a record type for them, with globals that are never used together sharing a member.
 static const Node* make_record_type(Context* ctx, AddressSpace as, Nodes collected) {
     IrArena* a = ctx->rewriter.dst_arena;
     Module* m = ctx->rewriter.dst_module;
@@ -397,14 +645,16 @@ static const Node* make_record_type(Context* ctx, AddressSpace as, Nodes collect
     String as_name = get_address_space_name(as);
     Node* global_struct_t = nominal_type(m, singleton(annotation(a, (Annotation) { .name = "Generated" })), format_string_arena(a->arena, "globals_physical_%s_t", as_name));
 
-    LARRAY(String, member_names, collected.count);
-    LARRAY(const Type*, member_tys, collected.count);
+    struct List* slots = pack_globals(ctx, collected);
+    size_t slots_count = entries_count_list(slots);
+    LARRAY(String, member_names, slots_count);
+    LARRAY(const Type*, member_tys, slots_count);
 
-    for (size_t i = 0; i < collected.count; i++) {
-        const Node* decl = collected.nodes[i];
-        const Type* type = decl->payload.global_variable.type;
+    for (size_t i = 0; i < slots_count; i++) {
+        GlobalSlot* slot = &read_list(GlobalSlot, slots)[i];
+        const Node* decl = read_list(const Node*, slot->globals)[0];
 
-        member_tys[i] = rewrite_node(&ctx->rewriter, type);
+        member_tys[i] = slot->type;
         member_names[i] = decl->payload.global_variable.name;
 
         // Turn the old global variable into a pointer (which are also now integers)
@@ -419,13 +669,20 @@ static const Node* make_record_type(Context* ctx, AddressSpace as, Nodes collect
         // const Node* offset_in_words = bytes_to_words(bb, offset);
         new_address->payload.constant.instruction = yield_values_and_wrap_in_block(bb, singleton(offset));
 
-        register_processed(&ctx->rewriter, decl, new_address);
+        // the globals sharing the slot all live at the same address
+        for (size_t j = 0; j < entries_count_list(slot->globals); j++)
+            register_processed(&ctx->rewriter, read_list(const Node*, slot->globals)[j], new_address);
     }
 
     const Type* record_t = record_type(a, (RecordType) {
-        .members = nodes(a, collected.count, member_tys),
-        .names = strings(a, collected.count, member_names)
+        .members = nodes(a, slots_count, member_tys),
+        .names = strings(a, slots_count, member_names)
     });
+    report_footprint(ctx, as, slots, record_t);
+
+    for (size_t i = 0; i < slots_count; i++)
+        destroy_list(read_list(GlobalSlot, slots)[i].globals);
+    destroy_list(slots);
 
     //return record_t;
     global_struct_t->payload.nom_type.body = record_t;
@@ -439,7 +696,7 @@ static void store_init_data(Context* ctx, AddressSpace as, Nodes collected, Body
         const Node* old_decl = collected.nodes[i];
         assert(old_decl->tag == GlobalVariable_TAG);
         const Node* old_init = old_decl->payload.global_variable.init;
-        if (old_init) {
+        if (has_initial_value(old_decl)) {
             const Node* old_store = prim_op_helper(oa, store_op, empty(oa), mk_nodes(oa, ref_decl_helper(oa, old_decl), old_init));
             bind_instruction(bb, rewrite_node(&ctx->rewriter, old_store));
         }
@@ -451,7 +708,7 @@ static void construct_emulated_memory_array(Context* ctx, AddressSpace as, Addre
     Module* m = ctx->rewriter.dst_module;
     String as_name = get_address_space_name(as);
 
-    const Type* word_type = int_type(a, (Int) { .width = a->config.memory.word_size, .is_signed = false });
+    const Type* word_type = int_type(a, (Int) { .width = ctx->word_width[as], .is_signed = false });
     const Type* ptr_size_type = int_type(a, (Int) { .width = a->config.memory.ptr_size, .is_signed = false });
 
     ctx->collected[as] = collect_globals(ctx, as);
@@ -471,7 +728,10 @@ static void construct_emulated_memory_array(Context* ctx, AddressSpace as, Addre
     // compute the size
     BodyBuilder* bb = begin_body(a);
     const Node* size_of = gen_primop_e(bb, size_of_op, singleton(type_decl_ref(a, (TypeDeclRef) { .decl = global_struct_t })), empty(a));
-    const Node* size_in_words = bytes_to_words(bb, size_of);
+    // round up, the globals might not fill the last word
+    const Node* word_size = size_t_literal(a, int_size_in_bytes(ctx->word_width[as]));
+    const Node* size_in_words = gen_primop_e(bb, add_op, empty(a), mk_nodes(a, size_of, gen_primop_e(bb, sub_op, empty(a), mk_nodes(a, word_size, size_t_literal(a, 1)))));
+                size_in_words = gen_primop_e(bb, div_op, empty(a), mk_nodes(a, size_in_words, word_size));
 
     Node* constant_decl = constant(m, annotations, ptr_size_type, format_string_interned(a, "globals_physical_%s_size", as_name));
     constant_decl->payload.constant.instruction = yield_values_and_wrap_in_block(bb, singleton(size_in_words));
@@ -496,6 +756,14 @@ Module* lower_physical_ptrs(const CompilerConfig* config, Module* src) {
         .config = config,
     };
 
+    // never narrower than what the memory layout assumes. Only private memory gets wider words, narrow stores to shared
+    // and subgroup words would be read-modify-writes racing with the other invocations storing to the same word.
+    IntSizes word_size = aconfig.memory.word_size;
+    ctx.word_width[AsPrivatePhysical]  = config->emulated_memory.private_word_size > word_size ? config->emulated_memory.private_word_size : word_size;
+    ctx.word_width[AsSubgroupPhysical] = word_size;
+    ctx.word_width[AsSharedPhysical]   = word_size;
+
+    ctx.entry_points = collect_entry_point_globals(src);
     construct_emulated_memory_array(&ctx, AsPrivatePhysical, AsPrivateLogical);
     if (dst->arena->config.allow_subgroup_memory)
         construct_emulated_memory_array(&ctx, AsSubgroupPhysical, AsSubgroupLogical);
@@ -514,6 +782,10 @@ Module* lower_physical_ptrs(const CompilerConfig* config, Module* src) {
     rewrite_module(&ctx.rewriter);
     destroy_rewriter(&ctx.rewriter);
 
+    for (size_t i = 0; i < entries_count_list(ctx.entry_points); i++)
+        destroy_dict(read_list(EntryPointGlobals, ctx.entry_points)[i].globals);
+    destroy_list(ctx.entry_points);
+
     for (size_t i = 0; i < NumAddressSpaces; i++) {
         if (is_as_emulated(&ctx, i)) {
             destroy_dict(ctx.serialisation_varying[i]);
@@ -11,6 +11,7 @@
 #include "../ir_private.h"
 
 #include "../transform/ir_gen_helpers.h"
+#include "../transform/memory_layout.h"
 
 #include <assert.h>
 #include <string.h>
@@ -26,8 +27,17 @@ typedef struct Context_ {
 
     const Node* stack;
     const Node* stack_pointer;
+    /// in bytes, what the stack pointer is kept a multiple of
+    size_t slot_alignment;
 } Context;
 
+/// Slots are padded to the words backing private memory, so lower_physical_ptrs can access them a word at a time
+static const Node* get_slot_size(Context* ctx, const Type* element_type) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    size_t size = get_mem_layout(a, element_type).size_in_bytes;
+    return uint32_literal(a, (size + ctx->slot_alignment - 1) / ctx->slot_alignment * ctx->slot_alignment);
+}
+
 static const Node* gen_fn(Context* ctx, const Type* element_type, bool push) {
     struct Dict* cache = push ? ctx->push : ctx->pop;
 
@@ -47,8 +57,7 @@ static const Node* gen_fn(Context* ctx, const Type* element_type, bool push) {
 
     BodyBuilder* bb = begin_body(a);
 
-    const Node* element_size = gen_primop_e(bb, size_of_op, singleton(element_type), empty(a));
-    element_size = gen_conversion(bb, uint32_type(a), element_size);
+    const Node* element_size = get_slot_size(ctx, element_type);
 
     // TODO somehow annotate the uniform guys as uniform
     const Node* stack_pointer = ctx->stack_pointer;
@@ -90,10 +99,68 @@ static const Node* gen_fn(Context* ctx, const Type* element_type, bool push) {
     return fun;
 }
 
+static bool is_stack_op_let(const Node* node, Op op) {
+    if (node->tag != Let_TAG)
+        return false;
+    const Node* instruction = get_let_instruction(node);
+    return instruction->tag == PrimOp_TAG && instruction->payload.prim_op.op == op;
+}
+
+/// Lowers a run of consecutive pushes or pops, loading and storing the stack pointer only once for all of them
+static const Node* gen_stack_run(Context* ctx, const Node* node) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    Op op = get_let_instruction(node)->payload.prim_op.op;
+    bool push = op == push_stack_op;
+
+    size_t count = 1;
+    for (const Node* next = get_abstraction_body(get_let_tail(node)); is_stack_op_let(next, op); next = get_abstraction_body(get_let_tail(next)))
+        count++;
+    if (count < 2)
+        return NULL;
+
+    BodyBuilder* bb = begin_body(a);
+    const Node* stack_size = gen_load(bb, ctx->stack_pointer);
+    const Node* tail = NULL;
+    for (size_t i = 0; i < count; i++) {
+        PrimOp payload = get_let_instruction(node)->payload.prim_op;
+        tail = get_let_tail(node);
+        const Type* element_type = rewrite_node(&ctx->rewriter, first(payload.type_arguments));
+        const Node* element_size = get_slot_size(ctx, element_type);
+
+        if (!push)
+            stack_size = gen_primop_ce(bb, sub_op, 2, (const Node* []) { stack_size, element_size });
+        const Node* addr = gen_lea(bb, ctx->stack, stack_size, singleton(uint32_literal(a, 0)));
+        AddressSpace addr_space = get_unqualified_type(addr->type)->payload.ptr_type.address_space;
+        addr = gen_reinterpret_cast(bb, ptr_type(a, (PtrType) { .address_space = addr_space, .pointed_type = element_type }), addr);
+        if (push) {
+            gen_store(bb, addr, rewrite_node(&ctx->rewriter, first(payload.operands)));
+            stack_size = gen_primop_ce(bb, add_op, 2, (const Node* []) { stack_size, element_size });
+        } else {
+            const Node* popped_value = gen_primop_ce(bb, load_op, 1, (const Node* []) { addr });
+            register_processed(&ctx->rewriter, first(get_abstraction_params(tail)), popped_value);
+        }
+
+        node = get_abstraction_body(tail);
+    }
+
+    gen_store(bb, ctx->stack_pointer, stack_size);
+    if (ctx->config->printf_trace.stack_size) {
+        bind_instruction(bb, prim_op(a, (PrimOp) { .op = debug_printf_op, .operands = mk_nodes(a, string_lit(a, (StringLiteral) { .string = push ? "bulk push" : "bulk pop" })) }));
+        bind_instruction(bb, prim_op(a, (PrimOp) { .op = debug_printf_op, .operands = mk_nodes(a, string_lit(a, (StringLiteral) { .string = "stack size after: %d\n" }), stack_size) }));
+    }
+    return finish_body(bb, rewrite_node(&ctx->rewriter, get_abstraction_body(tail)));
+}
+
 static const Node* process_let(Context* ctx, const Node* node) {
     assert(node->tag == Let_TAG);
     IrArena* a = ctx->rewriter.dst_arena;
 
+    if (is_stack_op_let(node, push_stack_op) || is_stack_op_let(node, pop_stack_op)) {
+        const Node* run = gen_stack_run(ctx, node);
+        if (run)
+            return run;
+    }
+
     const Node* old_instruction = node->payload.let.instruction;
     const Node* tail = rewrite_node(&ctx->rewriter, node->payload.let.tail);
 
@@ -108,6 +175,13 @@ static const Node* process_let(Context* ctx, const Node* node) {
             case set_stack_pointer_op: {
                 BodyBuilder* bb = begin_body(a);
                 const Node* val = rewrite_node(&ctx->rewriter, oprim_op->operands.nodes[0]);
+                // frames get padded like any other slot
+                if (ctx->slot_alignment > 1) {
+                    const Node* alignment = uint32_literal(a, ctx->slot_alignment);
+                    val = gen_primop_e(bb, add_op, empty(a), mk_nodes(a, val, uint32_literal(a, ctx->slot_alignment - 1)));
+                    val = gen_primop_e(bb, div_op, empty(a), mk_nodes(a, val, alignment));
+                    val = gen_primop_e(bb, mul_op, empty(a), mk_nodes(a, val, alignment));
+                }
                 gen_store(bb, ctx->stack_pointer, val);
                 return finish_body(bb, let(a, quote_helper(a, empty(a)), tail));
             }
@@ -207,6 +281,7 @@ Module* lower_stack(SHADY_UNUSED const CompilerConfig* config, Module* src) {
 
         .stack = ref_decl_helper(a, stack_decl),
         .stack_pointer = ref_decl_helper(a, stack_ptr_decl),
+        .slot_alignment = int_size_in_bytes(config->emulated_memory.private_word_size),
     };
 
     rewrite_module(&ctx.rewriter);
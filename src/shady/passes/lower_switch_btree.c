@@ -8,8 +8,17 @@
 #include "../rewrite.h"
 #include "../transform/ir_gen_helpers.h"
 
+#include <stdlib.h>
+
+/// how much of the range between the smallest and biggest literal has to be covered for a jump table to be worth it
+#define MIN_JUMP_TABLE_DENSITY_PERCENT 40
+/// bit tests test each literal against a 64-bit mask per case, which only pays off with a few distinct cases
+#define MAX_BIT_TEST_CASES 3
+#define MIN_BIT_TEST_LITERALS 3
+
 typedef struct {
     Rewriter rewriter;
+    const CompilerConfig* config;
 
     const Node* inspectee;
     const Node* run_default_case;
@@ -135,6 +144,94 @@ static const Node* generate_decision_tree(Context* ctx, TreeNode* n, uint64_t mi
     return body;
 }
 
+typedef struct {
+    uint64_t key;
+    const Node* lam;
+} MatchCase;
+
+static int compare_match_cases(const MatchCase* a, const MatchCase* b) {
+    if (a->key == b->key)
+        return 0;
+    return a->key < b->key ? -1 : 1;
+}
+
+/// Dense enough matches are left for SPIR-V to emit as an OpSwitch, the C emitter lowers them again since it prints if-chains
+static bool should_use_jump_table(Context* ctx, const MatchCase* sorted, size_t count) {
+    uint32_t min_cases = ctx->config->optimisations.switches.min_jump_table_cases;
+    if (min_cases == 0 || count < min_cases)
+        return false;
+    uint64_t range = sorted[count - 1].key - sorted[0].key;
+    return range < UINT64_MAX / 100 && count * 100 >= (range + 1) * MIN_JUMP_TABLE_DENSITY_PERCENT;
+}
+
+/// Collects the distinct cases of the match into @p cases, returns how many there are, or 0 when bit tests would not pay off
+static size_t get_bit_test_cases(const MatchCase* sorted, size_t count, const Node* cases[]) {
+    if (count < MIN_BIT_TEST_LITERALS || sorted[count - 1].key - sorted[0].key >= 64)
+        return 0;
+    size_t distinct = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t j = 0;
+        while (j < distinct && cases[j] != sorted[i].lam)
+            j++;
+        if (j < distinct)
+            continue;
+        if (distinct == MAX_BIT_TEST_CASES)
+            return 0;
+        cases[distinct++] = sorted[i].lam;
+    }
+    // bit tests only pay off when several literals go to the same case
+    return distinct < count ? distinct : 0;
+}
+
+/// Tests the offset of the inspectee from the smallest literal against a mask of the literals going to each case
+static const Node* generate_bit_tests(Context* ctx, const MatchCase* sorted, size_t count, const Node* cases[], size_t cases_count) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    const Type* inspectee_t = ctx->inspectee->type;
+    deconstruct_qualified_type(&inspectee_t);
+    assert(inspectee_t->tag == Int_TAG);
+    const Type* unsigned_t = int_type(a, (Int) { .width = inspectee_t->payload.int_type.width, .is_signed = false });
+    uint64_t base = sorted[0].key;
+    uint64_t range = sorted[count - 1].key - base;
+
+    BodyBuilder* bb = begin_body(a);
+    const Node* offset = gen_reinterpret_cast(bb, unsigned_t, ctx->inspectee);
+    offset = gen_primop_e(bb, sub_op, empty(a), mk_nodes(a, offset, int_literal(a, (IntLiteral) { .width = inspectee_t->payload.int_type.width, .value = base })));
+    const Node* in_range = gen_primop_e(bb, lte_op, empty(a), mk_nodes(a, offset, int_literal(a, (IntLiteral) { .width = inspectee_t->payload.int_type.width, .value = range })));
+
+    // the offset is only known to be small enough to shift by once we are in range
+    BodyBuilder* in_range_bb = begin_body(a);
+    const Node* bit = gen_primop_e(in_range_bb, lshift_op, empty(a), mk_nodes(a, uint64_literal(a, 1), gen_conversion(in_range_bb, uint64_type(a), offset)));
+    LARRAY(const Node*, hits, cases_count);
+    for (size_t i = 0; i < cases_count; i++) {
+        uint64_t mask = 0;
+        for (size_t j = 0; j < count; j++)
+            if (sorted[j].lam == cases[i])
+                mask |= UINT64_C(1) << (sorted[j].key - base);
+        const Node* masked = gen_primop_e(in_range_bb, and_op, empty(a), mk_nodes(a, bit, uint64_literal(a, mask)));
+        hits[i] = gen_primop_e(in_range_bb, neq_op, empty(a), mk_nodes(a, masked, uint64_literal(a, 0)));
+    }
+    const Node* chain = generate_default_fallback_case(ctx);
+    for (size_t i = cases_count - 1; i < cases_count; i--) {
+        BodyBuilder* test_bb = begin_body(a);
+        Nodes values = bind_instruction(test_bb, if_instr(a, (If) {
+            .yield_types = ctx->yield_types,
+            .condition = hits[i],
+            .if_true = cases[i],
+            .if_false = chain,
+        }));
+        chain = case_(a, empty(a), finish_body(test_bb, yield(a, (Yield) { .args = values })));
+    }
+    Nodes in_range_values = bind_instruction(in_range_bb, block(a, (Block) { .yield_types = add_qualifiers(a, ctx->yield_types, false), .inside = chain }));
+
+    Nodes values = bind_instruction(bb, if_instr(a, (If) {
+        .yield_types = ctx->yield_types,
+        .condition = in_range,
+        .if_true = case_(a, empty(a), finish_body(in_range_bb, yield(a, (Yield) { .args = in_range_values }))),
+        .if_false = generate_default_fallback_case(ctx),
+    }));
+    return case_(a, empty(a), finish_body(bb, yield(a, (Yield) { .args = values })));
+}
+
 static const Node* process(Context* ctx, const Node* node) {
     IrArena* a = ctx->rewriter.dst_arena;
 
@@ -142,18 +239,42 @@ static const Node* process(Context* ctx, const Node* node) {
         case Match_TAG: {
             Nodes yield_types = rewrite_nodes(&ctx->rewriter, node->payload.match_instr.yield_types);
             Nodes literals = rewrite_nodes(&ctx->rewriter, node->payload.match_instr.literals);
-            Nodes cases = rewrite_nodes(&ctx->rewriter, node->payload.match_instr.cases);
+            // the same case may be used for several literals, rewriting it once per literal would hide that from bit tests
+            Nodes old_cases = node->payload.match_instr.cases;
+            LARRAY(const Node*, new_cases, old_cases.count);
+            for (size_t i = 0; i < old_cases.count; i++) {
+                new_cases[i] = NULL;
+                for (size_t j = 0; j < i && !new_cases[i]; j++)
+                    if (old_cases.nodes[j] == old_cases.nodes[i])
+                        new_cases[i] = new_cases[j];
+                if (!new_cases[i])
+                    new_cases[i] = rewrite_node(&ctx->rewriter, old_cases.nodes[i]);
+            }
+            Nodes cases = nodes(a, old_cases.count, new_cases);
 
             // TODO handle degenerate no-cases case ?
             // TODO or maybe do that in fold()
             assert(cases.count > 0);
 
+            LARRAY(MatchCase, sorted, literals.count);
+            for (size_t i = 0; i < literals.count; i++)
+                sorted[i] = (MatchCase) { .key = get_int_literal_value(*resolve_to_int_literal(literals.nodes[i]), false), .lam = cases.nodes[i] };
+            qsort(sorted, literals.count, sizeof(MatchCase), (int (*)(const void*, const void*)) compare_match_cases);
+
+            if (should_use_jump_table(ctx, sorted, literals.count)) {
+                debugv_print("lower_switch_btree: keeping a match with %d cases as a jump table\n", (int) literals.count);
+                return recreate_node_identity(&ctx->rewriter, node);
+            }
+
+            LARRAY(const Node*, bit_test_cases, MAX_BIT_TEST_CASES);
+            size_t bit_test_cases_count = get_bit_test_cases(sorted, literals.count, bit_test_cases);
+
             Arena* arena = new_arena();
             TreeNode* root = NULL;
-            for (size_t i = 0; i < literals.count; i++) {
+            for (size_t i = 0; i < literals.count && !bit_test_cases_count; i++) {
                 TreeNode* t = arena_alloc(arena, sizeof(TreeNode));
-                t->key = get_int_literal_value(*resolve_to_int_literal(literals.nodes[i]), false);
-                t->lam = cases.nodes[i];
+                t->key = sorted[i].key;
+                t->lam = sorted[i].lam;
                 root = insert(root, t);
             }
 
@@ -165,7 +286,8 @@ static const Node* process(Context* ctx, const Node* node) {
             ctx2.run_default_case = run_default_case;
             ctx2.yield_types = yield_types;
             ctx2.inspectee = rewrite_node(&ctx->rewriter, node->payload.match_instr.inspect);
-            Nodes matched_results = bind_instruction(bb, block(a, (Block) { .yield_types = add_qualifiers(a, ctx2.yield_types, false), .inside = generate_decision_tree(&ctx2, root, 0, UINT64_MAX) }));
+            const Node* decision = bit_test_cases_count ? generate_bit_tests(&ctx2, sorted, literals.count, bit_test_cases, bit_test_cases_count) : generate_decision_tree(&ctx2, root, 0, UINT64_MAX);
+            Nodes matched_results = bind_instruction(bb, block(a, (Block) { .yield_types = add_qualifiers(a, ctx2.yield_types, false), .inside = decision }));
 
             // Check if we need to run the default case
             Nodes final_results = bind_instruction(bb, if_instr(a, (If) {
@@ -186,13 +308,14 @@ static const Node* process(Context* ctx, const Node* node) {
     return recreate_node_identity(&ctx->rewriter, node);
 }
 
-Module* lower_switch_btree(SHADY_UNUSED const CompilerConfig* config, Module* src) {
+Module* lower_switch_btree(const CompilerConfig* config, Module* src) {
     ArenaConfig aconfig = get_arena_config(get_module_arena(src));
     IrArena* a = new_ir_arena(aconfig);
     Module* dst = new_module(a, get_module_name(src));
 
     Context ctx = {
         .rewriter = create_rewriter(src, dst, (RewriteNodeFn) process),
+        .config = config,
     };
     rewrite_module(&ctx.rewriter);
     destroy_rewriter(&ctx.rewriter);
@@ -203,8 +203,10 @@ static const Node* process(Context* ctx, const Node* old) {
             const Node* target = rewrite_node(&ctx->rewriter, old->payload.tail_call.target);
             target = gen_conversion(bb, uint32_type(a), target);
 
+            // no need to partition the subgroup when everyone agrees on the destination
+            String fork_fn = is_qualified_type_uniform(target->type) ? "builtin_fork_uniform" : "builtin_fork";
             const Node* fork_call = call(a, (Call) {
-                .callee = access_decl(&ctx->rewriter, "builtin_fork"),
+                .callee = access_decl(&ctx->rewriter, fork_fn),
                 .args = nodes(a, 1, (const Node*[]) { target })
             });
             bind_instruction(bb, fork_call);
@@ -277,9 +279,10 @@ void generate_top_level_dispatch_fn(Context* ctx) {
 
     BodyBuilder* loop_body_builder = begin_body(a);
 
-    const Node* next_function = gen_load(loop_body_builder, access_decl(&ctx->rewriter, "next_fn"));
+    // this picks the next branch if the last one ended in a join or a yield, so next_fn has to be read after
     const Node* get_active_branch_fn = access_decl(&ctx->rewriter, "builtin_get_active_branch");
     const Node* next_mask = first(bind_instruction(loop_body_builder, call(a, (Call) { .callee = get_active_branch_fn, .args = empty(a) })));
+    const Node* next_function = gen_load(loop_body_builder, access_decl(&ctx->rewriter, "next_fn"));
     const Node* local_id = gen_builtin_load(ctx->rewriter.dst_module, loop_body_builder, BuiltinSubgroupLocalInvocationId);
     const Node* should_run = gen_primop_e(loop_body_builder, mask_is_thread_active_op, empty(a), mk_nodes(a, next_mask, local_id));
 
@@ -0,0 +1,393 @@
+#include "passes.h"
+
+#include "portability.h"
+#include "list.h"
+#include "dict.h"
+#include "log.h"
+
+#include "../analysis/uses.h"
+#include "../analysis/callgraph.h"
+#include "../analysis/merge_points.h"
+
+#include "../transform/ir_gen_helpers.h"
+
+#include "../rewrite.h"
+#include "../type.h"
+
+KeyHash hash_node(const Node**);
+bool compare_node(const Node**, const Node**);
+
+/// Nothing has flowed into a pointer yet, it might still end up pointing anywhere.
+/// At the other end of the lattice, AsGeneric means it can point to different address spaces, or we can't tell where.
+#define AsUndecided NumAddressSpaces
+
+typedef struct {
+    Rewriter rewriter;
+    CallGraph* graph;
+    /// old Function -> UsesMap*
+    struct Dict* uses;
+    /// old case -> the old instruction of the Let it is the tail of
+    struct Dict* let_instructions;
+    /// old parameter -> AddressSpace, refined until a fixed point is reached
+    struct Dict* spaces;
+    /// old value -> AddressSpace, caches get_address_space during an iteration
+    struct Dict* memo;
+    /// old Function parameter -> the new parameter, now in a specific address space
+    struct Dict* specialised;
+} Context;
+
+static bool is_generic_ptr(const Node* value) {
+    return is_generic_ptr_type(get_unqualified_type(value->type));
+}
+
+/// The address spaces lower_generic_ptrs can tag, and so the only ones a generic pointer can come from
+static bool is_taggable(AddressSpace as) {
+    switch (as) {
+        case AsGlobalPhysical:
+        case AsSharedPhysical:
+        case AsSubgroupPhysical:
+        case AsPrivatePhysical: return true;
+        default: return false;
+    }
+}
+
+static AddressSpace join_address_spaces(AddressSpace a, AddressSpace b) {
+    if (a == AsUndecided)
+        return b;
+    if (b == AsUndecided || a == b)
+        return a;
+    return AsGeneric;
+}
+
+/// The instruction @p var is the only result of, if any
+static const Node* get_defining_instruction(Context* ctx, const Node* var) {
+    const Node* abs = var->payload.var.abs;
+    const Node** instruction = abs ? find_value_dict(const Node*, const Node*, ctx->let_instructions, abs) : NULL;
+    if (!instruction || get_abstraction_params(abs).count != 1)
+        return NULL;
+    return *instruction;
+}
+
+static AddressSpace get_address_space(Context* ctx, const Node* value);
+
+static AddressSpace get_instruction_address_space(Context* ctx, const Node* instruction) {
+    if (instruction->tag != PrimOp_TAG)
+        return AsGeneric;
+    PrimOp payload = instruction->payload.prim_op;
+    switch (payload.op) {
+        case convert_op: {
+            const Type* src_t = get_unqualified_type(first(payload.operands)->type);
+            if (src_t->tag != PtrType_TAG)
+                return AsGeneric;
+            if (is_generic_ptr_type(src_t))
+                return get_address_space(ctx, first(payload.operands));
+            return is_taggable(src_t->payload.ptr_type.address_space) ? src_t->payload.ptr_type.address_space : AsGeneric;
+        }
+        case quote_op:
+            if (payload.operands.count != 1)
+                return AsGeneric;
+            SHADY_FALLTHROUGH
+        case lea_op:
+        case reinterpret_op: {
+            const Node* src = first(payload.operands);
+            if (!is_generic_ptr(src))
+                return AsGeneric;
+            return get_address_space(ctx, src);
+        }
+        case select_op: return join_address_spaces(get_address_space(ctx, payload.operands.nodes[1]), get_address_space(ctx, payload.operands.nodes[2]));
+        default: return AsGeneric;
+    }
+}
+
+/// Optimistic view of where the generic pointer @p value points: parameters are assumed to point to whatever
+/// is passed to them so far, and everything derived from a pointer points to the same address space.
+static AddressSpace get_address_space(Context* ctx, const Node* value) {
+    switch (value->tag) {
+        case NullPtr_TAG:
+        case Undef_TAG: return AsUndecided;
+        // lower_generic_globals puts those in global memory
+        case RefDecl_TAG: return value->payload.ref_decl.decl->tag == GlobalVariable_TAG ? AsGlobalPhysical : AsGeneric;
+        case Variable_TAG: break;
+        default: return AsGeneric;
+    }
+
+    AddressSpace* found = find_value_dict(const Node*, AddressSpace, ctx->spaces, value);
+    if (found)
+        return *found;
+    found = find_value_dict(const Node*, AddressSpace, ctx->memo, value);
+    if (found)
+        return *found;
+    // breaks cycles going through instructions, those can only be closed by a parameter which we track anyways
+    AddressSpace as = AsGeneric;
+    insert_dict(const Node*, AddressSpace, ctx->memo, value, as);
+    const Node* instruction = get_defining_instruction(ctx, value);
+    if (instruction)
+        as = get_instruction_address_space(ctx, instruction);
+    insert_dict(const Node*, AddressSpace, ctx->memo, value, as);
+    return as;
+}
+
+/// Joins what every predecessor of @p merge passes for its parameter @p i
+static AddressSpace get_incoming_address_space(Context* ctx, const MergePoint* merge, size_t i) {
+    struct List* values = new_list(const Node*);
+    // anything coming from somewhere we can't see might be pointing anywhere
+    AddressSpace as = get_incoming_values(ctx->graph, ctx->uses, merge, i, values) ? AsUndecided : AsGeneric;
+    for (size_t j = 0; j < entries_count_list(values); j++)
+        as = join_address_spaces(as, get_address_space(ctx, read_list(const Node*, values)[j]));
+    destroy_list(values);
+    return as;
+}
+
+/// Generic pointer parameters start out undecided
+static void track_params(Context* ctx, const MergePoint* merge) {
+    AddressSpace undecided = AsUndecided;
+    Nodes params = get_abstraction_params(merge->abs);
+    for (size_t i = 0; i < params.count; i++) {
+        if (is_generic_ptr(params.nodes[i]))
+            insert_dict(const Node*, AddressSpace, ctx->spaces, params.nodes[i], undecided);
+    }
+}
+
+static void analyse_module(Context* ctx, Module* m) {
+    struct List* merges = new_list(MergePoint);
+    Nodes decls = get_module_declarations(m);
+    for (size_t i = 0; i < decls.count; i++) {
+        if (decls.nodes[i]->tag == Function_TAG && get_abstraction_body(decls.nodes[i]))
+            find_merge_points(ctx->graph, ctx->uses, ctx->let_instructions, merges, decls.nodes[i]);
+    }
+    for (size_t i = 0; i < entries_count_list(merges); i++)
+        track_params(ctx, &read_list(MergePoint, merges)[i]);
+
+    // address spaces only ever go up the lattice, so this terminates
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        clear_dict(ctx->memo);
+        for (size_t i = 0; i < entries_count_list(merges); i++) {
+            MergePoint* merge = &read_list(MergePoint, merges)[i];
+            Nodes params = get_abstraction_params(merge->abs);
+            for (size_t j = 0; j < params.count; j++) {
+                AddressSpace* as = find_value_dict(const Node*, AddressSpace, ctx->spaces, params.nodes[j]);
+                if (!as)
+                    continue;
+                AddressSpace joined = join_address_spaces(*as, get_incoming_address_space(ctx, merge, j));
+                if (joined != *as) {
+                    *as = joined;
+                    changed = true;
+                }
+            }
+        }
+    }
+    clear_dict(ctx->memo);
+    destroy_list(merges);
+}
+
+/// The address space the generic pointer @p value is known to point to, or AsGeneric
+static AddressSpace get_known_address_space(Context* ctx, const Node* value) {
+    if (!is_generic_ptr(value))
+        return AsGeneric;
+    AddressSpace as = get_address_space(ctx, value);
+    return is_taggable(as) ? as : AsGeneric;
+}
+
+/// Recomputes the generic pointer @p old as a pointer into @p as, retracing how it was derived when we can
+static const Node* rebase_ptr(Context* ctx, BodyBuilder* bb, const Node* old, AddressSpace as) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    const Type* old_t = get_unqualified_type(old->type);
+    const Type* nptr_t = ptr_type(a, (PtrType) { .address_space = as, .pointed_type = rewrite_node(&ctx->rewriter, old_t->payload.ptr_type.pointed_type) });
+    switch (old->tag) {
+        case NullPtr_TAG: return null_ptr(a, (NullPtr) { .ptr_type = nptr_t });
+        case Variable_TAG: {
+            const Node** found = find_value_dict(const Node*, const Node*, ctx->specialised, old);
+            if (found)
+                return *found;
+            const Node* instruction = get_defining_instruction(ctx, old);
+            if (!instruction || instruction->tag != PrimOp_TAG)
+                break;
+            PrimOp payload = instruction->payload.prim_op;
+            const Node* src = payload.operands.count > 0 ? first(payload.operands) : NULL;
+            switch (payload.op) {
+                case convert_op: {
+                    const Type* src_t = get_unqualified_type(src->type);
+                    if (src_t->tag == PtrType_TAG && src_t->payload.ptr_type.address_space == as)
+                        return rewrite_node(&ctx->rewriter, src);
+                    break;
+                }
+                case quote_op: {
+                    if (payload.operands.count == 1 && is_generic_ptr(src))
+                        return rebase_ptr(ctx, bb, src, as);
+                    break;
+                }
+                case lea_op: {
+                    Nodes operands = rewrite_nodes(&ctx->rewriter, payload.operands);
+                    operands = change_node_at_index(a, operands, 0, rebase_ptr(ctx, bb, src, as));
+                    return gen_primop_e(bb, lea_op, empty(a), operands);
+                }
+                case reinterpret_op: {
+                    if (is_generic_ptr(src))
+                        return gen_reinterpret_cast(bb, nptr_t, rebase_ptr(ctx, bb, src, as));
+                    break;
+                }
+                default: break;
+            }
+            break;
+        }
+        default: break;
+    }
+    // we lost track of how it was made, so we have to strip the tag off instead
+    return gen_primop_e(bb, convert_op, singleton(nptr_t), singleton(rewrite_node(&ctx->rewriter, old)));
+}
+
+static bool is_address_operand(Op op, size_t i) {
+    switch (op) {
+        case load_op:
+        case store_op:
+        case memset_op: return i == 0;
+        case memcpy_op: return i <= 1;
+        default: return false;
+    }
+}
+
+static bool has_specialised_params(Context* ctx, const Node* fn) {
+    Nodes params = get_abstraction_params(fn);
+    for (size_t i = 0; i < params.count; i++)
+        if (is_generic_ptr(params.nodes[i]) && find_key_dict(const Node*, ctx->spaces, params.nodes[i]) && get_known_address_space(ctx, params.nodes[i]) != AsGeneric)
+            return true;
+    return false;
+}
+
+/// Rewrites call arguments so they match the parameters of the callee, if we specialised them
+static Nodes rebase_call_args(Context* ctx, BodyBuilder* bb, const Node* callee, Nodes oargs) {
+    if (callee->tag != FnAddr_TAG || !has_specialised_params(ctx, callee->payload.fn_addr.fn))
+        return rewrite_nodes(&ctx->rewriter, oargs);
+    Nodes oparams = get_abstraction_params(callee->payload.fn_addr.fn);
+    LARRAY(const Node*, nargs, oargs.count);
+    for (size_t i = 0; i < oargs.count; i++) {
+        AddressSpace as = find_key_dict(const Node*, ctx->spaces, oparams.nodes[i]) ? get_known_address_space(ctx, oparams.nodes[i]) : AsGeneric;
+        nargs[i] = as != AsGeneric ? rebase_ptr(ctx, bb, oargs.nodes[i], as) : rewrite_node(&ctx->rewriter, oargs.nodes[i]);
+    }
+    return nodes(ctx->rewriter.dst_arena, oargs.count, nargs);
+}
+
+static const Node* process_let(Context* ctx, const Node* old) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    const Node* oinstruction = get_let_instruction(old);
+    switch (oinstruction->tag) {
+        case PrimOp_TAG: {
+            PrimOp payload = oinstruction->payload.prim_op;
+            bool rebased = false;
+            BodyBuilder* bb = begin_body(a);
+            LARRAY(const Node*, noperands, payload.operands.count);
+            for (size_t i = 0; i < payload.operands.count; i++) {
+                const Node* operand = payload.operands.nodes[i];
+                AddressSpace as = is_address_operand(payload.op, i) ? get_known_address_space(ctx, operand) : AsGeneric;
+                if (as != AsGeneric) {
+                    noperands[i] = rebase_ptr(ctx, bb, operand, as);
+                    rebased = true;
+                } else
+                    noperands[i] = rewrite_node(&ctx->rewriter, operand);
+            }
+            if (!rebased) {
+                cancel_body(bb);
+                return NULL;
+            }
+            const Node* ninstruction = prim_op(a, (PrimOp) {
+                .op = payload.op,
+                .type_arguments = rewrite_nodes(&ctx->rewriter, payload.type_arguments),
+                .operands = nodes(a, payload.operands.count, noperands),
+            });
+            return finish_body(bb, let(a, ninstruction, rewrite_node(&ctx->rewriter, get_let_tail(old))));
+        }
+        case Call_TAG: {
+            Call payload = oinstruction->payload.call;
+            if (payload.callee->tag != FnAddr_TAG || !has_specialised_params(ctx, payload.callee->payload.fn_addr.fn))
+                return NULL;
+            BodyBuilder* bb = begin_body(a);
+            const Node* ncall = call(a, (Call) {
+                .callee = rewrite_node(&ctx->rewriter, payload.callee),
+                .args = rebase_call_args(ctx, bb, payload.callee, payload.args),
+            });
+            return finish_body(bb, let(a, ncall, rewrite_node(&ctx->rewriter, get_let_tail(old))));
+        }
+        default: return NULL;
+    }
+}
+
+static const Node* process(Context* ctx, const Node* old) {
+    const Node* found = search_processed(&ctx->rewriter, old);
+    if (found) return found;
+
+    IrArena* a = ctx->rewriter.dst_arena;
+    switch (old->tag) {
+        case Function_TAG: {
+            if (!get_abstraction_body(old) || !has_specialised_params(ctx, old))
+                break;
+            Nodes oparams = get_abstraction_params(old);
+            LARRAY(const Node*, nparams, oparams.count);
+            BodyBuilder* bb = begin_body(a);
+            for (size_t i = 0; i < oparams.count; i++) {
+                const Node* oparam = oparams.nodes[i];
+                AddressSpace as = find_key_dict(const Node*, ctx->spaces, oparam) ? get_known_address_space(ctx, oparam) : AsGeneric;
+                if (as == AsGeneric) {
+                    nparams[i] = recreate_variable(&ctx->rewriter, oparam);
+                    register_processed(&ctx->rewriter, oparam, nparams[i]);
+                    continue;
+                }
+                const Type* generic_t = rewrite_node(&ctx->rewriter, get_unqualified_type(oparam->type));
+                const Type* nptr_t = ptr_type(a, (PtrType) { .address_space = as, .pointed_type = generic_t->payload.ptr_type.pointed_type });
+                nparams[i] = var(a, qualified_type_helper(nptr_t, is_qualified_type_uniform(oparam->type)), get_value_name(oparam));
+                insert_dict(const Node*, const Node*, ctx->specialised, oparam, nparams[i]);
+                // the body still sees a generic pointer, rebase_ptr looks through this so it goes away when every access was rebased
+                register_processed(&ctx->rewriter, oparam, gen_primop_e(bb, convert_op, singleton(generic_t), singleton(nparams[i])));
+                debugv_print("opt_address_spaces: parameter %s of %s points to %s\n", get_value_name_safe(oparam), get_abstraction_name(old), get_address_space_name(as));
+            }
+            Node* new = function(ctx->rewriter.dst_module, nodes(a, oparams.count, nparams), get_abstraction_name(old), rewrite_nodes(&ctx->rewriter, old->payload.fun.annotations), rewrite_nodes(&ctx->rewriter, old->payload.fun.return_types));
+            register_processed(&ctx->rewriter, old, new);
+            new->payload.fun.body = finish_body(bb, rewrite_node(&ctx->rewriter, get_abstraction_body(old)));
+            return new;
+        }
+        case Let_TAG: {
+            const Node* new = process_let(ctx, old);
+            if (new)
+                return new;
+            break;
+        }
+        case TailCall_TAG: {
+            const Node* target = old->payload.tail_call.target;
+            if (target->tag != FnAddr_TAG || !has_specialised_params(ctx, target->payload.fn_addr.fn))
+                break;
+            BodyBuilder* bb = begin_body(a);
+            Nodes args = rebase_call_args(ctx, bb, target, old->payload.tail_call.args);
+            return finish_body(bb, tail_call(a, (TailCall) { .target = rewrite_node(&ctx->rewriter, target), .args = args }));
+        }
+        default: break;
+    }
+    return recreate_node_identity(&ctx->rewriter, old);
+}
+
+Module* opt_address_spaces(SHADY_UNUSED const CompilerConfig* config, Module* src) {
+    ArenaConfig aconfig = get_arena_config(get_module_arena(src));
+    IrArena* a = new_ir_arena(aconfig);
+    Module* dst = new_module(a, get_module_name(src));
+    Context ctx = {
+        .rewriter = create_rewriter(src, dst, (RewriteNodeFn) process),
+        .graph = new_callgraph(src),
+        .uses = new_uses_cache(),
+        .let_instructions = new_dict(const Node*, const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+        .spaces = new_dict(const Node*, AddressSpace, (HashFn) hash_node, (CmpFn) compare_node),
+        .memo = new_dict(const Node*, AddressSpace, (HashFn) hash_node, (CmpFn) compare_node),
+        .specialised = new_dict(const Node*, const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+    };
+
+    analyse_module(&ctx, src);
+    rewrite_module(&ctx.rewriter);
+    destroy_rewriter(&ctx.rewriter);
+
+    destroy_uses_cache(ctx.uses);
+    destroy_dict(ctx.let_instructions);
+    destroy_dict(ctx.spaces);
+    destroy_dict(ctx.memo);
+    destroy_dict(ctx.specialised);
+    destroy_callgraph(ctx.graph);
+    return dst;
+}
@@ -0,0 +1,374 @@
+#include "passes.h"
+
+#include "portability.h"
+#include "list.h"
+#include "dict.h"
+#include "log.h"
+
+#include "../analysis/uses.h"
+#include "../analysis/callgraph.h"
+#include "../analysis/merge_points.h"
+
+#include "../transform/ir_gen_helpers.h"
+
+#include "../rewrite.h"
+#include "../type.h"
+
+/// indirect calls with up to this many possible callees get an inline dispatch, more than that and we give up tracking them
+#define MAX_DISPATCH_TARGETS 4
+
+KeyHash hash_node(const Node**);
+bool compare_node(const Node**, const Node**);
+
+/// The functions a pointer might be the address of
+typedef struct {
+    /// set when we can't tell where this could point
+    bool unknown;
+    /// old Functions
+    Nodes fns;
+} Targets;
+
+typedef struct {
+    Rewriter rewriter;
+    CallGraph* graph;
+    /// old Function -> UsesMap*
+    struct Dict* uses;
+    /// old case -> the old instruction of the Let it is the tail of
+    struct Dict* let_instructions;
+    /// set of old GlobalVariables that are initialised to a function address and never written to
+    struct Dict* read_only_globals;
+    /// old parameter -> Targets, refined until a fixed point is reached
+    struct Dict* targets;
+    Node* fn;
+} Context;
+
+static bool is_fn_ptr_type(const Type* t) {
+    t = get_unqualified_type(t);
+    return t->tag == PtrType_TAG && t->payload.ptr_type.pointed_type->tag == FnType_TAG;
+}
+
+static Targets unknown_targets() {
+    return (Targets) { .unknown = true };
+}
+
+static Targets get_targets(Context* ctx, const Node* value) {
+    if (value->tag == FnAddr_TAG)
+        return (Targets) { .fns = singleton(value->payload.fn_addr.fn) };
+    if (value->tag != Variable_TAG)
+        return unknown_targets();
+
+    Targets* found = find_value_dict(const Node*, Targets, ctx->targets, value);
+    if (found)
+        return *found;
+
+    // a load from a global that still holds its initial function address
+    const Node* abs = value->payload.var.abs;
+    const Node** instruction = abs ? find_value_dict(const Node*, const Node*, ctx->let_instructions, abs) : NULL;
+    if (instruction && (*instruction)->tag == PrimOp_TAG && (*instruction)->payload.prim_op.op == load_op) {
+        const Node* ptr = first((*instruction)->payload.prim_op.operands);
+        if (ptr->tag == RefDecl_TAG && find_key_dict(const Node*, ctx->read_only_globals, ptr->payload.ref_decl.decl))
+            return get_targets(ctx, ptr->payload.ref_decl.decl->payload.global_variable.init);
+    }
+    return unknown_targets();
+}
+
+/// Adds the targets of @p value to @p acc, returns true if it changed
+static bool merge_targets(Context* ctx, Targets* acc, const Node* value) {
+    if (acc->unknown)
+        return false;
+    Targets t = get_targets(ctx, value);
+    if (t.unknown) {
+        *acc = unknown_targets();
+        return true;
+    }
+    bool changed = false;
+    for (size_t i = 0; i < t.fns.count; i++) {
+        const Node* fn = t.fns.nodes[i];
+        bool present = false;
+        for (size_t j = 0; j < acc->fns.count; j++)
+            present |= acc->fns.nodes[j] == fn;
+        if (present)
+            continue;
+        if (acc->fns.count == MAX_DISPATCH_TARGETS) {
+            *acc = unknown_targets();
+            return true;
+        }
+        acc->fns = append_nodes(fn->arena, acc->fns, fn);
+        changed = true;
+    }
+    return changed;
+}
+
+/// Merges what every predecessor of @p merge passes for its parameter @p i into @p acc
+static bool merge_incoming_targets(Context* ctx, const MergePoint* merge, size_t i, Targets* acc) {
+    struct List* values = new_list(const Node*);
+    bool changed = false;
+    if (get_incoming_values(ctx->graph, ctx->uses, merge, i, values)) {
+        for (size_t j = 0; j < entries_count_list(values); j++)
+            changed |= merge_targets(ctx, acc, read_list(const Node*, values)[j]);
+    } else if (!acc->unknown) {
+        *acc = unknown_targets();
+        changed = true;
+    }
+    destroy_list(values);
+    return changed;
+}
+
+/// Function pointer parameters start out pointing nowhere
+static void track_params(Context* ctx, const MergePoint* merge) {
+    Nodes params = get_abstraction_params(merge->abs);
+    for (size_t i = 0; i < params.count; i++) {
+        if (!is_fn_ptr_type(params.nodes[i]->type))
+            continue;
+        Targets bottom = { .fns = empty(merge->abs->arena) };
+        insert_dict(const Node*, Targets, ctx->targets, params.nodes[i], bottom);
+    }
+}
+
+static bool is_only_loaded_from(Context* ctx, Nodes functions, const Node* global) {
+    const Node* ref = ref_decl_helper(global->arena, global);
+    for (size_t i = 0; i < functions.count; i++) {
+        const UsesMap* uses = get_function_uses(ctx->uses, functions.nodes[i]);
+        for (const Use* use = get_first_use(uses, ref); use; use = use->next_use) {
+            if (use->user->tag != PrimOp_TAG || use->user->payload.prim_op.op != load_op)
+                return false;
+        }
+    }
+    return true;
+}
+
+static void analyse_module(Context* ctx, Module* m) {
+    Nodes decls = get_module_declarations(m);
+    LARRAY(const Node*, functions, decls.count);
+    size_t functions_count = 0;
+    for (size_t i = 0; i < decls.count; i++) {
+        if (decls.nodes[i]->tag == Function_TAG && get_abstraction_body(decls.nodes[i]))
+            functions[functions_count++] = decls.nodes[i];
+    }
+    Nodes fns = nodes(get_module_arena(m), functions_count, functions);
+
+    for (size_t i = 0; i < decls.count; i++) {
+        const Node* decl = decls.nodes[i];
+        if (decl->tag != GlobalVariable_TAG || !decl->payload.global_variable.init || decl->payload.global_variable.init->tag != FnAddr_TAG)
+            continue;
+        if (is_only_loaded_from(ctx, fns, decl))
+            insert_set_get_result(const Node*, ctx->read_only_globals, decl);
+    }
+
+    struct List* merges = new_list(MergePoint);
+    for (size_t i = 0; i < fns.count; i++)
+        find_merge_points(ctx->graph, ctx->uses, ctx->let_instructions, merges, fns.nodes[i]);
+    for (size_t i = 0; i < entries_count_list(merges); i++)
+        track_params(ctx, &read_list(MergePoint, merges)[i]);
+
+    // targets only ever grow, and are capped, so this terminates
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i = 0; i < entries_count_list(merges); i++) {
+            MergePoint* merge = &read_list(MergePoint, merges)[i];
+            Nodes params = get_abstraction_params(merge->abs);
+            for (size_t j = 0; j < params.count; j++) {
+                Targets* t = find_value_dict(const Node*, Targets, ctx->targets, params.nodes[j]);
+                if (t)
+                    changed |= merge_incoming_targets(ctx, merge, j, t);
+            }
+        }
+    }
+    destroy_list(merges);
+}
+
+/// Returns the possible callees of @p callee, if there are any and they all agree with its type
+static bool get_known_callees(Context* ctx, const Node* callee, Nodes* fns) {
+    if (callee->tag == FnAddr_TAG)
+        return false;
+    Targets t = get_targets(ctx, callee);
+    if (t.unknown || t.fns.count == 0)
+        return false;
+    const Type* callee_type = get_unqualified_type(callee->type);
+    for (size_t i = 0; i < t.fns.count; i++) {
+        if (get_unqualified_type(fn_addr_helper(callee->arena, t.fns.nodes[i])->type) != callee_type)
+            return false;
+    }
+    *fns = t.fns;
+    return true;
+}
+
+static const Node* get_monomorphic_value(Context* ctx, const Node* param) {
+    Targets* t = find_value_dict(const Node*, Targets, ctx->targets, param);
+    if (!t || t->unknown || t->fns.count != 1)
+        return NULL;
+    return fn_addr_helper(ctx->rewriter.dst_arena, rewrite_node(&ctx->rewriter, first(t->fns)));
+}
+
+/// Builds a chain of comparisons against all @p fns but the last one, which is what's left when they all fail
+static const Node* gen_dispatch(Context* ctx, const Node* callee, Nodes fns, const Node* (*gen_call)(Context*, const Node* fn, const void*), const void* uptr) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    const Node* terminator = gen_call(ctx, fn_addr_helper(a, rewrite_node(&ctx->rewriter, fns.nodes[fns.count - 1])), uptr);
+    for (size_t i = fns.count - 1; i > 0; i--) {
+        Node* fallback = basic_block(a, ctx->fn, empty(a), unique_name(a, "devirt_next"));
+        fallback->payload.basic_block.body = terminator;
+
+        const Node* target = fn_addr_helper(a, rewrite_node(&ctx->rewriter, fns.nodes[i - 1]));
+        Node* direct = basic_block(a, ctx->fn, empty(a), unique_name(a, "devirt_call"));
+        direct->payload.basic_block.body = gen_call(ctx, target, uptr);
+
+        BodyBuilder* bb = begin_body(a);
+        const Node* is_target = gen_primop_e(bb, eq_op, empty(a), mk_nodes(a, callee, target));
+        terminator = finish_body(bb, branch(a, (Branch) {
+            .branch_condition = is_target,
+            .true_jump = jump_helper(a, direct, empty(a)),
+            .false_jump = jump_helper(a, fallback, empty(a)),
+        }));
+    }
+    return terminator;
+}
+
+typedef struct {
+    Nodes args;
+    const Node* jp;
+} DispatchedCall;
+
+static const Node* gen_dispatched_call(Context* ctx, const Node* fn, const DispatchedCall* c) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    BodyBuilder* bb = begin_body(a);
+    Nodes results = bind_instruction(bb, call(a, (Call) { .callee = fn, .args = c->args }));
+    return finish_body(bb, join(a, (Join) { .join_point = c->jp, .args = results }));
+}
+
+static const Node* gen_dispatched_tail_call(Context* ctx, const Node* fn, const Nodes* args) {
+    return tail_call(ctx->rewriter.dst_arena, (TailCall) { .target = fn, .args = *args });
+}
+
+static const Node* process_let(Context* ctx, const Node* old) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    const Node* oinstruction = get_let_instruction(old);
+    if (oinstruction->tag != Call_TAG)
+        return NULL;
+    Call payload = oinstruction->payload.call;
+    Nodes fns;
+    if (!get_known_callees(ctx, payload.callee, &fns))
+        return NULL;
+
+    Nodes args = rewrite_nodes(&ctx->rewriter, payload.args);
+    if (fns.count == 1) {
+        debugv_print("opt_devirtualize: call to %s is now direct\n", get_abstraction_name(first(fns)));
+        const Node* ncall = call(a, (Call) { .callee = fn_addr_helper(a, rewrite_node(&ctx->rewriter, first(fns))), .args = args });
+        return let(a, ncall, rewrite_node(&ctx->rewriter, get_let_tail(old)));
+    }
+
+    // the control only yields varying values
+    Nodes return_types = get_unqualified_type(payload.callee->type)->payload.ptr_type.pointed_type->payload.fn_type.return_types;
+    for (size_t i = 0; i < return_types.count; i++)
+        if (is_qualified_type_uniform(return_types.nodes[i]))
+            return NULL;
+    Nodes yield_types = strip_qualifiers(a, rewrite_nodes(&ctx->rewriter, return_types));
+    const Node* jp = var(a, qualified_type_helper(join_point_type(a, (JoinPointType) { .yield_types = yield_types }), false), "devirt_join");
+    DispatchedCall c = { .args = args, .jp = jp };
+    const Node* dispatch = gen_dispatch(ctx, rewrite_node(&ctx->rewriter, payload.callee), fns, (const Node* (*)(Context*, const Node*, const void*)) gen_dispatched_call, &c);
+    const Node* ncontrol = control(a, (Control) { .yield_types = yield_types, .inside = case_(a, singleton(jp), dispatch) });
+    return let(a, ncontrol, rewrite_node(&ctx->rewriter, get_let_tail(old)));
+}
+
+static const Node* process(Context* ctx, const Node* old) {
+    const Node* found = search_processed(&ctx->rewriter, old);
+    if (found) return found;
+
+    IrArena* a = ctx->rewriter.dst_arena;
+    switch (old->tag) {
+        case Function_TAG: {
+            Node* new = recreate_decl_header_identity(&ctx->rewriter, old);
+            Context fn_ctx = *ctx;
+            fn_ctx.fn = new;
+            Nodes params = get_abstraction_params(old);
+            for (size_t i = 0; i < params.count; i++) {
+                // the parameter becomes dead, and opt_ipo can then remove it
+                const Node* value = get_monomorphic_value(ctx, params.nodes[i]);
+                if (!value)
+                    continue;
+                remove_dict(const Node*, ctx->rewriter.map, params.nodes[i]);
+                register_processed(&ctx->rewriter, params.nodes[i], value);
+            }
+            new->payload.fun.body = rewrite_node(&fn_ctx.rewriter, get_abstraction_body(old));
+            return new;
+        }
+        case BasicBlock_TAG: {
+            Nodes oparams = get_abstraction_params(old);
+            LARRAY(const Node*, nparams, oparams.count);
+            size_t count = 0;
+            for (size_t i = 0; i < oparams.count; i++) {
+                const Node* value = get_monomorphic_value(ctx, oparams.nodes[i]);
+                if (!value) {
+                    value = recreate_variable(&ctx->rewriter, oparams.nodes[i]);
+                    nparams[count++] = value;
+                }
+                register_processed(&ctx->rewriter, oparams.nodes[i], value);
+            }
+            Node* bb = basic_block(a, ctx->fn, nodes(a, count, nparams), old->payload.basic_block.name);
+            register_processed(&ctx->rewriter, old, bb);
+            bb->payload.basic_block.body = rewrite_node(&ctx->rewriter, get_abstraction_body(old));
+            return bb;
+        }
+        case Jump_TAG: {
+            const Node* target = old->payload.jump.target;
+            Nodes oparams = get_abstraction_params(target);
+            Nodes oargs = old->payload.jump.args;
+            LARRAY(const Node*, nargs, oargs.count);
+            size_t count = 0;
+            for (size_t i = 0; i < oargs.count; i++) {
+                if (!get_monomorphic_value(ctx, oparams.nodes[i]))
+                    nargs[count++] = rewrite_node(&ctx->rewriter, oargs.nodes[i]);
+            }
+            return jump_helper(a, rewrite_node(&ctx->rewriter, target), nodes(a, count, nargs));
+        }
+        case Case_TAG: {
+            Nodes oparams = get_abstraction_params(old);
+            Nodes nparams = recreate_variables(&ctx->rewriter, oparams);
+            for (size_t i = 0; i < oparams.count; i++) {
+                const Node* value = get_monomorphic_value(ctx, oparams.nodes[i]);
+                register_processed(&ctx->rewriter, oparams.nodes[i], value ? value : nparams.nodes[i]);
+            }
+            return case_(a, nparams, rewrite_node(&ctx->rewriter, get_abstraction_body(old)));
+        }
+        case Let_TAG: {
+            const Node* new = ctx->fn ? process_let(ctx, old) : NULL;
+            if (new)
+                return new;
+            break;
+        }
+        case TailCall_TAG: {
+            Nodes fns;
+            if (!ctx->fn || !get_known_callees(ctx, old->payload.tail_call.target, &fns))
+                break;
+            Nodes args = rewrite_nodes(&ctx->rewriter, old->payload.tail_call.args);
+            return gen_dispatch(ctx, rewrite_node(&ctx->rewriter, old->payload.tail_call.target), fns, (const Node* (*)(Context*, const Node*, const void*)) gen_dispatched_tail_call, &args);
+        }
+        default: break;
+    }
+    return recreate_node_identity(&ctx->rewriter, old);
+}
+
+Module* opt_devirtualize(SHADY_UNUSED const CompilerConfig* config, Module* src) {
+    ArenaConfig aconfig = get_arena_config(get_module_arena(src));
+    IrArena* a = new_ir_arena(aconfig);
+    Module* dst = new_module(a, get_module_name(src));
+    Context ctx = {
+        .rewriter = create_rewriter(src, dst, (RewriteNodeFn) process),
+        .graph = new_callgraph(src),
+        .uses = new_uses_cache(),
+        .let_instructions = new_dict(const Node*, const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+        .read_only_globals = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+        .targets = new_dict(const Node*, Targets, (HashFn) hash_node, (CmpFn) compare_node),
+    };
+
+    analyse_module(&ctx, src);
+    rewrite_module(&ctx.rewriter);
+    destroy_rewriter(&ctx.rewriter);
+
+    destroy_uses_cache(ctx.uses);
+    destroy_dict(ctx.let_instructions);
+    destroy_dict(ctx.read_only_globals);
+    destroy_dict(ctx.targets);
+    destroy_callgraph(ctx.graph);
+    return dst;
+}
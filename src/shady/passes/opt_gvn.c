@@ -0,0 +1,147 @@
+#include "passes.h"
+
+#include "portability.h"
+#include "dict.h"
+#include "arena.h"
+#include "log.h"
+
+#include "../analysis/scope.h"
+
+#include "../rewrite.h"
+
+KeyHash hash_node(const Node**);
+bool compare_node(const Node**, const Node**);
+
+typedef struct AvailableValue_ AvailableValue;
+struct AvailableValue_ {
+    /// where the results become visible, i.e. the tail of the let that computed them
+    const CFNode* where;
+    Nodes results;
+    AvailableValue* next;
+};
+
+typedef struct {
+    Rewriter rewriter;
+    Scope* scope;
+    const Node* abs;
+    /// rewritten instruction -> AvailableValue*
+    struct Dict* available;
+    Arena* a;
+} Context;
+
+/// Pure instructions whose value only depends on their operands. Since the destination arena hash-conses them,
+/// two such instructions compute the same value if and only if they are the same node once rewritten.
+static bool is_value_numbered(const Node* instruction) {
+    if (instruction->tag != PrimOp_TAG)
+        return false;
+    Op op = instruction->payload.prim_op.op;
+    if (has_primop_got_side_effects(op) || op == quote_op)
+        return false;
+    // the stack pointer is mutable state, and subgroup operations depend on which invocations are active
+    if (get_primop_class(op) & (OcStack | OcSubgroup_intrinsic))
+        return false;
+    return true;
+}
+
+static const AvailableValue* find_available_value(Context* ctx, const Node* instruction, const CFNode* where) {
+    AvailableValue** found = find_value_dict(const Node*, AvailableValue*, ctx->available, instruction);
+    for (const AvailableValue* v = found ? *found : NULL; v; v = v->next) {
+        if (cfnode_dominates(v->where, where))
+            return v;
+    }
+    return NULL;
+}
+
+static void add_available_value(Context* ctx, const Node* instruction, const CFNode* where, Nodes results) {
+    AvailableValue* v = arena_alloc(ctx->a, sizeof(AvailableValue));
+    *v = (AvailableValue) { .where = where, .results = results, .next = NULL };
+    AvailableValue** found = find_value_dict(const Node*, AvailableValue*, ctx->available, instruction);
+    if (found) {
+        v->next = *found;
+        *found = v;
+    } else
+        insert_dict(const Node*, AvailableValue*, ctx->available, instruction, v);
+}
+
+static const CFNode* find_cfnode(Context* ctx, const Node* abs) {
+    CFNode** found = find_value_dict(const Node*, CFNode*, ctx->scope->map, abs);
+    return found ? *found : NULL;
+}
+
+static const Node* process(Context* ctx, const Node* old) {
+    Context fn_ctx = *ctx;
+    if (old->tag == Function_TAG) {
+        ctx = &fn_ctx;
+        fn_ctx.scope = new_scope(old);
+        fn_ctx.abs = old;
+        fn_ctx.available = new_dict(const Node*, AvailableValue*, (HashFn) hash_node, (CmpFn) compare_node);
+        fn_ctx.a = new_arena();
+        const Node* new_fn = recreate_node_identity(&fn_ctx.rewriter, old);
+        destroy_dict(fn_ctx.available);
+        destroy_arena(fn_ctx.a);
+        destroy_scope(fn_ctx.scope);
+        return new_fn;
+    } else if (is_abstraction(old)) {
+        fn_ctx.abs = old;
+        ctx = &fn_ctx;
+    }
+
+    if (!ctx->scope)
+        return recreate_node_identity(&ctx->rewriter, old);
+
+    IrArena* a = ctx->rewriter.dst_arena;
+
+    switch (old->tag) {
+        case Let_TAG: {
+            const Node* oinstruction = get_let_instruction(old);
+            if (!is_value_numbered(oinstruction))
+                break;
+            const Node* ninstruction = rewrite_node(&ctx->rewriter, oinstruction);
+            // folding might have turned it into something else
+            if (!is_value_numbered(ninstruction))
+                break;
+
+            const Node* otail = get_let_tail(old);
+            const CFNode* where = find_cfnode(ctx, ctx->abs);
+            const CFNode* tail_where = find_cfnode(ctx, otail);
+            if (!where || !tail_where)
+                break;
+
+            Context tail_ctx = *ctx;
+            tail_ctx.abs = otail;
+
+            Nodes oparams = get_abstraction_params(otail);
+            const AvailableValue* existing = find_available_value(ctx, ninstruction, where);
+            if (existing && existing->results.count == oparams.count) {
+                debugv_print("opt_gvn: reusing the results of a dominating ");
+                log_node(DEBUGV, ninstruction);
+                debugv_print(".\n");
+                register_processed_list(&ctx->rewriter, oparams, existing->results);
+                return rewrite_node(&tail_ctx.rewriter, get_abstraction_body(otail));
+            }
+
+            // the results need to be known before we carry on rewriting the tail
+            Nodes nparams = recreate_variables(&ctx->rewriter, oparams);
+            register_processed_list(&ctx->rewriter, oparams, nparams);
+            add_available_value(ctx, ninstruction, tail_where, nparams);
+
+            const Node* nbody = rewrite_node(&tail_ctx.rewriter, get_abstraction_body(otail));
+            return let(a, ninstruction, case_(a, nparams, nbody));
+        }
+        default: break;
+    }
+
+    return recreate_node_identity(&ctx->rewriter, old);
+}
+
+Module* opt_gvn(SHADY_UNUSED const CompilerConfig* config, Module* src) {
+    ArenaConfig aconfig = get_arena_config(get_module_arena(src));
+    IrArena* a = new_ir_arena(aconfig);
+    Module* dst = new_module(a, get_module_name(src));
+    Context ctx = {
+        .rewriter = create_rewriter(src, dst, (RewriteNodeFn) process),
+    };
+    rewrite_module(&ctx.rewriter);
+    destroy_rewriter(&ctx.rewriter);
+    return dst;
+}
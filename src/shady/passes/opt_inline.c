@@ -13,14 +13,27 @@
 #include "../analysis/scope.h"
 #include "../analysis/callgraph.h"
 
+/// what a call costs on top of the instructions of the callee, when it is left in place
+#define CALL_COST 4
+/// calls to non-leaf functions go through lower_callf and lower_tailcalls: the return address is pushed, and control
+/// goes back through the dispatcher of the god function
+#define NON_LEAF_CALL_COST 32
+/// arguments and results of non-leaf calls are passed on the stack
+#define STACK_VALUE_COST 2
+/// constant arguments tend to unlock further folding once the callee is inlined
+#define CONSTANT_ARG_BONUS 2
+
 typedef struct {
     Rewriter rewriter;
     Scope* scope;
     CallGraph* graph;
+    /// old Function -> FnInliningCriteria
+    struct Dict* criteria;
     const Node* old_fun;
     Node* fun;
     bool allow_fn_inlining;
-    struct Dict* inlined_return_sites;
+    /// join point replacing the returns of the function being inlined, Return.fn is not reliable after infer
+    const Node* inlined_return;
 } Context;
 
 static const Node* ignore_immediate_fn_addr(const Node* node) {
@@ -31,7 +44,11 @@ static const Node* ignore_immediate_fn_addr(const Node* node) {
 }
 
 static bool is_call_potentially_inlineable(const Node* src_fn, const Node* dst_fn) {
-    if (lookup_annotation(src_fn, "Leaf"))
+    // leaf functions have to stay leaves
+    if (lookup_annotation(src_fn, "Leaf") && !lookup_annotation(dst_fn, "Leaf"))
+        return false;
+    // the join point replacing the returns could not be lowered in there
+    if (lookup_annotation(src_fn, "Structured"))
         return false;
     if (lookup_annotation(dst_fn, "NoInline"))
         return false;
@@ -41,42 +58,100 @@ static bool is_call_potentially_inlineable(const Node* src_fn, const Node* dst_f
 typedef struct {
     size_t num_calls;
     size_t num_inlineable_calls;
+    /// instruction count, once the calls it contains have been inlined
+    size_t inlined_size;
     bool can_be_inlined;
     bool can_be_eliminated;
 } FnInliningCriteria;
 
-static FnInliningCriteria get_inlining_heuristic(CGNode* fn_node) {
+static const FnInliningCriteria* find_criteria(Context* ctx, const Node* fn) {
+    return find_value_dict(const Node*, FnInliningCriteria, ctx->criteria, fn);
+}
+
+/// How much leaving this call in place costs, beyond the body of the callee.
+static size_t get_call_cost(const CGEdge* e) {
+    const Node* callee = e->dst_fn->fn;
+    Nodes args;
+    switch (e->instr->tag) {
+        case Call_TAG: args = e->instr->payload.call.args; break;
+        case TailCall_TAG: args = e->instr->payload.tail_call.args; break;
+        default: args = empty(callee->arena); break;
+    }
+    size_t cost = CALL_COST;
+    if (!lookup_annotation(callee, "Leaf"))
+        cost += NON_LEAF_CALL_COST + STACK_VALUE_COST * (args.count + callee->payload.fun.return_types.count);
+    for (size_t i = 0; i < args.count; i++) {
+        if (is_value(args.nodes[i]) && args.nodes[i]->tag != Variable_TAG)
+            cost += CONSTANT_ARG_BONUS;
+    }
+    return cost;
+}
+
+static FnInliningCriteria get_inlining_heuristic(Context* ctx, CGNode* fn_node, size_t* budget) {
     FnInliningCriteria crit = { 0 };
 
+    size_t saved = 0;
     CGEdge e;
     size_t i = 0;
     while (dict_iter(fn_node->callers, &i, &e, NULL)) {
         crit.num_calls++;
-        if (is_call_potentially_inlineable(e.src_fn->fn, e.dst_fn->fn))
+        if (is_call_potentially_inlineable(e.src_fn->fn, e.dst_fn->fn)) {
             crit.num_inlineable_calls++;
+            saved += get_call_cost(&e);
+        }
     }
 
-    debugv_print("%s has %d callers\n", get_abstraction_name(fn_node->fn), crit.num_calls);
+    // callees were visited first, the calls we're going to inline grow this function
+    crit.inlined_size = count_scope_instructions(fn_node->fn);
+    i = 0;
+    while (dict_iter(fn_node->callees, &i, &e, NULL)) {
+        const FnInliningCriteria* callee = find_criteria(ctx, e.dst_fn->fn);
+        if (callee && callee->can_be_inlined && is_call_potentially_inlineable(fn_node->fn, e.dst_fn->fn))
+            crit.inlined_size += callee->inlined_size;
+    }
+
+    debugv_print("%s has %d callers and an inlined size of %zu\n", get_abstraction_name(fn_node->fn), crit.num_calls, crit.inlined_size);
+
+    // avoid inlining recursive things for now, those we don't inline must not use up the growth budget either.
+    // if the address is captured, it also must remain available for the indirect calls.
+    if (fn_node->is_address_captured || fn_node->is_recursive)
+        return crit;
 
     // a function can be inlined if it has exactly one inlineable call...
     if (crit.num_inlineable_calls == 1)
         crit.can_be_inlined = true;
 
-    // avoid inlining recursive things for now
-    if (fn_node->is_address_captured || fn_node->is_recursive)
-        crit.can_be_inlined = false;
+    // ... or if duplicating it into every call site is worth it and fits in what's left of the growth budget
+    if (crit.num_inlineable_calls > 1 && !lookup_annotation(fn_node->fn, "Internal")) {
+        size_t copies = crit.num_inlineable_calls;
+        // the original goes away if nothing else refers to it
+        if (crit.num_calls == crit.num_inlineable_calls)
+            copies--;
+        size_t growth = crit.inlined_size * copies;
+        growth = growth > saved ? growth - saved : 0;
+        if (crit.inlined_size <= *budget && growth <= *budget) {
+            debugv_print("%s is worth inlining into its %zu callers, growing the module by %zu instructions\n", get_abstraction_name(fn_node->fn), crit.num_inlineable_calls, growth);
+            crit.can_be_inlined = true;
+            *budget -= growth;
+        }
+    }
 
     // it can be eliminated if it can be inlined, and all the calls are inlineable calls ...
     if (crit.num_calls == crit.num_inlineable_calls && crit.can_be_inlined)
         crit.can_be_eliminated = true;
 
-    // unless the address is captured, in which case it must remain available for the indirect calls.
-    if (fn_node->is_address_captured)
-        crit.can_be_eliminated = false;
-
     return crit;
 }
 
+/// Decisions are made bottom-up, so that the size of a function accounts for what gets inlined into it.
+static void compute_inlining_criteria(Context* ctx, size_t budget) {
+    for (size_t i = 0; i < entries_count_list(ctx->graph->bottom_up); i++) {
+        CGNode* fn_node = read_list(CGNode*, ctx->graph->bottom_up)[i];
+        FnInliningCriteria crit = get_inlining_heuristic(ctx, fn_node, &budget);
+        insert_dict(const Node*, FnInliningCriteria, ctx->criteria, fn_node->fn, crit);
+    }
+}
+
 /// inlines the abstraction with supplied arguments
 static const Node* inline_call(Context* ctx, const Node* oabs, Nodes nargs, bool separate_scope) {
     assert(is_abstraction(oabs));
@@ -113,12 +188,9 @@ static const Node* process(Context* ctx, const Node* node) {
 
     switch (node->tag) {
         case Function_TAG: {
-            if (ctx->graph) {
-                CGNode* fn_node = *find_value_dict(const Node*, CGNode*, ctx->graph->fn2cgn, node);
-                if (get_inlining_heuristic(fn_node).can_be_eliminated) {
-                    debugv_print("Eliminating %s because it has exactly one caller\n", get_abstraction_name(fn_node->fn));
-                    return NULL;
-                }
+            if (ctx->graph && find_criteria(ctx, node)->can_be_eliminated) {
+                debugv_print("Eliminating %s because all its callers inline it\n", get_abstraction_name(node));
+                return NULL;
             }
 
             Nodes annotations = rewrite_nodes(&ctx->rewriter, node->payload.fun.annotations);
@@ -133,6 +205,7 @@ static const Node* process(Context* ctx, const Node* node) {
             fn_ctx.scope = scope;
             fn_ctx.old_fun = node;
             fn_ctx.fun = new;
+            fn_ctx.inlined_return = NULL;
             recreate_decl_body_identity(&fn_ctx.rewriter, node, new);
             destroy_dict(fn_ctx.rewriter.map);
             destroy_scope(scope);
@@ -177,8 +250,7 @@ static const Node* process(Context* ctx, const Node* node) {
 
             ocallee = ignore_immediate_fn_addr(ocallee);
             if (ocallee->tag == Function_TAG) {
-                CGNode* fn_node = *find_value_dict(const Node*, CGNode*, ctx->graph->fn2cgn, ocallee);
-                if (get_inlining_heuristic(fn_node).can_be_inlined && is_call_potentially_inlineable(ctx->old_fun, ocallee)) {
+                if (find_criteria(ctx, ocallee)->can_be_inlined && is_call_potentially_inlineable(ctx->old_fun, ocallee)) {
                     debugv_print("Inlining call to %s\n", get_abstraction_name(ocallee));
                     Nodes nargs = rewrite_nodes(&ctx->rewriter, oargs);
 
@@ -186,11 +258,9 @@ static const Node* process(Context* ctx, const Node* node) {
                     Nodes nyield_types = strip_qualifiers(a, rewrite_nodes(&ctx->rewriter, ocallee->payload.fun.return_types));
                     const Type* jp_type = join_point_type(a, (JoinPointType) { .yield_types = nyield_types });
                     const Node* join_point = var(a, qualified_type_helper(jp_type, true), format_string_arena(a->arena, "inlined_return_%s", get_abstraction_name(ocallee)));
-                    insert_dict_and_get_result(const Node*, const Node*, ctx->inlined_return_sites, ocallee, join_point);
-
-                    const Node* nbody = inline_call(ctx, ocallee, nargs, true);
-
-                    remove_dict(const Node*, ctx->inlined_return_sites, ocallee);
+                    Context call_ctx = *ctx;
+                    call_ctx.inlined_return = join_point;
+                    const Node* nbody = inline_call(&call_ctx, ocallee, nargs, true);
 
                     return control(a, (Control) {
                         .yield_types = nyield_types,
@@ -201,9 +271,8 @@ static const Node* process(Context* ctx, const Node* node) {
             break;
         }
         case Return_TAG: {
-            const Node** p_ret_jp = find_value_dict(const Node*, const Node*, ctx->inlined_return_sites, node);
-            if (p_ret_jp)
-                return join(a, (Join) { .join_point = *p_ret_jp, .args = rewrite_nodes(&ctx->rewriter, node->payload.fn_ret.args )});
+            if (ctx->inlined_return)
+                return join(a, (Join) { .join_point = ctx->inlined_return, .args = rewrite_nodes(&ctx->rewriter, node->payload.fn_ret.args )});
             break;
         }
         case TailCall_TAG: {
@@ -212,8 +281,7 @@ static const Node* process(Context* ctx, const Node* node) {
             const Node* ocallee = node->payload.tail_call.target;
             ocallee = ignore_immediate_fn_addr(ocallee);
             if (ocallee->tag == Function_TAG) {
-                CGNode* fn_node = *find_value_dict(const Node*, CGNode*, ctx->graph->fn2cgn, ocallee);
-                if (get_inlining_heuristic(fn_node).can_be_inlined) {
+                if (find_criteria(ctx, ocallee)->can_be_inlined) {
                     debugv_print("Inlining tail call to %s\n", get_abstraction_name(ocallee));
                     Nodes nargs = rewrite_nodes(&ctx->rewriter, node->payload.tail_call.args);
 
@@ -242,23 +310,25 @@ static const Node* process(Context* ctx, const Node* node) {
 KeyHash hash_node(const Node**);
 bool compare_node(const Node**, const Node**);
 
-void opt_simplify_cf(SHADY_UNUSED const CompilerConfig* config, Module* src, Module* dst, bool allow_fn_inlining) {
+void opt_simplify_cf(const CompilerConfig* config, Module* src, Module* dst, bool allow_fn_inlining) {
     Context ctx = {
         .rewriter = create_rewriter(src, dst, (RewriteNodeFn) process),
         .graph = NULL,
         .scope = NULL,
         .fun = NULL,
-        .inlined_return_sites = new_dict(const Node*, CGNode*, (HashFn) hash_node, (CmpFn) compare_node),
+        .criteria = new_dict(const Node*, FnInliningCriteria, (HashFn) hash_node, (CmpFn) compare_node),
     };
-    if (allow_fn_inlining)
+    if (allow_fn_inlining) {
         ctx.graph = new_callgraph(src);
+        compute_inlining_criteria(&ctx, config->optimisations.inlining.growth_budget);
+    }
 
     rewrite_module(&ctx.rewriter);
     if (ctx.graph)
         destroy_callgraph(ctx.graph);
 
     destroy_rewriter(&ctx.rewriter);
-    destroy_dict(ctx.inlined_return_sites);
+    destroy_dict(ctx.criteria);
 }
 
 Module* opt_inline_jumps(const CompilerConfig* config, Module* src) {
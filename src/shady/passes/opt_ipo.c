@@ -0,0 +1,385 @@
+#include "passes.h"
+
+#include "portability.h"
+#include "list.h"
+#include "dict.h"
+#include "util.h"
+#include "log.h"
+
+#include "../analysis/scope.h"
+#include "../analysis/uses.h"
+#include "../analysis/callgraph.h"
+
+#include "../rewrite.h"
+#include "../type.h"
+
+/// a constant argument pattern needs to show up this many times before we clone the callee for it
+#define MIN_PATTERN_USES 2
+
+KeyHash hash_node(const Node**);
+bool compare_node(const Node**, const Node**);
+
+typedef struct {
+    /// for each parameter of the original function, the constant it is bound to in this variant, or NULL
+    const Node** constants;
+    size_t uses;
+    Node* fn;
+} Variant;
+
+typedef struct {
+    size_t params_count;
+    bool* dead_params;
+    size_t returns_count;
+    bool* dead_returns;
+    /// @ref List of @ref Variant, the first one is the base version all the other call sites go to
+    struct List* variants;
+} FnSpecialization;
+
+typedef struct {
+    Rewriter rewriter;
+    CallGraph* graph;
+    /// old Function -> FnSpecialization
+    struct Dict* specializations;
+    /// old Function -> UsesMap*
+    struct Dict* uses;
+    /// what the Returns in the body we're rewriting should turn into
+    const FnSpecialization* spec;
+    Node* fn;
+} Context;
+
+static bool is_constant_arg(const Node* arg) {
+    switch (arg->tag) {
+        case IntLiteral_TAG:
+        case FloatLiteral_TAG:
+        case True_TAG:
+        case False_TAG:
+        case NullPtr_TAG:
+        case RefDecl_TAG: return true;
+        default: return false;
+    }
+}
+
+static const Node* ignore_immediate_fn_addr(const Node* node) {
+    if (node->tag == FnAddr_TAG)
+        return node->payload.fn_addr.fn;
+    return node;
+}
+
+static bool is_used(const UsesMap* uses, const Node* var) {
+    for (const Use* use = get_first_use(uses, var); use; use = use->next_use) {
+        if (is_abstraction(use->user) && use->operand_class == NcVariable)
+            continue;
+        return true;
+    }
+    return false;
+}
+
+static size_t count_callsites(const UsesMap* caller_uses, const Node* instr) {
+    size_t count = 0;
+    for (const Use* use = get_first_use(caller_uses, instr); use; use = use->next_use)
+        count++;
+    return count > 0 ? count : 1;
+}
+
+static bool has_tail_calls(const Node* fn) {
+    Scope* scope = new_scope(fn);
+    bool found = false;
+    for (size_t i = 0; i < scope->size; i++)
+        found |= get_abstraction_body(scope->rpo[i]->node)->tag == TailCall_TAG;
+    destroy_scope(scope);
+    return found;
+}
+
+static bool is_specializable(CGNode* fn_node) {
+    const Node* fn = fn_node->fn;
+    if (!get_abstraction_body(fn) || fn_node->is_address_captured)
+        return false;
+    // the internal & generated functions get looked up by name
+    if (lookup_annotation(fn, "EntryPoint") || lookup_annotation(fn, "Internal") || lookup_annotation(fn, "Generated"))
+        return false;
+    return entries_count_dict(fn_node->callers) > 0;
+}
+
+static bool matches_pattern(const Node** constants, size_t count, Nodes args) {
+    for (size_t i = 0; i < count; i++) {
+        if (constants[i] && constants[i] != args.nodes[i])
+            return false;
+    }
+    return true;
+}
+
+static Variant* find_variant(const FnSpecialization* spec, Nodes args) {
+    Variant* variants = read_list(Variant, spec->variants);
+    // clones are more specific than the base, so try them first
+    for (size_t i = entries_count_list(spec->variants) - 1; i > 0; i--) {
+        if (matches_pattern(variants[i].constants, spec->params_count, args))
+            return &variants[i];
+    }
+    return &variants[0];
+}
+
+static bool analyse_function(Context* ctx, CGNode* fn_node, size_t* budget, FnSpecialization* spec) {
+    const Node* fn = fn_node->fn;
+    Nodes params = get_abstraction_params(fn);
+    size_t returns_count = fn->payload.fun.return_types.count;
+    *spec = (FnSpecialization) {
+        .params_count = params.count,
+        .dead_params = calloc(params.count, sizeof(bool)),
+        .returns_count = returns_count,
+        .dead_returns = calloc(returns_count, sizeof(bool)),
+        .variants = new_list(Variant),
+    };
+
+    const UsesMap* uses = get_function_uses(ctx->uses, fn);
+    for (size_t i = 0; i < params.count; i++)
+        spec->dead_params[i] = !is_used(uses, params.nodes[i]);
+
+    // results are dead when no call site reads them, tail calls forward them to their own caller
+    // and those made by this function return what the callee does, which has to keep matching our return types
+    bool prune_returns = !has_tail_calls(fn);
+    for (size_t j = 0; j < returns_count; j++)
+        spec->dead_returns[j] = prune_returns;
+    struct List* patterns = new_list(const Node**);
+    struct List* pattern_uses = new_list(size_t);
+    size_t iter = 0;
+    CGEdge e;
+    while (dict_iter(fn_node->callers, &iter, &e, NULL)) {
+        if (e.instr->tag == TailCall_TAG) {
+            for (size_t j = 0; j < returns_count; j++)
+                spec->dead_returns[j] = false;
+        } else {
+            const UsesMap* caller_uses = get_function_uses(ctx->uses, e.src_fn->fn);
+            for (const Use* use = get_first_use(caller_uses, e.instr); use; use = use->next_use) {
+                if (use->user->tag != Let_TAG)
+                    continue;
+                Nodes results = get_abstraction_params(get_let_tail(use->user));
+                for (size_t j = 0; j < returns_count && j < results.count; j++)
+                    spec->dead_returns[j] &= !is_used(caller_uses, results.nodes[j]);
+            }
+        }
+
+        // identical calls are the same node and share one edge, count each place it's used from
+        size_t sites = count_callsites(get_function_uses(ctx->uses, e.src_fn->fn), e.instr);
+        Nodes args = get_callsite_args(e.instr);
+        size_t i;
+        for (i = 0; i < entries_count_list(patterns); i++) {
+            const Node** pattern = read_list(const Node**, patterns)[i];
+            bool same = true;
+            for (size_t k = 0; k < args.count; k++)
+                same &= pattern[k] == (is_constant_arg(args.nodes[k]) ? args.nodes[k] : NULL);
+            if (same) {
+                read_list(size_t, pattern_uses)[i] += sites;
+                break;
+            }
+        }
+        if (i == entries_count_list(patterns)) {
+            const Node** pattern = calloc(params.count, sizeof(const Node*));
+            for (size_t k = 0; k < args.count; k++)
+                pattern[k] = is_constant_arg(args.nodes[k]) ? args.nodes[k] : NULL;
+            append_list(const Node**, patterns, pattern);
+            append_list(size_t, pattern_uses, sites);
+        }
+    }
+
+    // the base version keeps the constants every call site agrees on
+    const Node** base = calloc(params.count, sizeof(const Node*));
+    for (size_t k = 0; k < params.count; k++) {
+        base[k] = read_list(const Node**, patterns)[0][k];
+        for (size_t i = 1; i < entries_count_list(patterns); i++) {
+            if (read_list(const Node**, patterns)[i][k] != base[k])
+                base[k] = NULL;
+        }
+    }
+    Variant base_variant = { .constants = base };
+    append_list(Variant, spec->variants, base_variant);
+    bool changed = false;
+    for (size_t k = 0; k < params.count; k++)
+        changed |= spec->dead_params[k] || base[k];
+    for (size_t j = 0; j < returns_count; j++)
+        changed |= spec->dead_returns[j];
+
+    size_t size = count_scope_instructions(fn);
+    for (size_t i = 0; i < entries_count_list(patterns); i++) {
+        const Node** pattern = read_list(const Node**, patterns)[i];
+        bool more_specific = false;
+        for (size_t k = 0; k < params.count; k++)
+            more_specific |= pattern[k] && !base[k] && !spec->dead_params[k];
+        if (!more_specific || read_list(size_t, pattern_uses)[i] < MIN_PATTERN_USES || size > *budget) {
+            free(pattern);
+            continue;
+        }
+        *budget -= size;
+        Variant variant = { .constants = pattern, .uses = read_list(size_t, pattern_uses)[i] };
+        append_list(Variant, spec->variants, variant);
+        changed = true;
+    }
+    destroy_list(patterns);
+    destroy_list(pattern_uses);
+    return changed;
+}
+
+static void destroy_specialization(FnSpecialization* spec) {
+    for (size_t i = 0; i < entries_count_list(spec->variants); i++)
+        free(read_list(Variant, spec->variants)[i].constants);
+    destroy_list(spec->variants);
+    free(spec->dead_params);
+    free(spec->dead_returns);
+}
+
+static const FnSpecialization* find_specialization(Context* ctx, const Node* fn) {
+    return find_value_dict(const Node*, FnSpecialization, ctx->specializations, fn);
+}
+
+static Nodes filter_nodes(IrArena* a, Nodes old, const bool* dead, const Node** constants) {
+    LARRAY(const Node*, kept, old.count);
+    size_t count = 0;
+    for (size_t i = 0; i < old.count; i++) {
+        if (dead[i] || (constants && constants[i]))
+            continue;
+        kept[count++] = old.nodes[i];
+    }
+    return nodes(a, count, kept);
+}
+
+/// Creates the variants the first time the function is asked for, and returns the base one.
+/// They are remembered on the specialization: the rewriter's map might be the temporary one of a body being rewritten.
+static Node* specialize_function(Context* ctx, const Node* old, const FnSpecialization* spec) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    Variant* variants = read_list(Variant, spec->variants);
+    if (variants[0].fn)
+        return variants[0].fn;
+
+    Nodes oparams = get_abstraction_params(old);
+    Nodes return_types = filter_nodes(ctx->rewriter.src_arena, old->payload.fun.return_types, spec->dead_returns, NULL);
+    size_t variants_count = entries_count_list(spec->variants);
+    LARRAY(Nodes, nparams, variants_count);
+
+    for (size_t v = 0; v < variants_count; v++) {
+        LARRAY(const Node*, kept, oparams.count);
+        size_t kept_count = 0;
+        for (size_t i = 0; i < oparams.count; i++) {
+            if (!variants[v].constants[i] && !spec->dead_params[i])
+                kept[kept_count++] = var(a, rewrite_node(&ctx->rewriter, oparams.nodes[i]->type), oparams.nodes[i]->payload.var.name);
+        }
+        nparams[v] = nodes(a, kept_count, kept);
+
+        String name = v == 0 ? get_abstraction_name(old) : format_string_interned(a, "%s_spec_%zu", get_abstraction_name(old), v);
+        variants[v].fn = function(ctx->rewriter.dst_module, nparams[v], name, rewrite_nodes(&ctx->rewriter, old->payload.fun.annotations), rewrite_nodes(&ctx->rewriter, return_types));
+        debugv_print("opt_ipo: %s keeps %zu out of %zu parameters\n", name, kept_count, oparams.count);
+    }
+    register_processed(&ctx->rewriter, old, variants[0].fn);
+
+    // bodies are rewritten once every variant exists, they might call each other
+    for (size_t v = 0; v < variants_count; v++) {
+        Context fn_ctx = *ctx;
+        fn_ctx.rewriter.map = clone_dict(ctx->rewriter.map);
+        fn_ctx.spec = spec;
+        fn_ctx.fn = variants[v].fn;
+        size_t kept_count = 0;
+        for (size_t i = 0; i < oparams.count; i++) {
+            if (variants[v].constants[i])
+                register_processed(&fn_ctx.rewriter, oparams.nodes[i], rewrite_node(&ctx->rewriter, variants[v].constants[i]));
+            else if (!spec->dead_params[i])
+                register_processed(&fn_ctx.rewriter, oparams.nodes[i], nparams[v].nodes[kept_count++]);
+        }
+        variants[v].fn->payload.fun.body = rewrite_node(&fn_ctx.rewriter, get_abstraction_body(old));
+        destroy_dict(fn_ctx.rewriter.map);
+    }
+    return variants[0].fn;
+}
+
+static const Node* rewrite_call(Context* ctx, const Node* old_callee, Nodes old_args, const FnSpecialization* spec, Nodes* nargs) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    const Variant* variant = find_variant(spec, old_args);
+    *nargs = rewrite_nodes(&ctx->rewriter, filter_nodes(ctx->rewriter.src_arena, old_args, spec->dead_params, variant->constants));
+    if (old_callee->tag == FnAddr_TAG)
+        return fn_addr_helper(a, variant->fn);
+    return variant->fn;
+}
+
+static const Node* process(Context* ctx, const Node* old) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    switch (old->tag) {
+        case Function_TAG: {
+            const FnSpecialization* spec = find_specialization(ctx, old);
+            if (spec)
+                return specialize_function(ctx, old, spec);
+            Context fn_ctx = *ctx;
+            fn_ctx.spec = NULL;
+            fn_ctx.fn = NULL;
+            return recreate_node_identity(&fn_ctx.rewriter, old);
+        }
+        case Let_TAG: {
+            const Node* instr = get_let_instruction(old);
+            if (instr->tag != Call_TAG)
+                break;
+            const Node* ocallee = ignore_immediate_fn_addr(instr->payload.call.callee);
+            const FnSpecialization* spec = ocallee->tag == Function_TAG ? find_specialization(ctx, ocallee) : NULL;
+            if (!spec)
+                break;
+            specialize_function(ctx, ocallee, spec);
+            Nodes nargs;
+            const Node* ncallee = rewrite_call(ctx, instr->payload.call.callee, instr->payload.call.args, spec, &nargs);
+            const Node* otail = get_let_tail(old);
+            Nodes oresults = filter_nodes(ctx->rewriter.src_arena, get_abstraction_params(otail), spec->dead_returns, NULL);
+            Nodes nresults = recreate_variables(&ctx->rewriter, oresults);
+            register_processed_list(&ctx->rewriter, oresults, nresults);
+            const Node* ntail = case_(a, nresults, rewrite_node(&ctx->rewriter, get_abstraction_body(otail)));
+            return let(a, call(a, (Call) { .callee = ncallee, .args = nargs }), ntail);
+        }
+        case TailCall_TAG: {
+            const Node* ocallee = ignore_immediate_fn_addr(old->payload.tail_call.target);
+            const FnSpecialization* spec = ocallee->tag == Function_TAG ? find_specialization(ctx, ocallee) : NULL;
+            if (!spec)
+                break;
+            specialize_function(ctx, ocallee, spec);
+            Nodes nargs;
+            const Node* ntarget = rewrite_call(ctx, old->payload.tail_call.target, old->payload.tail_call.args, spec, &nargs);
+            return tail_call(a, (TailCall) { .target = ntarget, .args = nargs });
+        }
+        case Return_TAG: {
+            if (!ctx->spec)
+                break;
+            Nodes args = filter_nodes(ctx->rewriter.src_arena, old->payload.fn_ret.args, ctx->spec->dead_returns, NULL);
+            return fn_ret(a, (Return) { .fn = ctx->fn, .args = rewrite_nodes(&ctx->rewriter, args) });
+        }
+        default: break;
+    }
+    return recreate_node_identity(&ctx->rewriter, old);
+}
+
+Module* opt_ipo(const CompilerConfig* config, Module* src) {
+    ArenaConfig aconfig = get_arena_config(get_module_arena(src));
+    IrArena* a = new_ir_arena(aconfig);
+    Module* dst = new_module(a, get_module_name(src));
+    Context ctx = {
+        .rewriter = create_rewriter(src, dst, (RewriteNodeFn) process),
+        .graph = new_callgraph(src),
+        .specializations = new_dict(const Node*, FnSpecialization, (HashFn) hash_node, (CmpFn) compare_node),
+        .uses = new_uses_cache(),
+    };
+
+    size_t budget = config->optimisations.cloning.budget;
+    for (size_t i = 0; i < entries_count_list(ctx.graph->bottom_up); i++) {
+        CGNode* fn_node = read_list(CGNode*, ctx.graph->bottom_up)[i];
+        if (!is_specializable(fn_node))
+            continue;
+        FnSpecialization spec;
+        if (analyse_function(&ctx, fn_node, &budget, &spec))
+            insert_dict(const Node*, FnSpecialization, ctx.specializations, fn_node->fn, spec);
+        else
+            destroy_specialization(&spec);
+    }
+
+    rewrite_module(&ctx.rewriter);
+    destroy_rewriter(&ctx.rewriter);
+
+    size_t i = 0;
+    FnSpecialization spec;
+    while (dict_iter(ctx.specializations, &i, NULL, &spec))
+        destroy_specialization(&spec);
+    destroy_dict(ctx.specializations);
+    destroy_uses_cache(ctx.uses);
+    destroy_callgraph(ctx.graph);
+    return dst;
+}
@@ -0,0 +1,270 @@
+#include "passes.h"
+
+#include "portability.h"
+#include "list.h"
+#include "dict.h"
+#include "log.h"
+
+#include "../analysis/scope.h"
+#include "../analysis/looptree.h"
+
+#include "../type.h"
+#include "../rewrite.h"
+
+KeyHash hash_node(const Node**);
+bool compare_node(const Node**, const Node**);
+
+typedef struct {
+    Rewriter rewriter;
+    Scope* scope;
+    LoopTree* lt;
+    /// old variable -> CFNode* it will be defined in once hoisted
+    struct Dict* placed;
+    /// old loop Let or preheader abstraction -> List of old Let* to emit in front of it, or of its terminator.
+    /// Terminators are hash-consed, so the latch can end with the very same jump as the preheader.
+    struct Dict* hoisted_before;
+    /// set of old Let* that got hoisted out of their loop
+    struct Dict* hoisted;
+    /// the preheader whose terminator we're about to rewrite
+    const Node* preheader;
+} Context;
+
+/// Subgroup operations observe the set of active invocations, which can shrink from one iteration to the next
+/// under divergence. The only ones we move are those that merely forward an operand that is uniform already.
+static bool is_hoistable_subgroup_op(const Node* instruction) {
+    PrimOp payload = instruction->payload.prim_op;
+    switch (payload.op) {
+        case subgroup_broadcast_first_op:
+        case subgroup_assume_uniform_op:
+            return payload.operands.count == 1 && is_qualified_type_uniform(payload.operands.nodes[0]->type);
+        default:
+            return false;
+    }
+}
+
+/// @p speculative is set when the instruction might not run on every iteration, in which case hoisting it
+/// makes it run when it otherwise would not have.
+static bool is_hoistable(const Node* instruction, bool speculative) {
+    if (instruction->tag != PrimOp_TAG)
+        return false;
+    Op op = instruction->payload.prim_op.op;
+    if (has_primop_got_side_effects(op) || op == quote_op)
+        return false;
+    OpClass class = get_primop_class(op);
+    if (class & OcStack)
+        return false;
+    if (class & OcSubgroup_intrinsic)
+        return is_hoistable_subgroup_op(instruction);
+    // these trap on some targets when the divisor is zero
+    if (speculative && (op == div_op || op == mod_op))
+        return false;
+    return true;
+}
+
+static const CFNode* find_cfnode(Context* ctx, const Node* abs) {
+    CFNode** found = find_value_dict(const Node*, CFNode*, ctx->scope->map, abs);
+    return found ? *found : NULL;
+}
+
+static bool is_in_loop(Context* ctx, const CFNode* n, const LTNode* loop) {
+    for (const LTNode* l = looptree_lookup(ctx->lt, n->node); l; l = l->parent) {
+        if (l == loop)
+            return true;
+    }
+    return false;
+}
+
+/// Either @p loop or @p body is set, depending on whether we're looking at an unstructured or a structured loop.
+static bool is_defined_outside(Context* ctx, const Node* value, const LTNode* loop, const CFNode* body) {
+    switch (value->tag) {
+        case Variable_TAG: {
+            const CFNode** placed = find_value_dict(const Node*, const CFNode*, ctx->placed, value);
+            const CFNode* def = placed ? *placed : (value->payload.var.abs ? find_cfnode(ctx, value->payload.var.abs) : NULL);
+            if (!def)
+                return true;
+            if (loop)
+                return !is_in_loop(ctx, def, loop);
+            return !cfnode_dominates(body, def);
+        }
+        case Composite_TAG: {
+            Nodes contents = value->payload.composite.contents;
+            for (size_t i = 0; i < contents.count; i++) {
+                if (!is_defined_outside(ctx, contents.nodes[i], loop, body))
+                    return false;
+            }
+            return true;
+        }
+        case Fill_TAG: return is_defined_outside(ctx, value->payload.fill.value, loop, body);
+        case ConstrainedValue_TAG: return is_defined_outside(ctx, value->payload.constrained.value, loop, body);
+        default: return true;
+    }
+}
+
+static bool is_invariant(Context* ctx, const Node* instruction, const LTNode* loop, const CFNode* body) {
+    Nodes operands = instruction->payload.prim_op.operands;
+    for (size_t i = 0; i < operands.count; i++) {
+        if (!is_defined_outside(ctx, operands.nodes[i], loop, body))
+            return false;
+    }
+    return true;
+}
+
+static void hoist(Context* ctx, const Node* old_let, const Node* before, const CFNode* where) {
+    struct List** found = find_value_dict(const Node*, struct List*, ctx->hoisted_before, before);
+    struct List* list;
+    if (found)
+        list = *found;
+    else {
+        list = new_list(const Node*);
+        insert_dict(const Node*, struct List*, ctx->hoisted_before, before, list);
+    }
+    append_list(const Node*, list, old_let);
+    insert_set_get_result(const Node*, ctx->hoisted, old_let);
+
+    Nodes results = get_abstraction_params(get_let_tail(old_let));
+    for (size_t i = 0; i < results.count; i++)
+        insert_dict(const Node*, const CFNode*, ctx->placed, results.nodes[i], where);
+}
+
+/// The body of a structured loop runs at least once, and its straight-line prefix runs on every iteration.
+static void find_structured_invariants(Context* ctx, const CFNode* n, const Node* loop_let) {
+    const CFNode* body = find_cfnode(ctx, get_let_instruction(loop_let)->payload.loop_instr.body);
+    if (!body)
+        return;
+    const Node* terminator = get_abstraction_body(body->node);
+    while (terminator && terminator->tag == Let_TAG) {
+        const Node* instruction = get_let_instruction(terminator);
+        // past structured control flow, a break or continue might have skipped the rest of the iteration
+        if (instruction->tag != PrimOp_TAG && instruction->tag != Call_TAG && instruction->tag != Comment_TAG)
+            break;
+        if (is_hoistable(instruction, false) && is_invariant(ctx, instruction, NULL, body))
+            hoist(ctx, terminator, loop_let, n);
+        terminator = get_abstraction_body(get_let_tail(terminator));
+    }
+}
+
+/// Unstructured loops qualify when they have a single header whose immediate dominator ends in a plain branch,
+/// that dominator then acts as the preheader.
+static const CFNode* get_preheader(const LTNode* loop) {
+    if (loop->type != LF_HEAD || entries_count_list(loop->cf_nodes) != 1)
+        return NULL;
+    const CFNode* header = read_list(const CFNode*, loop->cf_nodes)[0];
+    if (header->node->tag != BasicBlock_TAG || !header->idom)
+        return NULL;
+    switch (get_abstraction_body(header->idom->node)->tag) {
+        case Jump_TAG:
+        case Branch_TAG:
+        case Switch_TAG: return header->idom;
+        default: return NULL;
+    }
+}
+
+static void find_unstructured_invariants(Context* ctx, const CFNode* n, const Node* let) {
+    const Node* instruction = get_let_instruction(let);
+    if (!is_hoistable(instruction, true))
+        return;
+    // hoist out of as many enclosing loops as possible
+    const CFNode* target = NULL;
+    for (const LTNode* loop = looptree_lookup(ctx->lt, n->node)->parent; loop && loop->parent; loop = loop->parent) {
+        const CFNode* preheader = get_preheader(loop);
+        if (!preheader || !is_invariant(ctx, instruction, loop, NULL))
+            break;
+        target = preheader;
+    }
+    if (target)
+        hoist(ctx, let, target->node, target);
+}
+
+static void find_invariants(Context* ctx) {
+    // in RPO, definitions are visited before their uses, so chains of invariant instructions move together
+    for (size_t i = 0; i < ctx->scope->size; i++) {
+        const CFNode* n = ctx->scope->rpo[i];
+        const Node* terminator = get_abstraction_body(n->node);
+        if (!terminator || terminator->tag != Let_TAG)
+            continue;
+        if (find_key_dict(const Node*, ctx->hoisted, terminator))
+            continue;
+        if (get_let_instruction(terminator)->tag == Loop_TAG)
+            find_structured_invariants(ctx, n, terminator);
+        else
+            find_unstructured_invariants(ctx, n, terminator);
+    }
+}
+
+static const Node* process(Context* ctx, const Node* old) {
+    if (old->tag == Function_TAG) {
+        Context fn_ctx = *ctx;
+        fn_ctx.scope = new_scope(old);
+        fn_ctx.lt = build_loop_tree(fn_ctx.scope);
+        find_invariants(&fn_ctx);
+        fn_ctx.preheader = find_key_dict(const Node*, ctx->hoisted_before, old) ? old : NULL;
+        const Node* new_fn = recreate_node_identity(&fn_ctx.rewriter, old);
+        destroy_loop_tree(fn_ctx.lt);
+        destroy_scope(fn_ctx.scope);
+        return new_fn;
+    }
+
+    IrArena* a = ctx->rewriter.dst_arena;
+
+    if (old->tag == Let_TAG && find_key_dict(const Node*, ctx->hoisted, old)) {
+        // the results were bound in the preheader already
+        return rewrite_node(&ctx->rewriter, get_abstraction_body(get_let_tail(old)));
+    }
+
+    if (is_abstraction(old) && find_key_dict(const Node*, ctx->hoisted_before, old)) {
+        Context abs_ctx = *ctx;
+        abs_ctx.preheader = old;
+        return recreate_node_identity(&abs_ctx.rewriter, old);
+    }
+
+    struct List** found = NULL;
+    if (old->tag == Let_TAG)
+        found = find_value_dict(const Node*, struct List*, ctx->hoisted_before, old);
+    else if (ctx->preheader && old == get_abstraction_body(ctx->preheader)) {
+        found = find_value_dict(const Node*, struct List*, ctx->hoisted_before, ctx->preheader);
+        ctx->preheader = NULL;
+    }
+    if (found) {
+        size_t count = entries_count_list(*found);
+        LARRAY(const Node*, instructions, count);
+        LARRAY(Nodes, results, count);
+        for (size_t i = 0; i < count; i++) {
+            const Node* old_let = read_list(const Node*, *found)[i];
+            debugv_print("opt_licm: hoisting ");
+            log_node(DEBUGV, get_let_instruction(old_let));
+            debugv_print(".\n");
+            instructions[i] = rewrite_node(&ctx->rewriter, get_let_instruction(old_let));
+            Nodes oparams = get_abstraction_params(get_let_tail(old_let));
+            results[i] = recreate_variables(&ctx->rewriter, oparams);
+            register_processed_list(&ctx->rewriter, oparams, results[i]);
+        }
+        const Node* body = recreate_node_identity(&ctx->rewriter, old);
+        for (size_t i = count; i > 0; i--)
+            body = let(a, instructions[i - 1], case_(a, results[i - 1], body));
+        return body;
+    }
+
+    return recreate_node_identity(&ctx->rewriter, old);
+}
+
+Module* opt_licm(SHADY_UNUSED const CompilerConfig* config, Module* src) {
+    ArenaConfig aconfig = get_arena_config(get_module_arena(src));
+    IrArena* a = new_ir_arena(aconfig);
+    Module* dst = new_module(a, get_module_name(src));
+    Context ctx = {
+        .rewriter = create_rewriter(src, dst, (RewriteNodeFn) process),
+        .placed = new_dict(const Node*, const CFNode*, (HashFn) hash_node, (CmpFn) compare_node),
+        .hoisted_before = new_dict(const Node*, struct List*, (HashFn) hash_node, (CmpFn) compare_node),
+        .hoisted = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+    };
+    rewrite_module(&ctx.rewriter);
+    destroy_rewriter(&ctx.rewriter);
+    size_t i = 0;
+    struct List* list;
+    while (dict_iter(ctx.hoisted_before, &i, NULL, &list))
+        destroy_list(list);
+    destroy_dict(ctx.hoisted_before);
+    destroy_dict(ctx.hoisted);
+    destroy_dict(ctx.placed);
+    return dst;
+}
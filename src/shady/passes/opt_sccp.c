@@ -0,0 +1,494 @@
+#include "passes.h"
+
+#include "portability.h"
+#include "list.h"
+#include "dict.h"
+#include "log.h"
+
+#include "../analysis/scope.h"
+
+#include "../visit.h"
+#include "../rewrite.h"
+
+KeyHash hash_node(const Node**);
+bool compare_node(const Node**, const Node**);
+
+typedef struct {
+    enum { Top, Const, Bottom } kind;
+    /// a literal in the destination arena
+    const Node* value;
+} LatticeValue;
+
+static const LatticeValue top = { .kind = Top };
+static const LatticeValue bottom = { .kind = Bottom };
+
+typedef struct {
+    Rewriter rewriter;
+    /// old variable -> LatticeValue, variables that aren't in there are Top
+    struct Dict* lattice;
+    /// old abstractions that were found to be reachable
+    struct Dict* executable;
+    /// old functions whose callers we can't all see
+    struct Dict* escaping;
+    bool changed;
+} Context;
+
+static LatticeValue const_value(const Node* value) {
+    return (LatticeValue) { .kind = Const, .value = value };
+}
+
+static LatticeValue meet(LatticeValue a, LatticeValue b) {
+    if (a.kind == Top)
+        return b;
+    if (b.kind == Top)
+        return a;
+    // literals are hash-consed
+    if (a.kind == Const && b.kind == Const && a.value == b.value)
+        return a;
+    return bottom;
+}
+
+static LatticeValue get_value(Context* ctx, const Node* old) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    switch (old->tag) {
+        case Variable_TAG: {
+            LatticeValue* found = find_value_dict(const Node*, LatticeValue, ctx->lattice, old);
+            return found ? *found : top;
+        }
+        case IntLiteral_TAG: return const_value(int_literal(a, old->payload.int_literal));
+        case FloatLiteral_TAG: return const_value(float_literal(a, old->payload.float_literal));
+        case True_TAG: return const_value(true_lit(a));
+        case False_TAG: return const_value(false_lit(a));
+        case RefDecl_TAG: {
+            const IntLiteral* lit = resolve_to_int_literal(old);
+            if (lit)
+                return const_value(int_literal(a, *lit));
+            const FloatLiteral* flit = resolve_to_float_literal(old);
+            if (flit)
+                return const_value(float_literal(a, *flit));
+            return bottom;
+        }
+        default: return bottom;
+    }
+}
+
+static void lower_value(Context* ctx, const Node* var, LatticeValue value) {
+    LatticeValue old = get_value(ctx, var);
+    LatticeValue new = meet(old, value);
+    if (new.kind == old.kind && new.value == old.value)
+        return;
+    if (old.kind == Top)
+        insert_dict(const Node*, LatticeValue, ctx->lattice, var, new);
+    else
+        *find_value_dict(const Node*, LatticeValue, ctx->lattice, var) = new;
+    ctx->changed = true;
+}
+
+static void lower_values(Context* ctx, Nodes vars, LatticeValue value) {
+    for (size_t i = 0; i < vars.count; i++)
+        lower_value(ctx, vars.nodes[i], value);
+}
+
+static void lower_to_args(Context* ctx, Nodes vars, Nodes args) {
+    if (vars.count != args.count) {
+        lower_values(ctx, vars, bottom);
+        return;
+    }
+    for (size_t i = 0; i < vars.count; i++)
+        lower_value(ctx, vars.nodes[i], get_value(ctx, args.nodes[i]));
+}
+
+static void mark_executable(Context* ctx, const Node* abs) {
+    if (!abs || find_key_dict(const Node*, ctx->executable, abs))
+        return;
+    insert_set_get_result(const Node*, ctx->executable, abs);
+    ctx->changed = true;
+}
+
+static bool is_evaluated(Op op) {
+    if (has_primop_got_side_effects(op))
+        return false;
+    if (get_primop_class(op) & (OcArithmetic | OcLogic | OcCompare | OcShift | OcMath))
+        return true;
+    switch (op) {
+        case select_op:
+        case convert_op:
+        case reinterpret_op: return true;
+        default: return false;
+    }
+}
+
+static bool is_literal(const Node* n) {
+    switch (n->tag) {
+        case IntLiteral_TAG:
+        case FloatLiteral_TAG:
+        case True_TAG:
+        case False_TAG: return true;
+        default: return false;
+    }
+}
+
+/// Runs the instruction on the lattice values of its operands, folding does the actual work for us.
+static LatticeValue evaluate(Context* ctx, const Node* instruction) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    PrimOp payload = instruction->payload.prim_op;
+    if (!is_evaluated(payload.op))
+        return bottom;
+    for (size_t i = 0; i < payload.type_arguments.count; i++) {
+        switch (payload.type_arguments.nodes[i]->tag) {
+            case Int_TAG:
+            case Float_TAG:
+            case Bool_TAG: continue;
+            default: return bottom;
+        }
+    }
+
+    LARRAY(const Node*, operands, payload.operands.count);
+    bool unknown = false;
+    for (size_t i = 0; i < payload.operands.count; i++) {
+        LatticeValue v = get_value(ctx, payload.operands.nodes[i]);
+        if (v.kind == Bottom)
+            return bottom;
+        unknown |= v.kind == Top;
+        operands[i] = v.value;
+    }
+    if (unknown)
+        return top;
+
+    const Node* folded = prim_op(a, (PrimOp) {
+        .op = payload.op,
+        .type_arguments = rewrite_nodes(&ctx->rewriter, payload.type_arguments),
+        .operands = nodes(a, payload.operands.count, operands),
+    });
+    if (folded->tag == PrimOp_TAG && folded->payload.prim_op.op == quote_op && folded->payload.prim_op.operands.count == 1 && is_literal(first(folded->payload.prim_op.operands)))
+        return const_value(first(folded->payload.prim_op.operands));
+    return bottom;
+}
+
+static const Node* get_direct_callee(const Node* callee) {
+    if (callee->tag == FnAddr_TAG)
+        return callee->payload.fn_addr.fn;
+    return NULL;
+}
+
+static void visit_call(Context* ctx, const Node* callee, Nodes args) {
+    const Node* fn = get_direct_callee(callee);
+    if (fn && !find_key_dict(const Node*, ctx->escaping, fn))
+        lower_to_args(ctx, get_abstraction_params(fn), args);
+}
+
+static void visit_jump(Context* ctx, const Node* j) {
+    const Node* target = j->payload.jump.target;
+    mark_executable(ctx, target);
+    lower_to_args(ctx, get_abstraction_params(target), j->payload.jump.args);
+}
+
+static bool is_same_literal(const Node* a, const Node* b) {
+    const IntLiteral* la = resolve_to_int_literal(a);
+    const IntLiteral* lb = resolve_to_int_literal(b);
+    return la && lb && get_int_literal_value(*la, false) == get_int_literal_value(*lb, false);
+}
+
+static void visit_instruction(Context* ctx, const Node* instruction, const Node* tail) {
+    Nodes results = get_abstraction_params(tail);
+    switch (is_instruction(instruction)) {
+        case Instruction_PrimOp_TAG: {
+            if (instruction->payload.prim_op.op == quote_op)
+                lower_to_args(ctx, results, instruction->payload.prim_op.operands);
+            else if (results.count == 1)
+                lower_value(ctx, first(results), evaluate(ctx, instruction));
+            else
+                lower_values(ctx, results, bottom);
+            return;
+        }
+        case Instruction_Call_TAG:
+            visit_call(ctx, instruction->payload.call.callee, instruction->payload.call.args);
+            break;
+        case Instruction_If_TAG: {
+            LatticeValue condition = get_value(ctx, instruction->payload.if_instr.condition);
+            if (condition.kind == Top)
+                return;
+            if (condition.kind == Bottom || condition.value->tag == True_TAG)
+                mark_executable(ctx, instruction->payload.if_instr.if_true);
+            if (condition.kind == Bottom || condition.value->tag == False_TAG)
+                mark_executable(ctx, instruction->payload.if_instr.if_false);
+            break;
+        }
+        case Instruction_Match_TAG: {
+            Match payload = instruction->payload.match_instr;
+            LatticeValue inspected = get_value(ctx, payload.inspect);
+            if (inspected.kind == Top)
+                return;
+            bool matched = false;
+            for (size_t i = 0; i < payload.cases.count; i++) {
+                if (inspected.kind == Bottom || is_same_literal(inspected.value, payload.literals.nodes[i])) {
+                    mark_executable(ctx, payload.cases.nodes[i]);
+                    matched = true;
+                }
+            }
+            if (inspected.kind == Bottom || !matched)
+                mark_executable(ctx, payload.default_case);
+            break;
+        }
+        case Instruction_Loop_TAG: {
+            const Node* body = instruction->payload.loop_instr.body;
+            mark_executable(ctx, body);
+            lower_values(ctx, get_abstraction_params(body), bottom);
+            break;
+        }
+        case Instruction_Control_TAG: {
+            const Node* inside = instruction->payload.control.inside;
+            mark_executable(ctx, inside);
+            lower_values(ctx, get_abstraction_params(inside), bottom);
+            break;
+        }
+        case Instruction_Block_TAG:
+            mark_executable(ctx, instruction->payload.block.inside);
+            break;
+        default: break;
+    }
+    // values yielded out of structured constructs are not tracked
+    lower_values(ctx, results, bottom);
+}
+
+static void visit_abstraction(Context* ctx, const Node* abs) {
+    const Node* terminator = get_abstraction_body(abs);
+    if (!terminator)
+        return;
+    switch (is_terminator(terminator)) {
+        case Let_TAG:
+            visit_instruction(ctx, get_let_instruction(terminator), get_let_tail(terminator));
+            mark_executable(ctx, get_let_tail(terminator));
+            break;
+        case LetMut_TAG: {
+            const Node* tail = terminator->payload.let_mut.tail;
+            lower_values(ctx, get_abstraction_params(tail), bottom);
+            mark_executable(ctx, tail);
+            break;
+        }
+        case Jump_TAG:
+            visit_jump(ctx, terminator);
+            break;
+        case Branch_TAG: {
+            Branch payload = terminator->payload.branch;
+            LatticeValue condition = get_value(ctx, payload.branch_condition);
+            if (condition.kind == Top)
+                break;
+            if (condition.kind == Bottom || condition.value->tag == True_TAG)
+                visit_jump(ctx, payload.true_jump);
+            if (condition.kind == Bottom || condition.value->tag == False_TAG)
+                visit_jump(ctx, payload.false_jump);
+            break;
+        }
+        case Switch_TAG: {
+            Switch payload = terminator->payload.br_switch;
+            LatticeValue inspected = get_value(ctx, payload.switch_value);
+            if (inspected.kind == Top)
+                break;
+            bool matched = false;
+            for (size_t i = 0; i < payload.case_jumps.count; i++) {
+                if (inspected.kind == Bottom || is_same_literal(inspected.value, payload.case_values.nodes[i])) {
+                    visit_jump(ctx, payload.case_jumps.nodes[i]);
+                    matched = true;
+                }
+            }
+            if (inspected.kind == Bottom || !matched)
+                visit_jump(ctx, payload.default_jump);
+            break;
+        }
+        case TailCall_TAG:
+            visit_call(ctx, terminator->payload.tail_call.target, terminator->payload.tail_call.args);
+            break;
+        default: break;
+    }
+}
+
+typedef struct {
+    Visitor v;
+    struct Dict* seen;
+    struct Dict* escaping;
+    /// functions that are called directly somewhere
+    struct Dict* called;
+} EscapeVisitor;
+
+static void visit_callee_args(EscapeVisitor* v, const Node* callee, Nodes args) {
+    const Node* direct = get_direct_callee(callee);
+    if (direct)
+        insert_set_get_result(const Node*, v->called, direct);
+    else
+        visit_node(&v->v, callee);
+    for (size_t i = 0; i < args.count; i++)
+        visit_node(&v->v, args.nodes[i]);
+}
+
+static void search_for_escaping_fns(EscapeVisitor* v, const Node* node) {
+    if (!insert_set_get_result(const Node*, v->seen, node))
+        return;
+    switch (node->tag) {
+        case Function_TAG:
+            if (lookup_annotation(node, "EntryPoint"))
+                insert_set_get_result(const Node*, v->escaping, node);
+            break;
+        case FnAddr_TAG:
+            insert_set_get_result(const Node*, v->escaping, node->payload.fn_addr.fn);
+            break;
+        // these are the only places where taking a function's address does not make it escape
+        case Call_TAG:
+            visit_callee_args(v, node->payload.call.callee, node->payload.call.args);
+            return;
+        case TailCall_TAG:
+            visit_callee_args(v, node->payload.tail_call.target, node->payload.tail_call.args);
+            return;
+        default: break;
+    }
+    visit_node_operands(&v->v, NcDeclaration, node);
+}
+
+static void analyse_module(Context* ctx, Module* src) {
+    EscapeVisitor v = {
+        .v = { .visit_node_fn = (VisitNodeFn) search_for_escaping_fns },
+        .seen = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+        .escaping = ctx->escaping,
+        .called = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+    };
+    visit_module(&v.v, src);
+    // like opt_inline, we treat functions without any callers as being called from the outside
+    Nodes decls = get_module_declarations(src);
+    for (size_t i = 0; i < decls.count; i++) {
+        if (decls.nodes[i]->tag == Function_TAG && !find_key_dict(const Node*, v.called, decls.nodes[i]))
+            insert_set_get_result(const Node*, ctx->escaping, decls.nodes[i]);
+    }
+    destroy_dict(v.seen);
+    destroy_dict(v.called);
+
+    struct List* scopes = build_scopes(src);
+    size_t scopes_count = entries_count_list(scopes);
+    for (size_t i = 0; i < scopes_count; i++) {
+        const Node* fn = read_list(Scope*, scopes)[i]->entry->node;
+        mark_executable(ctx, fn);
+        if (find_key_dict(const Node*, ctx->escaping, fn))
+            lower_values(ctx, get_abstraction_params(fn), bottom);
+    }
+
+    size_t rounds = 0;
+    do {
+        ctx->changed = false;
+        for (size_t i = 0; i < scopes_count; i++) {
+            Scope* scope = read_list(Scope*, scopes)[i];
+            for (size_t j = 0; j < scope->size; j++) {
+                const Node* abs = scope->rpo[j]->node;
+                if (find_key_dict(const Node*, ctx->executable, abs))
+                    visit_abstraction(ctx, abs);
+            }
+        }
+        rounds++;
+    } while (ctx->changed);
+    debugv_print("opt_sccp: converged after %zu rounds\n", rounds);
+
+    for (size_t i = 0; i < scopes_count; i++)
+        destroy_scope(read_list(Scope*, scopes)[i]);
+    destroy_list(scopes);
+}
+
+/// Maps the params that were found to be constant to their value instead of their new counterpart.
+static void register_params(Context* ctx, Nodes oparams, Nodes nparams) {
+    for (size_t i = 0; i < oparams.count; i++) {
+        LatticeValue v = get_value(ctx, oparams.nodes[i]);
+        if (v.kind == Const) {
+            debugv_print("opt_sccp: %s~%d is always ", get_value_name_safe(oparams.nodes[i]), oparams.nodes[i]->payload.var.id);
+            log_node(DEBUGV, v.value);
+            debugv_print(".\n");
+            register_processed(&ctx->rewriter, oparams.nodes[i], v.value);
+        } else
+            register_processed(&ctx->rewriter, oparams.nodes[i], nparams.nodes[i]);
+    }
+}
+
+/// Structured cases that can't be taken are emptied out, so folding can get rid of them or of the whole construct.
+static const Node* rewrite_structured_case(Context* ctx, const Node* old_case) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    if (!old_case || find_key_dict(const Node*, ctx->executable, old_case))
+        return rewrite_node(&ctx->rewriter, old_case);
+    debugv_print("opt_sccp: deleting an unreachable structured case.\n");
+    return case_(a, recreate_variables(&ctx->rewriter, get_abstraction_params(old_case)), unreachable(a));
+}
+
+static const Node* process(Context* ctx, const Node* old) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    switch (old->tag) {
+        case If_TAG: {
+            If payload = old->payload.if_instr;
+            LatticeValue condition = get_value(ctx, payload.condition);
+            if (condition.kind != Const)
+                break;
+            return if_instr(a, (If) {
+                .yield_types = rewrite_nodes(&ctx->rewriter, payload.yield_types),
+                .condition = condition.value,
+                .if_true = rewrite_structured_case(ctx, payload.if_true),
+                .if_false = rewrite_structured_case(ctx, payload.if_false),
+            });
+        }
+        case Match_TAG: {
+            Match payload = old->payload.match_instr;
+            LatticeValue inspected = get_value(ctx, payload.inspect);
+            if (inspected.kind != Const)
+                break;
+            LARRAY(const Node*, cases, payload.cases.count);
+            for (size_t i = 0; i < payload.cases.count; i++)
+                cases[i] = rewrite_structured_case(ctx, payload.cases.nodes[i]);
+            return match_instr(a, (Match) {
+                .yield_types = rewrite_nodes(&ctx->rewriter, payload.yield_types),
+                .inspect = inspected.value,
+                .literals = rewrite_nodes(&ctx->rewriter, payload.literals),
+                .cases = nodes(a, payload.cases.count, cases),
+                .default_case = rewrite_structured_case(ctx, payload.default_case),
+            });
+        }
+        case Function_TAG: {
+            Node* new = recreate_decl_header_identity(&ctx->rewriter, old);
+            Nodes oparams = get_abstraction_params(old);
+            for (size_t i = 0; i < oparams.count; i++)
+                remove_dict(const Node*, ctx->rewriter.map, oparams.nodes[i]);
+            register_params(ctx, oparams, get_abstraction_params(new));
+            recreate_decl_body_identity(&ctx->rewriter, old, new);
+            return new;
+        }
+        case BasicBlock_TAG: {
+            Nodes oparams = get_abstraction_params(old);
+            Nodes nparams = recreate_variables(&ctx->rewriter, oparams);
+            register_params(ctx, oparams, nparams);
+            const Node* fn = rewrite_node(&ctx->rewriter, old->payload.basic_block.fn);
+            Node* bb = basic_block(a, (Node*) fn, nparams, old->payload.basic_block.name);
+            register_processed(&ctx->rewriter, old, bb);
+            bb->payload.basic_block.body = rewrite_node(&ctx->rewriter, old->payload.basic_block.body);
+            return bb;
+        }
+        case Case_TAG: {
+            Nodes oparams = get_abstraction_params(old);
+            Nodes nparams = recreate_variables(&ctx->rewriter, oparams);
+            register_params(ctx, oparams, nparams);
+            return case_(a, nparams, rewrite_node(&ctx->rewriter, old->payload.case_.body));
+        }
+        default: break;
+    }
+    return recreate_node_identity(&ctx->rewriter, old);
+}
+
+Module* opt_sccp(SHADY_UNUSED const CompilerConfig* config, Module* src) {
+    ArenaConfig aconfig = get_arena_config(get_module_arena(src));
+    IrArena* a = new_ir_arena(aconfig);
+    Module* dst = new_module(a, get_module_name(src));
+    Context ctx = {
+        .rewriter = create_rewriter(src, dst, (RewriteNodeFn) process),
+        .lattice = new_dict(const Node*, LatticeValue, (HashFn) hash_node, (CmpFn) compare_node),
+        .executable = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+        .escaping = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+    };
+    analyse_module(&ctx, src);
+    rewrite_module(&ctx.rewriter);
+    destroy_rewriter(&ctx.rewriter);
+    destroy_dict(ctx.lattice);
+    destroy_dict(ctx.executable);
+    destroy_dict(ctx.escaping);
+    return dst;
+}
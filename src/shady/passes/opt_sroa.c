@@ -0,0 +1,191 @@
+#include "passes.h"
+
+#include "portability.h"
+#include "dict.h"
+#include "log.h"
+
+#include "../analysis/uses.h"
+#include "../analysis/leak.h"
+
+#include "../transform/ir_gen_helpers.h"
+
+#include "../rewrite.h"
+#include "../type.h"
+
+/// arrays bigger than this are left alone
+#define MAX_SPLIT_ARRAY_SIZE 16
+/// every round splits one more level of nested aggregates
+#define MAX_ROUNDS 4
+
+KeyHash hash_node(const Node**);
+bool compare_node(const Node**, const Node**);
+
+typedef struct {
+    /// the aggregate type, in the destination arena
+    const Type* type;
+    /// pointers to the allocas replacing each member
+    Nodes members;
+} SplitAlloca;
+
+typedef struct {
+    Rewriter rewriter;
+    const UsesMap* uses;
+    /// old alloca'd pointer -> SplitAlloca
+    struct Dict* split;
+    bool changed;
+} Context;
+
+static bool get_member_types(IrArena* a, const Type* t, Nodes* members) {
+    t = get_maybe_nominal_type_body(t);
+    switch (t->tag) {
+        case RecordType_TAG:
+            if (t->payload.record_type.special != NotSpecial)
+                return false;
+            *members = t->payload.record_type.members;
+            return members->count > 0;
+        case ArrType_TAG: {
+            const IntLiteral* size = t->payload.arr_type.size ? resolve_to_int_literal(t->payload.arr_type.size) : NULL;
+            if (!size)
+                return false;
+            size_t count = get_int_literal_value(*size, false);
+            if (count == 0 || count > MAX_SPLIT_ARRAY_SIZE)
+                return false;
+            LARRAY(const Type*, types, count);
+            for (size_t i = 0; i < count; i++)
+                types[i] = t->payload.arr_type.element_type;
+            *members = nodes(a, count, types);
+            return true;
+        }
+        default: return false;
+    }
+}
+
+static const SplitAlloca* find_split(Context* ctx, const Node* ptr) {
+    return find_value_dict(const Node*, SplitAlloca, ctx->split, ptr);
+}
+
+static const Node* process_let(Context* ctx, const Node* old) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    const Node* instruction = get_let_instruction(old);
+    if (instruction->tag != PrimOp_TAG)
+        return NULL;
+    PrimOp payload = instruction->payload.prim_op;
+    const Node* tail = get_let_tail(old);
+    Nodes oparams = get_abstraction_params(tail);
+
+    switch (payload.op) {
+        case alloca_op:
+        case alloca_logical_op: {
+            const Type* type = first(payload.type_arguments);
+            Nodes members;
+            if (!get_member_types(instruction->arena, type, &members))
+                return NULL;
+            const Node* ptr = first(oparams);
+            if (!is_aggregate_access_static(ctx->uses, ptr, members.count))
+                return NULL;
+
+            debugv_print("opt_sroa: splitting ");
+            log_node(DEBUGV, ptr);
+            debugv_print(" into %zu allocas.\n", members.count);
+            BodyBuilder* bb = begin_body(a);
+            LARRAY(const Node*, nptrs, members.count);
+            for (size_t i = 0; i < members.count; i++)
+                nptrs[i] = first(gen_primop(bb, payload.op, singleton(rewrite_node(&ctx->rewriter, members.nodes[i])), empty(a)));
+            SplitAlloca split = {
+                .type = rewrite_node(&ctx->rewriter, type),
+                .members = nodes(a, members.count, nptrs),
+            };
+            insert_dict(const Node*, SplitAlloca, ctx->split, ptr, split);
+            ctx->changed = true;
+            return finish_body(bb, rewrite_node(&ctx->rewriter, get_abstraction_body(tail)));
+        }
+        case load_op: {
+            const SplitAlloca* split = find_split(ctx, first(payload.operands));
+            if (!split)
+                return NULL;
+            BodyBuilder* bb = begin_body(a);
+            LARRAY(const Node*, values, split->members.count);
+            for (size_t i = 0; i < split->members.count; i++)
+                values[i] = gen_load(bb, split->members.nodes[i]);
+            register_processed(&ctx->rewriter, first(oparams), composite_helper(a, split->type, nodes(a, split->members.count, values)));
+            return finish_body(bb, rewrite_node(&ctx->rewriter, get_abstraction_body(tail)));
+        }
+        case store_op: {
+            const SplitAlloca* split = find_split(ctx, first(payload.operands));
+            if (!split)
+                return NULL;
+            BodyBuilder* bb = begin_body(a);
+            const Node* value = rewrite_node(&ctx->rewriter, payload.operands.nodes[1]);
+            for (size_t i = 0; i < split->members.count; i++)
+                gen_store(bb, split->members.nodes[i], gen_extract(bb, value, singleton(int32_literal(a, i))));
+            return finish_body(bb, rewrite_node(&ctx->rewriter, get_abstraction_body(tail)));
+        }
+        case lea_op: {
+            const SplitAlloca* split = find_split(ctx, first(payload.operands));
+            if (!split)
+                return NULL;
+            size_t index = get_int_literal_value(*resolve_to_int_literal(payload.operands.nodes[2]), false);
+            const Node* member = split->members.nodes[index];
+            BodyBuilder* bb = begin_body(a);
+            // the remaining indices now apply to the member
+            if (payload.operands.count > 3) {
+                Nodes indices = rewrite_nodes(&ctx->rewriter, nodes(instruction->arena, payload.operands.count - 3, &payload.operands.nodes[3]));
+                member = gen_lea(bb, member, rewrite_node(&ctx->rewriter, payload.operands.nodes[1]), indices);
+            }
+            register_processed(&ctx->rewriter, first(oparams), member);
+            return finish_body(bb, rewrite_node(&ctx->rewriter, get_abstraction_body(tail)));
+        }
+        default: return NULL;
+    }
+}
+
+static const Node* process(Context* ctx, const Node* old) {
+    switch (old->tag) {
+        case Function_TAG: {
+            if (!get_abstraction_body(old))
+                break;
+            Context fn_ctx = *ctx;
+            fn_ctx.uses = create_uses_map(old, (NcDeclaration | NcType));
+            const Node* new = recreate_node_identity(&fn_ctx.rewriter, old);
+            destroy_uses_map(fn_ctx.uses);
+            ctx->changed |= fn_ctx.changed;
+            return new;
+        }
+        case Let_TAG: {
+            if (!ctx->uses)
+                break;
+            const Node* new = process_let(ctx, old);
+            if (new)
+                return new;
+            break;
+        }
+        default: break;
+    }
+    return recreate_node_identity(&ctx->rewriter, old);
+}
+
+Module* opt_sroa(SHADY_UNUSED const CompilerConfig* config, Module* src) {
+    ArenaConfig aconfig = get_arena_config(get_module_arena(src));
+    IrArena* initial_arena = get_module_arena(src);
+    Module* dst = src;
+
+    for (size_t round = 0; round < MAX_ROUNDS; round++) {
+        IrArena* a = new_ir_arena(aconfig);
+        dst = new_module(a, get_module_name(src));
+        Context ctx = {
+            .rewriter = create_rewriter(src, dst, (RewriteNodeFn) process),
+            .split = new_dict(const Node*, SplitAlloca, (HashFn) hash_node, (CmpFn) compare_node),
+        };
+        rewrite_module(&ctx.rewriter);
+        destroy_rewriter(&ctx.rewriter);
+        destroy_dict(ctx.split);
+
+        if (get_module_arena(src) != initial_arena)
+            destroy_ir_arena(get_module_arena(src));
+        src = dst;
+        if (!ctx.changed)
+            break;
+    }
+
+    return dst;
+}
@@ -0,0 +1,603 @@
+#include "passes.h"
+
+#include "portability.h"
+#include "list.h"
+#include "dict.h"
+#include "arena.h"
+#include "log.h"
+
+#include "../analysis/scope.h"
+#include "../analysis/uses.h"
+#include "../analysis/leak.h"
+
+#include "../rewrite.h"
+#include "../type.h"
+
+KeyHash hash_node(const Node**);
+bool compare_node(const Node**, const Node**);
+
+typedef struct Phi_ Phi;
+/// A block parameter standing for the value of a promoted alloca on entry to some abstraction
+struct Phi_ {
+    /// the old alloca'd pointer
+    const Node* ptr;
+    /// created in the destination arena once the abstraction gets rewritten
+    const Node* param;
+    Phi* next;
+};
+
+typedef enum { DefNone, DefUndef, DefValue, DefPhi } DefTag;
+
+/// What a promoted pointer holds at some point of the function
+typedef struct {
+    DefTag tag;
+    /// the old stored value, or the Phi
+    const void* payload;
+} Def;
+
+typedef struct {
+    Rewriter rewriter;
+    Arena* arena;
+    Scope* scope;
+    const UsesMap* uses;
+    /// old alloca'd pointer -> CFNode* of the alloca
+    struct Dict* promoted;
+    /// old abstraction -> Phi*
+    struct Dict* phis;
+    /// old Let of a structured construct -> Nodes of old pointers stored to inside of it
+    struct Dict* modified;
+    /// old join point -> old Let of its Control
+    struct Dict* joins;
+
+    /// the old abstraction we're rewriting the body of
+    const Node* abs;
+    /// innermost If, Match or Block, targeted by Yield
+    const Node* yield_target;
+    /// innermost Loop, targeted by MergeContinue and MergeBreak
+    const Node* loop_target;
+} Context;
+
+static CFNode* find_cfnode(Context* ctx, const Node* abs) {
+    CFNode** found = find_value_dict(const Node*, CFNode*, ctx->scope->map, abs);
+    return found ? *found : NULL;
+}
+
+static const PrimOp* get_let_primop(const Node* body) {
+    if (!body || body->tag != Let_TAG || get_let_instruction(body)->tag != PrimOp_TAG)
+        return NULL;
+    return &get_let_instruction(body)->payload.prim_op;
+}
+
+/// The alloca'd pointer must only ever be loaded from and stored to, never passed around or stored itself
+static bool is_promotable(const UsesMap* uses, const Node* ptr) {
+    for (const Use* use = get_first_use(uses, ptr); use; use = use->next_use) {
+        if (is_abstraction(use->user) && use->operand_class == NcVariable)
+            continue;
+        if (use->user->tag != PrimOp_TAG)
+            return false;
+        PrimOp payload = use->user->payload.prim_op;
+        if (payload.op != load_op && payload.op != store_op)
+            return false;
+        if (first(payload.operands) != ptr)
+            return false;
+        for (size_t i = 1; i < payload.operands.count; i++) {
+            if (payload.operands.nodes[i] == ptr)
+                return false;
+        }
+    }
+    return true;
+}
+
+static Phi* find_phis(Context* ctx, const Node* abs) {
+    Phi** found = find_value_dict(const Node*, Phi*, ctx->phis, abs);
+    return found ? *found : NULL;
+}
+
+static Phi* find_phi(Context* ctx, const Node* abs, const Node* ptr) {
+    for (Phi* phi = find_phis(ctx, abs); phi; phi = phi->next) {
+        if (phi->ptr == ptr)
+            return phi;
+    }
+    return NULL;
+}
+
+static bool add_phi(Context* ctx, const Node* abs, const Node* ptr) {
+    Phi* last = NULL;
+    for (Phi* phi = find_phis(ctx, abs); phi; phi = phi->next) {
+        if (phi->ptr == ptr)
+            return false;
+        last = phi;
+    }
+    Phi* phi = arena_alloc(ctx->arena, sizeof(Phi));
+    *phi = (Phi) { .ptr = ptr };
+    if (last)
+        last->next = phi;
+    else
+        insert_dict(const Node*, Phi*, ctx->phis, abs, phi);
+    return true;
+}
+
+static Nodes get_modified(Context* ctx, const Node* let) {
+    Nodes* found = find_value_dict(const Node*, Nodes, ctx->modified, let);
+    return found ? *found : empty(ctx->rewriter.src_arena);
+}
+
+/// What the body of @p n itself does to @p ptr, ignoring everything before it.
+static Def get_local_def(Context* ctx, const CFNode* n, const Node* ptr) {
+    const PrimOp* op = get_let_primop(get_abstraction_body(n->node));
+    if (!op)
+        return (Def) { .tag = DefNone };
+    if (op->op == store_op && first(op->operands) == ptr)
+        return (Def) { .tag = DefValue, .payload = op->operands.nodes[1] };
+    if ((op->op == alloca_op || op->op == alloca_logical_op) && first(get_abstraction_params(get_let_tail(get_abstraction_body(n->node)))) == ptr)
+        return (Def) { .tag = DefUndef };
+    return (Def) { .tag = DefNone };
+}
+
+/// Walks up the dominator tree until something defines @p ptr.
+static Def get_def_at_entry(Context* ctx, const CFNode* n, const Node* ptr) {
+    while (n) {
+        Phi* phi = find_phi(ctx, n->node, ptr);
+        if (phi)
+            return (Def) { .tag = DefPhi, .payload = phi };
+        n = n->idom;
+        if (!n)
+            break;
+        Def def = get_local_def(ctx, n, ptr);
+        if (def.tag != DefNone)
+            return def;
+    }
+    return (Def) { .tag = DefUndef };
+}
+
+static Def get_def_at_exit(Context* ctx, const CFNode* n, const Node* ptr) {
+    Def def = get_local_def(ctx, n, ptr);
+    if (def.tag != DefNone)
+        return def;
+    return get_def_at_entry(ctx, n, ptr);
+}
+
+static const Node* get_promoted_type(Context* ctx, const Node* ptr) {
+    const CFNode** alloca_node = find_value_dict(const Node*, const CFNode*, ctx->promoted, ptr);
+    assert(alloca_node);
+    return rewrite_node(&ctx->rewriter, first(get_let_primop(get_abstraction_body((*alloca_node)->node))->type_arguments));
+}
+
+static const Node* resolve_def(Context* ctx, const Node* ptr, Def def) {
+    switch (def.tag) {
+        case DefValue: return rewrite_node(&ctx->rewriter, def.payload);
+        case DefPhi: {
+            const Phi* phi = def.payload;
+            assert(phi->param);
+            return phi->param;
+        }
+        default: return undef(ctx->rewriter.dst_arena, (Undef) { .type = get_promoted_type(ctx, ptr) });
+    }
+}
+
+/// The values of @p ptrs when leaving the abstraction we're currently in, to be passed along some edge.
+static Nodes get_values_at_exit(Context* ctx, Nodes ptrs) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    const CFNode* n = find_cfnode(ctx, ctx->abs);
+    LARRAY(const Node*, values, ptrs.count);
+    for (size_t i = 0; i < ptrs.count; i++)
+        values[i] = resolve_def(ctx, ptrs.nodes[i], n ? get_def_at_exit(ctx, n, ptrs.nodes[i]) : (Def) { .tag = DefUndef });
+    return nodes(a, ptrs.count, values);
+}
+
+static Nodes get_phi_ptrs(Context* ctx, const Node* abs) {
+    Nodes ptrs = empty(ctx->rewriter.src_arena);
+    for (Phi* phi = find_phis(ctx, abs); phi; phi = phi->next)
+        ptrs = append_nodes(ctx->rewriter.src_arena, ptrs, phi->ptr);
+    return ptrs;
+}
+
+static Nodes create_phi_params(Context* ctx, const Node* abs) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    Nodes params = empty(a);
+    for (Phi* phi = find_phis(ctx, abs); phi; phi = phi->next) {
+        phi->param = var(a, qualified_type_helper(get_promoted_type(ctx, phi->ptr), false), unique_name(a, "ssa_phi"));
+        params = append_nodes(a, params, phi->param);
+    }
+    return params;
+}
+
+/// Structured constructs hide their merges from the scope: we walk up from the store to the alloca, and every construct we
+/// leave on the way needs to carry the value out through its yields (and around its back-edge for loops).
+static bool mark_enclosing_constructs(Context* ctx, const CFNode* n, const CFNode* alloca_node, const Node* ptr, bool commit) {
+    while (n && n != alloca_node) {
+        const CFNode* parent = n->idom;
+        if (!parent)
+            return false;
+        bool entered = false;
+        for (size_t i = 0; i < entries_count_list(n->pred_edges); i++)
+            entered |= read_list(CFEdge, n->pred_edges)[i].type == StructuredEnterBodyEdge;
+        if (entered) {
+            const Node* let = get_abstraction_body(parent->node);
+            const Node* instruction = get_let_instruction(let);
+            switch (instruction->tag) {
+                case If_TAG:
+                case Match_TAG:
+                case Loop_TAG:
+                case Block_TAG: break;
+                // we need to see every join to add the values to
+                case Control_TAG:
+                    if (!is_control_static(ctx->uses, instruction))
+                        return false;
+                    break;
+                default: return false;
+            }
+            if (commit) {
+                Nodes modified = get_modified(ctx, let);
+                bool found = false;
+                for (size_t i = 0; i < modified.count; i++)
+                    found |= modified.nodes[i] == ptr;
+                if (!found) {
+                    modified = append_nodes(ctx->rewriter.src_arena, modified, ptr);
+                    insert_dict(const Node*, Nodes, ctx->modified, let, modified);
+                    add_phi(ctx, get_let_tail(let), ptr);
+                    if (instruction->tag == Loop_TAG)
+                        add_phi(ctx, instruction->payload.loop_instr.body, ptr);
+                }
+            }
+        }
+        n = parent;
+    }
+    return n == alloca_node;
+}
+
+static void place_phis(Context* ctx, struct List** frontiers, const Node* ptr, const CFNode* alloca_node) {
+    struct List* stores = new_list(const CFNode*);
+    for (size_t i = 0; i < ctx->scope->size; i++) {
+        const CFNode* n = ctx->scope->rpo[i];
+        Def def = get_local_def(ctx, n, ptr);
+        if (def.tag == DefValue)
+            append_list(const CFNode*, stores, n);
+    }
+
+    bool ok = true;
+    for (size_t i = 0; i < entries_count_list(stores); i++)
+        ok &= mark_enclosing_constructs(ctx, read_list(const CFNode*, stores)[i], alloca_node, ptr, false);
+
+    if (ok) {
+        debugv_print("opt_ssa: promoting ");
+        log_node(DEBUGV, ptr);
+        debugv_print(".\n");
+        insert_dict(const Node*, const CFNode*, ctx->promoted, ptr, alloca_node);
+        for (size_t i = 0; i < entries_count_list(stores); i++)
+            mark_enclosing_constructs(ctx, read_list(const CFNode*, stores)[i], alloca_node, ptr, true);
+
+        // the structured merges we just placed define the value as well
+        struct List* worklist = new_list(const CFNode*);
+        for (size_t i = 0; i < ctx->scope->size; i++) {
+            const CFNode* n = ctx->scope->rpo[i];
+            if (get_local_def(ctx, n, ptr).tag == DefValue || find_phi(ctx, n->node, ptr))
+                append_list(const CFNode*, worklist, n);
+        }
+        while (entries_count_list(worklist) > 0) {
+            const CFNode* n = pop_last_list(const CFNode*, worklist);
+            struct List* frontier = frontiers[n->rpo_index];
+            for (size_t i = 0; i < entries_count_list(frontier); i++) {
+                const CFNode* y = read_list(const CFNode*, frontier)[i];
+                // no point in merging values outside of where the alloca is live
+                if (!cfnode_dominates(alloca_node, y))
+                    continue;
+                if (add_phi(ctx, y->node, ptr))
+                    append_list(const CFNode*, worklist, y);
+            }
+        }
+        destroy_list(worklist);
+    }
+    destroy_list(stores);
+}
+
+/// Dominance frontiers over jump edges (Cooper, Harvey & Kennedy), structured merges are dealt with separately.
+static struct List** compute_frontiers(Scope* scope) {
+    struct List** frontiers = calloc(scope->size, sizeof(struct List*));
+    for (size_t i = 0; i < scope->size; i++)
+        frontiers[i] = new_list(const CFNode*);
+    for (size_t i = 0; i < scope->size; i++) {
+        const CFNode* n = scope->rpo[i];
+        size_t jumps = 0;
+        for (size_t j = 0; j < entries_count_list(n->pred_edges); j++)
+            jumps += read_list(CFEdge, n->pred_edges)[j].type == JumpEdge;
+        if (jumps < 2)
+            continue;
+        for (size_t j = 0; j < entries_count_list(n->pred_edges); j++) {
+            CFEdge edge = read_list(CFEdge, n->pred_edges)[j];
+            if (edge.type != JumpEdge)
+                continue;
+            for (const CFNode* runner = edge.src; runner && runner != n->idom; runner = runner->idom) {
+                struct List* frontier = frontiers[runner->rpo_index];
+                bool present = false;
+                for (size_t k = 0; k < entries_count_list(frontier); k++)
+                    present |= read_list(const CFNode*, frontier)[k] == n;
+                if (!present)
+                    append_list(const CFNode*, frontier, n);
+            }
+        }
+    }
+    return frontiers;
+}
+
+static bool find_promotable_allocas(Context* ctx, const Node* fn) {
+    const UsesMap* uses = create_uses_map(fn, (NcDeclaration | NcType));
+    ctx->uses = uses;
+    struct List** frontiers = compute_frontiers(ctx->scope);
+    for (size_t i = 0; i < ctx->scope->size; i++) {
+        const CFNode* n = ctx->scope->rpo[i];
+        const PrimOp* op = get_let_primop(get_abstraction_body(n->node));
+        if (!op || (op->op != alloca_op && op->op != alloca_logical_op))
+            continue;
+        const Node* ptr = first(get_abstraction_params(get_let_tail(get_abstraction_body(n->node))));
+        if (is_promotable(uses, ptr))
+            place_phis(ctx, frontiers, ptr, n);
+    }
+    for (size_t i = 0; i < ctx->scope->size; i++)
+        destroy_list(frontiers[i]);
+    free(frontiers);
+    destroy_uses_map(uses);
+    ctx->uses = NULL;
+    return entries_count_dict(ctx->promoted) > 0;
+}
+
+static bool is_promoted(Context* ctx, const Node* ptr) {
+    return find_value_dict(const Node*, const CFNode*, ctx->promoted, ptr);
+}
+
+static const Node* rewrite_tail(Context* ctx, const Node* old_tail) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    Nodes oparams = get_abstraction_params(old_tail);
+    Nodes nparams = recreate_variables(&ctx->rewriter, oparams);
+    register_processed_list(&ctx->rewriter, oparams, nparams);
+    nparams = concat_nodes(a, nparams, create_phi_params(ctx, old_tail));
+    Context tail_ctx = *ctx;
+    tail_ctx.abs = old_tail;
+    return case_(a, nparams, rewrite_node(&tail_ctx.rewriter, get_abstraction_body(old_tail)));
+}
+
+static const Node* rewrite_structured_let(Context* ctx, const Node* old) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    const Node* instruction = get_let_instruction(old);
+    Nodes modified = get_modified(ctx, old);
+    Nodes values = get_values_at_exit(ctx, modified);
+    LARRAY(const Type*, types, modified.count);
+    for (size_t i = 0; i < modified.count; i++)
+        types[i] = get_promoted_type(ctx, modified.nodes[i]);
+    Nodes extra_types = nodes(a, modified.count, types);
+
+    Context inner = *ctx;
+    const Node* ninstruction;
+    switch (instruction->tag) {
+        case If_TAG: {
+            If payload = instruction->payload.if_instr;
+            inner.yield_target = old;
+            const Node* if_false = NULL;
+            if (payload.if_false)
+                if_false = rewrite_node(&inner.rewriter, payload.if_false);
+            else if (modified.count > 0)
+                if_false = case_(a, empty(a), yield(a, (Yield) { .args = values }));
+            ninstruction = if_instr(a, (If) {
+                .yield_types = concat_nodes(a, rewrite_nodes(&ctx->rewriter, payload.yield_types), extra_types),
+                .condition = rewrite_node(&ctx->rewriter, payload.condition),
+                .if_true = rewrite_node(&inner.rewriter, payload.if_true),
+                .if_false = if_false,
+            });
+            break;
+        }
+        case Match_TAG: {
+            Match payload = instruction->payload.match_instr;
+            inner.yield_target = old;
+            ninstruction = match_instr(a, (Match) {
+                .yield_types = concat_nodes(a, rewrite_nodes(&ctx->rewriter, payload.yield_types), extra_types),
+                .inspect = rewrite_node(&ctx->rewriter, payload.inspect),
+                .literals = rewrite_nodes(&ctx->rewriter, payload.literals),
+                .cases = rewrite_nodes(&inner.rewriter, payload.cases),
+                .default_case = rewrite_node(&inner.rewriter, payload.default_case),
+            });
+            break;
+        }
+        case Block_TAG: {
+            Block payload = instruction->payload.block;
+            inner.yield_target = old;
+            ninstruction = block(a, (Block) {
+                .yield_types = concat_nodes(a, rewrite_nodes(&ctx->rewriter, payload.yield_types), add_qualifiers(a, extra_types, false)),
+                .inside = rewrite_node(&inner.rewriter, payload.inside),
+            });
+            break;
+        }
+        case Loop_TAG: {
+            Loop payload = instruction->payload.loop_instr;
+            inner.loop_target = old;
+            inner.abs = payload.body;
+            Nodes oparams = get_abstraction_params(payload.body);
+            Nodes nparams = recreate_variables(&ctx->rewriter, oparams);
+            register_processed_list(&ctx->rewriter, oparams, nparams);
+            nparams = concat_nodes(a, nparams, create_phi_params(ctx, payload.body));
+            const Node* body = case_(a, nparams, rewrite_node(&inner.rewriter, get_abstraction_body(payload.body)));
+            ninstruction = loop_instr(a, (Loop) {
+                .yield_types = concat_nodes(a, rewrite_nodes(&ctx->rewriter, payload.yield_types), extra_types),
+                .body = body,
+                .initial_args = concat_nodes(a, rewrite_nodes(&ctx->rewriter, payload.initial_args), values),
+            });
+            break;
+        }
+        case Control_TAG: {
+            Control payload = instruction->payload.control;
+            Nodes yield_types = concat_nodes(a, rewrite_nodes(&ctx->rewriter, payload.yield_types), extra_types);
+            const Node* ojp = first(get_abstraction_params(payload.inside));
+            const Node* njp = var(a, qualified_type(a, (QualifiedType) {
+                .type = join_point_type(a, (JoinPointType) { .yield_types = yield_types }),
+                .is_uniform = is_qualified_type_uniform(ojp->type),
+            }), ojp->payload.var.name);
+            register_processed(&ctx->rewriter, ojp, njp);
+            insert_dict(const Node*, const Node*, ctx->joins, ojp, old);
+            inner.abs = payload.inside;
+            ninstruction = control(a, (Control) {
+                .yield_types = yield_types,
+                .inside = case_(a, singleton(njp), rewrite_node(&inner.rewriter, get_abstraction_body(payload.inside))),
+            });
+            break;
+        }
+        default: SHADY_UNREACHABLE;
+    }
+    return let(a, ninstruction, rewrite_tail(ctx, get_let_tail(old)));
+}
+
+static const Node* process_let(Context* ctx, const Node* old) {
+    const Node* instruction = get_let_instruction(old);
+    switch (instruction->tag) {
+        case If_TAG:
+        case Match_TAG:
+        case Block_TAG:
+        case Loop_TAG: return rewrite_structured_let(ctx, old);
+        case Control_TAG:
+            if (get_modified(ctx, old).count > 0)
+                return rewrite_structured_let(ctx, old);
+            return NULL;
+        case PrimOp_TAG: break;
+        default: return NULL;
+    }
+
+    PrimOp payload = instruction->payload.prim_op;
+    const Node* tail = get_let_tail(old);
+    Context tail_ctx = *ctx;
+    tail_ctx.abs = tail;
+    switch (payload.op) {
+        case alloca_op:
+        case alloca_logical_op:
+            if (!is_promoted(ctx, first(get_abstraction_params(tail))))
+                return NULL;
+            break;
+        case store_op:
+            if (!is_promoted(ctx, first(payload.operands)))
+                return NULL;
+            break;
+        case load_op: {
+            const Node* ptr = first(payload.operands);
+            if (!is_promoted(ctx, ptr))
+                return NULL;
+            const Node* value = resolve_def(ctx, ptr, get_def_at_entry(ctx, find_cfnode(ctx, ctx->abs), ptr));
+            register_processed(&ctx->rewriter, first(get_abstraction_params(tail)), value);
+            break;
+        }
+        default: return NULL;
+    }
+    return rewrite_node(&tail_ctx.rewriter, get_abstraction_body(tail));
+}
+
+static const Node* process(Context* ctx, const Node* old) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    switch (old->tag) {
+        case Function_TAG: {
+            if (!get_abstraction_body(old) || lookup_annotation(old, "Internal"))
+                break;
+            Context fn_ctx = *ctx;
+            fn_ctx.scope = new_scope(old);
+            fn_ctx.promoted = new_dict(const Node*, const CFNode*, (HashFn) hash_node, (CmpFn) compare_node);
+            fn_ctx.phis = new_dict(const Node*, Phi*, (HashFn) hash_node, (CmpFn) compare_node);
+            fn_ctx.modified = new_dict(const Node*, Nodes, (HashFn) hash_node, (CmpFn) compare_node);
+            fn_ctx.joins = new_dict(const Node*, const Node*, (HashFn) hash_node, (CmpFn) compare_node);
+            fn_ctx.abs = old;
+            fn_ctx.yield_target = NULL;
+            fn_ctx.loop_target = NULL;
+            const Node* new;
+            if (find_promotable_allocas(&fn_ctx, old))
+                new = recreate_node_identity(&fn_ctx.rewriter, old);
+            else {
+                // nothing to do, don't bother with the custom rewriting
+                Context plain_ctx = *ctx;
+                plain_ctx.scope = NULL;
+                plain_ctx.promoted = NULL;
+                new = recreate_node_identity(&plain_ctx.rewriter, old);
+            }
+            destroy_dict(fn_ctx.joins);
+            destroy_dict(fn_ctx.modified);
+            destroy_dict(fn_ctx.phis);
+            destroy_dict(fn_ctx.promoted);
+            destroy_scope(fn_ctx.scope);
+            return new;
+        }
+        default: break;
+    }
+
+    if (!ctx->scope || !ctx->promoted || entries_count_dict(ctx->promoted) == 0)
+        return recreate_node_identity(&ctx->rewriter, old);
+
+    switch (old->tag) {
+        case Let_TAG: {
+            const Node* new = process_let(ctx, old);
+            if (new)
+                return new;
+            break;
+        }
+        case BasicBlock_TAG: {
+            Nodes oparams = get_abstraction_params(old);
+            Nodes nparams = recreate_variables(&ctx->rewriter, oparams);
+            register_processed_list(&ctx->rewriter, oparams, nparams);
+            nparams = concat_nodes(a, nparams, create_phi_params(ctx, old));
+            Node* bb = basic_block(a, (Node*) rewrite_node(&ctx->rewriter, old->payload.basic_block.fn), nparams, get_abstraction_name(old));
+            register_processed(&ctx->rewriter, old, bb);
+            Context bb_ctx = *ctx;
+            bb_ctx.abs = old;
+            bb->payload.basic_block.body = rewrite_node(&bb_ctx.rewriter, get_abstraction_body(old));
+            return bb;
+        }
+        case Case_TAG: {
+            Context case_ctx = *ctx;
+            case_ctx.abs = old;
+            return recreate_node_identity(&case_ctx.rewriter, old);
+        }
+        case Jump_TAG: {
+            const Node* target = rewrite_node(&ctx->rewriter, old->payload.jump.target);
+            Nodes args = rewrite_nodes(&ctx->rewriter, old->payload.jump.args);
+            args = concat_nodes(a, args, get_values_at_exit(ctx, get_phi_ptrs(ctx, old->payload.jump.target)));
+            return jump(a, (Jump) { .target = target, .args = args });
+        }
+        case Yield_TAG: {
+            if (!ctx->yield_target)
+                break;
+            Nodes args = rewrite_nodes(&ctx->rewriter, old->payload.yield.args);
+            args = concat_nodes(a, args, get_values_at_exit(ctx, get_modified(ctx, ctx->yield_target)));
+            return yield(a, (Yield) { .args = args });
+        }
+        case MergeContinue_TAG: {
+            if (!ctx->loop_target)
+                break;
+            Nodes args = rewrite_nodes(&ctx->rewriter, old->payload.merge_continue.args);
+            args = concat_nodes(a, args, get_values_at_exit(ctx, get_modified(ctx, ctx->loop_target)));
+            return merge_continue(a, (MergeContinue) { .args = args });
+        }
+        case Join_TAG: {
+            const Node** control = find_value_dict(const Node*, const Node*, ctx->joins, old->payload.join.join_point);
+            if (!control)
+                break;
+            Nodes args = rewrite_nodes(&ctx->rewriter, old->payload.join.args);
+            args = concat_nodes(a, args, get_values_at_exit(ctx, get_modified(ctx, *control)));
+            return join(a, (Join) { .join_point = rewrite_node(&ctx->rewriter, old->payload.join.join_point), .args = args });
+        }
+        case MergeBreak_TAG: {
+            if (!ctx->loop_target)
+                break;
+            Nodes args = rewrite_nodes(&ctx->rewriter, old->payload.merge_break.args);
+            args = concat_nodes(a, args, get_values_at_exit(ctx, get_modified(ctx, ctx->loop_target)));
+            return merge_break(a, (MergeBreak) { .args = args });
+        }
+        default: break;
+    }
+    return recreate_node_identity(&ctx->rewriter, old);
+}
+
+Module* opt_ssa(SHADY_UNUSED const CompilerConfig* config, Module* src) {
+    ArenaConfig aconfig = get_arena_config(get_module_arena(src));
+    IrArena* a = new_ir_arena(aconfig);
+    Module* dst = new_module(a, get_module_name(src));
+    Context ctx = {
+        .rewriter = create_rewriter(src, dst, (RewriteNodeFn) process),
+        .arena = new_arena(),
+    };
+    rewrite_module(&ctx.rewriter);
+    destroy_rewriter(&ctx.rewriter);
+    destroy_arena(ctx.arena);
+    return dst;
+}
@@ -1,8 +1,13 @@
 #include "passes.h"
 
 #include "../rewrite.h"
+#include "../visit.h"
 #include "portability.h"
 #include "log.h"
+#include "dict.h"
+
+KeyHash hash_node(const Node**);
+bool compare_node(const Node**, const Node**);
 
 typedef struct StackState_ StackState;
 struct StackState_ {
@@ -17,6 +22,8 @@ struct StackState_ {
 typedef struct {
     Rewriter rewriter;
     StackState* state;
+    /// old Function -> bool, whether calling it leaves the stack as it found it without looking at what's on it
+    struct Dict* neutral_fns;
 } Context;
 
 static void tag_leaks(Context* ctx) {
@@ -27,6 +34,85 @@ static void tag_leaks(Context* ctx) {
     }
 }
 
+typedef struct {
+    Visitor visitor;
+    Context* ctx;
+    struct Dict* seen;
+    bool allow_frames;
+    bool touches_stack;
+} StackVisitor;
+
+static bool is_stack_neutral_fn(Context* ctx, const Node* fn);
+
+static void search_for_stack_accesses(StackVisitor* v, const Node* node) {
+    if (v->touches_stack)
+        return;
+    if (is_abstraction(node) && !insert_set_get_result(const Node*, v->seen, node))
+        return;
+    switch (node->tag) {
+        case PrimOp_TAG: {
+            switch (node->payload.prim_op.op) {
+                case get_stack_pointer_op:
+                case set_stack_pointer_op:
+                case get_stack_base_op:
+                    // a function setting up and tearing down its own frame is fine
+                    if (v->allow_frames)
+                        break;
+                    // fallthrough
+                case push_stack_op:
+                case pop_stack_op: v->touches_stack = true; return;
+                default: break;
+            }
+            break;
+        }
+        case Call_TAG: {
+            const Node* callee = node->payload.call.callee;
+            if (callee->tag != FnAddr_TAG || !is_stack_neutral_fn(v->ctx, callee->payload.fn_addr.fn)) {
+                v->touches_stack = true;
+                return;
+            }
+            break;
+        }
+        case TailCall_TAG: v->touches_stack = true; return;
+        default: break;
+    }
+    visit_node_operands(&v->visitor, NcDeclaration, node);
+}
+
+static bool is_stack_neutral_fn(Context* ctx, const Node* fn) {
+    bool* found = find_value_dict(const Node*, bool, ctx->neutral_fns, fn);
+    if (found)
+        return *found;
+    // leaf functions are never recursive, but be safe while we look
+    bool neutral = false;
+    insert_dict(const Node*, bool, ctx->neutral_fns, fn, neutral);
+    if (lookup_annotation(fn, "Leaf") && get_abstraction_body(fn)) {
+        StackVisitor v = {
+            .visitor = { .visit_node_fn = (VisitNodeFn) search_for_stack_accesses },
+            .ctx = ctx,
+            .seen = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+            .allow_frames = true,
+        };
+        search_for_stack_accesses(&v, get_abstraction_body(fn));
+        destroy_dict(v.seen);
+        neutral = !v.touches_stack;
+    }
+    insert_dict(const Node*, bool, ctx->neutral_fns, fn, neutral);
+    return neutral;
+}
+
+/// Whether a structured instruction, along with everything nested in it, stays clear of the stack
+static bool is_stack_neutral_instruction(Context* ctx, const Node* instruction) {
+    StackVisitor v = {
+        .visitor = { .visit_node_fn = (VisitNodeFn) search_for_stack_accesses },
+        .ctx = ctx,
+        .seen = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+    };
+    search_for_stack_accesses(&v, instruction);
+    destroy_dict(v.seen);
+    return !v.touches_stack;
+}
+
 static const Node* process(Context* ctx, const Node* node) {
     const Node* found = search_processed(&ctx->rewriter, node);
     if (found) return found;
@@ -37,6 +123,7 @@ static const Node* process(Context* ctx, const Node* node) {
 
     bool is_push = false;
     bool is_pop = false;
+    bool is_neutral = false;
 
     switch (is_terminator(node)) {
         case Terminator_Unreachable_TAG: break;
@@ -65,19 +152,30 @@ static const Node* process(Context* ctx, const Node* node) {
                             }
                             break;
                         }
+                        // the stack pointer gives away what was pushed, and moving it loses track of what's on top
+                        case get_stack_pointer_op:
+                        case set_stack_pointer_op:
+                        case get_stack_base_op: {
+                            tag_leaks(ctx);
+                            child_ctx.state = NULL;
+                            break;
+                        }
                         default: break;
                     }
                     break;
                 }
-                // We sadly don't handle those yet:
+                // Structured instructions and calls that stay clear of the stack let us carry on,
+                // anything else is considered to leak the state, and we need to forget about it too
                 case Match_TAG:
                 case Control_TAG:
                 case Loop_TAG:
                 case If_TAG:
                 case Instruction_Block_TAG:
-                // Leaf calls and indirect calls are not analysed and so they are considered to leak the state
-                // we also need to forget our information about the current state
                 case Instruction_Call_TAG: {
+                    if (is_stack_neutral_instruction(ctx, old_instruction)) {
+                        is_neutral = true;
+                        break;
+                    }
                     tag_leaks(ctx);
                     child_ctx.state = NULL;
                     break;
@@ -96,6 +194,11 @@ static const Node* process(Context* ctx, const Node* node) {
                 assert(ctx->state->type == VALUE);
                 const Node* value = ctx->state->value;
                 ninstruction = quote_helper(a, singleton(value));
+            } else if (is_neutral) {
+                // what's nested in there doesn't get to see our state
+                Context nested_ctx = *ctx;
+                nested_ctx.state = NULL;
+                ninstruction = recreate_node_identity(&nested_ctx.rewriter, old_instruction);
             } else {
                 // if the stack state is observed, or this was an unrelated instruction, leave it alone
                 ninstruction = recreate_node_identity(&ctx->rewriter, old_instruction);
@@ -132,9 +235,11 @@ Module* opt_stack(SHADY_UNUSED const CompilerConfig* config, Module* src) {
     Context ctx = {
         .rewriter = create_rewriter(src, dst, (RewriteNodeFn) process),
         .state = NULL,
+        .neutral_fns = new_dict(const Node*, bool, (HashFn) hash_node, (CmpFn) compare_node),
     };
 
     rewrite_module(&ctx.rewriter);
     destroy_rewriter(&ctx.rewriter);
+    destroy_dict(ctx.neutral_fns);
     return dst;
 }
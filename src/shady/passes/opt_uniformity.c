@@ -0,0 +1,350 @@
+#include "passes.h"
+
+#include "portability.h"
+#include "list.h"
+#include "dict.h"
+#include "log.h"
+
+#include "../analysis/scope.h"
+#include "../analysis/uses.h"
+#include "../analysis/leak.h"
+
+#include "../transform/ir_gen_helpers.h"
+
+#include "../rewrite.h"
+#include "../type.h"
+
+KeyHash hash_node(const Node**);
+bool compare_node(const Node**, const Node**);
+
+typedef struct {
+    Rewriter rewriter;
+    Scope* scope;
+    const UsesMap* uses;
+    /// old case -> the old instruction of the Let it is the tail of
+    struct Dict* let_instructions;
+    /// set of old parameters whose qualifier we're trying to improve on
+    struct Dict* candidates;
+    /// set of candidates that were proven to be varying after all
+    struct Dict* varying;
+    /// old value -> bool, caches is_varying during an iteration
+    struct Dict* memo;
+    /// set of old abstractions where invocations that took different sides of a varying branch might meet
+    struct Dict* divergent;
+} Context;
+
+/// Ops whose result is uniform exactly when all their operands are, according to check_type_prim_op
+static bool is_uniformity_preserving(Op op) {
+    switch (op) {
+        case neg_op: case not_op:
+        case add_op: case sub_op: case mul_op: case div_op: case mod_op: case min_op: case max_op:
+        case and_op: case or_op: case xor_op:
+        case lshift_op: case rshift_arithm_op: case rshift_logical_op:
+        case lt_op: case lte_op: case gt_op: case gte_op: case eq_op: case neq_op:
+        case sqrt_op: case inv_sqrt_op: case floor_op: case ceil_op: case round_op: case fract_op:
+        case sin_op: case cos_op: case exp_op: case pow_op: case abs_op: case sign_op:
+        case select_op: case extract_op: case extract_dynamic_op: case insert_op:
+        case convert_op: case reinterpret_op:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool is_varying(Context* ctx, const Node* value);
+
+static bool is_instruction_varying(Context* ctx, const Node* instruction) {
+    if (instruction->tag != PrimOp_TAG)
+        return true;
+    PrimOp payload = instruction->payload.prim_op;
+    if (payload.op == load_op) {
+        const Type* ptr_type = get_unqualified_type(first(payload.operands)->type);
+        if (!is_addr_space_uniform(instruction->arena, ptr_type->payload.ptr_type.address_space))
+            return true;
+    } else if (!is_uniformity_preserving(payload.op))
+        return true;
+    for (size_t i = 0; i < payload.operands.count; i++)
+        if (is_varying(ctx, payload.operands.nodes[i]))
+            return true;
+    return false;
+}
+
+/// Optimistic view of the uniformity of @p value: candidates are assumed uniform until proven otherwise,
+/// and so is everything computed purely out of them.
+static bool is_varying(Context* ctx, const Node* value) {
+    if (is_qualified_type_uniform(value->type))
+        return false;
+    if (value->tag != Variable_TAG)
+        return true;
+    if (find_key_dict(const Node*, ctx->candidates, value))
+        return find_key_dict(const Node*, ctx->varying, value);
+
+    bool* found = find_value_dict(const Node*, bool, ctx->memo, value);
+    if (found)
+        return *found;
+    bool varying = true;
+    const Node* abs = value->payload.var.abs;
+    const Node** instruction = abs ? find_value_dict(const Node*, const Node*, ctx->let_instructions, abs) : NULL;
+    if (instruction && get_abstraction_params(abs).count == 1)
+        varying = is_instruction_varying(ctx, *instruction);
+    insert_dict(const Node*, bool, ctx->memo, value, varying);
+    return varying;
+}
+
+/// A terminator that can send invocations of the same subgroup down different paths
+static bool is_divergent_branch(Context* ctx, const Node* terminator) {
+    if (!terminator)
+        return false;
+    switch (terminator->tag) {
+        case Branch_TAG: return is_varying(ctx, terminator->payload.branch.branch_condition);
+        case Switch_TAG: return is_varying(ctx, terminator->payload.br_switch.switch_value);
+        case Let_TAG: {
+            const Node* instruction = get_let_instruction(terminator);
+            switch (instruction->tag) {
+                case If_TAG: return is_varying(ctx, instruction->payload.if_instr.condition);
+                case Match_TAG: return is_varying(ctx, instruction->payload.match_instr.inspect);
+                default: return false;
+            }
+        }
+        default: return false;
+    }
+}
+
+/// The tail of a structured construct enclosing @p branch is where its invocations are guaranteed to meet again.
+static bool is_reconvergence_point(const CFNode* node, const CFNode* branch) {
+    for (size_t i = 0; i < entries_count_list(node->pred_edges); i++) {
+        CFEdge edge = read_list(CFEdge, node->pred_edges)[i];
+        if (edge.type == StructuredPseudoExitEdge && cfnode_dominates(edge.src, branch))
+            return true;
+    }
+    return false;
+}
+
+/// Marks everything reachable from @p branch before the invocations reconverge.
+/// This over-approximates the join region, but it is sound even under temporal divergence out of loops.
+static void mark_divergent_region(Context* ctx, const CFNode* branch) {
+    struct Dict* visited = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node);
+    struct List* queue = new_list(const CFNode*);
+    append_list(const CFNode*, queue, branch);
+    insert_set_get_result(const Node*, visited, branch->node);
+    while (entries_count_list(queue) > 0) {
+        const CFNode* node = pop_last_list(const CFNode*, queue);
+        for (size_t i = 0; i < entries_count_list(node->succ_edges); i++) {
+            const CFNode* succ = read_list(CFEdge, node->succ_edges)[i].dst;
+            insert_set_get_result(const Node*, ctx->divergent, succ->node);
+            if (is_reconvergence_point(succ, branch))
+                continue;
+            if (insert_set_get_result(const Node*, visited, succ->node))
+                append_list(const CFNode*, queue, succ);
+        }
+    }
+    destroy_list(queue);
+    destroy_dict(visited);
+}
+
+/// Checks every predecessor of @p node passes a uniform value for its parameter @p i
+static bool are_incoming_args_uniform(Context* ctx, const CFNode* node, size_t i) {
+    size_t count = 0;
+    for (size_t j = 0; j < entries_count_list(node->pred_edges); j++) {
+        CFEdge edge = read_list(CFEdge, node->pred_edges)[j];
+        if (!edge.src->node)
+            return false;
+        const Node* terminator = get_abstraction_body(edge.src->node);
+        Nodes jumps;
+        switch (edge.type) {
+            case JumpEdge:
+                switch (terminator->tag) {
+                    case Jump_TAG: jumps = singleton(terminator); break;
+                    case Branch_TAG: jumps = mk_nodes(terminator->arena, terminator->payload.branch.true_jump, terminator->payload.branch.false_jump); break;
+                    case Switch_TAG: jumps = append_nodes(terminator->arena, terminator->payload.br_switch.case_jumps, terminator->payload.br_switch.default_jump); break;
+                    default: return false;
+                }
+                for (size_t k = 0; k < jumps.count; k++) {
+                    Jump jump = jumps.nodes[k]->payload.jump;
+                    if (jump.target != node->node)
+                        continue;
+                    if (is_varying(ctx, jump.args.nodes[i]))
+                        return false;
+                    count++;
+                }
+                break;
+            case StructuredLeaveBodyEdge:
+                assert(terminator->tag == Join_TAG);
+                if (is_varying(ctx, terminator->payload.join.args.nodes[i]))
+                    return false;
+                count++;
+                break;
+            case StructuredPseudoExitEdge:
+                continue;
+            default:
+                return false;
+        }
+    }
+    return count > 0;
+}
+
+/// The tail of a Let is where assume_uniform gets inserted, this checks we haven't done so already
+static bool is_tail_already_promoted(const Node* tail) {
+    const Node* body = get_abstraction_body(tail);
+    if (body->tag != Let_TAG || get_let_instruction(body)->tag != PrimOp_TAG)
+        return false;
+    PrimOp payload = get_let_instruction(body)->payload.prim_op;
+    if (payload.op != subgroup_assume_uniform_op)
+        return false;
+    Nodes params = get_abstraction_params(tail);
+    for (size_t i = 0; i < params.count; i++)
+        if (first(payload.operands) == params.nodes[i])
+            return true;
+    return false;
+}
+
+/// Parameters of basic blocks and of the tails of static controls are the only merge points we can requalify
+static void add_candidates(Context* ctx, struct List* merges, const Node* abs) {
+    append_list(const Node*, merges, abs);
+    Nodes params = get_abstraction_params(abs);
+    for (size_t i = 0; i < params.count; i++)
+        if (!is_qualified_type_uniform(params.nodes[i]->type))
+            insert_set_get_result(const Node*, ctx->candidates, params.nodes[i]);
+}
+
+static void analyse_function(Context* ctx) {
+    Scope* scope = ctx->scope;
+    struct List* merges = new_list(const Node*);
+    for (size_t i = 0; i < scope->size; i++) {
+        const Node* abs = scope->rpo[i]->node;
+        if (abs->tag == BasicBlock_TAG)
+            add_candidates(ctx, merges, abs);
+        const Node* body = get_abstraction_body(abs);
+        if (!body || body->tag != Let_TAG)
+            continue;
+        const Node* tail = get_let_tail(body);
+        const Node* instruction = get_let_instruction(body);
+        insert_dict(const Node*, const Node*, ctx->let_instructions, tail, instruction);
+        if (instruction->tag == Control_TAG && is_control_static(ctx->uses, instruction) && !is_tail_already_promoted(tail))
+            add_candidates(ctx, merges, tail);
+    }
+
+    // the set of varying candidates only grows, so this terminates
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        clear_dict(ctx->memo);
+        clear_dict(ctx->divergent);
+        for (size_t i = 0; i < scope->size; i++) {
+            const CFNode* node = scope->rpo[i];
+            if (is_divergent_branch(ctx, get_abstraction_body(node->node)))
+                mark_divergent_region(ctx, node);
+        }
+        for (size_t i = 0; i < entries_count_list(merges); i++) {
+            const Node* abs = read_list(const Node*, merges)[i];
+            const CFNode* node = scope_lookup(scope, abs);
+            bool divergent = find_key_dict(const Node*, ctx->divergent, abs);
+            Nodes params = get_abstraction_params(abs);
+            for (size_t j = 0; j < params.count; j++) {
+                const Node* param = params.nodes[j];
+                if (!find_key_dict(const Node*, ctx->candidates, param) || find_key_dict(const Node*, ctx->varying, param))
+                    continue;
+                if (divergent || !are_incoming_args_uniform(ctx, node, j)) {
+                    insert_set_get_result(const Node*, ctx->varying, param);
+                    changed = true;
+                }
+            }
+        }
+    }
+    destroy_list(merges);
+}
+
+static bool is_promoted(Context* ctx, const Node* param) {
+    return find_key_dict(const Node*, ctx->candidates, param) && !find_key_dict(const Node*, ctx->varying, param);
+}
+
+static bool has_promoted_params(Context* ctx, const Node* abs) {
+    if (!ctx->candidates)
+        return false;
+    Nodes params = get_abstraction_params(abs);
+    for (size_t i = 0; i < params.count; i++)
+        if (is_promoted(ctx, params.nodes[i]))
+            return true;
+    return false;
+}
+
+static const Node* process(Context* ctx, const Node* old) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    switch (old->tag) {
+        case Function_TAG: {
+            if (!get_abstraction_body(old))
+                break;
+            Context fn_ctx = *ctx;
+            fn_ctx.scope = new_scope(old);
+            fn_ctx.uses = create_uses_map(old, (NcDeclaration | NcType));
+            fn_ctx.let_instructions = new_dict(const Node*, const Node*, (HashFn) hash_node, (CmpFn) compare_node);
+            fn_ctx.candidates = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node);
+            fn_ctx.varying = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node);
+            fn_ctx.memo = new_dict(const Node*, bool, (HashFn) hash_node, (CmpFn) compare_node);
+            fn_ctx.divergent = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node);
+            analyse_function(&fn_ctx);
+            const Node* new = recreate_node_identity(&fn_ctx.rewriter, old);
+            destroy_dict(fn_ctx.let_instructions);
+            destroy_dict(fn_ctx.candidates);
+            destroy_dict(fn_ctx.varying);
+            destroy_dict(fn_ctx.memo);
+            destroy_dict(fn_ctx.divergent);
+            destroy_uses_map(fn_ctx.uses);
+            destroy_scope(fn_ctx.scope);
+            return new;
+        }
+        case BasicBlock_TAG: {
+            if (!has_promoted_params(ctx, old))
+                break;
+            Nodes oparams = get_abstraction_params(old);
+            LARRAY(const Node*, nparams, oparams.count);
+            for (size_t i = 0; i < oparams.count; i++) {
+                if (is_promoted(ctx, oparams.nodes[i])) {
+                    const Type* t = rewrite_node(&ctx->rewriter, get_unqualified_type(oparams.nodes[i]->type));
+                    nparams[i] = var(a, qualified_type_helper(t, true), get_value_name(oparams.nodes[i]));
+                } else
+                    nparams[i] = recreate_variable(&ctx->rewriter, oparams.nodes[i]);
+                register_processed(&ctx->rewriter, oparams.nodes[i], nparams[i]);
+            }
+            debugv_print("opt_uniformity: promoted parameters of %s\n", get_abstraction_name(old));
+            Node* bb = basic_block(a, (Node*) rewrite_node(&ctx->rewriter, old->payload.basic_block.fn), nodes(a, oparams.count, nparams), old->payload.basic_block.name);
+            register_processed(&ctx->rewriter, old, bb);
+            bb->payload.basic_block.body = rewrite_node(&ctx->rewriter, get_abstraction_body(old));
+            return bb;
+        }
+        case Let_TAG: {
+            // the result types of a join are fixed by the join point, so we promote the tail parameters with an assumption instead
+            const Node* otail = get_let_tail(old);
+            if (!has_promoted_params(ctx, otail))
+                break;
+            const Node* instruction = rewrite_node(&ctx->rewriter, get_let_instruction(old));
+            Nodes oparams = get_abstraction_params(otail);
+            Nodes nparams = recreate_variables(&ctx->rewriter, oparams);
+            BodyBuilder* bb = begin_body(a);
+            for (size_t i = 0; i < oparams.count; i++) {
+                const Node* value = nparams.nodes[i];
+                if (is_promoted(ctx, oparams.nodes[i]))
+                    value = first(gen_primop(bb, subgroup_assume_uniform_op, empty(a), singleton(value)));
+                register_processed(&ctx->rewriter, oparams.nodes[i], value);
+            }
+            const Node* tail = case_(a, nparams, finish_body(bb, rewrite_node(&ctx->rewriter, get_abstraction_body(otail))));
+            return let(a, instruction, tail);
+        }
+        default: break;
+    }
+    return recreate_node_identity(&ctx->rewriter, old);
+}
+
+Module* opt_uniformity(SHADY_UNUSED const CompilerConfig* config, Module* src) {
+    ArenaConfig aconfig = get_arena_config(get_module_arena(src));
+    IrArena* a = new_ir_arena(aconfig);
+    Module* dst = new_module(a, get_module_name(src));
+    Context ctx = {
+        .rewriter = create_rewriter(src, dst, (RewriteNodeFn) process),
+    };
+    // let-bound results follow the (possibly) more uniform operands we give them
+    ctx.rewriter.config.rebind_let = true;
+    rewrite_module(&ctx.rewriter);
+    destroy_rewriter(&ctx.rewriter);
+    return dst;
+}
@@ -0,0 +1,412 @@
+#include "passes.h"
+
+#include "portability.h"
+#include "dict.h"
+#include "log.h"
+
+#include "../transform/internal_constants.h"
+
+#include "../visit.h"
+#include "../rewrite.h"
+
+#include <string.h>
+
+/// we give up on computing trip counts past this
+#define MAX_TRIP_COUNT 65536
+
+typedef struct {
+    Rewriter rewriter;
+    const CompilerConfig* config;
+    /// whether the placeholder values of the internal constants got replaced by the real ones yet
+    bool specialized;
+} Context;
+
+typedef struct {
+    Visitor v;
+    size_t size;
+    /// how many loops deep we are, relative to the one we're looking at
+    size_t depth;
+    bool leaves_loop;
+    bool unstructured;
+} BodyVisitor;
+
+static void visit_body(BodyVisitor* v, const Node* node) {
+    switch (node->tag) {
+        case Let_TAG:
+        case LetMut_TAG:
+            v->size++;
+            break;
+        case MergeBreak_TAG:
+        case MergeContinue_TAG:
+            if (v->depth == 0)
+                v->leaves_loop = true;
+            break;
+        // copies of the body would jump to the same basic blocks
+        case Jump_TAG:
+        case Branch_TAG:
+        case Switch_TAG:
+        case TailCall_TAG:
+            v->unstructured = true;
+            return;
+        case Loop_TAG:
+            v->depth++;
+            visit_node_operands(&v->v, NcDeclaration, node);
+            v->depth--;
+            return;
+        default: break;
+    }
+    visit_node_operands(&v->v, NcDeclaration, node);
+}
+
+static BodyVisitor scan(const Node* node) {
+    BodyVisitor v = { .v = { .visit_node_fn = (VisitNodeFn) visit_body } };
+    visit_node(&v.v, node);
+    return v;
+}
+
+typedef enum { Invalid, Falls, Breaks, Continues } CaseKind;
+
+static CaseKind classify_case(const Node* c) {
+    if (!c)
+        return Falls;
+    const Node* terminator = get_abstraction_body(c);
+    while (terminator->tag == Let_TAG) {
+        BodyVisitor v = scan(get_let_instruction(terminator));
+        if (v.leaves_loop || v.unstructured)
+            return Invalid;
+        terminator = get_abstraction_body(get_let_tail(terminator));
+    }
+    switch (terminator->tag) {
+        case MergeBreak_TAG: return Breaks;
+        case MergeContinue_TAG: return Continues;
+        case Yield_TAG: return terminator->payload.yield.args.count == 0 ? Falls : Invalid;
+        default: return Invalid;
+    }
+}
+
+static const Node* get_case_terminator(const Node* c) {
+    const Node* terminator = get_abstraction_body(c);
+    while (terminator->tag == Let_TAG)
+        terminator = get_abstraction_body(get_let_tail(terminator));
+    return terminator;
+}
+
+typedef struct {
+    /// the let binding the if that decides whether to leave the loop
+    const Node* exit_let;
+    bool break_on_true;
+    /// the merge_continue reached by iterations that don't exit
+    const Node* latch;
+    size_t size;
+    /// how many times the loop continues before it finally breaks
+    size_t trip_count;
+} LoopInfo;
+
+/// We handle loop bodies made of a chain of lets, with a single if that either breaks out or carries on, and no other
+/// way of leaving the loop. That covers both loops that test their exit condition first and rotated ones.
+static bool analyse_loop_shape(const Node* body, LoopInfo* info) {
+    BodyVisitor whole = scan(body);
+    if (whole.unstructured)
+        return false;
+    info->size = whole.size;
+
+    CaseKind other = Invalid;
+    const Node* terminator = get_abstraction_body(body);
+    while (terminator->tag == Let_TAG) {
+        const Node* instruction = get_let_instruction(terminator);
+        if (!info->exit_let && instruction->tag == If_TAG && instruction->payload.if_instr.yield_types.count == 0) {
+            CaseKind t = classify_case(instruction->payload.if_instr.if_true);
+            CaseKind f = classify_case(instruction->payload.if_instr.if_false);
+            if (t == Breaks && (f == Falls || f == Continues)) {
+                info->exit_let = terminator;
+                info->break_on_true = true;
+                other = f;
+            } else if (f == Breaks && (t == Falls || t == Continues)) {
+                info->exit_let = terminator;
+                info->break_on_true = false;
+                other = t;
+            }
+        }
+        if (info->exit_let != terminator) {
+            BodyVisitor v = scan(instruction);
+            if (v.leaves_loop)
+                return false;
+        }
+        terminator = get_abstraction_body(get_let_tail(terminator));
+    }
+    if (!info->exit_let)
+        return false;
+
+    if (other == Continues) {
+        If exit = get_let_instruction(info->exit_let)->payload.if_instr;
+        info->latch = get_case_terminator(info->break_on_true ? exit.if_false : exit.if_true);
+        return true;
+    }
+    info->latch = terminator;
+    return terminator->tag == MergeContinue_TAG;
+}
+
+static bool is_internal_constant(const Node* decl) {
+#define X(name, T, placeholder) if (strcmp(get_decl_name(decl), #name) == 0) return true;
+    INTERNAL_CONSTANTS(X)
+#undef X
+    return false;
+}
+
+static const IntLiteral* resolve_to_known_int(Context* ctx, const Node* node) {
+    while (node) {
+        switch (node->tag) {
+            case IntLiteral_TAG: return &node->payload.int_literal;
+            case Variable_TAG: node = get_var_def(node->payload.var); continue;
+            case PrimOp_TAG: node = get_quoted_value(node); continue;
+            case RefDecl_TAG: node = node->payload.ref_decl.decl; continue;
+            case Constant_TAG:
+                if (!ctx->specialized && is_internal_constant(node)) {
+                    // the subgroup size is already known if we're going to specialize for an entry point later on
+                    if (ctx->config->specialization.entry_point && strcmp(get_decl_name(node), "SUBGROUP_SIZE") == 0)
+                        return &uint32_literal(ctx->rewriter.dst_arena, ctx->config->specialization.subgroup_size)->payload.int_literal;
+                    return NULL;
+                }
+                node = node->payload.constant.instruction;
+                continue;
+            default: return NULL;
+        }
+    }
+    return NULL;
+}
+
+/// Matches p, p + c and p - c where p is a parameter of the loop body, and returns p.
+static const Node* get_induction_base(Context* ctx, const Node* body, const Node* value, int64_t* offset) {
+    if (value->tag != Variable_TAG)
+        return NULL;
+    if (value->payload.var.abs == body) {
+        *offset = 0;
+        return value;
+    }
+    const Node* def = get_var_def(value->payload.var);
+    if (!def || def->tag != PrimOp_TAG || def->payload.prim_op.operands.count != 2)
+        return NULL;
+    PrimOp payload = def->payload.prim_op;
+    if (payload.op != add_op && payload.op != sub_op)
+        return NULL;
+    for (size_t i = 0; i < 2; i++) {
+        const Node* base = payload.operands.nodes[i];
+        const IntLiteral* lit = resolve_to_known_int(ctx, payload.operands.nodes[1 - i]);
+        if (base->tag != Variable_TAG || base->payload.var.abs != body || !lit)
+            continue;
+        // c - p isn't an induction we know how to deal with
+        if (payload.op == sub_op && i == 1)
+            return NULL;
+        int64_t c = get_int_literal_value(*lit, lit->is_signed);
+        *offset = payload.op == sub_op ? -c : c;
+        return base;
+    }
+    return NULL;
+}
+
+static int64_t wrap(int64_t value, IntSizes width, bool is_signed) {
+    return get_int_literal_value((IntLiteral) { .width = width, .is_signed = is_signed, .value = (uint64_t) value }, is_signed);
+}
+
+static bool compare(Op op, int64_t a, int64_t b, bool is_signed) {
+    if (!is_signed) {
+        uint64_t ua = (uint64_t) a;
+        uint64_t ub = (uint64_t) b;
+        switch (op) {
+            case lt_op: return ua < ub;
+            case lte_op: return ua <= ub;
+            case gt_op: return ua > ub;
+            case gte_op: return ua >= ub;
+            default: break;
+        }
+    }
+    switch (op) {
+        case lt_op: return a < b;
+        case lte_op: return a <= b;
+        case gt_op: return a > b;
+        case gte_op: return a >= b;
+        case eq_op: return a == b;
+        case neq_op: return a != b;
+        default: assert(false);
+    }
+    SHADY_UNREACHABLE;
+}
+
+/// The exit condition needs to compare an induction variable against a known bound, we then find out how many
+/// iterations it takes by stepping through them.
+static bool compute_trip_count(Context* ctx, const Node* loop, LoopInfo* info) {
+    const Node* body = loop->payload.loop_instr.body;
+    const Node* condition = get_let_instruction(info->exit_let)->payload.if_instr.condition;
+    if (condition->tag != Variable_TAG)
+        return false;
+    const Node* def = get_var_def(condition->payload.var);
+    if (!def || def->tag != PrimOp_TAG || def->payload.prim_op.operands.count != 2)
+        return false;
+    Op op = def->payload.prim_op.op;
+    switch (op) {
+        case lt_op: case lte_op: case gt_op: case gte_op: case eq_op: case neq_op: break;
+        default: return false;
+    }
+
+    Nodes operands = def->payload.prim_op.operands;
+    for (size_t side = 0; side < 2; side++) {
+        int64_t offset;
+        const Node* base = get_induction_base(ctx, body, operands.nodes[side], &offset);
+        const IntLiteral* bound = resolve_to_known_int(ctx, operands.nodes[1 - side]);
+        if (!base || !bound)
+            continue;
+
+        size_t index = base->payload.var.pindex;
+        const IntLiteral* init = resolve_to_known_int(ctx, loop->payload.loop_instr.initial_args.nodes[index]);
+        int64_t step;
+        if (!init || get_induction_base(ctx, body, info->latch->payload.merge_continue.args.nodes[index], &step) != base || step == 0)
+            return false;
+
+        IntSizes width = init->width;
+        bool is_signed = init->is_signed;
+        int64_t b = get_int_literal_value(*bound, is_signed);
+        int64_t i = get_int_literal_value(*init, is_signed);
+        for (size_t n = 0; n < MAX_TRIP_COUNT; n++) {
+            int64_t x = wrap(i + offset, width, is_signed);
+            bool result = side == 0 ? compare(op, x, b, is_signed) : compare(op, b, x, is_signed);
+            if (result == info->break_on_true) {
+                info->trip_count = n;
+                return true;
+            }
+            i = wrap(i + step, width, is_signed);
+        }
+        return false;
+    }
+    return false;
+}
+
+typedef enum { TakeContinue, TakeBreak, KeepExit } ExitMode;
+
+typedef struct {
+    /// null if we ran into unreachable
+    const Node* merge;
+    Nodes args;
+} IterationResult;
+
+static IterationResult emit_chain(Context* ctx, BodyBuilder* bb, const Node* terminator, const LoopInfo* info, ExitMode mode) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    while (terminator->tag == Let_TAG) {
+        const Node* instruction = get_let_instruction(terminator);
+        const Node* tail = get_let_tail(terminator);
+        if (terminator == info->exit_let && mode != KeepExit) {
+            If payload = instruction->payload.if_instr;
+            bool take_true = (mode == TakeBreak) == info->break_on_true;
+            const Node* taken = take_true ? payload.if_true : payload.if_false;
+            if (taken) {
+                IterationResult result = emit_chain(ctx, bb, get_abstraction_body(taken), info, mode);
+                if (result.merge)
+                    return result;
+            }
+        } else {
+            Nodes results = bind_instruction(bb, rewrite_node(&ctx->rewriter, instruction));
+            register_processed_list(&ctx->rewriter, get_abstraction_params(tail), results);
+        }
+        terminator = get_abstraction_body(tail);
+    }
+    switch (terminator->tag) {
+        case MergeContinue_TAG: return (IterationResult) { terminator, rewrite_nodes(&ctx->rewriter, terminator->payload.merge_continue.args) };
+        case MergeBreak_TAG: return (IterationResult) { terminator, rewrite_nodes(&ctx->rewriter, terminator->payload.merge_break.args) };
+        // falling out of the exit if
+        case Yield_TAG:
+        case Unreachable_TAG: return (IterationResult) { NULL, empty(a) };
+        default: assert(false);
+    }
+    SHADY_UNREACHABLE;
+}
+
+/// Emits a copy of the loop body with its parameters bound to @p args
+static IterationResult emit_iteration(Context* ctx, BodyBuilder* bb, const Node* body, Nodes args, const LoopInfo* info, ExitMode mode) {
+    Context copy_ctx = *ctx;
+    copy_ctx.rewriter.map = clone_dict(ctx->rewriter.map);
+    register_processed_list(&copy_ctx.rewriter, get_abstraction_params(body), args);
+    IterationResult result = emit_chain(&copy_ctx, bb, get_abstraction_body(body), info, mode);
+    destroy_dict(copy_ctx.rewriter.map);
+    return result;
+}
+
+static const Node* unroll_fully(Context* ctx, const Node* old_let, const LoopInfo* info) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    const Node* loop = get_let_instruction(old_let);
+    const Node* body = loop->payload.loop_instr.body;
+    BodyBuilder* bb = begin_body(a);
+    Nodes args = rewrite_nodes(&ctx->rewriter, loop->payload.loop_instr.initial_args);
+    for (size_t i = 0; i < info->trip_count; i++) {
+        IterationResult result = emit_iteration(ctx, bb, body, args, info, TakeContinue);
+        assert(result.merge && result.merge->tag == MergeContinue_TAG);
+        args = result.args;
+    }
+    IterationResult result = emit_iteration(ctx, bb, body, args, info, TakeBreak);
+    assert(result.merge && result.merge->tag == MergeBreak_TAG);
+    const Node* tail = get_let_tail(old_let);
+    register_processed_list(&ctx->rewriter, get_abstraction_params(tail), result.args);
+    return finish_body(bb, rewrite_node(&ctx->rewriter, get_abstraction_body(tail)));
+}
+
+/// Since the exit is taken after a multiple of @p factor iterations, only the last copy needs to test for it.
+static const Node* unroll_partially(Context* ctx, const Node* old_let, const LoopInfo* info, size_t factor) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    const Node* loop = get_let_instruction(old_let);
+    const Node* body = loop->payload.loop_instr.body;
+    BodyBuilder* bb = begin_body(a);
+    Nodes params = recreate_variables(&ctx->rewriter, get_abstraction_params(body));
+    Nodes args = params;
+    for (size_t i = 0; i + 1 < factor; i++) {
+        IterationResult result = emit_iteration(ctx, bb, body, args, info, TakeContinue);
+        assert(result.merge && result.merge->tag == MergeContinue_TAG);
+        args = result.args;
+    }
+    IterationResult result = emit_iteration(ctx, bb, body, args, info, KeepExit);
+    const Node* terminator = result.merge ? merge_continue(a, (MergeContinue) { .args = result.args }) : unreachable(a);
+    const Node* nloop = loop_instr(a, (Loop) {
+        .yield_types = rewrite_nodes(&ctx->rewriter, loop->payload.loop_instr.yield_types),
+        .body = case_(a, params, finish_body(bb, terminator)),
+        .initial_args = rewrite_nodes(&ctx->rewriter, loop->payload.loop_instr.initial_args),
+    });
+    return let(a, nloop, rewrite_node(&ctx->rewriter, get_let_tail(old_let)));
+}
+
+static const Node* process(Context* ctx, const Node* old) {
+    if (old->tag != Let_TAG || get_let_instruction(old)->tag != Loop_TAG)
+        return recreate_node_identity(&ctx->rewriter, old);
+
+    size_t budget = ctx->config->optimisations.unrolling.max_size;
+    const Node* loop = get_let_instruction(old);
+    LoopInfo info = { 0 };
+    if (!analyse_loop_shape(loop->payload.loop_instr.body, &info) || !compute_trip_count(ctx, loop, &info))
+        return recreate_node_identity(&ctx->rewriter, old);
+
+    // the body runs once more than the loop continues
+    size_t iterations = info.trip_count + 1;
+    if (iterations * info.size <= budget) {
+        debugv_print("opt_unroll: fully unrolling a loop with %zu iterations\n", iterations);
+        return unroll_fully(ctx, old, &info);
+    }
+
+    size_t factor = info.size ? budget / info.size : 0;
+    while (factor >= 2 && iterations % factor != 0)
+        factor--;
+    if (factor >= 2) {
+        debugv_print("opt_unroll: unrolling a loop with %zu iterations by a factor of %zu\n", iterations, factor);
+        return unroll_partially(ctx, old, &info, factor);
+    }
+    return recreate_node_identity(&ctx->rewriter, old);
+}
+
+Module* opt_unroll(const CompilerConfig* config, Module* src) {
+    ArenaConfig aconfig = get_arena_config(get_module_arena(src));
+    IrArena* a = new_ir_arena(aconfig);
+    Module* dst = new_module(a, get_module_name(src));
+    Context ctx = {
+        .rewriter = create_rewriter(src, dst, (RewriteNodeFn) process),
+        .config = config,
+        .specialized = aconfig.specializations.subgroup_size != 0,
+    };
+    rewrite_module(&ctx.rewriter);
+    destroy_rewriter(&ctx.rewriter);
+    return dst;
+}
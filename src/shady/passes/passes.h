@@ -107,9 +107,29 @@ RewritePass eliminate_constants;
 RewritePass mark_leaf_functions;
 /// Inlines basic blocks used exactly once, necessary after opt_restructure
 RewritePass opt_inline_jumps;
-/// In addition, also inlines function calls according to heuristics
+/// In addition, also inlines function calls: those with a single caller, and others while it pays off within the growth budget
 RewritePass opt_inline;
+/// Splits allocas of records and small arrays that are only accessed member by member into one alloca per member
+RewritePass opt_sroa;
+/// Promotes allocas that are only loaded from and stored to into SSA values, placing parameters at the iterated dominance frontiers of the stores
+RewritePass opt_ssa;
 RewritePass opt_mem2reg;
+/// Clones functions for constant arguments that recur across call sites, and removes unused parameters and results
+RewritePass opt_ipo;
+/// Turns calls through function pointers with known targets into direct calls, or into a dispatch over a few direct calls
+RewritePass opt_devirtualize;
+/// Works out which address space generic pointers point into, and accesses memory through specific pointers when it can
+RewritePass opt_address_spaces;
+/// Promotes basic block and join parameters to uniform when no varying branch can make the incoming values disagree
+RewritePass opt_uniformity;
+/// Replaces pure instructions with the results of an identical, dominating one
+RewritePass opt_gvn;
+/// Moves pure, loop-invariant instructions out of structured loop bodies and into the preheaders of natural loops
+RewritePass opt_licm;
+/// Propagates constants through basic block parameters, branches and function arguments
+RewritePass opt_sccp;
+/// Unrolls loops with a compile-time known trip count, fully or by a factor that fits the size budget
+RewritePass opt_unroll;
 
 /// Try to identify reconvergence points throughout the program for unstructured control flow programs
 RewritePass reconvergence_heuristics;
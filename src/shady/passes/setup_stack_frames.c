@@ -3,6 +3,7 @@
 #include "log.h"
 #include "portability.h"
 #include "list.h"
+#include "dict.h"
 #include "util.h"
 
 #include "../rewrite.h"
@@ -10,9 +11,16 @@
 #include "../type.h"
 #include "../ir_private.h"
 #include "../transform/ir_gen_helpers.h"
+#include "../transform/memory_layout.h"
+#include "../analysis/scope.h"
+#include "../analysis/uses.h"
+#include "../analysis/liveness.h"
 
 #include <assert.h>
 
+KeyHash hash_node(const Node**);
+bool compare_node(const Node**, const Node**);
+
 typedef struct Context_ {
     Rewriter rewriter;
     bool disable_lowering;
@@ -24,41 +32,232 @@ typedef struct Context_ {
 
 typedef struct {
     Visitor visitor;
-    Context* context;
-    BodyBuilder* bb;
-    Node* nom_t;
-    struct List* members;
+    struct List* allocas;
+    struct Dict* seen;
 } VContext;
 
 static void search_operand_for_alloca(VContext* vctx, const Node* node) {
-    IrArena* a = vctx->context->rewriter.dst_arena;
-    AddressSpace as;
-
     if (node->tag == PrimOp_TAG) {
         switch (node->payload.prim_op.op) {
-            case alloca_op: as = AsPrivatePhysical; break;
-            case alloca_subgroup_op: as = AsSubgroupPhysical; break;
-            default: goto not_alloca;
+            case alloca_op:
+            case alloca_subgroup_op: {
+                if (insert_set_get_result(const Node*, vctx->seen, node))
+                    append_list(const Node*, vctx->allocas, node);
+                return;
+            }
+            default: break;
         }
+    }
 
-        const Type* element_type = rewrite_node(&vctx->context->rewriter, node->payload.prim_op.type_arguments.nodes[0]);
-        assert(is_data_type(element_type));
-        const Node* slot_offset = gen_primop_e(vctx->bb, offset_of_op, singleton(type_decl_ref_helper(a, vctx->nom_t)), singleton(int32_literal(a, entries_count_list(vctx->members))));
-        append_list(const Type*, vctx->members, element_type);
+    visit_node_operands(&vctx->visitor, IGNORE_ABSTRACTIONS_MASK, node);
+}
 
-        const Node* slot = first(bind_instruction_named(vctx->bb, prim_op(a, (PrimOp) {
-            .op = lea_op,
-            .operands = mk_nodes(a, vctx->context->entry_base_stack_ptr, slot_offset) }), (String []) {format_string_arena(a->arena, "stack_slot_%d", entries_count_list(vctx->members)) }));
+/// An alloca, and the abstractions its memory might still be accessed from
+typedef struct {
+    const Node* instruction;
+    const Type* element_type;
+    /// set of old abstractions, NULL when the pointer escapes and we can't tell
+    struct Dict* region;
+} FrameAlloca;
 
-        const Node* ptr_t = ptr_type(a, (PtrType) { .pointed_type = element_type, .address_space = as });
-        slot = gen_reinterpret_cast(vctx->bb, ptr_t, slot);
+/// Allocas whose regions don't overlap can share a slot in the frame
+typedef struct {
+    struct List* allocas;
+    TypeMemLayout layout;
+    /// set when all the allocas in there agree on a type
+    const Type* type;
+} FrameSlot;
 
-        register_processed(&vctx->context->rewriter, node, quote_helper(a, singleton(slot)));
-        return;
+static void add_derived(const UsesMap* uses, struct List* derived, const Node* instruction, size_t result) {
+    for (const Use* use = get_first_use(uses, instruction); use; use = use->next_use) {
+        if (use->user->tag != Let_TAG)
+            continue;
+        Nodes results = get_abstraction_params(get_let_tail(use->user));
+        if (result < results.count)
+            append_list(const Node*, derived, results.nodes[result]);
     }
+}
 
-    not_alloca:
-    visit_node_operands(&vctx->visitor, IGNORE_ABSTRACTIONS_MASK, node);
+/// Finds the pointers derived from what @p alloca returns, returns false if one of them goes somewhere we can't follow
+static bool find_derived_pointers(const UsesMap* uses, const Node* alloca, struct List* derived) {
+    add_derived(uses, derived, alloca, 0);
+    for (size_t i = 0; i < entries_count_list(derived); i++) {
+        const Node* ptr = read_list(const Node*, derived)[i];
+        for (const Use* use = get_first_use(uses, ptr); use; use = use->next_use) {
+            if (is_abstraction(use->user) && use->operand_class == NcVariable)
+                continue;
+            if (use->user->tag != PrimOp_TAG)
+                return false;
+            PrimOp payload = use->user->payload.prim_op;
+            switch (payload.op) {
+                case load_op:
+                case memcpy_op: break;
+                case store_op: {
+                    if (payload.operands.nodes[1] == ptr)
+                        return false;
+                    break;
+                }
+                case lea_op:
+                case reinterpret_op:
+                case convert_op: add_derived(uses, derived, use->user, 0); break;
+                case quote_op: {
+                    for (size_t j = 0; j < payload.operands.count; j++)
+                        if (payload.operands.nodes[j] == ptr)
+                            add_derived(uses, derived, use->user, j);
+                    break;
+                }
+                default: return false;
+            }
+        }
+    }
+    return true;
+}
+
+static struct Dict* compute_alloca_region(Scope* scope, const UsesMap* uses, const Liveness* liveness, const Node* alloca) {
+    struct List* derived = new_list(const Node*);
+    struct Dict* region = NULL;
+    if (find_derived_pointers(uses, alloca, derived)) {
+        region = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node);
+        for (size_t i = 0; i < scope->size; i++) {
+            const Node* abs = scope->rpo[i]->node;
+            for (size_t j = 0; j < entries_count_list(derived); j++) {
+                const Node* ptr = read_list(const Node*, derived)[j];
+                if (ptr->payload.var.abs == abs || is_live_in(liveness, abs, ptr)) {
+                    insert_set_get_result(const Node*, region, abs);
+                    break;
+                }
+            }
+        }
+    }
+    destroy_list(derived);
+    return region;
+}
+
+static bool do_regions_overlap(const FrameAlloca* a, const FrameAlloca* b) {
+    if (!a->region || !b->region)
+        return true;
+    size_t i = 0;
+    const Node* abs;
+    while (dict_iter(a->region, &i, &abs, NULL)) {
+        if (find_key_dict(const Node*, b->region, abs))
+            return true;
+    }
+    return false;
+}
+
+/// Assigns the allocas of @p fn to slots, reusing them when the allocas are never live at the same time
+static struct List* color_frame_slots(Context* ctx, const Node* fn, struct List* allocas, FrameAlloca* frame_allocas) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    Scope* scope = new_scope(fn);
+    const UsesMap* uses = create_uses_map(fn, (NcDeclaration | NcType));
+    Liveness* liveness = compute_liveness(scope);
+
+    size_t allocas_count = entries_count_list(allocas);
+    struct List* slots = new_list(FrameSlot);
+    for (size_t i = 0; i < allocas_count; i++) {
+        const Node* instruction = read_list(const Node*, allocas)[i];
+        FrameAlloca* alloca = &frame_allocas[i];
+        *alloca = (FrameAlloca) {
+            .instruction = instruction,
+            .element_type = rewrite_node(&ctx->rewriter, first(instruction->payload.prim_op.type_arguments)),
+            .region = compute_alloca_region(scope, uses, liveness, instruction),
+        };
+        assert(is_data_type(alloca->element_type));
+        TypeMemLayout layout = get_mem_layout(a, alloca->element_type);
+
+        FrameSlot* slot = NULL;
+        for (size_t j = 0; j < entries_count_list(slots) && !slot; j++) {
+            FrameSlot* candidate = &read_list(FrameSlot, slots)[j];
+            bool free = true;
+            for (size_t k = 0; k < entries_count_list(candidate->allocas) && free; k++)
+                free = !do_regions_overlap(read_list(FrameAlloca*, candidate->allocas)[k], alloca);
+            if (free)
+                slot = candidate;
+        }
+        if (!slot) {
+            append_list(FrameSlot, slots, ((FrameSlot) { .allocas = new_list(FrameAlloca*), .layout = layout, .type = alloca->element_type }));
+            slot = &read_list(FrameSlot, slots)[entries_count_list(slots) - 1];
+        } else {
+            debugv_print("setup_stack_frames: %s shares a stack slot\n", get_abstraction_name(fn));
+            if (slot->type != alloca->element_type)
+                slot->type = NULL;
+            slot->layout.size_in_bytes = layout.size_in_bytes > slot->layout.size_in_bytes ? layout.size_in_bytes : slot->layout.size_in_bytes;
+            slot->layout.alignment_in_bytes = layout.alignment_in_bytes > slot->layout.alignment_in_bytes ? layout.alignment_in_bytes : slot->layout.alignment_in_bytes;
+        }
+        append_list(FrameAlloca*, slot->allocas, alloca);
+    }
+
+    // slots holding several types are made of words as wide as the strictest alignment among them
+    for (size_t j = 0; j < entries_count_list(slots); j++) {
+        FrameSlot* slot = &read_list(FrameSlot, slots)[j];
+        if (slot->type)
+            continue;
+        size_t alignment = slot->layout.alignment_in_bytes;
+        size_t word_size = int_size_in_bytes(a->config.memory.word_size);
+        if (alignment < word_size)
+            alignment = word_size;
+        IntSizes width = IntTy8;
+        while (int_size_in_bytes(width) < alignment && width < IntTy64)
+            width++;
+        size_t words = (slot->layout.size_in_bytes + int_size_in_bytes(width) - 1) / int_size_in_bytes(width);
+        slot->type = arr_type(a, (ArrType) {
+            .element_type = int_type(a, (Int) { .width = width, .is_signed = false }),
+            .size = uint32_literal(a, words),
+        });
+    }
+
+    for (size_t i = 0; i < allocas_count; i++) {
+        if (frame_allocas[i].region)
+            destroy_dict(frame_allocas[i].region);
+    }
+    destroy_liveness(liveness);
+    destroy_uses_map(uses);
+    destroy_scope(scope);
+    return slots;
+}
+
+static void setup_frame(Context* ctx, BodyBuilder* bb, const Node* fn, struct List* allocas) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    Module* m = ctx->rewriter.dst_module;
+
+    Node* nom_t = nominal_type(m, empty(a), format_string_arena(a->arena, "%s_stack_frame", get_abstraction_name(fn)));
+    ctx->entry_stack_offset = first(bind_instruction_named(bb, prim_op(a, (PrimOp) { .op = get_stack_pointer_op } ), (String []) {format_string_arena(a->arena, "saved_stack_ptr_entering_%s", get_abstraction_name(fn)) }));
+    ctx->entry_base_stack_ptr = gen_primop_ce(bb, get_stack_base_op, 0, NULL);
+
+    LARRAY(FrameAlloca, frame_allocas, entries_count_list(allocas));
+    struct List* slots = color_frame_slots(ctx, fn, allocas, frame_allocas);
+    size_t slots_count = entries_count_list(slots);
+    LARRAY(const Type*, members, slots_count);
+    for (size_t j = 0; j < slots_count; j++) {
+        FrameSlot* slot = &read_list(FrameSlot, slots)[j];
+        members[j] = slot->type;
+
+        const Node* slot_offset = gen_primop_e(bb, offset_of_op, singleton(type_decl_ref_helper(a, nom_t)), singleton(int32_literal(a, j)));
+        const Node* slot_ptr = first(bind_instruction_named(bb, prim_op(a, (PrimOp) {
+            .op = lea_op,
+            .operands = mk_nodes(a, ctx->entry_base_stack_ptr, slot_offset) }), (String []) {format_string_arena(a->arena, "stack_slot_%d", j + 1) }));
+
+        for (size_t k = 0; k < entries_count_list(slot->allocas); k++) {
+            FrameAlloca* alloca = read_list(FrameAlloca*, slot->allocas)[k];
+            AddressSpace as = alloca->instruction->payload.prim_op.op == alloca_subgroup_op ? AsSubgroupPhysical : AsPrivatePhysical;
+            const Node* ptr_t = ptr_type(a, (PtrType) { .pointed_type = alloca->element_type, .address_space = as });
+            const Node* ptr = gen_reinterpret_cast(bb, ptr_t, slot_ptr);
+            register_processed(&ctx->rewriter, alloca->instruction, quote_helper(a, singleton(ptr)));
+        }
+        destroy_list(slot->allocas);
+    }
+    destroy_list(slots);
+
+    nom_t->payload.nom_type.body = record_type(a, (RecordType) {
+        .members = nodes(a, slots_count, members),
+        .names = strings(a, 0, NULL),
+        .special = 0
+    });
+
+    const Node* frame_size = gen_primop_e(bb, size_of_op, singleton(type_decl_ref_helper(a, nom_t)), empty(a));
+    frame_size = convert_int_extend_according_to_src_t(bb, get_unqualified_type(ctx->entry_stack_offset->type), frame_size);
+    const Node* updated_stack_ptr = gen_primop_e(bb, add_op, empty(a), mk_nodes(a, ctx->entry_stack_offset, frame_size));
+    gen_primop(bb, set_stack_pointer_op, empty(a), singleton(updated_stack_ptr));
 }
 
 static const Node* process(Context* ctx, const Node* node) {
@@ -66,7 +265,6 @@ static const Node* process(Context* ctx, const Node* node) {
     if (found) return found;
 
     IrArena* a = ctx->rewriter.dst_arena;
-    Module* m = ctx->rewriter.dst_module;
     switch (node->tag) {
         case Function_TAG: {
             Node* fun = recreate_decl_header_identity(&ctx->rewriter, node);
@@ -74,34 +272,22 @@ static const Node* process(Context* ctx, const Node* node) {
             ctx2.disable_lowering = lookup_annotation_with_string_payload(node, "DisablePass", "setup_stack_frames");
 
             BodyBuilder* bb = begin_body(a);
-            if (!ctx2.disable_lowering) {
-                Node* nom_t = nominal_type(m, empty(a), format_string_arena(a->arena, "%s_stack_frame", get_abstraction_name(node)));
-                ctx2.entry_stack_offset = first(bind_instruction_named(bb, prim_op(a, (PrimOp) { .op = get_stack_pointer_op } ), (String []) {format_string_arena(a->arena, "saved_stack_ptr_entering_%s", get_abstraction_name(fun)) }));
-                ctx2.entry_base_stack_ptr = gen_primop_ce(bb, get_stack_base_op, 0, NULL);
+            ctx2.entry_stack_offset = NULL;
+            if (!ctx2.disable_lowering && node->payload.fun.body) {
                 VContext vctx = {
                     .visitor = {
                         .visit_node_fn = (VisitNodeFn) search_operand_for_alloca,
                     },
-                    .context = &ctx2,
-                    .bb = bb,
-                    .nom_t = nom_t,
-                    .members = new_list(const Node*),
+                    .allocas = new_list(const Node*),
+                    .seen = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node),
                 };
-                if (node->payload.fun.body) {
-                    search_operand_for_alloca(&vctx, node->payload.fun.body);
-                    visit_function_rpo(&vctx.visitor, node);
-                }
-                vctx.nom_t->payload.nom_type.body = record_type(a, (RecordType) {
-                    .members = nodes(a, entries_count_list(vctx.members), read_list(const Node*, vctx.members)),
-                    .names = strings(a, 0, NULL),
-                    .special = 0
-                });
-                destroy_list(vctx.members);
-
-                const Node* frame_size = gen_primop_e(bb, size_of_op, singleton(type_decl_ref_helper(a, nom_t)), empty(a));
-                frame_size = convert_int_extend_according_to_src_t(bb, get_unqualified_type(ctx2.entry_stack_offset->type), frame_size);
-                const Node* updated_stack_ptr = gen_primop_e(bb, add_op, empty(a), mk_nodes(a, ctx2.entry_stack_offset, frame_size));
-                gen_primop(bb, set_stack_pointer_op, empty(a), singleton(updated_stack_ptr));
+                search_operand_for_alloca(&vctx, node->payload.fun.body);
+                visit_function_rpo(&vctx.visitor, node);
+                // functions without allocas leave the stack pointer alone
+                if (entries_count_list(vctx.allocas) > 0)
+                    setup_frame(&ctx2, bb, node, vctx.allocas);
+                destroy_list(vctx.allocas);
+                destroy_dict(vctx.seen);
             }
             if (node->payload.fun.body)
                 fun->payload.fun.body = finish_body(bb, rewrite_node(&ctx2.rewriter, node->payload.fun.body));
@@ -111,8 +297,7 @@ static const Node* process(Context* ctx, const Node* node) {
         }
         case Return_TAG: {
             BodyBuilder* bb = begin_body(a);
-            if (!ctx->disable_lowering) {
-                assert(ctx->entry_stack_offset);
+            if (!ctx->disable_lowering && ctx->entry_stack_offset) {
                 // Restore SP before calling exit
                 bind_instruction(bb, prim_op(a, (PrimOp) {
                     .op = set_stack_pointer_op,
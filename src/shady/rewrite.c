@@ -341,7 +341,11 @@ const Node* recreate_node_identity(Rewriter* rewriter, const Node* node) {
                 tail = rewrite_op_helper(rewriter, NcCase, "tail", node->payload.let.tail);
             return let(arena, instruction, tail);
         }
-        case LetMut_TAG: error("De-sugar this by hand")
+        case LetMut_TAG: {
+            const Node* instruction = rewrite_op_helper(rewriter, NcInstruction, "instruction", node->payload.let_mut.instruction);
+            const Node* tail = rewrite_op_helper(rewriter, NcCase, "tail", node->payload.let_mut.tail);
+            return let_mut(arena, instruction, tail);
+        }
         case Case_TAG: {
             Nodes params = recreate_variables(rewriter, node->payload.case_.params);
             register_processed_list(rewriter, node->payload.case_.params, params);
@@ -153,14 +153,9 @@ bool is_builtin_load_op(const Node* n, Builtin* out) {
 }
 
 const Node* find_or_process_decl(Rewriter* rewriter, const char* name) {
-    Nodes old_decls = get_module_declarations(rewriter->src_module);
-    for (size_t i = 0; i < old_decls.count; i++) {
-        const Node* decl = old_decls.nodes[i];
-        if (strcmp(get_decl_name(decl), name) == 0) {
-            return rewrite_node(rewriter, decl);
-        }
-    }
-    assert(false);
+    const Node* decl = get_declaration(rewriter->src_module, name);
+    assert(decl);
+    return rewrite_node(rewriter, decl);
 }
 
 const Node* access_decl(Rewriter* rewriter, const char* name) {
@@ -0,0 +1,61 @@
+#include "../src/frontends/slim/token.h"
+
+#include "growy.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CHECK(x, failure_handler) { if (!(x)) { error_print(#x " failed\n"); failure_handler; } }
+
+static const char snippet[] =
+    "// generated helper\n"
+    "@Leaf fn helper_%d i32(varying i32 a, uniform u32 b) {\n"
+    "    /* some block comment */\n"
+    "    val x = add(a, 0x10);\n"
+    "    val y = mul(x, 1.5e-3f);\n"
+    "    if (gt(x, 42)) { return (x); } else { return (a >>> b); }\n"
+    "}\n";
+
+static const TokenTag snippet_tags[] = {
+    at_tok, identifier_tok, fn_tok, identifier_tok, i32_tok, lpar_tok, varying_tok, i32_tok, identifier_tok, comma_tok, uniform_tok, u32_tok, identifier_tok, rpar_tok, lbracket_tok,
+    val_tok, identifier_tok, equal_tok, identifier_tok, lpar_tok, identifier_tok, comma_tok, hex_lit_tok, rpar_tok, semi_tok,
+    val_tok, identifier_tok, equal_tok, identifier_tok, lpar_tok, identifier_tok, comma_tok, dec_lit_tok, rpar_tok, semi_tok,
+    if_tok, lpar_tok, identifier_tok, lpar_tok, identifier_tok, comma_tok, dec_lit_tok, rpar_tok, rpar_tok, lbracket_tok, return_tok, lpar_tok, identifier_tok, rpar_tok, semi_tok, rbracket_tok,
+    else_tok, lbracket_tok, return_tok, lpar_tok, identifier_tok, infix_rshift_logical_tok, identifier_tok, rpar_tok, semi_tok, rbracket_tok,
+    rbracket_tok,
+};
+
+#define SNIPPET_TOKENS (sizeof(snippet_tags) / sizeof(snippet_tags[0]))
+
+int main(int argc, char** argv) {
+    size_t target_size = 1 << 20;
+    if (argc > 1)
+        target_size = (size_t) strtoull(argv[1], NULL, 10) << 20;
+
+    Growy* g = new_growy();
+    size_t copies = 0;
+    while (growy_size(g) < target_size)
+        growy_append_formatted(g, snippet, (int) copies++);
+    size_t size = growy_size(g);
+    char* source = growy_deconstruct(g);
+
+    clock_t start = clock();
+    Tokenizer* tokenizer = new_tokenizer(size, source);
+    clock_t end = clock();
+
+    size_t count = 0;
+    for (Token t = curr_token(tokenizer); t.tag != EOF_tok; t = next_token(tokenizer)) {
+        CHECK(t.tag == snippet_tags[count % SNIPPET_TOKENS], exit(-1));
+        count++;
+    }
+    CHECK(count == copies * SNIPPET_TOKENS, exit(-1));
+    destroy_tokenizer(tokenizer);
+    free(source);
+
+    double seconds = (double) (end - start) / CLOCKS_PER_SEC;
+    printf("tokenized %zu bytes into %zu tokens in %f s (%f MiB/s)\n", size, count, seconds, seconds > 0 ? (double) size / (1 << 20) / seconds : 0.0);
+    return 0;
+}
@@ -0,0 +1,16 @@
+target datalayout = "e-m:e-p270:32:32-p271:32:32-p272:64:64-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "spir64-unknown-unknown"
+
+define i32 @main(i32 %x) {
+  %arr = alloca [4 x i32]
+  %p = getelementptr [4 x i32], [4 x i32]* %arr, i32 0, i32 0
+  store i32 %x, i32* %p
+  %r = call i32 @get(i32* %p, i32 %x)
+  ret i32 %r
+}
+
+define internal i32 @get(i32* %p, i32 %i) noinline {
+  %q = getelementptr i32, i32* %p, i32 %i
+  %v = load i32, i32* %q
+  ret i32 %v
+}
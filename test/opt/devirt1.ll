@@ -0,0 +1,29 @@
+target datalayout = "e-m:e-p270:32:32-p271:32:32-p272:64:64-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "spir64-unknown-unknown"
+
+define i32 @main(i32 %x) {
+  %a = call i32 @apply(i32 (i32)* @square, i32 %x)
+  %b = call i32 @apply(i32 (i32)* @twice, i32 %a)
+  %c = call i32 @apply_once(i32 (i32)* @square, i32 %b)
+  ret i32 %c
+}
+
+define internal i32 @square(i32 %x) {
+  %r = mul i32 %x, %x
+  ret i32 %r
+}
+
+define internal i32 @twice(i32 %x) {
+  %r = add i32 %x, %x
+  ret i32 %r
+}
+
+define internal i32 @apply(i32 (i32)* %f, i32 %x) {
+  %r = call i32 %f(i32 %x)
+  ret i32 %r
+}
+
+define internal i32 @apply_once(i32 (i32)* %f, i32 %x) {
+  %r = call i32 %f(i32 %x)
+  ret i32 %r
+}
@@ -2,17 +2,42 @@
 #include "shady/driver.h"
 
 #include "log.h"
+#include "dict.h"
 
 #include "../src/shady/visit.h"
+#include "../src/shady/analysis/scope.h"
+#include "../src/shady/analysis/looptree.h"
 
 #include <string.h>
 #include <assert.h>
 #include <stdlib.h>
 
+KeyHash hash_node(const Node**);
+bool compare_node(const Node**, const Node**);
+
+static String oracle_pass = "opt_mem2reg";
+
 static bool expect_memstuff = false;
 static bool found_memstuff = false;
 
+static const char* counted_primop = NULL;
+static int expected_primop_count = -1;
+static int found_primop_count = 0;
+static bool count_in_loops_only = false;
+static int expected_stack_size = -1;
+static struct Dict* seen_blocks = NULL;
+/// basic blocks that are part of an unstructured loop
+static struct Dict* looping_blocks = NULL;
+
+typedef struct {
+    Visitor v;
+    bool in_loop;
+} CountVisitor;
+
 static void search_for_memstuff(Visitor* v, const Node* n) {
+    // loops make basic blocks reachable from themselves
+    if (n->tag == BasicBlock_TAG && !insert_set_get_result(const Node*, seen_blocks, n))
+        return;
     if (n->tag == PrimOp_TAG) {
         PrimOp payload = n->payload.prim_op;
         switch (payload.op) {
@@ -31,10 +56,81 @@ static void search_for_memstuff(Visitor* v, const Node* n) {
     visit_node_operands(v, NcDeclaration, n);
 }
 
+static void count_primop(CountVisitor* v, const Node* n) {
+    // loops make basic blocks reachable from themselves
+    if (n->tag == BasicBlock_TAG && !insert_set_get_result(const Node*, seen_blocks, n))
+        return;
+    if (n->tag == PrimOp_TAG && strcmp(get_primop_name(n->payload.prim_op.op), counted_primop) == 0)
+        if (v->in_loop || !count_in_loops_only)
+            found_primop_count++;
+
+    if (n->tag == Loop_TAG || n->tag == BasicBlock_TAG) {
+        CountVisitor loop_v = *v;
+        loop_v.in_loop = n->tag == Loop_TAG || find_key_dict(const Node*, looping_blocks, n);
+        visit_node_operands(&loop_v.v, NcDeclaration, n);
+        return;
+    }
+
+    visit_node_operands(&v->v, NcDeclaration, n);
+}
+
+static void find_looping_blocks(Module* mod) {
+    Nodes decls = get_module_declarations(mod);
+    for (size_t i = 0; i < decls.count; i++) {
+        if (decls.nodes[i]->tag != Function_TAG || !get_abstraction_body(decls.nodes[i]))
+            continue;
+        Scope* scope = new_scope(decls.nodes[i]);
+        LoopTree* lt = build_loop_tree(scope);
+        for (size_t j = 0; j < scope->size; j++) {
+            const Node* abs = scope->rpo[j]->node;
+            const LTNode* leaf = looptree_lookup(lt, abs);
+            // the root of the loop tree is not a loop
+            if (abs->tag == BasicBlock_TAG && leaf->parent && leaf->parent->parent)
+                insert_set_get_result(const Node*, looping_blocks, abs);
+        }
+        destroy_loop_tree(lt);
+        destroy_scope(scope);
+    }
+}
+
 static void after_pass(void* uptr, String pass_name, Module* mod) {
-    if (strcmp(pass_name, "opt_mem2reg") == 0) {
+    if (strcmp(pass_name, oracle_pass) == 0) {
+        if (expected_stack_size >= 0) {
+            // lower_stack reserves the stack as an array in private memory
+            const Node* stack = get_declaration(mod, "stack");
+            if (!stack || stack->tag != GlobalVariable_TAG || stack->payload.global_variable.type->tag != ArrType_TAG)
+                error("The stack has to be lowered before it can be measured");
+            int64_t stack_size = get_int_literal_value(*resolve_to_int_literal(stack->payload.global_variable.type->payload.arr_type.size), false);
+            if (stack_size != expected_stack_size) {
+                error_print("Expected a %d bytes stack, found %d.\n", expected_stack_size, (int) stack_size);
+                dump_module(mod);
+                exit(-1);
+            }
+            dump_module(mod);
+            exit(0);
+        }
+
+        if (counted_primop) {
+            CountVisitor v = { .v = { .visit_node_fn = (VisitNodeFn) count_primop } };
+            seen_blocks = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node);
+            looping_blocks = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node);
+            find_looping_blocks(mod);
+            visit_module(&v.v, mod);
+            destroy_dict(looping_blocks);
+            destroy_dict(seen_blocks);
+            if (found_primop_count != expected_primop_count) {
+                error_print("Expected %d %s primops %sin the output, found %d.\n", expected_primop_count, counted_primop, count_in_loops_only ? "inside of loops " : "", found_primop_count);
+                dump_module(mod);
+                exit(-1);
+            }
+            dump_module(mod);
+            exit(0);
+        }
+
         Visitor v = {.visit_node_fn = search_for_memstuff};
+        seen_blocks = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node);
         visit_module(&v, mod);
+        destroy_dict(seen_blocks);
         if (expect_memstuff != found_memstuff) {
             error_print("Expected ");
             if (!expect_memstuff)
@@ -58,6 +154,31 @@ static void cli_parse_oracle_args(int* pargc, char** argv) {
             argv[i] = NULL;
             expect_memstuff = true;
             continue;
+        } else if (strcmp(argv[i], "--oracle-pass") == 0) {
+            argv[i] = NULL;
+            i++;
+            oracle_pass = argv[i];
+            argv[i] = NULL;
+            continue;
+        } else if (strcmp(argv[i], "--expect-primop-count") == 0) {
+            argv[i] = NULL;
+            i++;
+            counted_primop = argv[i];
+            argv[i] = NULL;
+            i++;
+            expected_primop_count = atoi(argv[i]);
+            argv[i] = NULL;
+            continue;
+        } else if (strcmp(argv[i], "--expect-stack-size") == 0) {
+            argv[i] = NULL;
+            i++;
+            expected_stack_size = atoi(argv[i]);
+            argv[i] = NULL;
+            continue;
+        } else if (strcmp(argv[i], "--count-in-loops-only") == 0) {
+            argv[i] = NULL;
+            count_in_loops_only = true;
+            continue;
         }
     }
 
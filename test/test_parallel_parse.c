@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shady/ir.h"
+#include "shady/driver.h"
+
+#include "log.h"
+#include "growy.h"
+
+#include "../src/frontends/slim/parser.h"
+
+#define CHECK(x, failure_handler) { if (!(x)) { error_print(#x " failed\n"); failure_handler; } }
+
+#define DECLARATIONS_COUNT 256
+
+/// Functions that call into the next one, so references cross from one thread's share of the declarations to another's
+static const char snippet[] =
+    "const i32 k_%d = %d;\n"
+    "fn f_%d varying i32(varying i32 a) {\n"
+    "    val x = a + k_%d;\n"
+    "    if (gt(x, 42)) { return (f_%d(x)); }\n"
+    "    return (x);\n"
+    "}\n";
+
+static char* parse_and_print(const char* source, size_t threads) {
+    IrArena* a = new_ir_arena(default_arena_config());
+    Module* m = new_module(a, "parallel");
+    ParserConfig pconfig = {
+        .front_end = true,
+        .threads = threads,
+    };
+    parse_shady_ir(pconfig, strlen(source), source, m);
+    CHECK(get_module_declarations(m).count == DECLARATIONS_COUNT, exit(-1));
+
+    char* printed;
+    size_t size;
+    print_module_into_str(m, &printed, &size);
+    destroy_ir_arena(a);
+    return printed;
+}
+
+int main(int argc, char** argv) {
+    cli_parse_common_args(&argc, argv);
+
+    Growy* g = new_growy();
+    for (int i = 0; i < DECLARATIONS_COUNT / 2; i++)
+        growy_append_formatted(g, snippet, i, i, i, i, (i + 1) % (DECLARATIONS_COUNT / 2));
+    growy_append_bytes(g, 1, "\0");
+    char* source = growy_deconstruct(g);
+
+    char* serial = parse_and_print(source, 1);
+    // one thread per declaration at most, however many there are
+    size_t threads[] = { 2, 3, 8, DECLARATIONS_COUNT * 2 };
+    for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+        char* parallel = parse_and_print(source, threads[i]);
+        CHECK(strcmp(serial, parallel) == 0, exit(-1));
+        free(parallel);
+    }
+
+    free(serial);
+    free(source);
+    return 0;
+}
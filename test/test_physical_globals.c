@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shady/ir.h"
+#include "shady/driver.h"
+
+#include "log.h"
+
+#include "../src/shady/type.h"
+#include "../src/shady/passes/passes.h"
+#include "../src/shady/transform/ir_gen_helpers.h"
+
+#define CHECK(x, failure_handler) { if (!(x)) { error_print(#x " failed\n"); failure_handler; } }
+
+static Node* entry_point(Module* m, String name) {
+    IrArena* a = get_module_arena(m);
+    return function(m, empty(a), name, singleton(annotation(a, (Annotation) { .name = "EntryPoint" })), empty(a));
+}
+
+/// Two entry points using private physical globals. The first one only gets to 'b' through the initialiser of 'a',
+/// and 'c' is only used by the second one.
+static Module* make_globals(IrArena* a) {
+    Module* m = new_module(a, "globals");
+    const Type* u32_ptr_t = ptr_type(a, (PtrType) { .address_space = AsPrivatePhysical, .pointed_type = uint32_type(a) });
+    Node* ga = global_var(m, empty(a), u32_ptr_t, "a", AsPrivatePhysical);
+    Node* gb = global_var(m, empty(a), uint32_type(a), "b", AsPrivatePhysical);
+    Node* gc = global_var(m, empty(a), uint32_type(a), "c", AsPrivatePhysical);
+    Node* gd = global_var(m, empty(a), uint32_type(a), "d", AsPrivatePhysical);
+    ga->payload.global_variable.init = ref_decl_helper(a, gb);
+
+    Node* main1 = entry_point(m, "main1");
+    BodyBuilder* bb = begin_body(a);
+    const Node* p = gen_load(bb, ref_decl_helper(a, ga));
+    gen_store(bb, p, uint32_literal(a, 7));
+    gen_store(bb, ref_decl_helper(a, gd), uint32_literal(a, 1));
+    main1->payload.fun.body = finish_body(bb, fn_ret(a, (Return) { .fn = main1, .args = empty(a) }));
+
+    Node* main2 = entry_point(m, "main2");
+    bb = begin_body(a);
+    gen_store(bb, ref_decl_helper(a, gc), uint32_literal(a, 2));
+    main2->payload.fun.body = finish_body(bb, fn_ret(a, (Return) { .fn = main2, .args = empty(a) }));
+    return m;
+}
+
+static void test_initialisers_keep_globals_apart(IrArena* a) {
+    Module* m = make_globals(a);
+    CompilerConfig config = default_compiler_config();
+
+    Module* lowered = lower_physical_ptrs(&config, m);
+    const Node* globals_t = get_declaration(lowered, "globals_physical_PrivatePhysical_t");
+    CHECK(globals_t && globals_t->tag == NominalType_TAG, exit(-1));
+    // 'a' has an initial value so it gets its own slot, 'b' and 'd' are both used by main1, 'c' can share with either
+    CHECK(globals_t->payload.nom_type.body->payload.record_type.members.count == 3, exit(-1));
+    destroy_ir_arena(get_module_arena(lowered));
+}
+
+int main(int argc, char** argv) {
+    cli_parse_common_args(&argc, argv);
+
+    ArenaConfig acfg = default_arena_config();
+    acfg.name_bound = true;
+    acfg.check_types = true;
+    acfg.allow_fold = true;
+    IrArena* a = new_ir_arena(acfg);
+    test_initialisers_keep_globals_apart(a);
+    destroy_ir_arena(a);
+}
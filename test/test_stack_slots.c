@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shady/ir.h"
+#include "shady/driver.h"
+
+#include "log.h"
+
+#include "../src/shady/type.h"
+#include "../src/shady/visit.h"
+#include "../src/shady/passes/passes.h"
+#include "../src/shady/transform/ir_gen_helpers.h"
+
+#define CHECK(x, failure_handler) { if (!(x)) { error_print(#x " failed\n"); failure_handler; } }
+
+typedef struct {
+    Visitor v;
+    size_t offsets;
+    size_t misaligned;
+    size_t alignment;
+} OffsetVisitor;
+
+/// Looks at how far the stack pointer gets moved by, which is always by a constant
+static void check_offsets(OffsetVisitor* v, const Node* n) {
+    if (n->tag == PrimOp_TAG && (n->payload.prim_op.op == add_op || n->payload.prim_op.op == sub_op)) {
+        const IntLiteral* offset = resolve_to_int_literal(n->payload.prim_op.operands.nodes[1]);
+        if (offset) {
+            v->offsets++;
+            if (get_int_literal_value(*offset, false) % v->alignment != 0)
+                v->misaligned++;
+        }
+    }
+    visit_node_operands(&v->v, NcDeclaration, n);
+}
+
+/// Pushes a byte and a word after it, then pops them back
+static Module* make_pushes(IrArena* a) {
+    Module* m = new_module(a, "pushes");
+    const Node* x = var(a, qualified_type_helper(uint32_type(a), false), "x");
+    Node* fn = function(m, singleton(x), "pushes", empty(a), singleton(qualified_type_helper(uint32_type(a), false)));
+
+    BodyBuilder* bb = begin_body(a);
+    gen_primop(bb, push_stack_op, singleton(uint8_type(a)), singleton(uint8_literal(a, 42)));
+    gen_primop(bb, push_stack_op, singleton(uint32_type(a)), singleton(x));
+    const Node* popped = gen_primop_e(bb, pop_stack_op, singleton(uint32_type(a)), empty(a));
+    gen_primop(bb, pop_stack_op, singleton(uint8_type(a)), empty(a));
+    fn->payload.fun.body = finish_body(bb, fn_ret(a, (Return) { .fn = fn, .args = singleton(popped) }));
+    return m;
+}
+
+static void test_slots_are_word_aligned(IrArena* a) {
+    Module* m = make_pushes(a);
+    CompilerConfig config = default_compiler_config();
+    config.emulated_memory.private_word_size = IntTy32;
+
+    Module* lowered = lower_stack(&config, m);
+    OffsetVisitor v = { .v = { .visit_node_fn = (VisitNodeFn) check_offsets }, .alignment = 4 };
+    visit_module(&v.v, lowered);
+    // the word must not start right after the byte, or it would straddle two words
+    CHECK(v.offsets == 4, exit(-1));
+    CHECK(v.misaligned == 0, exit(-1));
+    destroy_ir_arena(get_module_arena(lowered));
+}
+
+int main(int argc, char** argv) {
+    cli_parse_common_args(&argc, argv);
+
+    ArenaConfig acfg = default_arena_config();
+    acfg.name_bound = true;
+    acfg.check_types = true;
+    acfg.allow_fold = true;
+    IrArena* a = new_ir_arena(acfg);
+    test_slots_are_word_aligned(a);
+    destroy_ir_arena(a);
+}
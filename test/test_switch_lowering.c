@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shady/ir.h"
+#include "shady/driver.h"
+
+#include "log.h"
+#include "portability.h"
+
+#include "../src/shady/type.h"
+#include "../src/shady/visit.h"
+#include "../src/shady/passes/passes.h"
+
+#define CHECK(x, failure_handler) { if (!(x)) { error_print(#x " failed\n"); failure_handler; } }
+
+typedef struct {
+    Visitor v;
+    Op op;
+    size_t primops;
+    size_t matches;
+} CountVisitor;
+
+static void count_nodes(CountVisitor* v, const Node* n) {
+    if (n->tag == PrimOp_TAG && n->payload.prim_op.op == v->op)
+        v->primops++;
+    if (n->tag == Match_TAG)
+        v->matches++;
+    visit_node_operands(&v->v, NcDeclaration, n);
+}
+
+static CountVisitor count_in_module(Module* m, Op op) {
+    CountVisitor v = { .v = { .visit_node_fn = (VisitNodeFn) count_nodes }, .op = op };
+    visit_module(&v.v, m);
+    return v;
+}
+
+/// A parity check written as a match over 0..7, where the even and the odd literals share a case each
+static Module* make_parity_match(IrArena* a) {
+    Module* m = new_module(a, "parity");
+    const Node* x = var(a, qualified_type_helper(uint32_type(a), false), "x");
+    Node* fn = function(m, singleton(x), "parity", empty(a), singleton(qualified_type_helper(int32_type(a), false)));
+
+    const Node* even = case_(a, empty(a), yield(a, (Yield) { .args = singleton(int32_literal(a, 0)) }));
+    const Node* odd = case_(a, empty(a), yield(a, (Yield) { .args = singleton(int32_literal(a, 1)) }));
+    LARRAY(const Node*, literals, 8);
+    LARRAY(const Node*, cases, 8);
+    for (size_t i = 0; i < 8; i++) {
+        literals[i] = uint32_literal(a, i);
+        cases[i] = i % 2 == 0 ? even : odd;
+    }
+
+    BodyBuilder* bb = begin_body(a);
+    Nodes results = bind_instruction(bb, match_instr(a, (Match) {
+        .yield_types = singleton(int32_type(a)),
+        .inspect = x,
+        .literals = nodes(a, 8, literals),
+        .cases = nodes(a, 8, cases),
+        .default_case = case_(a, empty(a), yield(a, (Yield) { .args = singleton(int32_literal(a, -1)) })),
+    }));
+    fn->payload.fun.body = finish_body(bb, fn_ret(a, (Return) { .fn = fn, .args = results }));
+    return m;
+}
+
+static void test_bit_tests(IrArena* a) {
+    Module* m = make_parity_match(a);
+    CompilerConfig config = default_compiler_config();
+
+    // dense enough to be kept as a jump table by default
+    Module* kept = lower_switch_btree(&config, m);
+    CHECK(count_in_module(kept, lshift_op).matches == 1, exit(-1));
+    destroy_ir_arena(get_module_arena(kept));
+
+    // otherwise the two cases are told apart by testing a single bit against one mask each
+    config.optimisations.switches.min_jump_table_cases = 0;
+    Module* lowered = lower_switch_btree(&config, m);
+    CountVisitor counts = count_in_module(lowered, lshift_op);
+    CHECK(counts.matches == 0, exit(-1));
+    CHECK(counts.primops == 1, exit(-1));
+    destroy_ir_arena(get_module_arena(lowered));
+}
+
+int main(int argc, char** argv) {
+    cli_parse_common_args(&argc, argv);
+
+    ArenaConfig acfg = default_arena_config();
+    acfg.name_bound = true;
+    acfg.check_types = true;
+    acfg.allow_fold = true;
+    IrArena* a = new_ir_arena(acfg);
+    test_bit_tests(a);
+    destroy_ir_arena(a);
+}